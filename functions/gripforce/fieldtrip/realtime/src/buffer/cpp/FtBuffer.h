@@ -9,6 +9,9 @@
 #define __FtBuffer_h
 
 #include <buffer.h>
+#include <shm.h>
+#include <compress.h>
+#include <batch.h>
 #include <SimpleStorage.h>
 
 struct FtDataType {
@@ -203,6 +206,46 @@ class FtBufferRequest {
 		m_extras.ds.endsample = endsample;
 	}
 
+	/** Asks for the given channels only, converted to dataType (DATATYPE_UNKNOWN
+		keeps the stored type). Channels are numbered from 0, and numChannels=0
+		selects all of them. Check the datadef_t of the response, older servers
+		ignore the selection.
+	*/
+	bool prepGetDataChannels(UINT32_T begsample, UINT32_T endsample, UINT32_T dataType, UINT32_T numChannels, const UINT32_T *channels) {
+		UINT32_T argSize = numChannels * sizeof(UINT32_T);
+		if (!prepGetDataSelection(begsample, endsample, CHANSEL_INDEX, dataType, numChannels, argSize)) return false;
+		if (argSize > 0) memcpy((char *) m_buf.data() + sizeof(datasel_t) + sizeof(channelseldef_t), channels, argSize);
+		return true;
+	}
+
+	/** Same as above, with the channels given by their names in the header */
+	bool prepGetDataLabels(UINT32_T begsample, UINT32_T endsample, UINT32_T dataType, UINT32_T numChannels, const char * const *labels) {
+		UINT32_T argSize = 0;
+		for (UINT32_T i=0;i<numChannels;i++) argSize += strlen(labels[i]) + 1;
+		if (!prepGetDataSelection(begsample, endsample, CHANSEL_LABEL, dataType, numChannels, argSize)) return false;
+		char *dest = (char *) m_buf.data() + sizeof(datasel_t) + sizeof(channelseldef_t);
+		for (UINT32_T i=0;i<numChannels;i++) {
+			UINT32_T len = strlen(labels[i]) + 1;
+			memcpy(dest, labels[i], len);
+			dest += len;
+		}
+		return true;
+	}
+
+	/** Asks for an overview of the samples for a plot that is about width
+		points wide: the minimum, maximum and mean of every channel over bins
+		of 8, 64 or 512 samples, or over single samples for short selections.
+		Use endsample=-1 for the latest sample, see decimateddef_t.
+	*/
+	void prepGetDataDecimated(UINT32_T begsample, UINT32_T endsample, UINT32_T width) {
+		m_def.command = GET_DAT_DECIMATED;
+		m_msg.buf = &m_extras.dc;
+		m_def.bufsize = sizeof(decimatedsel_t);
+		m_extras.dc.begsample = begsample;
+		m_extras.dc.endsample = endsample;
+		m_extras.dc.width = width;
+	}
+
 	void prepGetEvents(UINT32_T begevent, UINT32_T endevent) {
 		m_def.command = GET_EVT;
 		m_msg.buf = &m_extras.es;
@@ -211,6 +254,61 @@ class FtBufferRequest {
 		m_extras.es.endevent = endevent;
 	}
 
+	/** Starts a GET_EVT_QUERY request without criteria, which would return all events.
+		Add criteria (which all have to match) using the functions below.
+	*/
+	void prepQueryEvents() {
+		m_buf.resize(0);
+		m_def.command = GET_EVT_QUERY;
+		m_def.bufsize = 0;
+		m_msg.buf = NULL;
+	}
+
+	bool prepQueryEventsAddCriterion(UINT32_T what, UINT32_T argSize, const void *arg) {
+		if (m_def.command != GET_EVT_QUERY) return false;
+
+		UINT32_T oldSize = m_buf.size();
+		UINT32_T newSize = oldSize + sizeof(eventquerydef_t) + argSize;
+
+		if (!m_buf.resize(newSize)) return false;
+
+		m_def.bufsize = newSize;
+		m_msg.buf = m_buf.data();
+
+		eventquerydef_t *qd = (eventquerydef_t *) ((char *) m_msg.buf + oldSize);
+		qd->what = what;
+		qd->bufsize = argSize;
+		memcpy(qd+1, arg, argSize);
+		return true;
+	}
+
+	// what = EVENTSEL_TYPE or EVENTSEL_VALUE, for events with a string type or value
+	bool prepQueryEventsAddString(UINT32_T what, const char *str) {
+		if (m_def.command != GET_EVT_QUERY) return false;
+
+		UINT32_T len = strlen(str);
+		UINT32_T oldSize = m_buf.size();
+		UINT32_T newSize = oldSize + sizeof(eventquerydef_t) + sizeof(UINT32_T) + len;
+
+		if (!m_buf.resize(newSize)) return false;
+
+		m_def.bufsize = newSize;
+		m_msg.buf = m_buf.data();
+
+		eventquerydef_t *qd = (eventquerydef_t *) ((char *) m_msg.buf + oldSize);
+		qd->what = what;
+		qd->bufsize = sizeof(UINT32_T) + len;
+		UINT32_T *dataType = (UINT32_T *) (qd+1);
+		*dataType = DATATYPE_CHAR;
+		memcpy(dataType+1, str, len);
+		return true;
+	}
+
+	// what = EVENTSEL_SAMPLE, EVENTSEL_MINSAMPLE or EVENTSEL_MAXSAMPLE
+	bool prepQueryEventsAddSample(UINT32_T what, INT32_T sample) {
+		return prepQueryEventsAddCriterion(what, sizeof(INT32_T), &sample);
+	}
+
 	void prepWaitData(UINT32_T nSamples, UINT32_T nEvents, UINT32_T milliseconds) {
 		m_def.command = WAIT_DAT;
 		m_msg.buf = &m_extras.wd;
@@ -220,12 +318,75 @@ class FtBufferRequest {
 		m_extras.wd.milliseconds = milliseconds;
 	}
 
+	/** Selects the stream with the given name for all further requests on this
+		connection. An empty name or NULL selects the default stream.
+	*/
+	bool prepOpenStream(const char *name) {
+		UINT32_T len = (name == NULL) ? 0 : strlen(name);
+		if (!m_buf.resize(len)) return false;
+		if (len > 0) memcpy(m_buf.data(), name, len);
+		m_def.command = OPEN_STREAM;
+		m_def.bufsize = len;
+		m_msg.buf = (len > 0) ? m_buf.data() : NULL;
+		return true;
+	}
+
+	/** Starts a BATCH request (see batch.h), to which other requests
+		can be added with prepBatchAdd.
+	*/
+	void prepBatch() {
+		m_def.command = BATCH;
+		m_def.bufsize = 0;
+		m_msg.buf = NULL;
+		m_buf.resize(0);
+	}
+
+	bool prepBatchAdd(const FtBufferRequest &request) {
+		if (m_def.command != BATCH) return false;
+
+		const message_t *msg = request.out();
+		unsigned int offset = m_def.bufsize;
+		unsigned int size = (sizeof(messagedef_t) + msg->def->bufsize + FT_BATCH_ALIGN - 1) & ~(FT_BATCH_ALIGN - 1);
+		if (!m_buf.resize(offset + size)) return false;
+
+		char *dest = (char *) m_buf.data() + offset;
+		memset(dest, 0, size);
+		memcpy(dest, msg->def, sizeof(messagedef_t));
+		if (msg->def->bufsize > 0) memcpy(dest + sizeof(messagedef_t), msg->buf, msg->def->bufsize);
+
+		m_def.bufsize = offset + size;
+		m_msg.buf = m_buf.data();
+		return true;
+	}
+
 	const message_t *out() const {
 		return &m_msg;
 	}
 
 	protected:
 
+	bool prepGetDataSelection(UINT32_T begsample, UINT32_T endsample, UINT32_T what, UINT32_T dataType, UINT32_T numChannels, UINT32_T argSize) {
+		m_def.command = GET_ERR;
+		m_def.bufsize = 0;
+		m_msg.buf = NULL;
+
+		if (!m_buf.resize(sizeof(datasel_t) + sizeof(channelseldef_t) + argSize)) return false;
+
+		datasel_t *ds = (datasel_t *) m_buf.data();
+		ds->begsample = begsample;
+		ds->endsample = endsample;
+		channelseldef_t *cd = (channelseldef_t *) (ds+1);
+		cd->what = what;
+		cd->nchans = numChannels;
+		cd->data_type = dataType;
+		cd->bufsize = argSize;
+
+		m_def.command = GET_DAT;
+		m_def.bufsize = m_buf.size();
+		m_msg.buf = m_buf.data();
+		return true;
+	}
+
 	SimpleStorage m_buf;
 	message_t m_msg;
 	messagedef_t m_def;
@@ -235,6 +396,7 @@ class FtBufferRequest {
 		waitdef_t wd;
 		datasel_t ds;
 		eventsel_t es;
+		decimatedsel_t dc;
 	} m_extras;
 };
 
@@ -284,6 +446,24 @@ class FtBufferResponse {
 		return true;
 	}
 
+	bool checkGetDataDecimated(decimateddef_t &decdef, SimpleStorage *binStore = NULL) const {
+		if (m_response == NULL) return false;
+		if (m_response->def == NULL) return false;
+		if (m_response->def->version != VERSION) return false;
+		if (m_response->def->command != GET_OK) return false;
+		if (m_response->def->bufsize < sizeof(decimateddef_t)) return false;
+		if (m_response->buf == NULL) return false;
+
+		memcpy(&decdef, m_response->buf, sizeof(decimateddef_t));
+		if (binStore != NULL) {
+			unsigned int len = m_response->def->bufsize - sizeof(decimateddef_t);
+			char *src = (char *) m_response->buf + sizeof(decimateddef_t);
+			if (!binStore->resize(len)) return false;
+			memcpy(binStore->data(), src, len);
+		}
+		return true;
+	}
+
 	int checkGetEvents(SimpleStorage *evtStore = NULL) const {
 		if (m_response == NULL) return false;
 		if (m_response->def == NULL) return false;
@@ -312,6 +492,22 @@ class FtBufferResponse {
 		return true;
 	}
 
+	/** Gives the definition and buf of the response to the index'th request
+		of a BATCH, which are in the order of the requests.
+	*/
+	bool checkBatch(unsigned int index, messagedef_t &def, const void *&buf) const {
+		if (m_response == NULL) return false;
+		if (m_response->def == NULL) return false;
+		if (m_response->def->version != VERSION) return false;
+		if (m_response->def->command != BATCH_OK) return false;
+
+		UINT32_T offset = 0;
+		for (unsigned int i=0; i<=index; i++) {
+			if (ft_batch_next(m_response->def->bufsize, m_response->buf, &offset, &def, &buf) != 1) return false;
+		}
+		return true;
+	}
+
 	message_t **in() {
 		if (m_response != NULL) clearResponse();
 		return &m_response;
@@ -324,6 +520,13 @@ class FtBufferResponse {
 		return m_response->def->command == PUT_OK;
 	}
 
+	bool checkOpen() {
+		if (m_response == NULL) return false;
+		if (m_response->def == NULL) return false;
+		if (m_response->def->version != VERSION) return false;
+		return m_response->def->command == OPEN_OK;
+	}
+
 	bool checkFlush() {
 		if (m_response == NULL) return false;
 		if (m_response->def == NULL) return false;
@@ -592,8 +795,22 @@ class FtConnection {
 
 	bool connectTcp(const char *hostname, int port);
 	bool connectUnix(const char *pathname);
+	bool connectShm(const char *name);
+
+	/** Asks the server to send and accept samples with the given encoding
+		(see compress.h), returns false if it does not support that, which
+		is also the case for a stream of FLOAT32 samples.
+	*/
+	bool setEncoding(UINT32_T encoding) {
+		return sock > 0 && ft_request_encoding(sock, encoding) == 0;
+	}
+
 	void disconnect() {
-		if (sock > 0) closesocket(sock);
+		if (sock > 0) {
+			if (type == 3) ft_shm_detach(sock);
+			ft_forget_encoding(sock);
+			closesocket(sock);
+		}
 		sock = -1;
 		type = -1;
 	}
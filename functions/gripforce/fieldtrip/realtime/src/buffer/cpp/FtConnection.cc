@@ -108,7 +108,19 @@ bool FtConnection::connectUnix(const char *pathname) {
 	return false;
 }
 
+bool FtConnection::connectShm(const char *name) {
+	char path[256];
+
+	if (ft_shm_socket_path(name, path, sizeof(path)) != 0 || !connectUnix(path)) return false;
+	// without the shared memory, this is still a working UNIX domain connection
+	if (ft_shm_attach(sock, name) == 0) type = 3;
+	return true;
+}
+
 bool FtConnection::connect(const char *address) {
+	const char *shmName = ft_shm_address(address);
+	if (shmName != NULL) return connectShm(shmName);
+
 	const char *colPos = strchr(address, ':');
 	if (colPos != NULL) {
 		int len = colPos - address;
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ *
+ * Micro-benchmarks of the C++ side of an acquisition driver: tvmAddScaledVector,
+ * MultiChannelFilter::process on blocks of samples, and OnlineDataManager::handleBlock
+ * streaming to a buffer in the same process, with and without the lowpass filter.
+ * The output has the same format as that of test_microbench in ../test, which
+ * can compare it with a baseline:
+ *
+ *   odmBench > odm.txt
+ *   test_microbench -compare baseline.txt odm.txt
+ *
+ * Lines that are not results, such as those of OnlineDataManager, are ignored there.
+ *
+ * Use as
+ *   odmBench [port=1980]
+ */
+
+#include <OnlineDataManager.h>
+#include <stats.h>
+
+#define ROUNDS  5
+#define NBLK    32
+
+static double roundTime = 0.04;	// seconds
+
+/** Calls func() often enough to read it from the clock, and returns the time
+	of one call in nanoseconds, the best of ROUNDS rounds. */
+template <typename F>
+double measure(F& func) {
+	UINT64_T start, elapsed;
+	unsigned int n = 1;
+	double best = 0;
+
+	for (;;) {
+		start = ft_stats_now();
+		for (unsigned int i=0;i<n;i++) func();
+		elapsed = ft_stats_now() - start;
+		if (elapsed >= 1e9*roundTime/4 || n >= 0x40000000u) break;
+		n *= 2;
+	}
+	if (elapsed > 0) n = (unsigned int) (n * (1e9*roundTime / elapsed)) + 1;
+
+	for (int r=0;r<ROUNDS;r++) {
+		start = ft_stats_now();
+		for (unsigned int i=0;i<n;i++) func();
+		elapsed = ft_stats_now() - start;
+		if (r == 0 || elapsed < best) best = (double) elapsed;
+	}
+	return best / n;
+}
+
+static void report(const char *name, unsigned int bytes, double ns) {
+	printf("%-40s %10u %12.1f %10.1f\n", name, bytes, ns, (ns > 0) ? 1e3 * bytes / ns : 0);
+	fflush(stdout);
+}
+
+template <typename Tout, typename Tin>
+struct AddScaled {
+	Tout *y;
+	Tin *x;
+	int n;
+
+	AddScaled(int n) : n(n) {
+		y = new Tout[n];
+		x = new Tin[n];
+		for (int i=0;i<n;i++) {
+			y[i] = 0;
+			x[i] = (Tin) (i & 15);
+		}
+	}
+	~AddScaled() {
+		delete[] y;
+		delete[] x;
+	}
+	void operator()() {
+		tvmAddScaledVector<Tout,double,Tin>(y, 1e-9, x, n);
+	}
+};
+
+struct FilterBlock {
+	MultiChannelFilter<float,float> filter;
+	float *source, *dest;
+	int nChans;
+
+	FilterBlock(int nChans, int order) : filter(nChans, order), nChans(nChans) {
+		filter.setButterLP(0.1);
+		source = new float[NBLK*nChans];
+		dest   = new float[NBLK*nChans];
+		for (int i=0;i<NBLK*nChans;i++) source[i] = (float) (i % 100);
+	}
+	~FilterBlock() {
+		delete[] source;
+		delete[] dest;
+	}
+	void operator()() {
+		filter.process(NBLK, dest, source);
+	}
+};
+
+struct HandleBlock {
+	OnlineDataManager<int,float> &ODM;
+
+	HandleBlock(OnlineDataManager<int,float> &ODM) : ODM(ODM) {}
+	void operator()() {
+		ODM.provideBlock(NBLK);
+		if (!ODM.handleBlock()) {
+			fprintf(stderr, "odmBench: handleBlock failed\n");
+			exit(1);
+		}
+	}
+};
+
+int main(int argc, char *argv[]) {
+	static const int sizes[] = {2, 64, 280, 1024};
+	static const int chans[] = {2, 64, 280};
+	int port = (argc>1) ? atoi(argv[1]) : 1980;
+	char name[64];
+
+	check_datatypes();
+
+	printf("# %-38s %10s %12s %10s\n", "benchmark", "bytes", "ns", "MB/s");
+
+	for (unsigned int k=0;k<sizeof(sizes)/sizeof(sizes[0]);k++) {
+		AddScaled<double,double> dd(sizes[k]);
+		AddScaled<float,double> fd(sizes[k]);
+
+		sprintf(name, "tvmAddScaledVector/%d/double", sizes[k]);
+		report(name, sizes[k]*sizeof(double), measure(dd));
+		sprintf(name, "tvmAddScaledVector/%d/float", sizes[k]);
+		report(name, sizes[k]*sizeof(float), measure(fd));
+	}
+
+	for (unsigned int k=0;k<sizeof(chans)/sizeof(chans[0]);k++) {
+		for (int order=2;order<=4;order+=2) {
+			FilterBlock F(chans[k], order);
+			sprintf(name, "MultiChannelFilter::process/%dx%d/order%d", chans[k], NBLK, order);
+			report(name, NBLK*chans[k]*sizeof(float), measure(F));
+		}
+	}
+
+	// a ring of 10 seconds instead of the default, which would take up to 512 MB
+	capacitydef_t cap = {0, 10.0f, 0, 0};
+	ft_set_default_capacity(&cap);
+
+	for (unsigned int k=0;k<sizeof(chans)/sizeof(chans[0]);k++) {
+		for (int order=0;order<=4;order+=4) {
+			OnlineDataManager<int, float> ODM(1, chans[k], 2048.0);
+			SignalConfiguration cfg;
+
+			for (int i=0;i<chans[k];i++) {
+				char label[16];
+				sprintf(label, "chan%d", i+1);
+				cfg.selectForStreaming(i, label);
+			}
+			cfg.setOrder(order);
+			cfg.setBandwidth(100.0);
+			if (!ODM.useOwnServer(port) || !ODM.setSignalConfiguration(cfg) || !ODM.enableStreaming()) {
+				fprintf(stderr, "odmBench: cannot stream to a buffer on port %d\n", port);
+				return 1;
+			}
+
+			int *block = ODM.provideBlock(NBLK);
+			for (int i=0;i<NBLK*(1+chans[k]);i++) block[i] = i % 2048 - 1024;
+
+			HandleBlock H(ODM);
+			sprintf(name, "OnlineDataManager::handleBlock/%dx%d/order%d", chans[k], NBLK, order);
+			report(name, NBLK*chans[k]*sizeof(int), measure(H));
+			ODM.disableStreaming();
+		}
+	}
+	ft_set_default_capacity(NULL);
+	return 0;
+}
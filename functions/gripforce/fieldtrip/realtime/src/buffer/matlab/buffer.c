@@ -91,10 +91,8 @@ void exitFun(void) {
             pthread_mutex_unlock(&mutexstatus);
     }
 
-	/* free the memory that is used for the header, data and events */
-	free_event();
-	free_data();
-	free_header();
+	/* free the memory that is used for the header, data and events of all streams */
+	ft_free_streams();
 
 	/* clean up host/address/socket list and close open sockets */
 	while (firstHostPortSock != NULL) {
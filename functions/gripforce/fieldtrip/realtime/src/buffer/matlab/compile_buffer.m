@@ -109,6 +109,10 @@ if ispc
 else
   % On POSIX systems such as MacOS X and Linux, the following should work without tweaking
   ldflags = '-lpthread';
+  if ~ismac
+    % shm_open lives in librt on older Linux systems
+    ldflags = [ldflags ' -lrt'];
+  end
   extra_cflags = '';
   suffix = 'o';
 end
@@ -123,6 +127,25 @@ libfuncs = {
   'tcpsocket'
   'extern'
   'dmarequest'
+  'ringbuffer'
+  'eventlog'
+  'eventindex'
+  'waitreg'
+  'stream'
+  'shm'
+  'persist'
+  'history'
+  'ft_storage'
+  'chansel'
+  'pyramid'
+  'detect'
+  'compress'
+  'batch'
+  'subscribe'
+  'reactor'
+  'stats'
+  'trace'
+  'lockstat'
   'endianutil'
   'cleanup'
   'clock_gettime'
@@ -20,7 +20,7 @@ LIBFLAGS = /MACHINE:X86
 
 all: libbuffer.lib
 
-libbuffer.lib: tcpserver.obj tcpsocket.obj tcprequest.obj clientrequest.obj dmarequest.obj cleanup.obj util.obj printstruct.obj swapbytes.obj extern.obj endianutil.obj  socketserver.obj
+libbuffer.lib: tcpserver.obj tcpsocket.obj tcprequest.obj clientrequest.obj dmarequest.obj ringbuffer.obj eventlog.obj eventindex.obj waitreg.obj stream.obj shm.obj persist.obj history.obj ft_storage.obj chansel.obj pyramid.obj detect.obj compress.obj batch.obj subscribe.obj reactor.obj stats.obj trace.obj lockstat.obj cleanup.obj util.obj printstruct.obj swapbytes.obj extern.obj endianutil.obj  socketserver.obj
 	lib $(LIBFLAGS) /OUT:libbuffer.lib $**
 	
 %.obj: %.c buffer.h message.h swapbytes.h socket_includes.h unix_includes.h
@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef ATOMICOPS_H
+#define ATOMICOPS_H
+
+#include "compiler.h"
+
+/*
+ * Minimal set of atomic operations on aligned 32-bit words, as used by the
+ * lock-free parts of the buffer (see ringbuffer.c). FT_ATOMIC_CAS(p,o,n)
+ * replaces *p by n if it equals o, and evaluates to non-zero if it did; "o"
+ * must be a variable, since the GCC version writes the current value to it. GCC-compatible compilers
+ * use the __atomic builtins, MSVC uses the Interlocked functions and full
+ * memory barriers. Other compilers fall back to volatile accesses, which is
+ * only correct on strongly ordered (x86) processors. FT_ATOMIC_ADD64 adds to
+ * a 64-bit counter, and is only defined (with FT_HAVE_ATOMIC64) where that
+ * does not take a lock or a library.
+ */
+
+#if defined(COMPILER_GCC) || defined(COMPILER_MINGW) || defined(COMPILER_CYGWIN) || defined(__clang__)
+  #define FT_ATOMIC_LOAD(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+  #define FT_ATOMIC_LOAD_RELAXED(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+  #define FT_ATOMIC_STORE(p,v)      __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+  #define FT_ATOMIC_ADD(p,v)        __atomic_add_fetch((p), (v), __ATOMIC_ACQ_REL)
+  #define FT_ATOMIC_CAS(p,o,n)      __atomic_compare_exchange_n((p), &(o), (n), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+  #define FT_FENCE_ACQUIRE()        __atomic_thread_fence(__ATOMIC_ACQUIRE)
+  #define FT_FENCE_RELEASE()        __atomic_thread_fence(__ATOMIC_RELEASE)
+  #define FT_FENCE_FULL()           __atomic_thread_fence(__ATOMIC_SEQ_CST)
+  #if defined(__GCC_HAVE_SYNC_COMPARE_AND_SWAP_8)
+    /* without it, a 64-bit add would need libatomic */
+    #define FT_HAVE_ATOMIC64
+    #define FT_ATOMIC_ADD64(p,v)    __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+  #endif
+
+#elif defined(COMPILER_MSVC)
+  #include <windows.h>
+  #define FT_ATOMIC_LOAD(p)         (MemoryBarrier(), *(volatile UINT32_T *)(p))
+  #define FT_ATOMIC_LOAD_RELAXED(p) (*(volatile UINT32_T *)(p))
+  #define FT_ATOMIC_STORE(p,v)      do { MemoryBarrier(); *(volatile UINT32_T *)(p) = (v); } while (0)
+  #define FT_ATOMIC_ADD(p,v)        ((UINT32_T) InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v)) + (UINT32_T)(v))
+  #define FT_ATOMIC_CAS(p,o,n)      ((UINT32_T) InterlockedCompareExchange((volatile LONG *)(p), (LONG)(n), (LONG)(o)) == (UINT32_T)(o))
+  #define FT_FENCE_ACQUIRE()        MemoryBarrier()
+  #define FT_FENCE_RELEASE()        MemoryBarrier()
+  #define FT_FENCE_FULL()           MemoryBarrier()
+  #define FT_HAVE_ATOMIC64
+  #define FT_ATOMIC_ADD64(p,v)      ((UINT64_T) InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v)) + (UINT64_T)(v))
+
+#else
+  #define FT_ATOMIC_LOAD(p)         (*(volatile UINT32_T *)(p))
+  #define FT_ATOMIC_LOAD_RELAXED(p) (*(volatile UINT32_T *)(p))
+  #define FT_ATOMIC_STORE(p,v)      (*(volatile UINT32_T *)(p) = (v))
+  #define FT_ATOMIC_ADD(p,v)        (*(volatile UINT32_T *)(p) += (v))
+  #define FT_ATOMIC_CAS(p,o,n)      ((*(volatile UINT32_T *)(p) == (o)) ? (*(volatile UINT32_T *)(p) = (n), 1) : 0)
+  #define FT_FENCE_ACQUIRE()
+  #define FT_FENCE_RELEASE()
+  #define FT_FENCE_FULL()
+
+#endif
+
+#endif /* ATOMICOPS_H */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "batch.h"
+
+/* size of a request or response in a batch, including its padding */
+static UINT64_T item_size(UINT32_T bufsize) {
+	return ((UINT64_T) sizeof(messagedef_t) + bufsize + FT_BATCH_ALIGN - 1) & ~(UINT64_T) (FT_BATCH_ALIGN - 1);
+}
+
+int ft_batch_allowed(UINT16_T command, int *exclusive) {
+	switch (command) {
+		case PUT_HDR:
+		case FLUSH_HDR:
+		case FLUSH_DAT:
+			/* these replace or reset the ring */
+			*exclusive = 1;
+			return 1;
+		case PUT_DAT:
+		case PUT_EVT:
+		case GET_HDR:
+		case GET_DAT:
+		case GET_DAT_DECIMATED:
+		case GET_EVT:
+		case GET_EVT_QUERY:
+		case FLUSH_EVT:
+			return 1;
+	}
+	return 0;
+}
+
+int ft_batch_next(UINT32_T bufsize, const void *buf, UINT32_T *offset, messagedef_t *def, const void **itembuf) {
+	if (*offset == bufsize) return 0;
+	if (*offset > bufsize || bufsize - *offset < sizeof(messagedef_t)) return -1;
+
+	memcpy(def, (const char *) buf + *offset, sizeof(messagedef_t));
+	if (item_size(def->bufsize) > bufsize - *offset) return -1;
+
+	*itembuf = (const char *) buf + *offset + sizeof(messagedef_t);
+	*offset += (UINT32_T) item_size(def->bufsize);
+	return 1;
+}
+
+int ft_batch_check(UINT32_T bufsize, const void *buf, int *exclusive) {
+	UINT32_T offset = 0;
+	messagedef_t def;
+	const void *itembuf;
+	int n = 0, r;
+
+	*exclusive = 0;
+	while ((r = ft_batch_next(bufsize, buf, &offset, &def, &itembuf)) == 1) {
+		if (def.version != VERSION || !ft_batch_allowed(def.command, exclusive)) return -1;
+		n++;
+	}
+	return (r == 0) ? n : -1;
+}
+
+int ft_batch_append(message_t *batch, const messagedef_t *def, const void *buf) {
+	UINT64_T size = item_size(def->bufsize);
+	char *dest;
+
+	if (batch->def->bufsize + size > 0xFFFFFFFFu) return -1;
+	dest = (char *) realloc(batch->buf, batch->def->bufsize + (size_t) size);
+	if (dest == NULL) return -1;
+	batch->buf = dest;
+
+	dest += batch->def->bufsize;
+	memcpy(dest, def, sizeof(messagedef_t));
+	if (def->bufsize > 0) memcpy(dest + sizeof(messagedef_t), buf, def->bufsize);
+	/* the padding */
+	memset(dest + sizeof(messagedef_t) + def->bufsize, 0, (size_t) size - sizeof(messagedef_t) - def->bufsize);
+
+	batch->def->bufsize += (UINT32_T) size;
+	return 0;
+}
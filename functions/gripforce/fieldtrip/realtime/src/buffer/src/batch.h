@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* every request and response in a batch starts at a multiple of this many bytes */
+#define FT_BATCH_ALIGN  8
+
+/** Several requests in one message.
+
+    The buf of a BATCH request holds any number of requests back to back,
+    each as its messagedef_t followed by its buf, and padded with zeros to
+    a multiple of FT_BATCH_ALIGN bytes. The server answers with BATCH_OK,
+    whose buf holds the responses in the same way and in the same order.
+    A typical polling cycle of GET_HDR, GET_DAT and GET_EVT, or the PUT_DAT
+    and PUT_EVT of an acquisition loop, then only costs one round trip.
+
+    The requests are handled one after the other while the server holds all
+    the locks of the stream (see dmarequest.c), so other batches and the
+    requests that take these locks see either all or none of the changes of
+    a batch, and the responses of a batch are a consistent snapshot: the
+    number of samples in GET_HDR is the one that GET_DAT saw. GET_DAT
+    requests outside of a batch never wait for a writer, and may see the
+    new samples of a batch before its events.
+
+    A batch can contain PUT_HDR, PUT_DAT, PUT_EVT, GET_HDR, GET_DAT,
+    GET_DAT_DECIMATED, GET_EVT, GET_EVT_QUERY and the FLUSH_* requests.
+    A batch with anything else, such as WAIT_DAT (which would block with the
+    locks held), OPEN_STREAM or another BATCH, is answered with BATCH_ERR.
+    A request that fails gets its usual error response, and does not stop
+    the ones after it. The samples in a batch are never encoded (compress.h).
+*/
+
+/** Returns 1 if command is allowed in a batch, and sets *exclusive if it
+    needs the stream to itself (see dmarequest.c)
+*/
+int ft_batch_allowed(UINT16_T command, int *exclusive);
+
+/** Checks the requests in the buf of a BATCH request. Returns their number,
+    or -1 if they do not fill the buffer exactly or one is not allowed.
+    *exclusive is set if any of them needs the stream to itself.
+*/
+int ft_batch_check(UINT32_T bufsize, const void *buf, int *exclusive);
+
+/** Reads the messagedef_t of the request or response at *offset in a BATCH
+    buffer into def, points *itembuf to its buf and moves *offset on to the
+    next one. Returns 1, 0 at the end of the buffer, or -1 if it is malformed.
+*/
+int ft_batch_next(UINT32_T bufsize, const void *buf, UINT32_T *offset, messagedef_t *def, const void **itembuf);
+
+/** Appends a request or response with the given def and buf to the buf
+    of batch, and updates its bufsize. Returns 0, or -1 if there is no memory for it.
+*/
+int ft_batch_append(message_t *batch, const messagedef_t *def, const void *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BATCH_H */
@@ -50,10 +50,10 @@
 /* this is because the function has been renamed, but is perhaps already in use in other software */
 #define open_remotehost open_connection
 
-/* FIXME these should be variable */
+/* these are the defaults, they can be changed with ft_set_default_capacity or per header with FT_CHUNK_BUFFER_CAPACITY */
 #define MAXNUMBYTE      (512*1024*1024)
 #define MAXNUMSAMPLE    600000
-#define MAXNUMEVENT     100
+#define MAXNUMEVENT     100000
 
 #define WRAP(x,y) ((x) - ((int)((float)(x)/(y)))*(y))
 #define FREE(x) {if (x) {free(x); x=NULL;}}
@@ -73,6 +73,8 @@ extern "C" {
 	void *tcpsocket(void *);
 	int clientrequest(int, const message_t *, message_t**);
 	int dmarequest(const message_t *, message_t**);
+	void ft_set_default_capacity(const capacitydef_t *);
+	void ft_free_streams(void);
 	int tcprequest(int, const message_t *, message_t**);
 
 #ifdef __cplusplus
@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "chansel.h"
+
+/* returns 1 for the types that samples can be converted from and to */
+static int is_numeric(UINT32_T data_type) {
+	return data_type != DATATYPE_CHAR && wordsize_from_type(data_type) != 0;
+}
+
+/* looks up the channel names in the FT_CHUNK_CHANNEL_NAMES of the header */
+static int find_labels(const header_t *header, UINT32_T nlabels, const char *labels, UINT32_T size, UINT32_T *index) {
+	const ft_chunk_t *chunk;
+	const char **name;
+	UINT32_T nchans = header->def->nchans, i, k, offset;
+	int result = 0;
+
+	chunk = (header->buf == NULL) ? NULL : find_chunk(header->buf, 0, header->def->bufsize, FT_CHUNK_CHANNEL_NAMES);
+	if (chunk == NULL) {
+		fprintf(stderr, "ft_chansel: the header does not have channel names\n");
+		return -1;
+	}
+
+	name = (const char **) malloc(nchans * sizeof(char *));
+	DIE_BAD_MALLOC(name);
+	for (i=0, offset=0; i<nchans; i++) {
+		const char *end = (offset < chunk->def.size) ? memchr(chunk->data + offset, 0, chunk->def.size - offset) : NULL;
+		name[i] = (end != NULL) ? chunk->data + offset : NULL;
+		offset = (end != NULL) ? (UINT32_T) (end - chunk->data) + 1 : chunk->def.size;
+	}
+
+	for (k=0, offset=0; k<nlabels && result == 0; k++) {
+		const char *label = labels + offset;
+		const char *end = (offset < size) ? memchr(label, 0, size - offset) : NULL;
+
+		if (end == NULL) {
+			result = -1;
+			break;
+		}
+		for (i=0; i<nchans; i++) {
+			if (name[i] != NULL && strcmp(name[i], label) == 0) break;
+		}
+		if (i == nchans) {
+			fprintf(stderr, "ft_chansel: there is no channel '%s'\n", label);
+			result = -1;
+		}
+		index[k] = i;
+		offset += (UINT32_T) (end - label) + 1;
+	}
+	free(name);
+	return result;
+}
+
+int ft_chansel_parse(const header_t *header, UINT32_T size, const void *buf, ft_chansel_t *sel) {
+	const headerdef_t *hdef = header->def;
+	channelseldef_t def;
+	const char *arg = (const char *) buf + sizeof(channelseldef_t);
+	UINT32_T *index, i, n;
+	int result = 0;
+
+	memset(sel, 0, sizeof(ft_chansel_t));
+	if (size < sizeof(channelseldef_t)) return -1;
+	memcpy(&def, buf, sizeof(channelseldef_t));
+	if (def.bufsize > size - sizeof(channelseldef_t)) return -1;
+
+	sel->data_type = (def.data_type == DATATYPE_UNKNOWN) ? hdef->data_type : def.data_type;
+	if (sel->data_type != hdef->data_type && !(is_numeric(sel->data_type) && is_numeric(hdef->data_type))) {
+		fprintf(stderr, "ft_chansel: cannot convert samples of type %u to type %u\n", hdef->data_type, sel->data_type);
+		return -1;
+	}
+
+	/* every channel in the list takes at least one byte */
+	n = (def.nchans > 0) ? def.nchans : hdef->nchans;
+	if (n == 0 || (def.nchans > 0 && def.nchans > def.bufsize)) return -1;
+	index = (UINT32_T *) malloc(n * sizeof(UINT32_T));
+	DIE_BAD_MALLOC(index);
+
+	if (def.nchans == 0) {
+		for (i=0; i<n; i++) index[i] = i;
+	}
+	else if (def.what == CHANSEL_INDEX) {
+		if (def.bufsize < n * sizeof(UINT32_T)) result = -1;
+		for (i=0; i<n && result == 0; i++) {
+			memcpy(&index[i], arg + i*sizeof(UINT32_T), sizeof(UINT32_T));
+			if (index[i] >= hdef->nchans) result = -1;
+		}
+	}
+	else if (def.what == CHANSEL_LABEL) {
+		result = find_labels(header, n, arg, def.bufsize, index);
+	}
+	else {
+		result = -1;
+	}
+
+	if (result == 0) {
+		/* runs of consecutive channels are copied in one go */
+		sel->runs = (ft_chanrun_t *) malloc(n * sizeof(ft_chanrun_t));
+		DIE_BAD_MALLOC(sel->runs);
+		for (i=0; i<n; i++) {
+			if (sel->nruns > 0 && index[i] == sel->runs[sel->nruns-1].first + sel->runs[sel->nruns-1].count) {
+				sel->runs[sel->nruns-1].count++;
+			} else {
+				sel->runs[sel->nruns].first = index[i];
+				sel->runs[sel->nruns].count = 1;
+				sel->nruns++;
+			}
+		}
+		sel->nchans = n;
+	}
+	free(index);
+	return result;
+}
+
+void ft_chansel_free(ft_chansel_t *sel) {
+	FREE(sel->runs);
+	sel->nruns = 0;
+	sel->nchans = 0;
+}
+
+int ft_chansel_is_all(const ft_chansel_t *sel, const headerdef_t *hdef) {
+	return sel->data_type == hdef->data_type && sel->nruns == 1 && sel->runs[0].first == 0 && sel->runs[0].count == hdef->nchans;
+}
+
+/*****************************************************************************/
+
+#define CONVERT_RUNS(TI, TO) {                                  \
+	const TI *in = (const TI *) src;                            \
+	TO *out = (TO *) dest;                                      \
+	for (s=0; s<nblocks; s++, in += stride) {                   \
+		for (r=0; r<nruns; r++) {                               \
+			const TI *a = in + runs[r].first;                   \
+			UINT32_T j, count = runs[r].count;                  \
+			for (j=0; j<count; j++) out[j] = (TO) a[j];         \
+			out += count;                                       \
+		}                                                       \
+	}                                                           \
+}
+
+#define CONVERT_FROM(TI)                                                 \
+	switch (sel->data_type) {                                            \
+		case DATATYPE_UINT8:   CONVERT_RUNS(TI, UINT8_T);   break;      \
+		case DATATYPE_UINT16:  CONVERT_RUNS(TI, UINT16_T);  break;      \
+		case DATATYPE_UINT32:  CONVERT_RUNS(TI, UINT32_T);  break;      \
+		case DATATYPE_UINT64:  CONVERT_RUNS(TI, UINT64_T);  break;      \
+		case DATATYPE_INT8:    CONVERT_RUNS(TI, INT8_T);    break;      \
+		case DATATYPE_INT16:   CONVERT_RUNS(TI, INT16_T);   break;      \
+		case DATATYPE_INT32:   CONVERT_RUNS(TI, INT32_T);   break;      \
+		case DATATYPE_INT64:   CONVERT_RUNS(TI, INT64_T);   break;      \
+		case DATATYPE_FLOAT32: CONVERT_RUNS(TI, FLOAT32_T); break;      \
+		case DATATYPE_FLOAT64: CONVERT_RUNS(TI, FLOAT64_T); break;      \
+	}
+
+void ft_chansel_convert(const ft_chansel_t *sel, UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src, void *dest) {
+	const ft_chanrun_t *runs = sel->runs;
+	ft_chanrun_t all;
+	UINT32_T s, r, nruns = sel->nruns, nblocks = nsamples, stride = nchans;
+
+	if (nruns == 1 && runs[0].first == 0 && runs[0].count == nchans) {
+		/* all channels in their order: one run over all samples */
+		all.first = 0;
+		all.count = nchans * nsamples;
+		runs = &all;
+		nblocks = 1;
+	}
+
+	if (data_type == sel->data_type) {
+		UINT32_T wordsize = wordsize_from_type(data_type);
+		const char *in = (const char *) src;
+		char *out = (char *) dest;
+		for (s=0; s<nblocks; s++, in += (size_t) stride * wordsize) {
+			for (r=0; r<nruns; r++) {
+				memcpy(out, in + (size_t) runs[r].first * wordsize, (size_t) runs[r].count * wordsize);
+				out += (size_t) runs[r].count * wordsize;
+			}
+		}
+		return;
+	}
+
+	switch (data_type) {
+		case DATATYPE_UINT8:   CONVERT_FROM(UINT8_T);   break;
+		case DATATYPE_UINT16:  CONVERT_FROM(UINT16_T);  break;
+		case DATATYPE_UINT32:  CONVERT_FROM(UINT32_T);  break;
+		case DATATYPE_UINT64:  CONVERT_FROM(UINT64_T);  break;
+		case DATATYPE_INT8:    CONVERT_FROM(INT8_T);    break;
+		case DATATYPE_INT16:   CONVERT_FROM(INT16_T);   break;
+		case DATATYPE_INT32:   CONVERT_FROM(INT32_T);   break;
+		case DATATYPE_INT64:   CONVERT_FROM(INT64_T);   break;
+		case DATATYPE_FLOAT32: CONVERT_FROM(FLOAT32_T); break;
+		case DATATYPE_FLOAT64: CONVERT_FROM(FLOAT64_T); break;
+	}
+}
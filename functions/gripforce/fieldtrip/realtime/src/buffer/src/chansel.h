@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef CHANSEL_H
+#define CHANSEL_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* GET_DAT copies and converts the samples in blocks of about this size, so they stay in the cache */
+#define FT_CHANSEL_BLOCK_SIZE  (64*1024)
+
+/** Channel selection and type conversion in GET_DAT.
+
+    A client that only needs a few channels, or that wants the samples in
+    another type than the one they are stored in, appends a channelseldef_t
+    to the datasel_t of its GET_DAT request (see message.h). The server then
+    copies only the selected channels into the response, converting them on
+    the way. Channels are given by number, or by name, in which case they are
+    looked up in the FT_CHUNK_CHANNEL_NAMES of the current header.
+
+    The selection is turned into runs of consecutive channels, and each run
+    is converted in a tight loop over a single source and destination type,
+    which the compiler can vectorize. A selection of all channels in their
+    original order is one run over the whole block of samples. Conversions
+    work like a cast in C: integers are converted to floating point exactly
+    where the type allows it, and floating point values that are converted
+    to an integer type are truncated and need to be within its range.
+*/
+
+typedef struct {
+	UINT32_T first;     /* first channel of the run */
+	UINT32_T count;     /* number of consecutive channels */
+} ft_chanrun_t;
+
+typedef struct {
+	UINT32_T     nchans;      /* number of selected channels */
+	UINT32_T     data_type;   /* type of the samples in the response */
+	UINT32_T     nruns;
+	ft_chanrun_t *runs;
+} ft_chansel_t;
+
+/** Parses the part of a GET_DAT request that follows the datasel_t (size
+    bytes at buf) for a buffer with the given header. Returns 0, or -1 if
+    the selection is malformed or names a channel that does not exist.
+    The selection needs to be freed with ft_chansel_free.
+*/
+int  ft_chansel_parse(const header_t *header, UINT32_T size, const void *buf, ft_chansel_t *sel);
+
+void ft_chansel_free(ft_chansel_t *sel);
+
+/** Returns 1 if the selection is all channels of the header in the stored type */
+int  ft_chansel_is_all(const ft_chansel_t *sel, const headerdef_t *hdef);
+
+/** Copies the selected channels of nsamples samples with nchans channels of
+    the given type from src to dest, converting them to sel->data_type.
+*/
+void ft_chansel_convert(const ft_chansel_t *sel, UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src, void *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHANSEL_H */
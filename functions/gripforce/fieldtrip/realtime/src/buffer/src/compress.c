@@ -0,0 +1,340 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "buffer.h"
+#include "compress.h"
+
+/* number of bits needed for v */
+static UINT32_T bits_of(UINT32_T v) {
+	UINT32_T b = 0;
+	while (v) {
+		b++;
+		v >>= 1;
+	}
+	return b;
+}
+
+/* the words are in the byte order of the machine, SET_ENCODING is only
+ * accepted between machines that agree on that */
+static void store32(UINT8_T *q, UINT32_T w) {
+	memcpy(q, &w, 4);
+}
+
+#ifndef __SSE2__
+static UINT32_T load32(const UINT8_T *p) {
+	UINT32_T w;
+	memcpy(&w, p, 4);
+	return w;
+}
+#endif
+
+/* writes a block of FT_DELTA_BLOCK values of b bits in FT_DELTA_LANES lanes,
+ * returns the end of it. All lanes are at the same bit position, so they only
+ * share the bookkeeping, and the loop has no branches that depend on b */
+static UINT8_T *pack_block(UINT8_T *q, const UINT32_T *v, UINT32_T b) {
+	UINT64_T acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+	UINT32_T t, nb = 0;
+	UINT8_T *w;
+
+	*q++ = (UINT8_T) b;
+	if (b == 0) return q;
+	for (t=0, w=q; t<FT_DELTA_BLOCK; t+=FT_DELTA_LANES, v+=FT_DELTA_LANES) {
+		UINT32_T full;
+		acc0 |= (UINT64_T) v[0] << nb;
+		acc1 |= (UINT64_T) v[1] << nb;
+		acc2 |= (UINT64_T) v[2] << nb;
+		acc3 |= (UINT64_T) v[3] << nb;
+		nb += b;
+		/* stores the words in any case, and moves on once they are full */
+		full = nb & 32;
+		store32(w,      (UINT32_T) acc0);
+		store32(w + 4,  (UINT32_T) acc1);
+		store32(w + 8,  (UINT32_T) acc2);
+		store32(w + 12, (UINT32_T) acc3);
+		w    += full >> 1;
+		acc0 >>= full;
+		acc1 >>= full;
+		acc2 >>= full;
+		acc3 >>= full;
+		nb   -= full;
+	}
+	return q + FT_DELTA_LANES*4*b;
+}
+
+/* reads the values of a full block of b bits. Every value can be taken from
+ * the word it starts in and the next one on its own, so that all four lanes
+ * are done at once (with SSE2 in one register) */
+static void unpack_values(const UINT8_T *p, UINT32_T *v, UINT32_T b) {
+	UINT32_T mask = (UINT32_T) (((UINT64_T) 1 << b) - 1);
+	UINT32_T t;
+#ifdef __SSE2__
+	__m128i M = _mm_set1_epi32((int) mask);
+	for (t=0; t<FT_DELTA_BLOCK/FT_DELTA_LANES; t++, v+=FT_DELTA_LANES) {
+		UINT32_T pos = t*b, sh = pos & 31, spill = (sh + b > 32);
+		const UINT8_T *w = p + 16*(pos >> 5);
+		__m128i lo = _mm_loadu_si128((const __m128i *) w);
+		__m128i hi = _mm_loadu_si128((const __m128i *) (w + 16*spill));
+		/* a shift by 32 gives 0 */
+		__m128i x = _mm_or_si128(_mm_srl_epi32(lo, _mm_cvtsi32_si128(sh)), _mm_sll_epi32(hi, _mm_cvtsi32_si128(spill ? 32 - sh : 32)));
+		_mm_storeu_si128((__m128i *) v, _mm_and_si128(x, M));
+	}
+#else
+	for (t=0; t<FT_DELTA_BLOCK/FT_DELTA_LANES; t++, v+=FT_DELTA_LANES) {
+		UINT32_T pos = t*b, sh = pos & 31, l;
+		const UINT8_T *w = p + 16*(pos >> 5);
+		const UINT8_T *w2 = (sh + b > 32) ? w + 16 : w;
+		for (l=0; l<FT_DELTA_LANES; l++) {
+			UINT64_T x = load32(w + 4*l) | ((UINT64_T) load32(w2 + 4*l) << 32);
+			v[l] = (UINT32_T) (x >> sh) & mask;
+		}
+	}
+#endif
+}
+
+/* reads a block written by pack_block, returns the end of it or NULL */
+static const UINT8_T *unpack_block(const UINT8_T *p, const UINT8_T *end, UINT32_T *v, UINT32_T maxbits) {
+	UINT32_T b;
+
+	if (p >= end) return NULL;
+	b = *p++;
+	if (b > maxbits || (size_t) (end - p) < FT_DELTA_LANES*4*b) return NULL;
+	if (b == 0)
+		memset(v, 0, FT_DELTA_BLOCK * sizeof(UINT32_T));
+	else
+		unpack_values(p, v, b);
+	return p + FT_DELTA_LANES*4*b;
+}
+
+/* differences with the previous sample, zig-zag coded, for a whole block of
+ * words of type T. The fixed length lets the compiler vectorize these loops */
+#define DEFINE_ZIGZAG(T, BITS)                                            \
+static UINT32_T zigzag##BITS(const T *x, const T *prev, UINT32_T *v) {    \
+	UINT32_T j, any = 0;                                                  \
+	for (j=0; j<FT_DELTA_BLOCK; j++) {                                    \
+		T d = (T) (x[j] - prev[j]);                                       \
+		T z = (T) ((T) (d << 1) ^ (T) (0 - (d >> (BITS-1))));            \
+		v[j] = z;                                                         \
+		any |= z;                                                         \
+	}                                                                     \
+	return any;                                                           \
+}                                                                         \
+static void unzigzag##BITS(const UINT32_T *v, T *d) {                     \
+	UINT32_T j;                                                           \
+	for (j=0; j<FT_DELTA_BLOCK; j++) {                                    \
+		d[j] = (T) ((T) (v[j] >> 1) ^ (T) (0 - (v[j] & 1)));              \
+	}                                                                     \
+}
+
+DEFINE_ZIGZAG(UINT16_T, 16)
+DEFINE_ZIGZAG(UINT32_T, 32)
+
+/* the first sample is taken relative to 0, and the last block is padded
+ * with zeros, so those blocks are prepared in tmp first */
+#define ENCODE_DELTA(T, BITS) {                                           \
+	const T *x = (const T *) src;                                         \
+	T tmp[2*FT_DELTA_BLOCK];                                              \
+	for (i=0; i<n; i+=FT_DELTA_BLOCK) {                                   \
+		UINT32_T any;                                                     \
+		m = (n - i < FT_DELTA_BLOCK) ? n - i : FT_DELTA_BLOCK;            \
+		if (m == FT_DELTA_BLOCK && i >= nchans) {                         \
+			any = zigzag##BITS(x + i, x + i - nchans, v);                 \
+		} else {                                                          \
+			memset(tmp, 0, sizeof(tmp));                                  \
+			for (j=0; j<m; j++) {                                         \
+				tmp[j] = x[i+j];                                          \
+				if (i+j >= nchans) tmp[FT_DELTA_BLOCK+j] = x[i+j-nchans]; \
+			}                                                             \
+			any = zigzag##BITS(tmp, tmp + FT_DELTA_BLOCK, v);             \
+		}                                                                 \
+		q = pack_block(q, v, bits_of(any));                               \
+	}                                                                     \
+}
+
+#define DECODE_DELTA(T, BITS) {                                           \
+	T *x = (T *) dest;                                                    \
+	T d[FT_DELTA_BLOCK];                                                  \
+	for (i=0; i<n; i+=FT_DELTA_BLOCK) {                                   \
+		m = (n - i < FT_DELTA_BLOCK) ? n - i : FT_DELTA_BLOCK;            \
+		if ((p = unpack_block(p, end, v, BITS)) == NULL) return -1;       \
+		unzigzag##BITS(v, d);                                             \
+		if (i >= nchans && nchans >= 8 && m == FT_DELTA_BLOCK) {          \
+			/* runs of 8 never depend on themselves, and vectorize */     \
+			for (j=0; j<m; j+=8) {                                        \
+				const T *q = x + (i + j - nchans);                        \
+				T r[8];                                                   \
+				int l;                                                    \
+				for (l=0; l<8; l++) r[l] = (T) (d[j+l] + q[l]);           \
+				memcpy(x+i+j, r, sizeof(r));                              \
+			}                                                             \
+		} else if (i >= nchans) {                                         \
+			for (j=0; j<m; j++) x[i+j] = (T) (d[j] + x[i+j-nchans]);      \
+		} else {                                                          \
+			for (j=0; j<m; j++) {                                         \
+				x[i+j] = (T) (d[j] + ((i+j >= nchans) ? x[i+j-nchans] : 0)); \
+			}                                                             \
+		}                                                                 \
+	}                                                                     \
+}
+
+/* not FLOAT32: the bit patterns of noisy floats differ in nearly all of
+ * their mantissa, and by 2^31 when the sign changes, so they need all 32
+ * bits in almost every block */
+static UINT32_T delta_wordsize(UINT32_T data_type) {
+	switch (data_type) {
+		case DATATYPE_INT16:
+		case DATATYPE_UINT16:
+			return 2;
+		case DATATYPE_INT32:
+		case DATATYPE_UINT32:
+			return 4;
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+
+int ft_delta_supported(UINT32_T data_type) {
+	return delta_wordsize(data_type) != 0;
+}
+
+UINT32_T ft_delta_bound(UINT32_T n, UINT32_T wordsize) {
+	/* a header byte per block, and the last block is padded */
+	UINT32_T nblocks = (n + FT_DELTA_BLOCK - 1) / FT_DELTA_BLOCK;
+	return nblocks * (1 + FT_DELTA_BLOCK*wordsize);
+}
+
+UINT32_T ft_delta_encode(UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src, void *dest) {
+	UINT32_T v[FT_DELTA_BLOCK];
+	UINT32_T i, j, m, n = nchans*nsamples;
+	UINT8_T *q = (UINT8_T *) dest;
+
+	switch (delta_wordsize(data_type)) {
+		case 2: ENCODE_DELTA(UINT16_T, 16); break;
+		case 4: ENCODE_DELTA(UINT32_T, 32); break;
+		default: return 0;
+	}
+	return (UINT32_T) (q - (UINT8_T *) dest);
+}
+
+int ft_delta_decode(UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src, UINT32_T srcsize, void *dest) {
+	UINT32_T v[FT_DELTA_BLOCK];
+	UINT32_T i, j, m, n = nchans*nsamples;
+	const UINT8_T *p = (const UINT8_T *) src;
+	const UINT8_T *end = p + srcsize;
+
+	switch (delta_wordsize(data_type)) {
+		case 2: DECODE_DELTA(UINT16_T, 16); break;
+		case 4: DECODE_DELTA(UINT32_T, 32); break;
+		default: return -1;
+	}
+	return (p == end) ? 0 : -1;
+}
+
+int ft_samples_encoded(const void *buf, UINT32_T bufsize) {
+	const datadef_t *ddef = (const datadef_t *) buf;
+	if (buf == NULL || bufsize < sizeof(datadef_t)) return 0;
+	return (ddef->data_type & DATATYPE_ENCODED) && ddef->data_type != DATATYPE_UNKNOWN;
+}
+
+void *ft_encode_samples(const void *buf, UINT32_T bufsize, UINT32_T *size) {
+	const datadef_t *ddef = (const datadef_t *) buf;
+	UINT32_T wordsize, n, encsize;
+	datadef_t *out;
+
+	if (buf == NULL || bufsize < sizeof(datadef_t)) return NULL;
+	wordsize = delta_wordsize(ddef->data_type);
+	if (wordsize == 0 || ddef->nchans == 0) return NULL;
+	if ((UINT64_T) ddef->nchans * ddef->nsamples * wordsize != ddef->bufsize) return NULL;
+	if (ddef->bufsize != bufsize - sizeof(datadef_t)) return NULL;
+	/* not worth the trouble for a few samples */
+	if (ddef->bufsize < 256) return NULL;
+
+	n = ddef->nchans * ddef->nsamples;
+	out = (datadef_t *) malloc(sizeof(datadef_t) + ft_delta_bound(n, wordsize));
+	if (out == NULL) return NULL;
+	encsize = ft_delta_encode(ddef->data_type, ddef->nchans, ddef->nsamples, ddef+1, out+1);
+	if (encsize == 0 || encsize >= ddef->bufsize) {
+		free(out);
+		return NULL;
+	}
+	out->nchans    = ddef->nchans;
+	out->nsamples  = ddef->nsamples;
+	out->data_type = ddef->data_type | DATATYPE_ENCODED;
+	out->bufsize   = encsize;
+	*size = sizeof(datadef_t) + encsize;
+	return out;
+}
+
+void *ft_decode_samples(const void *buf, UINT32_T bufsize, UINT32_T *size) {
+	const datadef_t *ddef = (const datadef_t *) buf;
+	UINT32_T data_type, wordsize;
+	UINT64_T rawsize;
+	datadef_t *out;
+
+	if (!ft_samples_encoded(buf, bufsize)) return NULL;
+	if (ddef->bufsize != bufsize - sizeof(datadef_t)) return NULL;
+	data_type = ddef->data_type & ~DATATYPE_ENCODED;
+	wordsize = delta_wordsize(data_type);
+	rawsize = (UINT64_T) ddef->nchans * ddef->nsamples * wordsize;
+	if (wordsize == 0 || rawsize + sizeof(datadef_t) > 0xFFFFFFFFu) return NULL;
+
+	out = (datadef_t *) malloc(sizeof(datadef_t) + (size_t) rawsize);
+	if (out == NULL) return NULL;
+	if (ft_delta_decode(data_type, ddef->nchans, ddef->nsamples, ddef+1, ddef->bufsize, out+1) != 0) {
+		free(out);
+		return NULL;
+	}
+	out->nchans    = ddef->nchans;
+	out->nsamples  = ddef->nsamples;
+	out->data_type = data_type;
+	out->bufsize   = (UINT32_T) rawsize;
+	*size = sizeof(datadef_t) + (UINT32_T) rawsize;
+	return out;
+}
+
+/*****************************************************************************
+ * client side
+ *****************************************************************************/
+
+/* indexed by the socket, only changed by the thread that uses the socket */
+static UINT32_T connectionEncoding[FT_ENCODING_MAX_SOCKET];
+
+int ft_request_encoding(int server, UINT32_T encoding) {
+	messagedef_t def;
+	message_t request, *response = NULL;
+	int result = -1;
+
+	if (server <= 0 || server >= FT_ENCODING_MAX_SOCKET) return -1;
+	def.version = VERSION;
+	def.command = SET_ENCODING;
+	def.bufsize = sizeof(UINT32_T);
+	request.def = &def;
+	request.buf = &encoding;
+	if (tcprequest(server, &request, &response) == 0 && response != NULL) {
+		if (response->def->command == ENCODING_OK) {
+			connectionEncoding[server] = encoding;
+			result = 0;
+		}
+	}
+	cleanup_message((void **) &response);
+	return result;
+}
+
+UINT32_T ft_connection_encoding(int server) {
+	if (server <= 0 || server >= FT_ENCODING_MAX_SOCKET) return FT_ENCODING_NONE;
+	return connectionEncoding[server];
+}
+
+void ft_forget_encoding(int server) {
+	if (server <= 0 || server >= FT_ENCODING_MAX_SOCKET) return;
+	connectionEncoding[server] = FT_ENCODING_NONE;
+}
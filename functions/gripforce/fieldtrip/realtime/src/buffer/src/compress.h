@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_DELTA_BLOCK          128     /* values per bit-packed block */
+#define FT_DELTA_LANES          4       /* ... which are packed in this many interleaved lanes */
+#define FT_ENCODING_MAX_SOCKET  1024    /* clients can only ask for an encoding on sockets below this number */
+
+/** Lossless compression of the samples in PUT_DAT and GET_DAT over the network.
+
+    A client asks for FT_ENCODING_DELTA once per connection with SET_ENCODING,
+    which the server answers with ENCODING_OK, or with ENCODING_ERR when the
+    two sides differ in endianness or the header of the stream has a type
+    that cannot be encoded (see below). From then on, both sides may
+    send the samples of PUT_DAT requests and GET_DAT responses encoded, which
+    they mark by adding DATATYPE_ENCODED to the data_type in the datadef_t.
+    Samples that do not get any smaller are sent as they are, so the receiver
+    has to look at the data_type of every message.
+
+    The encoding works on integers of 16 and 32 bits (INT16, UINT16, INT32
+    and UINT32). FLOAT32 is not encoded: the bit patterns of noisy floats
+    hardly get any smaller as differences, so clients that stream floats
+    should not ask for it, and samples of other types are always sent as
+    they are. Every value is replaced by its difference with the same channel in the
+    previous sample, mapped to an unsigned number by zig-zag coding, so that
+    small differences of either sign become small numbers:
+
+        zz = (d << 1) ^ (d >> (bits-1))
+
+    The differences, in the order of the samples, are then packed in blocks
+    of FT_DELTA_BLOCK values, the last one padded with zeros. Each block
+    starts with one byte that gives the number of bits b of its largest
+    value, followed by 16*b bytes with the values in b bits each. Value j of
+    the block goes into lane j%4, and lane l fills the 32-bit words l, l+4,
+    l+8, ... from the lowest bit up, so that the four lanes can be packed and
+    unpacked side by side. The words are in the byte order of the machines,
+    which is why both sides have to agree on that. Slowly changing signals such as EEG
+    or the time series of a voxel need far fewer bits than their type.
+
+    On the client side, tcprequest encodes PUT_DAT and decodes GET_DAT on
+    connections that have an encoding, and socketserver does the opposite.
+    Everything else, including dmarequest, only ever sees plain samples.
+*/
+
+/** Returns 1 if samples of this type can be encoded */
+int ft_delta_supported(UINT32_T data_type);
+
+/** Returns the largest number of bytes that n values of the given word size can be encoded in */
+UINT32_T ft_delta_bound(UINT32_T n, UINT32_T wordsize);
+
+/** Encodes nsamples samples of nchans channels into dest, which must hold
+    ft_delta_bound bytes. Returns the size of the encoding, or 0 if the type
+    cannot be encoded.
+*/
+UINT32_T ft_delta_encode(UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src, void *dest);
+
+/** The reverse, returns 0 or -1 if src is not a valid encoding of that size */
+int ft_delta_decode(UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src, UINT32_T srcsize, void *dest);
+
+/** Returns 1 if buf starts with a datadef_t of encoded samples */
+int ft_samples_encoded(const void *buf, UINT32_T bufsize);
+
+/** Encodes the datadef_t and samples in buf (of a PUT_DAT request or a
+    GET_DAT response) into a newly allocated buffer, and returns it with
+    its size in *size. Returns NULL if the samples are better sent as they are.
+*/
+void *ft_encode_samples(const void *buf, UINT32_T bufsize, UINT32_T *size);
+
+/** The reverse, returns NULL if buf is not a valid encoding */
+void *ft_decode_samples(const void *buf, UINT32_T bufsize, UINT32_T *size);
+
+/** Client side: asks the server for an encoding, returns 0 if it agreed, -1 otherwise */
+int ft_request_encoding(int server, UINT32_T encoding);
+
+/** Client side: the encoding that was agreed on for this socket */
+UINT32_T ft_connection_encoding(int server);
+
+/** Client side: to be called when the socket is closed */
+void ft_forget_encoding(int server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* COMPRESS_H */
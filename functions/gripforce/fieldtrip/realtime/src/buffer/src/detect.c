@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "stream.h"
+#include "detect.h"
+
+#define DEFAULT_TYPE "detector"
+#define CHUNK 256                 /* values of a channel that are converted at once */
+
+typedef struct {
+	detectordef_t def;
+	char     *type;       /* type of its events, def.bufsize characters */
+	double   *window;     /* the last def.window values of the channel */
+	UINT32_T fill;        /* number of values in the window */
+	UINT32_T pos;         /* where the next value goes */
+	double   sum;
+	double   sumsq;
+	int      above;       /* whether the last value was above the threshold, -1 before the first */
+	UINT32_T quiet;       /* no event before this sample */
+} detector_t;
+
+typedef struct {
+	UINT32_T  detector;
+	INT32_T   sample;
+	FLOAT64_T value;
+} detected_t;
+
+struct ft_detectors {
+	UINT32_T   count;
+	detector_t item[FT_DETECT_MAX];
+	UINT32_T   done;      /* all samples before this one have been seen */
+	double     fsample;
+	UINT32_T   npending;
+	UINT32_T   dropped;   /* events that did not fit in "pending" */
+	detected_t pending[FT_DETECT_PENDING];
+};
+
+static void restart(detector_t *D) {
+	D->fill  = 0;
+	D->pos   = 0;
+	D->sum   = 0;
+	D->sumsq = 0;
+	D->above = -1;
+	D->quiet = 0;
+}
+
+/* the header may have changed since the detectors were added */
+static int valid_channel(const ft_stream_t *S, UINT32_T channel) {
+	return S->header != NULL && channel < S->header->def->nchans && S->header->def->data_type != DATATYPE_CHAR
+	       && wordsize_from_type(S->header->def->data_type) != 0;
+}
+
+#define READ_CHANNEL(T) {                                 \
+	for (s=0; s<n; s++, src += chansize)                  \
+		dest[s] = (double) ((const T *) src)[channel];    \
+}
+
+/* copies channel "channel" of n samples at src into dest */
+static void read_channel(const char *src, UINT32_T n, UINT32_T chansize, UINT32_T data_type, UINT32_T channel, double *dest) {
+	UINT32_T s;
+	switch (data_type) {
+		case DATATYPE_UINT8:   READ_CHANNEL(UINT8_T);   break;
+		case DATATYPE_UINT16:  READ_CHANNEL(UINT16_T);  break;
+		case DATATYPE_UINT32:  READ_CHANNEL(UINT32_T);  break;
+		case DATATYPE_UINT64:  READ_CHANNEL(UINT64_T);  break;
+		case DATATYPE_INT8:    READ_CHANNEL(INT8_T);    break;
+		case DATATYPE_INT16:   READ_CHANNEL(INT16_T);   break;
+		case DATATYPE_INT32:   READ_CHANNEL(INT32_T);   break;
+		case DATATYPE_INT64:   READ_CHANNEL(INT64_T);   break;
+		case DATATYPE_FLOAT32: READ_CHANNEL(FLOAT32_T); break;
+		case DATATYPE_FLOAT64: READ_CHANNEL(FLOAT64_T); break;
+	}
+}
+
+/* Newton's method, as libbuffer does not need libm otherwise; only used for the value of an event */
+static double square_root(double x) {
+	double r, next;
+	if (x <= 0) return 0;
+	r = (x > 1) ? x : 1;
+	for (;;) {
+		next = 0.5 * (r + x / r);
+		if (next >= r) return r;
+		r = next;
+	}
+}
+
+static void emit(struct ft_detectors *T, UINT32_T d, UINT32_T sample, double value) {
+	if (T->npending == FT_DETECT_PENDING) {
+		T->dropped++;
+		return;
+	}
+	T->pending[T->npending].detector = d;
+	T->pending[T->npending].sample   = (INT32_T) sample;
+	T->pending[T->npending].value    = value;
+	T->npending++;
+}
+
+/* runs detector d over n values of its channel, the first of which is sample "sample" */
+static void run(struct ft_detectors *T, UINT32_T d, const double *x, UINT32_T n, UINT32_T sample) {
+	detector_t *D = &T->item[d];
+	UINT32_T w = D->def.window, i;
+
+	for (i=0; i<n; i++, sample++) {
+		double old = D->window[D->pos], v;
+		int full = (D->fill == w), above;
+
+		/* slide the window by one value */
+		D->window[D->pos] = x[i];
+		if (full) {
+			D->sum   += x[i] - old;
+			D->sumsq += x[i]*x[i] - old*old;
+		} else {
+			D->sum   += x[i];
+			D->sumsq += x[i]*x[i];
+			D->fill++;
+		}
+		if (++D->pos == w) {
+			/* start from exact sums again, once per window */
+			UINT32_T k;
+			D->pos = 0;
+			D->sum = D->sumsq = 0;
+			for (k=0; k<D->fill; k++) {
+				D->sum   += D->window[k];
+				D->sumsq += D->window[k]*D->window[k];
+			}
+		}
+
+		switch (D->def.operation) {
+			case FT_DETECT_MEAN:
+				if (D->fill < w) continue;
+				v = D->sum / w;
+				break;
+			case FT_DETECT_DERIVATIVE:
+				/* needs the value that just left the window */
+				if (!full) continue;
+				v = (x[i] - old) / w * T->fsample;
+				break;
+			default:
+				/* the mean square, which is compared with the square of the threshold */
+				if (D->fill < w) continue;
+				v = (D->sumsq > 0) ? D->sumsq / w : 0;
+				break;
+		}
+
+		if (D->def.operation == FT_DETECT_RMS)
+			above = (D->def.threshold < 0 || v > D->def.threshold * D->def.threshold);
+		else
+			above = (v > D->def.threshold);
+		if (D->above >= 0 && above != D->above && sample >= D->quiet) {
+			if ((above && (D->def.edge & FT_DETECT_RISING)) || (!above && (D->def.edge & FT_DETECT_FALLING))) {
+				emit(T, d, sample, (D->def.operation == FT_DETECT_RMS) ? square_root(v) : v);
+				D->quiet = sample + D->def.holdoff;
+			}
+		}
+		D->above = above;
+	}
+}
+
+/*****************************************************************************/
+
+int ft_detect_add(ft_stream_t *S, const detectordef_t *def, const char *type) {
+	struct ft_detectors *T = S->detect;
+	detector_t *D;
+
+	if (def->operation < FT_DETECT_MEAN || def->operation > FT_DETECT_RMS) return -1;
+	if (def->window == 0 || def->edge == 0 || (def->edge & ~(FT_DETECT_RISING | FT_DETECT_FALLING))) return -1;
+	if (S->header != NULL && !valid_channel(S, def->channel)) return -1;
+
+	if (T == NULL) {
+		T = (struct ft_detectors *) calloc(1, sizeof(struct ft_detectors));
+		if (T == NULL) return -1;
+		S->detect = T;
+		ft_detect_reset(S);
+	}
+	if (T->count == FT_DETECT_MAX) return -1;
+
+	D = &T->item[T->count];
+	D->def = *def;
+	if (def->bufsize == 0) {
+		D->def.bufsize = strlen(DEFAULT_TYPE);
+		type = DEFAULT_TYPE;
+	}
+	D->type   = (char *) malloc(D->def.bufsize);
+	D->window = (double *) calloc(def->window, sizeof(double));
+	if (D->type == NULL || D->window == NULL) {
+		FREE(D->type);
+		FREE(D->window);
+		return -1;
+	}
+	memcpy(D->type, type, D->def.bufsize);
+	restart(D);
+	return (int) T->count++;
+}
+
+void ft_detect_clear(ft_stream_t *S) {
+	struct ft_detectors *T = S->detect;
+	UINT32_T d;
+
+	if (T == NULL) return;
+	for (d=0; d<T->count; d++) {
+		FREE(T->item[d].type);
+		FREE(T->item[d].window);
+	}
+	T->count = 0;
+	T->npending = 0;
+}
+
+void ft_detect_reset(ft_stream_t *S) {
+	struct ft_detectors *T = S->detect;
+	UINT32_T d;
+
+	if (T == NULL) return;
+	for (d=0; d<T->count; d++) restart(&T->item[d]);
+	/* samples that are in the ring already (after a restore, see persist.h) are not looked at */
+	T->done     = (S->data != NULL) ? ft_ring_count(S->data) : 0;
+	T->fsample  = (S->header != NULL && S->header->def->fsample > 0) ? S->header->def->fsample : 1;
+	T->npending = 0;
+}
+
+UINT32_T ft_detect_update(ft_stream_t *S) {
+	struct ft_detectors *T = S->detect;
+	ft_ring_t *R = S->data;
+	double x[CHUNK];
+	UINT32_T count;
+
+	if (T == NULL || R == NULL || T->count == 0) return 0;
+	count = ft_ring_count(R);
+
+	while (T->done < count) {
+		/* the writer holds mutexdata, so these samples are not overwritten */
+		UINT32_T start = T->done % R->capacity, d;
+		UINT32_T n = R->capacity - start;
+		if (n > count - T->done) n = count - T->done;
+		if (n > CHUNK) n = CHUNK;
+
+		for (d=0; d<T->count; d++) {
+			if (!valid_channel(S, T->item[d].def.channel)) continue;
+			read_channel(R->buf + (size_t) start * R->chansize, n, R->chansize, S->header->def->data_type, T->item[d].def.channel, x);
+			run(T, d, x, n, T->done);
+		}
+		T->done += n;
+	}
+	if (T->dropped > 0) {
+		fprintf(stderr, "ft_detect: dropped %u events, consider a longer holdoff\n", T->dropped);
+		T->dropped = 0;
+	}
+	return T->npending;
+}
+
+void ft_detect_publish(ft_stream_t *S) {
+	struct ft_detectors *T = S->detect;
+	UINT32_T i;
+
+	if (T == NULL || T->npending == 0) return;
+	if (S->header == NULL || S->event == NULL) {
+		T->npending = 0;
+		return;
+	}
+
+	for (i=0; i<T->npending; i++) {
+		const detector_t *D = &T->item[T->pending[i].detector];
+		char buf[256 + sizeof(FLOAT64_T)];
+		eventdef_t evdef;
+		UINT32_T len = (D->def.bufsize < 256) ? D->def.bufsize : 256;
+
+		evdef.type_type   = DATATYPE_CHAR;
+		evdef.type_numel  = len;
+		evdef.value_type  = DATATYPE_FLOAT64;
+		evdef.value_numel = 1;
+		evdef.sample      = T->pending[i].sample;
+		evdef.offset      = 0;
+		evdef.duration    = 0;
+		evdef.bufsize     = len + sizeof(FLOAT64_T);
+		memcpy(buf, D->type, len);
+		memcpy(buf + len, &T->pending[i].value, sizeof(FLOAT64_T));
+
+		if (ft_eventlog_append(S->event, &evdef, buf) != 0) {
+			fprintf(stderr, "ft_detect: cannot store event\n");
+			break;
+		}
+		if (ft_eventindex_add(&S->eventindex, S->event, S->event->count-1, &evdef, buf) != 0) {
+			fprintf(stderr, "ft_detect: cannot add event to the index\n");
+		}
+		S->header->def->nevents = S->event->count;
+	}
+	T->npending = 0;
+	ft_waitreg_update(&S->waiters, FT_WAIT_EVENTS, S->header->def->nevents);
+}
+
+void ft_detect_free(ft_stream_t *S) {
+	if (S->detect == NULL) return;
+	ft_detect_clear(S);
+	FREE(S->detect);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef DETECT_H
+#define DETECT_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_DETECT_MAX      16     /* detectors per stream */
+#define FT_DETECT_PENDING  256    /* events that can wait for ft_detect_publish */
+
+/** Online detectors, which turn threshold crossings into events.
+
+    A client that only wants to know when, say, the mean force over 20 ms
+    goes above some level does not need the samples for that. It sends
+    ADD_DETECTOR with a detectordef_t (see message.h) for one channel, and
+    the writer computes the mean, the derivative of that mean, or the RMS
+    over a sliding window of that channel for every sample that PUT_DAT
+    commits. Whenever the value crosses the threshold in the direction(s)
+    given by "edge", an event is added to the stream as if it had been put
+    with PUT_EVT: its type is the string that follows the detectordef_t
+    ("detector" if there is none), its value the FLOAT64_T value of the
+    operation, and its sample the one at which the threshold was crossed.
+    A client can wait for it with WAIT_DAT, and find it with GET_EVT_QUERY.
+
+    The window is kept as a running sum (and sum of squares) over the last
+    "window" values, which is recomputed from those values every time the
+    window has been filled again, so that rounding errors do not add up.
+    The derivative is the change of the mean from one sample to the next,
+    (x[t] - x[t-window]) / window, times the sampling rate. A detector gives
+    its first value when its window is full, and reports a crossing only
+    after that. After an event, "holdoff" samples are skipped before the
+    next, so a noisy signal does not make a burst of events.
+
+    The detectors belong to the stream and are kept until CLEAR_DETECTORS,
+    also when a new header is put; detectors for a channel that the header
+    does not have are ignored. A new header and FLUSH_DAT start all windows
+    afresh.
+*/
+
+struct ft_stream;
+
+/** Adds a detector (def, followed by def->bufsize characters of the event
+    type in buf) to stream S, with the header, ring and data locks held.
+    Returns its number, or -1 if the definition is not valid or there are
+    FT_DETECT_MAX detectors already.
+*/
+int  ft_detect_add(struct ft_stream *S, const detectordef_t *def, const char *type);
+
+/** Removes all detectors of S, with the same locks held */
+void ft_detect_clear(struct ft_stream *S);
+
+/** Starts all windows afresh after PUT_HDR or FLUSH_DAT, with all locks held */
+void ft_detect_reset(struct ft_stream *S);
+
+/** With mutexdata held, by the writer: runs the detectors over the samples
+    that have been committed since the last call, and returns the number of
+    events that wait for ft_detect_publish.
+*/
+UINT32_T ft_detect_update(struct ft_stream *S);
+
+/** With mutexheader, mutexdata and mutexevent held: adds the waiting events
+    to the event log, like PUT_EVT
+*/
+void ft_detect_publish(struct ft_stream *S);
+
+/** Frees the detectors of S, only when no client can be active anymore */
+void ft_detect_free(struct ft_stream *S);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DETECT_H */
@@ -14,20 +14,40 @@
 
 #include "buffer.h"
 #include "platform_includes.h"
-
-/* FIXME should these be static? */
-static header_t   *header   = NULL;
-static data_t     *data     = NULL;
-static event_t    *event    = NULL;
-
-/* these are used for fine-tuning the sample number of incoming events */
-struct timespec putdat_clock;
-struct timespec putevt_clock;
-
-static unsigned int current_max_num_sample = 0;
-
-static int thissample = 0;    /* points at the buffer */
-static int thisevent = 0;     /* points at the buffer */
+#include "ringbuffer.h"
+#include "eventlog.h"
+#include "eventindex.h"
+#include "waitreg.h"
+#include "stream.h"
+#include "zerocopy.h"
+#include "shm.h"
+#include "persist.h"
+#include "history.h"
+#include "chansel.h"
+#include "pyramid.h"
+#include "batch.h"
+#include "detect.h"
+#include "stats.h"
+#include "trace.h"
+#include "lockstat.h"
+
+/* capacity that is used if PUT_HDR does not come with a FT_CHUNK_BUFFER_CAPACITY */
+static capacitydef_t default_capacity = {0, 0, 0, 0};
+static pthread_mutex_t mutexcapacity = PTHREAD_MUTEX_INITIALIZER;
+
+/* minimal size of GET_DAT responses that are sent straight from the ring */
+static volatile UINT32_T zerocopy_threshold = FT_ZEROCOPY_THRESHOLD;
+
+/* minimal size of PUT_DAT requests that are received straight into the ring */
+static volatile UINT32_T ingest_threshold = FT_INGEST_THRESHOLD;
+
+/* the requests in a BATCH are handled while execute_batch holds all the locks of the stream.
+   The locks are taken through lockstat.c, which keeps track of who waits for whom
+   and adds the waits to the trace (see trace.h), when either is enabled. */
+#define STREAM_LOCK(kind)    do { if (!batched) held[kind] = ft_stream_lock(S, kind, request->def->command); } while (0)
+#define STREAM_UNLOCK(kind)  do { if (!batched) ft_stream_unlock(S, kind, request->def->command, held[kind]); } while (0)
+
+static int execute_batch(ft_stream_t *S, const message_t *request, message_t *response);
 
 /* Note that there have been problems with the order of the mutexes (e.g.
  * http://bugzilla.fcdonders.nl/show_bug.cgi?id=933).
@@ -42,104 +62,294 @@ static int thisevent = 0;     /* points at the buffer */
  * functions.
  *
  * -- Boris
+ *
+ * The data ring itself is lock-free for readers (see ringbuffer.c): GET_DAT
+ * only holds rwlockring for reading, which keeps the ring from being freed
+ * or reallocated underneath it, and never waits for PUT_DAT. The writer
+ * holds rwlockring for reading as well, plus mutexdata to serialize multiple
+ * writers. Only PUT_HDR, FLUSH_HDR and FLUSH_DAT take rwlockring for writing.
+ * The order of locking is mutexheader, rwlockring, mutexdata, mutexevent,
+ * and the lock of the WAIT_DAT registry (see waitreg.c) comes last.
+ *
+ * All of these locks, and the header, data and events they protect, exist
+ * once per stream (see stream.h). A request only ever touches the stream
+ * that is selected by its connection, so the order above is per stream and
+ * requests for different streams never wait for each other. The WAIT_DAT
+ * registry keeps its own copy of the sample and event counts, which is
+ * updated by whoever changes them while still holding mutexdata or
+ * mutexevent, so the registry lock always comes last.
+ *
+ * A BATCH (see batch.h) takes mutexheader, rwlockring (for writing only if
+ * one of its requests replaces or resets the ring), mutexdata and mutexevent
+ * once, in this order, and then handles its requests without any further
+ * locking, which is what the STREAM_LOCK calls below leave out.
+ *
+ * The events of the detectors (see detect.h) are found by the writer while
+ * it holds mutexdata, and added to the log after it has let go of the ring,
+ * with mutexheader, mutexdata and mutexevent, in that order.
  */
 
-pthread_mutex_t mutexheader   = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutexdata     = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutexevent    = PTHREAD_MUTEX_INITIALIZER;
+/*****************************************************************************/
 
-pthread_cond_t getData_cond   = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t getData_mutex = PTHREAD_MUTEX_INITIALIZER;
+void ft_set_default_capacity(const capacitydef_t *capacity) {
+	pthread_mutex_lock(&mutexcapacity);
+	if (capacity)
+		memcpy(&default_capacity, capacity, sizeof(capacitydef_t));
+	else
+		memset(&default_capacity, 0, sizeof(capacitydef_t));
+	pthread_mutex_unlock(&mutexcapacity);
+}
 
-/*****************************************************************************/
+/* returns a copy of the server default capacity */
+static capacitydef_t get_default_capacity(void) {
+	capacitydef_t capacity;
+	pthread_mutex_lock(&mutexcapacity);
+	capacity = default_capacity;
+	pthread_mutex_unlock(&mutexcapacity);
+	return capacity;
+}
 
-void free_header() {
-	int verbose = 0;
-	if (verbose>0) fprintf(stderr, "free_header: freeing header buffer\n");
-	if (header) {
-		FREE(header->def);
-		FREE(header->buf);
-		FREE(header);
-	}
+/* returns the FT_CHUNK_BUFFER_CAPACITY in the given header, or NULL */
+static capacitydef_t *header_capacity(const header_t *header) {
+	const ft_chunk_t *chunk;
+	if (header==NULL || header->buf==NULL) return NULL;
+	chunk = find_chunk(header->buf, 0, header->def->bufsize, FT_CHUNK_BUFFER_CAPACITY);
+	if (chunk==NULL || chunk->def.size < sizeof(capacitydef_t)) return NULL;
+	return (capacitydef_t *) chunk->data;
 }
 
-void free_data() {
-	int verbose = 0;
-	if (verbose>0) fprintf(stderr, "free_data: freeing data buffer\n");
-	if (data) {
-		FREE(data->def);
-		FREE(data->buf);
-		FREE(data);
+/* determines the samples that a GET_DAT request asks for, given the number
+ * of samples in the ring. Returns 0 if the selection is valid, or the number
+ * of the error (1, 2 or 3) that dmarequest reports. */
+static int get_data_selection(const ft_stream_t *S, const message_t *request, UINT32_T nsamples, datasel_t *datasel) {
+	if (request->def->bufsize) {
+		/* the selection has been specified */
+		memcpy(datasel, request->buf, sizeof(datasel_t));
+		/* If endsample is -1 read the buffer to the end */
+		if(datasel->endsample == -1)
+		{
+			datasel->endsample = nsamples - 1;
+		}
 	}
-	thissample = 0;
-	if (header) header->def->nsamples = 0;
+	else {
+		/* determine a valid selection */
+		if (nsamples>S->data->capacity) {
+			/* the ringbuffer is completely full */
+			datasel->begsample = nsamples - S->data->capacity;
+			datasel->endsample = nsamples - 1;
+		}
+		else {
+			/* the ringbuffer is not yet completely full */
+			datasel->begsample = 0;
+			datasel->endsample = nsamples - 1;
+		}
+	}
+
+	if (datasel->begsample < 0 || datasel->endsample < 0)
+		return 1;
+	if (datasel->begsample >= nsamples || datasel->endsample >= nsamples || datasel->endsample < datasel->begsample)
+		return 2;
+	/* samples that have left the ring may still be in the history */
+	if ((nsamples - datasel->begsample) > S->data->capacity && !ft_history_active(S))
+		return 3;
+	return 0;
 }
 
-void free_event() {
-	int verbose = 0;
-	int i;
-	if (verbose>0) fprintf(stderr, "free_event: freeing event buffer\n");
-	if (event) {
-		for (i=0; i<MAXNUMEVENT; i++) {
-			FREE(event[i].def);
-			FREE(event[i].buf);
+/* copies samples from the ring, and from the history for those that have left it */
+static int read_samples(ft_stream_t *S, UINT32_T begsample, UINT32_T nsamples, char *dest) {
+	for (;;) {
+		UINT32_T first = ft_ring_first(S->data), n = 0;
+		int res;
+
+		if (begsample < first) {
+			n = (first - begsample < nsamples) ? first - begsample : nsamples;
+			if (ft_history_read(S, begsample, n, dest) != 0) return -1;
+			if (n == nsamples) return 0;
 		}
-		FREE(event);
+		res = ft_ring_read(S->data, begsample + n, nsamples - n, dest + (size_t) n * S->data->chansize);
+		if (res == FT_RING_OK) return 0;
+		/* if the writer overtook us, what it overwrote has been written to the history first */
+		if (res != FT_RING_OVERWRITTEN || !ft_history_active(S)) return -1;
 	}
-	thisevent = 0;
-	if (header) header->def->nevents = 0;
 }
 
-/*****************************************************************************/
+/* copies the selected channels of the samples, converted to the selected type,
+ * in blocks that are read like read_samples does and converted while they are
+ * still in the cache */
+static int read_selected_samples(ft_stream_t *S, const ft_chansel_t *sel, UINT32_T begsample, UINT32_T nsamples, char *dest) {
+	UINT32_T block = FT_CHANSEL_BLOCK_SIZE / S->data->chansize;
+	size_t outsize = (size_t) sel->nchans * wordsize_from_type(sel->data_type);
+	char *tmp;
+	int result = 0;
+
+	if (block == 0) block = 1;
+	if (block > nsamples) block = nsamples;
+	if ((tmp = (char *) malloc((size_t) block * S->data->chansize)) == NULL) return -1;
+
+	while (nsamples > 0 && result == 0) {
+		UINT32_T n = (nsamples < block) ? nsamples : block;
+		result = read_samples(S, begsample, n, tmp);
+		if (result == 0) ft_chansel_convert(sel, S->header->def->data_type, S->header->def->nchans, n, tmp, dest);
+		begsample += n;
+		nsamples  -= n;
+		dest      += n * outsize;
+	}
+	free(tmp);
+	return result;
+}
 
-void init_data(void) {
-	int verbose = 0;
-	if (verbose>0) fprintf(stderr, "init_data: creating data buffer\n");
-	if (header) {
-		unsigned int wordsize = wordsize_from_type(header->def->data_type);
+/* answers GET_DAT_DECIMATED with the samples themselves, for selections that
+ * are too short for the pyramid: every sample is a bin of one sample */
+static int read_undecimated(ft_stream_t *S, UINT32_T begsample, UINT32_T endsample, void **buf, UINT32_T *bufsize) {
+	UINT32_T nchans = S->header->def->nchans, n, i;
+	UINT64_T size;
+	ft_chanrun_t all = {0, 0};
+	ft_chansel_t sel;
+	decimateddef_t *ddef;
+	FLOAT32_T *samples, *bins;
+
+	/* like the levels of the pyramid, only give what is still there */
+	if (!ft_history_active(S) && begsample < ft_ring_first(S->data)) begsample = ft_ring_first(S->data);
+	n = (endsample >= begsample) ? endsample - begsample + 1 : 0;
+
+	size = sizeof(decimateddef_t) + (UINT64_T) n * 3 * nchans * sizeof(FLOAT32_T);
+	if (size > 0xFFFFFFFFu || (*buf = malloc((size_t) size)) == NULL) return -1;
+	ddef = (decimateddef_t *) *buf;
+	ddef->nchans    = nchans;
+	ddef->nbins     = n;
+	ddef->factor    = 1;
+	ddef->begsample = begsample;
+	ddef->data_type = DATATYPE_FLOAT32;
+	ddef->bufsize   = (UINT32_T) (size - sizeof(decimateddef_t));
+	*bufsize = (UINT32_T) size;
+	if (n == 0) return 0;
+
+	/* convert the samples into the last third of the buffer, and spread them out from the front */
+	all.count     = nchans;
+	sel.nchans    = nchans;
+	sel.data_type = DATATYPE_FLOAT32;
+	sel.nruns     = 1;
+	sel.runs      = &all;
+	bins    = (FLOAT32_T *) (ddef+1);
+	samples = bins + (size_t) 2 * n * nchans;
+	if (read_selected_samples(S, &sel, begsample, n, (char *) samples) != 0) {
+		FREE(*buf);
+		return -1;
+	}
+	for (i=0; i<n; i++) {
+		const FLOAT32_T *x = samples + (size_t) i * nchans;
+		FLOAT32_T *bin = bins + (size_t) i * 3 * nchans;
+		memmove(bin, x, nchans * sizeof(FLOAT32_T));
+		memcpy(bin + nchans, bin, nchans * sizeof(FLOAT32_T));
+		memcpy(bin + 2*nchans, bin, nchans * sizeof(FLOAT32_T));
+	}
+	return 0;
+}
 
-		if (wordsize==0) {
-			fprintf(stderr, "init_data: unsupported data type (%u)\n", header->def->data_type);
-			return;
-		}
+/*****************************************************************************/
+
+/* works out how many samples of how many bytes the ring for the current header
+ * holds, and reports that back in the FT_CHUNK_BUFFER_CAPACITY of the header.
+ * Returns 0, or -1 if there cannot be a ring for this header. */
+static int data_capacity(ft_stream_t *S, UINT32_T *capacity, UINT32_T *chansize_ptr) {
+	unsigned int wordsize = wordsize_from_type(S->header->def->data_type);
+	UINT64_T chansize = (UINT64_T) wordsize * S->header->def->nchans;
+	UINT64_T current_max_num_sample;
+	capacitydef_t *requested = header_capacity(S->header);
+	capacitydef_t defcap = get_default_capacity();
+	const capacitydef_t *cap = &defcap;
+
+	if (wordsize==0 || chansize==0) {
+		fprintf(stderr, "init_data: unsupported data type (%u)\n", S->header->def->data_type);
+		return -1;
+	}
+	/* the capacity in the header takes precedence over the server default */
+	if (requested && (requested->nsamples || requested->seconds > 0 || requested->nbytes))
+		cap = requested;
+
+	if (cap->nsamples) {
+		current_max_num_sample = cap->nsamples;
+	} else if (cap->seconds > 0 && S->header->def->fsample > 0) {
+		current_max_num_sample = (UINT64_T) (cap->seconds * S->header->def->fsample + 0.5);
+	} else if (cap->nbytes) {
+		current_max_num_sample = cap->nbytes / chansize;
+	} else if (S->header->def->nchans <= 256) {
 		/* heuristic of choosing size of buffer:
 			 set current_max_num_sample to MAXNUMSAMPLE if nchans <= 256
 			 otherwise, allocate about MAXNUMBYTE and calculate current_max_num_sample from nchans + wordsize
 		 */
-		if (header->def->nchans <= 256) {
-			current_max_num_sample = MAXNUMSAMPLE;
-		} else {
-			current_max_num_sample = MAXNUMBYTE / (wordsize * header->def->nchans);
-		}
-		data = (data_t*)malloc(sizeof(data_t));
+		current_max_num_sample = MAXNUMSAMPLE;
+	} else {
+		current_max_num_sample = MAXNUMBYTE / chansize;
+	}
+	if (current_max_num_sample < 1) current_max_num_sample = 1;
+
+	if (current_max_num_sample > 0xFFFFFFFFu || current_max_num_sample*chansize != (size_t) (current_max_num_sample*chansize)) {
+		fprintf(stderr, "init_data: requested capacity is too large\n");
+		return -1;
+	}
+	*capacity = (UINT32_T) current_max_num_sample;
+	*chansize_ptr = (UINT32_T) chansize;
+
+	/* report back what is going to be allocated */
+	if (requested) {
+		requested->nsamples = *capacity;
+		requested->nbytes   = (UINT64_T) *capacity * *chansize_ptr;
+		requested->seconds  = (S->header->def->fsample > 0) ? *capacity / S->header->def->fsample : 0;
+	}
+	return 0;
+}
+
+/* same for the number of events */
+static UINT32_T event_capacity(ft_stream_t *S) {
+	capacitydef_t *requested = header_capacity(S->header);
+	capacitydef_t defcap = get_default_capacity();
+	UINT32_T maxevents;
+
+	if (requested && requested->nevents)
+		maxevents = requested->nevents;
+	else if (defcap.nevents)
+		maxevents = defcap.nevents;
+	else
+		maxevents = MAXNUMEVENT;
+	if (maxevents == 0) maxevents = 1;
+
+	if (requested) requested->nevents = maxevents;
+	return maxevents;
+}
 
-		DIE_BAD_MALLOC(data);
+static void init_data(ft_stream_t *S, UINT32_T capacity, UINT32_T chansize) {
+	int verbose = 0;
+	if (verbose>0) fprintf(stderr, "init_data: creating data buffer\n");
 
-		data->def = (datadef_t*)malloc(sizeof(datadef_t));
+	/* servers that export their rings put them in shared memory, if that works */
+	S->data = ft_shm_ring_alloc(S, capacity, chansize, S->header->def->nchans, S->header->def->data_type);
 
-		DIE_BAD_MALLOC(data->def);
+	if (S->data == NULL) {
+		S->data = (ft_ring_t*)malloc(sizeof(ft_ring_t));
 
-		data->def->nchans    = header->def->nchans;
-		data->def->nsamples  = current_max_num_sample;
-		data->def->data_type = header->def->data_type;
-		data->buf = malloc(header->def->nchans*current_max_num_sample*wordsize);
+		DIE_BAD_MALLOC(S->data);
 
-		DIE_BAD_MALLOC(data->buf);
+		if (ft_ring_init(S->data, capacity, chansize) != 0) {
+			fprintf(stderr, "init_data: out of memory\n");
+			FREE(S->data);
+		}
 	}
 }
 
-void init_event(void) {
+static void init_event(ft_stream_t *S, UINT32_T maxevents) {
 	int verbose = 0;
-	int i;
 	if (verbose>0) fprintf(stderr, "init_event: creating event buffer\n");
-	if (header) {
-		event = (event_t*)malloc(MAXNUMEVENT*sizeof(event_t));
-		DIE_BAD_MALLOC(event);
-		for (i=0; i<MAXNUMEVENT; i++) {
-			event[i].def = NULL;
-			event[i].buf = NULL;
-		}
+
+	/* the event log grows on demand, so this only allocates a little */
+	S->event = (ft_eventlog_t*)malloc(sizeof(ft_eventlog_t));
+	DIE_BAD_MALLOC(S->event);
+	if (ft_eventlog_init(S->event, maxevents, 0) != 0) {
+		fprintf(stderr, "init_event: cannot allocate event log\n");
+		FREE(S->event);
+		return;
 	}
+	ft_eventindex_init(&S->eventindex);
 }
 
 
@@ -147,7 +357,7 @@ void init_event(void) {
  * this function handles the direct memory access to the buffer
  * and copies objects to and from memory
  *****************************************************************************/
-int dmarequest(const message_t *request, message_t **response_ptr) {
+static int handle_request(ft_stream_t *S, const message_t *request, message_t **response_ptr, int batched) {
 	unsigned int offset;
 	/*
 		 int blockrequest = 0;
@@ -160,11 +370,17 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 
 	/* use a local variable for datasel (in GET_DAT) */
 	datasel_t datasel;
+	UINT32_T nsamples;
+
+	/* when each of the locks was taken, see lockstat.h */
+	UINT64_T held[FT_LOCK_KINDS] = {0, 0, 0, 0, 0};
+	UINT32_T capacity, chansize, maxevents;
+	UINT32_T detected = 0;
+	int err;
 
 	/* these are for typecasting */
 	headerdef_t    *headerdef;
 	datadef_t      *datadef;
-	eventdef_t     *eventdef;
 	eventsel_t     *eventsel;
 
 	/* this will hold the response */
@@ -194,52 +410,66 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 
 		case PUT_HDR:
 			if (verbose>1) fprintf(stderr, "dmarequest: PUT_HDR\n");
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexdata);
-			pthread_mutex_lock(&mutexevent);
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_RING_WRITE);
+			STREAM_LOCK(FT_LOCK_DATA);
+			STREAM_LOCK(FT_LOCK_EVENT);
 
 			headerdef = (headerdef_t*)request->buf;
 			if (verbose>1) print_headerdef(headerdef);
 
 			/* delete the old header, data and events */
-			free_header();
-			free_data();
-			free_event();
+			ft_stream_free_header(S);
+			ft_stream_free_data(S);
+			ft_stream_free_event(S);
 
 			/* store the header and re-initialize */
-			header      = (header_t*)malloc(sizeof(header_t));
-			DIE_BAD_MALLOC(header);
-			header->def = (headerdef_t*)malloc(sizeof(headerdef_t));
-			DIE_BAD_MALLOC(header->def);
-			header->buf = malloc(headerdef->bufsize);
-			DIE_BAD_MALLOC(header->buf);
-			memcpy(header->def, request->buf, sizeof(headerdef_t));
-			memcpy(header->buf, (char*)request->buf+sizeof(headerdef_t), headerdef->bufsize);
-			header->def->nsamples = 0;
-			header->def->nevents  = 0;
-
-			init_data();
-			init_event();
+			S->header      = (header_t*)malloc(sizeof(header_t));
+			DIE_BAD_MALLOC(S->header);
+			S->header->def = (headerdef_t*)malloc(sizeof(headerdef_t));
+			DIE_BAD_MALLOC(S->header->def);
+			S->header->buf = malloc(headerdef->bufsize);
+			DIE_BAD_MALLOC(S->header->buf);
+			memcpy(S->header->def, request->buf, sizeof(headerdef_t));
+			memcpy(S->header->buf, (char*)request->buf+sizeof(headerdef_t), headerdef->bufsize);
+			S->header->def->nsamples = 0;
+			S->header->def->nevents  = 0;
+
+			maxevents = event_capacity(S);
+			if (data_capacity(S, &capacity, &chansize) != 0) {
+				init_event(S, maxevents);
+			}
+			else if (ft_persist_create(S, capacity, chansize, maxevents) != 0) {
+				/* the stream is only kept in memory, unless the server is persistent (see persist.h) */
+				init_data(S, capacity, chansize);
+				init_event(S, maxevents);
+			}
+			ft_history_create(S);
+			ft_pyramid_create(S);
+			ft_detect_reset(S);
+			ft_waitreg_reset(&S->waiters, 0, 0);
 
 			response->def->version = VERSION;
 			response->def->bufsize = 0;
 			/* check whether memory could indeed be allocated */
-			if (data!= NULL && data->buf != NULL && data->def != NULL) {
+			if (S->data != NULL && S->data->buf != NULL) {
 				response->def->command = PUT_OK;
 			} else {
 				/* let's at least tell the client that something's wrong */
 				response->def->command = PUT_ERR;
 			}
 
-			pthread_mutex_unlock(&mutexevent);
-			pthread_mutex_unlock(&mutexdata);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_EVENT);
+			STREAM_UNLOCK(FT_LOCK_DATA);
+			STREAM_UNLOCK(FT_LOCK_RING_WRITE);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case PUT_DAT:
 			if (verbose>1) fprintf(stderr, "dmarequest: PUT_DAT\n");
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexdata);
+			/* the header cannot change while we hold rwlockring */
+			STREAM_LOCK(FT_LOCK_RING_READ);
+			STREAM_LOCK(FT_LOCK_DATA);
 
 			datadef = (datadef_t*)request->buf;
 			if (verbose>1) print_datadef(datadef);
@@ -249,17 +479,16 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 			response->def->bufsize = 0;
 			if (request->def->bufsize < sizeof(datadef_t))
 				response->def->command = PUT_ERR;
-			else if (header==NULL || data==NULL)
+			else if (S->header==NULL || S->data==NULL)
 				response->def->command = PUT_ERR;
-			else if (header->def->nchans != datadef->nchans)
+			else if (S->header->def->nchans != datadef->nchans)
 				response->def->command = PUT_ERR;
-			else if (header->def->data_type != datadef->data_type)
+			else if (S->header->def->data_type != datadef->data_type)
 				response->def->command = PUT_ERR;
-			else if (datadef->nsamples > current_max_num_sample)
+			else if (datadef->nsamples > S->data->capacity)
 				response->def->command = PUT_ERR;
 			else {
-				unsigned int i;
-				unsigned int wordsize = wordsize_from_type(header->def->data_type);
+				unsigned int wordsize = wordsize_from_type(S->header->def->data_type);
 				unsigned int datasize = wordsize * datadef->nsamples * datadef->nchans;
 
 				response->def->command = PUT_OK;
@@ -273,45 +502,54 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				} else {
 
 					/* record the time at which the data was received */
-					if (clock_gettime(CLOCK_REALTIME, &putdat_clock) != 0) {
+					if (clock_gettime(CLOCK_REALTIME, &S->putdat_clock) != 0) {
 						perror("clock_gettime");
+						STREAM_UNLOCK(FT_LOCK_DATA);
+						STREAM_UNLOCK(FT_LOCK_RING_READ);
 						return -1;
 					}
 
-					/* number of bytes per sample (all channels) is given by wordsize x number of channels */
-					unsigned int chansize = wordsize * data->def->nchans;
-					/* request_data points to actual data samples within the request, use char* for convenience */
-					const char *request_data = (const char *) request->buf + sizeof(datadef_t);
-					char *buffer_data = (char *)data->buf;
-
-					for (i=0; i<datadef->nsamples; i++) {
-						memcpy(buffer_data+(thissample*chansize), request_data+(i*chansize), chansize);
-						header->def->nsamples++;
-						thissample++;
-						thissample = WRAP(thissample, current_max_num_sample);
-					}
-					/* Signal possibly waiting threads that we have received data */
-					pthread_cond_broadcast(&getData_cond);
+					/* copy the samples into the ring in (at most) two pieces and publish them */
+					ft_history_make_room(S, datadef->nsamples);
+					ft_ring_write(S->data, (const char *) request->buf + sizeof(datadef_t), datadef->nsamples);
+					ft_pyramid_update(S);
+					detected = ft_detect_update(S);
+
+					/* wake up the waiting threads whose threshold has been reached */
+					ft_waitreg_update(&S->waiters, FT_WAIT_SAMPLES, ft_ring_count(S->data));
 				}
 			}
 
-			pthread_mutex_unlock(&mutexdata);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_DATA);
+			STREAM_UNLOCK(FT_LOCK_RING_READ);
+
+			if (detected > 0) {
+				/* a detector found a crossing, store its event as PUT_EVT would */
+				STREAM_LOCK(FT_LOCK_HEADER);
+				STREAM_LOCK(FT_LOCK_DATA);
+				STREAM_LOCK(FT_LOCK_EVENT);
+				ft_detect_publish(S);
+				STREAM_UNLOCK(FT_LOCK_EVENT);
+				STREAM_UNLOCK(FT_LOCK_DATA);
+				STREAM_UNLOCK(FT_LOCK_HEADER);
+			}
 			break;
 
 		case PUT_EVT:
 			if (verbose>1) fprintf(stderr, "dmarequest: PUT_EVT\n");
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexevent);
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_EVENT);
 
 			/* record the time at which the event was received */
-			if (clock_gettime(CLOCK_REALTIME, &putevt_clock) != 0) {
+			if (clock_gettime(CLOCK_REALTIME, &S->putevt_clock) != 0) {
 				perror("clock_gettime");
+				STREAM_UNLOCK(FT_LOCK_EVENT);
+				STREAM_UNLOCK(FT_LOCK_HEADER);
 				return -1;
 			}
 
 			/* Give an error message if there is no header, or if the given event array is defined badly */
-			if (header==NULL || event==NULL || check_event_array(request->def->bufsize, request->buf) < 0) {
+			if (S->header==NULL || S->event==NULL || check_event_array(request->def->bufsize, request->buf) < 0) {
 				response->def->version = VERSION;
 				response->def->command = PUT_ERR;
 				response->def->bufsize = 0;
@@ -323,219 +561,211 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 
 				offset = 0; /* this represents the offset of the event in the buffer */
 				while (offset<request->def->bufsize) {
-					FREE(event[thisevent].def);
-					FREE(event[thisevent].buf);
-
-					eventdef = (eventdef_t*)((char*)request->buf+offset);
-					if (verbose>1) print_eventdef(eventdef);
+					eventdef_t evdef;
 
-					event[thisevent].def = (eventdef_t*)malloc(sizeof(eventdef_t));
-					DIE_BAD_MALLOC(event[thisevent].def);
-					memcpy(event[thisevent].def, (char*)request->buf+offset, sizeof(eventdef_t));
+					/* work on a copy, the request buffer is not necessarily aligned */
+					memcpy(&evdef, (char*)request->buf+offset, sizeof(eventdef_t));
+					if (verbose>1) print_eventdef(&evdef);
 
-					if (event[thisevent].def->sample == EVENT_AUTO_SAMPLE) {
+					if (evdef.sample == EVENT_AUTO_SAMPLE) {
 						/* automatically convert event->def->sample to current sample number */
 						/* make some fine adjustment of the assigned sample number */
-						double adjust = (putevt_clock.tv_sec - putdat_clock.tv_sec) + (double)(putevt_clock.tv_nsec - putdat_clock.tv_nsec) / 1000000000L;
-						event[thisevent].def->sample = header->def->nsamples + (int)(header->def->fsample*adjust);
+						double adjust = (S->putevt_clock.tv_sec - S->putdat_clock.tv_sec) + (double)(S->putevt_clock.tv_nsec - S->putdat_clock.tv_nsec) / 1000000000L;
+						evdef.sample = (S->data ? ft_ring_count(S->data) : 0) + (int)(S->header->def->fsample*adjust);
 					}
 
 					offset += sizeof(eventdef_t);
-					event[thisevent].buf = malloc(eventdef->bufsize);
-					DIE_BAD_MALLOC(event[thisevent].buf);
-					memcpy(event[thisevent].buf, (char*)request->buf+offset, eventdef->bufsize);
-					offset += eventdef->bufsize;
-					if (verbose>1) print_eventdef(event[thisevent].def);
-					thisevent++;
-					thisevent = WRAP(thisevent, MAXNUMEVENT);
-					header->def->nevents++;
+					if (ft_eventlog_append(S->event, &evdef, (char*)request->buf+offset) != 0) {
+						fprintf(stderr, "dmarequest: cannot store event of %u bytes\n", evdef.bufsize);
+						response->def->command = PUT_ERR;
+						break;
+					}
+					if (ft_eventindex_add(&S->eventindex, S->event, S->event->count-1, &evdef, (char*)request->buf+offset) != 0) {
+						fprintf(stderr, "dmarequest: cannot add event to the index\n");
+						response->def->command = PUT_ERR;
+					}
+					offset += evdef.bufsize;
+					S->header->def->nevents = S->event->count;
 				}
+				ft_waitreg_update(&S->waiters, FT_WAIT_EVENTS, S->header->def->nevents);
 			}
 
-			pthread_mutex_unlock(&mutexevent);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_EVENT);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case GET_HDR:
 			if (verbose>1) fprintf(stderr, "dmarequest: GET_HDR\n");
-			if (header==NULL) {
+			if (S->header==NULL) {
 				response->def->version = VERSION;
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 				break;
 			}
 
-			pthread_mutex_lock(&mutexheader);
+			STREAM_LOCK(FT_LOCK_HEADER);
 
 			response->def->version = VERSION;
 			response->def->command = GET_OK;
 			response->def->bufsize = 0;
-			response->def->bufsize = append(&response->buf, response->def->bufsize, header->def, sizeof(headerdef_t));
-			response->def->bufsize = append(&response->buf, response->def->bufsize, header->buf, header->def->bufsize);
+			response->def->bufsize = append(&response->buf, response->def->bufsize, S->header->def, sizeof(headerdef_t));
+			response->def->bufsize = append(&response->buf, response->def->bufsize, S->header->buf, S->header->def->bufsize);
+			/* the writer does not take mutexheader, so take the sample count from the ring */
+			if (S->data) ((headerdef_t *) response->buf)->nsamples = ft_ring_count(S->data);
 
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case GET_DAT:
 			if (verbose>1) fprintf(stderr, "dmarequest: GET_DAT\n");
-			if (header==NULL || data==NULL) {
+
+			/* this only protects the ring against being freed, the writer can continue */
+			STREAM_LOCK(FT_LOCK_RING_READ);
+
+			if (S->header==NULL || S->data==NULL) {
+				STREAM_UNLOCK(FT_LOCK_RING_READ);
 				response->def->version = VERSION;
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 				break;
 			}
 
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexdata);
+			/* take one snapshot of the number of samples, the ring may move on while we copy */
+			nsamples = ft_ring_count(S->data);
 
-			if (request->def->bufsize) {
-				/* the selection has been specified */
-				memcpy(&datasel, request->buf, sizeof(datasel_t));
-				/* If endsample is -1 read the buffer to the end */
-				if(datasel.endsample == -1)
-				{
-					datasel.endsample = header->def->nsamples - 1;
-				}
-			}
-			else {
-				/* determine a valid selection */
-				if (header->def->nsamples>current_max_num_sample) {
-					/* the ringbuffer is completely full */
-					datasel.begsample = header->def->nsamples - current_max_num_sample;
-					datasel.endsample = header->def->nsamples - 1;
-				}
-				else {
-					/* the ringbuffer is not yet completely full */
-					datasel.begsample = 0;
-					datasel.endsample = header->def->nsamples - 1;
-				}
-			}
+			err = get_data_selection(S, request, nsamples, &datasel);
 
-			/*
-
-			// if the read should block...
-			if(blockrequest == 1)
-			{
-			// check whether data is available
-			while((datasel.begsample >= (datasel.endsample+1)) || (datasel.endsample > header->def->nsamples - 1))
-			{
-			// if not unlock all mutexes
-			pthread_mutex_unlock(&mutexdata);
-			pthread_mutex_unlock(&mutexheader);
-
-			// wait for the condition to be signaled
-			pthread_mutex_lock(&getData_mutex);
-			gettimeofday(&tp, NULL);
-			ts.tv_sec = tp.tv_sec;
-			ts.tv_nsec = tp.tv_usec * 1000;
-			ts.tv_sec += 1;
-			pthread_cond_timedwait(&getData_cond, &getData_mutex, &ts);
-			pthread_mutex_unlock(&getData_mutex);
-
-			// Lock the mutexes again
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexdata);
-			if(datasel.begsample == (datasel.endsample+1))
-			datasel.endsample = header->def->nsamples - 1;
-			}
-			}
-			 */
-
-			if (verbose>1) print_headerdef(header->def);
+			if (verbose>1) print_headerdef(S->header->def);
 			if (verbose>1) print_datasel(&datasel);
 
-			if (datasel.begsample < 0 || datasel.endsample < 0) {
-				fprintf(stderr, "dmarequest: err1\n");
-				response->def->version = VERSION;
-				response->def->command = GET_ERR;
-				response->def->bufsize = 0;
-			}
-			else if (datasel.begsample >= header->def->nsamples || datasel.endsample >= header->def->nsamples) {
-				fprintf(stderr, "dmarequest: err2\n");
-				response->def->version = VERSION;
-				response->def->command = GET_ERR;
-				response->def->bufsize = 0;
-			}
-			else if ((header->def->nsamples - datasel.begsample) > current_max_num_sample) {
-				fprintf(stderr, "dmarequest: err3\n");
+			if (err) {
+				fprintf(stderr, "dmarequest: err%i\n", err);
+				if (err == 3) ft_stats_overrun();
 				response->def->version = VERSION;
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 			}
 			else {
-				unsigned int wordsize = wordsize_from_type(data->def->data_type);
-				if (wordsize==0) {
-					fprintf(stderr, "dmarequest: unsupported data type (%d)\n", data->def->data_type);
-					response->def->version = VERSION;
-					response->def->command = GET_ERR;
-					response->def->bufsize = 0;
-				}  else {
-					unsigned int n;
-					response->def->version = VERSION;
-					response->def->command = GET_OK;
-					response->def->bufsize = 0;
+				unsigned int n;
+				ft_chansel_t chansel;
+				/* the channels and type of the response, if the request selects them */
+				int selected = (request->def->bufsize > sizeof(datasel_t));
+				UINT32_T nchans = S->header->def->nchans, data_type = S->header->def->data_type, chansize = S->data->chansize;
 
-					/* determine the number of samples to return */
-					n = datasel.endsample - datasel.begsample + 1;
+				response->def->version = VERSION;
+				response->def->command = GET_OK;
+				response->def->bufsize = 0;
 
-					response->buf = malloc(sizeof(datadef_t) + n*data->def->nchans*wordsize);
-					if (response->buf == NULL) {
-						/* not enough space for copying data into response */
-						fprintf(stderr, "dmarequest: out of memory\n");
+				if (selected) {
+					if (ft_chansel_parse(S->header, request->def->bufsize - sizeof(datasel_t), (const char *) request->buf + sizeof(datasel_t), &chansel) != 0) {
+						fprintf(stderr, "dmarequest: err8\n");
 						response->def->command = GET_ERR;
+						selected = 0;
+					}
+					else if (ft_chansel_is_all(&chansel, S->header->def)) {
+						ft_chansel_free(&chansel);
+						selected = 0;
 					}
 					else {
-						/* number of bytes per sample (all channels) */
-						unsigned int chansize = data->def->nchans * wordsize;
-
-						/* convenience pointer to start of actual data in response */
-						char *resp_data = ((char *) response->buf) + sizeof(datadef_t);
-
-						/* this is the location of begsample within the ringbuffer */
-						unsigned int start_index = 	WRAP(datasel.begsample, current_max_num_sample);
-
-						/* have datadef point into the freshly allocated response buffer and directly
-							 fill in the information */
-						datadef = (datadef_t *) response->buf;
-						datadef->nchans    = data->def->nchans;
-						datadef->data_type = data->def->data_type;
-						datadef->nsamples  = n;
-						datadef->bufsize   = n*chansize;
-
-						response->def->bufsize = sizeof(datadef_t) + datadef->bufsize;
-
-						if (start_index + n <= current_max_num_sample) {
-							/* we can copy everything in one go */
-							memcpy(resp_data, (char*)(data->buf) + start_index*chansize, n*chansize);
-						} else {
-							/* need to wrap around at current_max_num_sample */
-							unsigned int na = current_max_num_sample - start_index;
-							unsigned int nb = n - na;
-
-							memcpy(resp_data, (char*)(data->buf) + start_index*chansize, na*chansize);
-							memcpy(resp_data + na*chansize, (char*)(data->buf), nb*chansize);
-
-							/* printf("Wrapped around!\n"); */
-						}
+						nchans    = chansel.nchans;
+						data_type = chansel.data_type;
+						chansize  = nchans * wordsize_from_type(data_type);
 					}
 				}
+
+				/* determine the number of samples to return */
+				n = datasel.endsample - datasel.begsample + 1;
+
+				if (response->def->command != GET_OK) {
+					/* the channel selection was not valid */
+				}
+				/* with a history, the selection may be more than what fits into one response */
+				else if ((UINT64_T) n*chansize + sizeof(datadef_t) > 0xFFFFFFFFu) {
+					fprintf(stderr, "dmarequest: selection of %u samples is too large\n", n);
+					response->def->command = GET_ERR;
+				}
+				else if ((response->buf = malloc(sizeof(datadef_t) + (size_t) n*chansize)) == NULL) {
+					/* not enough space for copying data into response */
+					fprintf(stderr, "dmarequest: out of memory\n");
+					response->def->command = GET_ERR;
+				}
+				else if ((selected ? read_selected_samples(S, &chansel, datasel.begsample, n, (char *) response->buf + sizeof(datadef_t))
+				                   : read_samples(S, datasel.begsample, n, (char *) response->buf + sizeof(datadef_t))) != 0) {
+					/* the writer overtook us while we were copying */
+					fprintf(stderr, "dmarequest: err3\n");
+					ft_stats_overrun();
+					FREE(response->buf);
+					response->def->command = GET_ERR;
+				}
+				else {
+					/* have datadef point into the freshly allocated response buffer and directly
+						 fill in the information */
+					datadef = (datadef_t *) response->buf;
+					datadef->nchans    = nchans;
+					datadef->data_type = data_type;
+					datadef->nsamples  = n;
+					datadef->bufsize   = n*chansize;
+
+					response->def->bufsize = sizeof(datadef_t) + datadef->bufsize;
+				}
+				if (selected) ft_chansel_free(&chansel);
 			}
 
-			pthread_mutex_unlock(&mutexdata);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_RING_READ);
+			break;
+
+		case GET_DAT_DECIMATED:
+			if (verbose>1) fprintf(stderr, "dmarequest: GET_DAT_DECIMATED\n");
+			STREAM_LOCK(FT_LOCK_RING_READ);
+
+			response->def->version = VERSION;
+			response->def->command = GET_ERR;
+			response->def->bufsize = 0;
+
+			if (S->header!=NULL && S->data!=NULL && request->def->bufsize >= sizeof(decimatedsel_t)) {
+				decimatedsel_t decsel;
+				UINT32_T bufsize = 0;
+
+				memcpy(&decsel, request->buf, sizeof(decimatedsel_t));
+				nsamples = ft_ring_count(S->data);
+				if (decsel.endsample == (UINT32_T) -1) decsel.endsample = nsamples - 1;
+
+				if (nsamples == 0 || decsel.endsample >= nsamples || decsel.endsample < decsel.begsample) {
+					fprintf(stderr, "dmarequest: err9\n");
+				}
+				else {
+					/* catch up with a ring that was restored, unless the writer is busy and will do so itself */
+					if (batched) {
+						ft_pyramid_update(S);
+					}
+					else if (ft_stream_trylock(S, FT_LOCK_DATA, request->def->command, &held[FT_LOCK_DATA]) == 0) {
+						ft_pyramid_update(S);
+						STREAM_UNLOCK(FT_LOCK_DATA);
+					}
+					err = ft_pyramid_read(S, decsel.begsample, decsel.endsample, decsel.width, &response->buf, &bufsize);
+					/* short selections are answered with the samples themselves */
+					if (err == 1) err = read_undecimated(S, decsel.begsample, decsel.endsample, &response->buf, &bufsize);
+					if (err == 0) {
+						response->def->command = GET_OK;
+						response->def->bufsize = bufsize;
+					}
+				}
+			}
+
+			STREAM_UNLOCK(FT_LOCK_RING_READ);
 			break;
 
 		case GET_EVT:
 			if (verbose>1) fprintf(stderr, "dmarequest: GET_EVT\n");
-			if (header==NULL || event==NULL || header->def->nevents==0) {
+			if (S->header==NULL || S->event==NULL || S->header->def->nevents==0) {
 				response->def->version = VERSION;
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 				break;
 			}
 
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexevent);
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_EVENT);
 
 			eventsel = (eventsel_t*)malloc(sizeof(eventsel_t));
 			DIE_BAD_MALLOC(eventsel);
@@ -547,19 +777,12 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 			}
 			else {
 				/* determine a valid selection */
-				if (header->def->nevents>MAXNUMEVENT) {
-					/* the ringbuffer is completely full */
-					eventsel->begevent = header->def->nevents - MAXNUMEVENT;
-					eventsel->endevent = header->def->nevents - 1;
-				}
-				else {
-					/* the ringbuffer is not yet completely full */
-					eventsel->begevent = 0;
-					eventsel->endevent = header->def->nevents - 1;
-				}
+				/* all events that are still in the log */
+				eventsel->begevent = S->event->first;
+				eventsel->endevent = S->header->def->nevents - 1;
 			}
 
-			if (verbose>1) print_headerdef(header->def);
+			if (verbose>1) print_headerdef(S->header->def);
 			if (verbose>1) print_eventsel(eventsel);
 
 			if (eventsel==NULL) {
@@ -573,48 +796,108 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 			}
-			else if (eventsel->begevent >= header->def->nevents || eventsel->endevent >= header->def->nevents) {
+			else if (eventsel->begevent >= S->header->def->nevents || eventsel->endevent >= S->header->def->nevents || eventsel->endevent < eventsel->begevent) {
 				fprintf(stderr, "dmarequest: err5\n");
 				response->def->version = VERSION;
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 			}
-			else if ((header->def->nevents-eventsel->begevent) > MAXNUMEVENT) {
+			else if (eventsel->begevent < S->event->first) {
 				fprintf(stderr, "dmarequest: err6\n");
 				response->def->version = VERSION;
 				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
 			}
+			else if (ft_eventlog_range_size(S->event, eventsel->begevent, eventsel->endevent - eventsel->begevent + 1) > 0xFFFFFFFFu) {
+				fprintf(stderr, "dmarequest: err7\n");
+				response->def->version = VERSION;
+				response->def->command = GET_ERR;
+				response->def->bufsize = 0;
+			}
 			else {
-				unsigned int j,n;
+				/* the selected events are stored back to back in the log, in wire format */
+				UINT32_T n = eventsel->endevent - eventsel->begevent + 1;
+				UINT64_T size = ft_eventlog_range_size(S->event, eventsel->begevent, n);
+
+				response->buf = malloc((size_t) size);
+				DIE_BAD_MALLOC(response->buf);
+				ft_eventlog_read(S->event, eventsel->begevent, n, response->buf);
 
 				response->def->version = VERSION;
 				response->def->command = GET_OK;
+				response->def->bufsize = (UINT32_T) size;
+			}
+
+			FREE(eventsel);
+			STREAM_UNLOCK(FT_LOCK_EVENT);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
+			break;
+
+		case GET_EVT_QUERY:
+			if (verbose>1) fprintf(stderr, "dmarequest: GET_EVT_QUERY\n");
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_EVENT);
+
+			if (S->header==NULL || S->event==NULL || check_event_query(request->def->bufsize, request->buf) < 0) {
+				response->def->version = VERSION;
+				response->def->command = GET_ERR;
 				response->def->bufsize = 0;
+			}
+			else {
+				UINT32_T *match = NULL, nmatch = 0, i, j;
+				UINT64_T size = 0;
 
-				/* determine the number of events to return */
-				n = eventsel->endevent - eventsel->begevent + 1;
+				if (ft_eventindex_query(&S->eventindex, S->event, request->def->bufsize, request->buf, &match, &nmatch) != 0) {
+					fprintf(stderr, "dmarequest: out of memory in event query\n");
+					nmatch = 0;
+					response->def->command = GET_ERR;
+				}
+				else {
+					response->def->command = GET_OK;
+				}
 
-				for (j=0; j<n; j++) {
-					if (verbose>1) print_eventdef(event[WRAP(eventsel->begevent+j, MAXNUMEVENT)].def);
-					response->def->bufsize = append(&response->buf, response->def->bufsize, event[WRAP(eventsel->begevent+j, MAXNUMEVENT)].def, sizeof(eventdef_t));
-					response->def->bufsize = append(&response->buf, response->def->bufsize, event[WRAP(eventsel->begevent+j, MAXNUMEVENT)].buf, event[WRAP(eventsel->begevent+j, MAXNUMEVENT)].def->bufsize);
+				/* copy the matching events, with one memcpy per run of consecutive events */
+				for (i=0; i<nmatch; i=j) {
+					for (j=i+1; j<nmatch && match[j]==match[j-1]+1; j++);
+					size += ft_eventlog_range_size(S->event, match[i], j-i);
+				}
+				if (size > 0xFFFFFFFFu) {
+					fprintf(stderr, "dmarequest: err7\n");
+					nmatch = size = 0;
+					response->def->command = GET_ERR;
+				}
+				if (size > 0) {
+					response->buf = malloc((size_t) size);
+					DIE_BAD_MALLOC(response->buf);
 				}
+				offset = 0;
+				for (i=0; i<nmatch; i=j) {
+					for (j=i+1; j<nmatch && match[j]==match[j-1]+1; j++);
+					ft_eventlog_read(S->event, match[i], j-i, (char*)response->buf + offset);
+					offset += (unsigned int) ft_eventlog_range_size(S->event, match[i], j-i);
+				}
+				FREE(match);
+
+				response->def->version = VERSION;
+				response->def->bufsize = (UINT32_T) size;
 			}
 
-			FREE(eventsel);
-			pthread_mutex_unlock(&mutexevent);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_EVENT);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case FLUSH_HDR:
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexdata);
-			pthread_mutex_lock(&mutexevent);
-			if (header) {
-				free_header();
-				free_data();
-				free_event();
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_RING_WRITE);
+			STREAM_LOCK(FT_LOCK_DATA);
+			STREAM_LOCK(FT_LOCK_EVENT);
+			if (S->header) {
+				ft_persist_remove(S);
+				ft_history_free(S, 1);
+				ft_stream_free_header(S);
+				ft_stream_free_data(S);
+				ft_stream_free_event(S);
+				ft_waitreg_reset(&S->waiters, 0, 0);
 				response->def->version = VERSION;
 				response->def->command = FLUSH_OK;
 				response->def->bufsize = 0;
@@ -624,16 +907,29 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				response->def->command = FLUSH_ERR;
 				response->def->bufsize = 0;
 			}
-			pthread_mutex_unlock(&mutexevent);
-			pthread_mutex_unlock(&mutexdata);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_EVENT);
+			STREAM_UNLOCK(FT_LOCK_DATA);
+			STREAM_UNLOCK(FT_LOCK_RING_WRITE);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case FLUSH_DAT:
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexdata);
-			if (header && data) {
-				header->def->nsamples = thissample = 0;
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_RING_WRITE);
+			STREAM_LOCK(FT_LOCK_DATA);
+			if (S->header && S->data) {
+				ft_ring_unpin_all(S->data);
+				ft_shm_begin_update(S);
+				ft_ring_reset(S->data);
+				ft_shm_end_update(S);
+				/* the samples start from 0 again, and so does their history */
+				ft_history_free(S, 1);
+				ft_history_create(S);
+				ft_pyramid_free(S);
+				ft_pyramid_create(S);
+				ft_detect_reset(S);
+				S->header->def->nsamples = 0;
+				ft_waitreg_update(&S->waiters, FT_WAIT_SAMPLES, 0);
 				response->def->version = VERSION;
 				response->def->command = FLUSH_OK;
 				response->def->bufsize = 0;
@@ -643,21 +939,19 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				response->def->command = FLUSH_ERR;
 				response->def->bufsize = 0;
 			}
-			pthread_mutex_unlock(&mutexdata);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_DATA);
+			STREAM_UNLOCK(FT_LOCK_RING_WRITE);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case FLUSH_EVT:
-			pthread_mutex_lock(&mutexheader);
-			pthread_mutex_lock(&mutexevent);
-			if (header && event) {
-				unsigned int i;
-
-				header->def->nevents = thisevent = 0;
-				for (i=0; i<MAXNUMEVENT; i++) {
-					FREE(event[i].def);
-					FREE(event[i].buf);
-				}
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_EVENT);
+			if (S->header && S->event) {
+				ft_eventlog_reset(S->event);
+				ft_eventindex_reset(&S->eventindex);
+				S->header->def->nevents = 0;
+				ft_waitreg_update(&S->waiters, FT_WAIT_EVENTS, 0);
 				response->def->version = VERSION;
 				response->def->command = FLUSH_OK;
 				response->def->bufsize = 0;
@@ -667,8 +961,8 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				response->def->command = FLUSH_ERR;
 				response->def->bufsize = 0;
 			}
-			pthread_mutex_unlock(&mutexevent);
-			pthread_mutex_unlock(&mutexheader);
+			STREAM_UNLOCK(FT_LOCK_EVENT);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
 			break;
 
 		case WAIT_DAT:
@@ -681,14 +975,12 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				 in the buffer as described by samples_events_t.
 			 */
 			response->def->version = VERSION;
-			if (header==NULL || request->def->bufsize!=sizeof(waitdef_t)) {
+			if (S->header==NULL || request->def->bufsize!=sizeof(waitdef_t)) {
 				response->def->command = WAIT_ERR;
 				response->def->bufsize = 0;
 			} else {
-				int waiterr;
 				waitdef_t *wd = (waitdef_t *) request->buf;
 				samples_events_t *nret = malloc(sizeof(samples_events_t));
-				UINT32_T nsmp, nevt;
 
 				if (nret == NULL) {
 					/* highly unlikely, but we cannot allocate a sample_event_t - return an error */
@@ -701,18 +993,9 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 				response->def->bufsize = sizeof(samples_events_t);
 				response->buf = nret;
 
-				/* get current number of samples */
-				pthread_mutex_lock(&mutexheader);
-				nsmp = header->def->nsamples;
-				nevt = header->def->nevents;
-				pthread_mutex_unlock(&mutexheader);
-
-				if (wd->milliseconds == 0 || nsmp > wd->threshold.nsamples || nevt > wd->threshold.nevents) {
-					/* the client doesn't want to wait, or
-						 we're already above the threshold:
-						 return immediately */
-					nret->nsamples = nsmp;
-					nret->nevents = nevt;
+				if (wd->milliseconds == 0) {
+					/* the client doesn't want to wait: return the current numbers */
+					ft_waitreg_wait(&S->waiters, &wd->threshold, NULL, nret);
 					break;
 				}
 				gettimeofday(&tp, NULL);
@@ -723,29 +1006,331 @@ int dmarequest(const message_t *request, message_t **response_ptr) {
 					ts.tv_nsec-=1000000000;
 				}
 
-				/* FIXME: The getData condition variable is only triggered by incoming data, not events */
-				do {
-					pthread_mutex_lock(&getData_mutex);
-					waiterr = pthread_cond_timedwait(&getData_cond, &getData_mutex, &ts);
-					pthread_mutex_unlock(&getData_mutex);
-
-					/* get current number of samples */
-					pthread_mutex_lock(&mutexheader);
-					nsmp = header->def->nsamples;
-					nevt = header->def->nevents;
-					pthread_mutex_unlock(&mutexheader);
-				} while (nsmp <= wd->threshold.nsamples && nevt <= wd->threshold.nevents && waiterr==0);
-				nret->nsamples = nsmp;
-				nret->nevents = nevt;
+				/* this returns immediately if we're already above the threshold,
+				   otherwise we are only woken up by the PUT_DAT or PUT_EVT that
+				   takes us over it, or by the timeout */
+				if (ft_waitreg_wait(&S->waiters, &wd->threshold, &ts, nret) < 0) {
+					response->def->command = WAIT_ERR;
+					response->def->bufsize = 0;
+					response->buf = NULL;
+					free(nret);
+				}
+			}
+			break;
+
+		case OPEN_STREAM:
+			/* select the stream for all further requests on this connection,
+			   the name is in the buffer and an empty name means the default stream */
+			if (verbose>1) fprintf(stderr, "dmarequest: OPEN_STREAM\n");
+			response->def->version = VERSION;
+			response->def->bufsize = 0;
+			S = ft_find_stream((const char *) request->buf, request->def->bufsize, 1);
+			if (S == NULL) {
+				fprintf(stderr, "dmarequest: cannot open stream\n");
+				response->def->command = OPEN_ERR;
+				S = ft_current_stream();
+			}
+			else {
+				ft_select_stream(S);
+				response->def->command = OPEN_OK;
+			}
+			break;
+
+		case BATCH:
+			if (verbose>1) fprintf(stderr, "dmarequest: BATCH\n");
+			if (execute_batch(S, request, response) != 0) return -1;
+			break;
+
+		case ADD_DETECTOR:
+			if (verbose>1) fprintf(stderr, "dmarequest: ADD_DETECTOR\n");
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_RING_READ);
+			STREAM_LOCK(FT_LOCK_DATA);
+
+			response->def->version = VERSION;
+			response->def->command = DETECTOR_ERR;
+			response->def->bufsize = 0;
+			if (request->def->bufsize >= sizeof(detectordef_t)) {
+				detectordef_t detdef;
+				int num;
+
+				/* work on a copy, the request buffer is not necessarily aligned */
+				memcpy(&detdef, request->buf, sizeof(detectordef_t));
+				if (detdef.bufsize == request->def->bufsize - sizeof(detectordef_t) &&
+				    (num = ft_detect_add(S, &detdef, (const char *) request->buf + sizeof(detectordef_t))) >= 0) {
+					response->buf = malloc(sizeof(UINT32_T));
+					DIE_BAD_MALLOC(response->buf);
+					*(UINT32_T *) response->buf = (UINT32_T) num;
+					response->def->command = DETECTOR_OK;
+					response->def->bufsize = sizeof(UINT32_T);
+				}
 			}
+
+			STREAM_UNLOCK(FT_LOCK_DATA);
+			STREAM_UNLOCK(FT_LOCK_RING_READ);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
+			break;
+
+		case CLEAR_DETECTORS:
+			if (verbose>1) fprintf(stderr, "dmarequest: CLEAR_DETECTORS\n");
+			STREAM_LOCK(FT_LOCK_HEADER);
+			STREAM_LOCK(FT_LOCK_RING_READ);
+			STREAM_LOCK(FT_LOCK_DATA);
+			ft_detect_clear(S);
+			STREAM_UNLOCK(FT_LOCK_DATA);
+			STREAM_UNLOCK(FT_LOCK_RING_READ);
+			STREAM_UNLOCK(FT_LOCK_HEADER);
+			response->def->version = VERSION;
+			response->def->command = DETECTOR_OK;
+			response->def->bufsize = 0;
+			break;
+
+		case GET_STATS:
+			if (verbose>1) fprintf(stderr, "dmarequest: GET_STATS\n");
+			response->def->version = VERSION;
+			response->def->bufsize = 0;
+			if ((response->buf = ft_stats_snapshot(&response->def->bufsize)) == NULL) {
+				response->def->command = STATS_ERR;
+				break;
+			}
+			response->def->command = STATS_OK;
+			if (request->def->bufsize >= sizeof(UINT32_T) && (*(const UINT32_T *) request->buf & FT_STATS_RESET)) ft_stats_reset();
+
+			/* the writer can continue, the numbers are a snapshot anyway */
+			STREAM_LOCK(FT_LOCK_RING_READ);
+			if (S->header && S->data) {
+				statsdef_t *statsdef = (statsdef_t *) response->buf;
+				statsdef->capacity = S->data->capacity;
+				statsdef->nsamples = ft_ring_count(S->data);
+				statsdef->first    = ft_ring_first(S->data);
+				statsdef->pinwaits = FT_ATOMIC_LOAD(&S->data->pinwaits);
+			}
+			STREAM_UNLOCK(FT_LOCK_RING_READ);
+			break;
+
+		case SUBSCRIBE_DAT:
+		case SUBSCRIBE_CREDIT:
+		case UNSUBSCRIBE:
+			/* only the socket server can push, see subscribe.h */
+			if (verbose>1) fprintf(stderr, "dmarequest: subscription\n");
+			response->def->version = VERSION;
+			response->def->command = SUBSCRIBE_ERR;
+			response->def->bufsize = 0;
 			break;
 
 		default:
 			fprintf(stderr, "dmarequest: unknown command\n");
 	}
 
-	if (verbose>0) fprintf(stderr, "dmarequest: thissample = %u, thisevent = %u\n", thissample, thisevent);
+	if (verbose>0) fprintf(stderr, "dmarequest: nsamples = %u, nevents = %u\n", S->data ? ft_ring_count(S->data) : 0, S->event ? S->event->count : 0);
 
 	/* everything went fine */
 	return 0;
 }
+
+int dmarequest(const message_t *request, message_t **response_ptr) {
+	/* the stream that was selected by this connection */
+	return handle_request(ft_current_stream(), request, response_ptr, 0);
+}
+
+/*****************************************************************************
+ * BATCH, see batch.h
+ *****************************************************************************/
+static int execute_batch(ft_stream_t *S, const message_t *request, message_t *response) {
+	messagedef_t def;
+	message_t item, **sub;
+	UINT32_T offset = 0;
+	UINT64_T held[FT_LOCK_KINDS];
+	int exclusive, ring, n, i, err = 0;
+
+	response->def->version = VERSION;
+	response->def->command = BATCH_ERR;
+	response->def->bufsize = 0;
+
+	n = ft_batch_check(request->def->bufsize, request->buf, &exclusive);
+	if (n < 0) {
+		fprintf(stderr, "dmarequest: invalid BATCH request\n");
+		return 0;
+	}
+	sub = (message_t **) calloc(n + 1, sizeof(message_t *));
+	if (sub == NULL) {
+		fprintf(stderr, "dmarequest: out of memory\n");
+		return 0;
+	}
+
+	/* take all locks of the stream in their usual order, and only once,
+	   so that the requests see and leave the stream as if they were one */
+	ring = exclusive ? FT_LOCK_RING_WRITE : FT_LOCK_RING_READ;
+	held[FT_LOCK_HEADER] = ft_stream_lock(S, FT_LOCK_HEADER, BATCH);
+	held[ring]           = ft_stream_lock(S, ring, BATCH);
+	held[FT_LOCK_DATA]   = ft_stream_lock(S, FT_LOCK_DATA, BATCH);
+	held[FT_LOCK_EVENT]  = ft_stream_lock(S, FT_LOCK_EVENT, BATCH);
+
+	item.def = &def;
+	for (i=0; i<n && err==0; i++) {
+		ft_batch_next(request->def->bufsize, request->buf, &offset, &def, (const void **) &item.buf);
+		err = handle_request(S, &item, &sub[i], 1);
+		if (sub[i] == NULL || sub[i]->def == NULL) err = -1;
+	}
+
+	ft_stream_unlock(S, FT_LOCK_EVENT, BATCH, held[FT_LOCK_EVENT]);
+	ft_stream_unlock(S, FT_LOCK_DATA, BATCH, held[FT_LOCK_DATA]);
+	ft_stream_unlock(S, ring, BATCH, held[ring]);
+	ft_stream_unlock(S, FT_LOCK_HEADER, BATCH, held[FT_LOCK_HEADER]);
+
+	/* the responses are put together after the locks have been released */
+	if (err == 0) {
+		response->def->command = BATCH_OK;
+		for (i=0; i<n; i++) {
+			if (ft_batch_append(response, sub[i]->def, sub[i]->buf) != 0) {
+				fprintf(stderr, "dmarequest: BATCH response is too large\n");
+				FREE(response->buf);
+				response->def->command = BATCH_ERR;
+				response->def->bufsize = 0;
+				break;
+			}
+		}
+	}
+	for (i=0; i<n; i++) cleanup_message((void **) &sub[i]);
+	FREE(sub);
+	return err;
+}
+
+/*****************************************************************************
+ * zero-copy GET_DAT, see zerocopy.h
+ *****************************************************************************/
+void ft_set_zerocopy_threshold(UINT32_T nbytes) {
+	zerocopy_threshold = nbytes;
+}
+
+int ft_getdat_pinned(const message_t *request, ft_pinned_data_t *P) {
+	ft_stream_t *S = ft_current_stream();
+	datasel_t datasel;
+	UINT32_T n, threshold = zerocopy_threshold;
+	UINT64_T held;
+
+	if (request->def->command != GET_DAT || threshold == 0) return 0;
+	/* a selection of channels or another type needs to be copied */
+	if (request->def->bufsize != 0 && request->def->bufsize != sizeof(datasel_t)) return 0;
+
+	/* once the samples are pinned, the ring cannot go away (see ft_ring_unpin_all) */
+	held = ft_stream_lock(S, FT_LOCK_RING_READ, GET_DAT);
+
+	if (S->header==NULL || S->data==NULL) goto fallback;
+	if (get_data_selection(S, request, ft_ring_count(S->data), &datasel) != 0) goto fallback;
+
+	n = datasel.endsample - datasel.begsample + 1;
+	if ((UINT64_T) n * S->data->chansize < threshold) goto fallback;
+	if ((UINT64_T) n * S->data->chansize + sizeof(datadef_t) > 0xFFFFFFFFu) goto fallback;
+
+	if (ft_ring_pin(S->data, datasel.begsample, n, S->data->capacity / FT_ZEROCOPY_HEADROOM, P->seg, &P->pin) != FT_RING_OK) goto fallback;
+
+	P->ddef.nchans    = S->header->def->nchans;
+	P->ddef.data_type = S->header->def->data_type;
+	P->ddef.nsamples  = n;
+	P->ddef.bufsize   = n * S->data->chansize;
+	P->def.version = VERSION;
+	P->def.command = GET_OK;
+	P->def.bufsize = sizeof(datadef_t) + P->ddef.bufsize;
+	P->ring   = S->data;
+	ft_stream_unlock(S, FT_LOCK_RING_READ, GET_DAT, held);
+	return 1;
+
+fallback:
+	ft_stream_unlock(S, FT_LOCK_RING_READ, GET_DAT, held);
+	return 0;
+}
+
+int ft_getdat_release(ft_pinned_data_t *P) {
+	int res = ft_ring_unpin(P->ring, P->pin);
+	P->ring = NULL;
+	return res;
+}
+
+void ft_set_ingest_threshold(UINT32_T nbytes) {
+	ingest_threshold = nbytes;
+}
+
+int ft_putdat_wanted(const messagedef_t *def) {
+	UINT32_T threshold = ingest_threshold;
+	return def->command == PUT_DAT && threshold != 0 && def->bufsize >= threshold && def->bufsize > sizeof(datadef_t);
+}
+
+int ft_putdat_reserve(const messagedef_t *def, const datadef_t *ddef, ft_ingest_t *P) {
+	ft_stream_t *S = ft_current_stream();
+	UINT64_T datasize;
+
+	/* the same locks as PUT_DAT in dmarequest, held until ft_putdat_commit or ft_putdat_abort */
+	P->held[0] = ft_stream_lock(S, FT_LOCK_RING_READ, PUT_DAT);
+	P->held[1] = ft_stream_lock(S, FT_LOCK_DATA, PUT_DAT);
+
+	/* anything unusual is left to dmarequest, which also sends the error */
+	if (S->header==NULL || S->data==NULL) goto fallback;
+	if (S->header->def->nchans != ddef->nchans) goto fallback;
+	if (S->header->def->data_type != ddef->data_type) goto fallback;
+	if (ddef->nsamples == 0 || ddef->nsamples > S->data->capacity) goto fallback;
+
+	datasize = (UINT64_T) ddef->nsamples * S->data->chansize;
+	if (datasize != ddef->bufsize || datasize + sizeof(datadef_t) != def->bufsize) goto fallback;
+
+	ft_history_make_room(S, ddef->nsamples);
+	ft_ring_reserve(S->data, ddef->nsamples, P->seg);
+	P->ring   = S->data;
+	P->stream = S;
+	return 1;
+
+fallback:
+	ft_stream_unlock(S, FT_LOCK_DATA, PUT_DAT, P->held[1]);
+	ft_stream_unlock(S, FT_LOCK_RING_READ, PUT_DAT, P->held[0]);
+	return 0;
+}
+
+void ft_putdat_commit(ft_ingest_t *P) {
+	ft_stream_t *S = P->stream;
+	UINT32_T detected;
+
+	/* record the time at which the data was received */
+	if (clock_gettime(CLOCK_REALTIME, &S->putdat_clock) != 0) {
+		perror("clock_gettime");
+	}
+	ft_ring_commit(P->ring);
+	ft_pyramid_update(S);
+	detected = ft_detect_update(S);
+	ft_waitreg_update(&S->waiters, FT_WAIT_SAMPLES, ft_ring_count(P->ring));
+
+	ft_stream_unlock(S, FT_LOCK_DATA, PUT_DAT, P->held[1]);
+	ft_stream_unlock(S, FT_LOCK_RING_READ, PUT_DAT, P->held[0]);
+
+	if (detected > 0) {
+		/* as in PUT_DAT */
+		UINT64_T held[FT_LOCK_KINDS];
+		held[FT_LOCK_HEADER] = ft_stream_lock(S, FT_LOCK_HEADER, PUT_DAT);
+		held[FT_LOCK_DATA]   = ft_stream_lock(S, FT_LOCK_DATA, PUT_DAT);
+		held[FT_LOCK_EVENT]  = ft_stream_lock(S, FT_LOCK_EVENT, PUT_DAT);
+		ft_detect_publish(S);
+		ft_stream_unlock(S, FT_LOCK_EVENT, PUT_DAT, held[FT_LOCK_EVENT]);
+		ft_stream_unlock(S, FT_LOCK_DATA, PUT_DAT, held[FT_LOCK_DATA]);
+		ft_stream_unlock(S, FT_LOCK_HEADER, PUT_DAT, held[FT_LOCK_HEADER]);
+	}
+	P->ring = NULL;
+	P->stream = NULL;
+}
+
+void ft_putdat_abort(ft_ingest_t *P, void *dest, size_t nbytes) {
+	ft_stream_t *S = P->stream;
+	int i;
+
+	for (i=0; i<2 && dest != NULL && nbytes > 0; i++) {
+		size_t size = (size_t) P->seg[i].nsamples * P->ring->chansize;
+		if (size > nbytes) size = nbytes;
+		memcpy(dest, P->seg[i].ptr, size);
+		dest = (char *) dest + size;
+		nbytes -= size;
+	}
+	ft_ring_abort(P->ring);
+
+	ft_stream_unlock(S, FT_LOCK_DATA, PUT_DAT, P->held[1]);
+	ft_stream_unlock(S, FT_LOCK_RING_READ, PUT_DAT, P->held[0]);
+	P->ring = NULL;
+	P->stream = NULL;
+}
@@ -5,54 +5,162 @@
  *
  */
 
+#include <string.h>
+
 #include "buffer.h"
+#include "batch.h"
 
-/* TODO: see if these can be optimized using compiler intrinsics etc. */
-void ft_swap16(unsigned int numel, void *data) {
-	unsigned int n;
-	char *d = (char *) data;
-	for (n=0;n<numel;n++) {
-		char t = d[0];
-		d[0] = d[1];
-		d[1] = t;
-		d+=2;
+/* On x86 with gcc or clang, the byte order is reversed 16 or 32 bytes at a
+   time with pshufb (SSSE3) or vpshufb (AVX2), whichever the CPU supports. The
+   kernels are compiled for their instruction set with a target attribute, so
+   the library itself does not need -mavx2 and still runs on any x86. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FT_SWAP_X86
+#include <immintrin.h>
+#endif
+
+static int simdLevel = -1;	/* not determined yet */
+
+/* the shuffles that reverse the bytes within each word of a 32-byte block */
+static const char swapMask[3][32] = {
+	{1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,17,16,19,18,21,20,23,22,25,24,27,26,29,28,31,30},
+	{3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,19,18,17,16,23,22,21,20,27,26,25,24,31,30,29,28},
+	{7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,23,22,21,20,19,18,17,16,31,30,29,28,27,26,25,24}
+};
+
+static const char *swap_mask(unsigned int wordsize) {
+	return swapMask[(wordsize == 2) ? 0 : (wordsize == 4) ? 1 : 2];
+}
+
+#ifdef FT_SWAP_X86
+__attribute__((target("avx2")))
+static size_t swap_avx2(size_t nbytes, unsigned int wordsize, const char *src, char *dest) {
+	__m256i mask = _mm256_loadu_si256((const __m256i *) swap_mask(wordsize));
+	size_t i = 0;
+
+	for (;i+128<=nbytes;i+=128) {
+		/* all loads before the stores, for src == dest */
+		__m256i a = _mm256_loadu_si256((const __m256i *) (src+i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (src+i+32));
+		__m256i c = _mm256_loadu_si256((const __m256i *) (src+i+64));
+		__m256i d = _mm256_loadu_si256((const __m256i *) (src+i+96));
+		_mm256_storeu_si256((__m256i *) (dest+i),    _mm256_shuffle_epi8(a, mask));
+		_mm256_storeu_si256((__m256i *) (dest+i+32), _mm256_shuffle_epi8(b, mask));
+		_mm256_storeu_si256((__m256i *) (dest+i+64), _mm256_shuffle_epi8(c, mask));
+		_mm256_storeu_si256((__m256i *) (dest+i+96), _mm256_shuffle_epi8(d, mask));
+	}
+	for (;i+32<=nbytes;i+=32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (src+i));
+		_mm256_storeu_si256((__m256i *) (dest+i), _mm256_shuffle_epi8(a, mask));
 	}
+	return i;
 }
 
-void ft_swap32(unsigned int numel, void *data) {
-	unsigned int n;
-	char *d = (char *) data;
-	for (n=0;n<numel;n++) {
-		char t0 = d[0];
-		char t1 = d[1];
-		d[0] = d[3];
-		d[1] = d[2];
-		d[2] = t1;
-		d[3] = t0;
-		d+=4;
+__attribute__((target("ssse3")))
+static size_t swap_ssse3(size_t nbytes, unsigned int wordsize, const char *src, char *dest) {
+	__m128i mask = _mm_loadu_si128((const __m128i *) swap_mask(wordsize));
+	size_t i = 0;
+
+	for (;i+64<=nbytes;i+=64) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (src+i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (src+i+16));
+		__m128i c = _mm_loadu_si128((const __m128i *) (src+i+32));
+		__m128i d = _mm_loadu_si128((const __m128i *) (src+i+48));
+		_mm_storeu_si128((__m128i *) (dest+i),    _mm_shuffle_epi8(a, mask));
+		_mm_storeu_si128((__m128i *) (dest+i+16), _mm_shuffle_epi8(b, mask));
+		_mm_storeu_si128((__m128i *) (dest+i+32), _mm_shuffle_epi8(c, mask));
+		_mm_storeu_si128((__m128i *) (dest+i+48), _mm_shuffle_epi8(d, mask));
+	}
+	for (;i+16<=nbytes;i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (src+i));
+		_mm_storeu_si128((__m128i *) (dest+i), _mm_shuffle_epi8(a, mask));
 	}
+	return i;
 }
-		
-void ft_swap64(unsigned int numel, void *data) {
-	unsigned int n;
-	char *d = (char *) data;
-	for (n=0;n<numel;n++) {
-		char t0 = d[0];
-		char t1 = d[1];
-		char t2 = d[2];
-		char t3 = d[3];
-		d[0] = d[7];
-		d[1] = d[6];
-		d[2] = d[5];
-		d[3] = d[4];
-		d[4] = t3;
-		d[5] = t2;
-		d[6] = t1;
-		d[7] = t0;
-		d+=8;
+#endif
+
+static int simd_supported(void) {
+#ifdef FT_SWAP_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))  return FT_SIMD_AVX2;
+	if (__builtin_cpu_supports("ssse3")) return FT_SIMD_SSSE3;
+#endif
+	return FT_SIMD_NONE;
+}
+
+int ft_swap_use_simd(int level) {
+	int supported = simd_supported();
+	if (level < FT_SIMD_NONE) level = FT_SIMD_NONE;
+	simdLevel = (level < supported) ? level : supported;
+	return simdLevel;
+}
+
+/* one word at a time, in a form that compilers turn into bswap or rev */
+static void swap_scalar(size_t numel, unsigned int wordsize, const char *src, char *dest) {
+	size_t n;
+	switch(wordsize) {
+		case 2:
+			for (n=0;n<numel;n++,src+=2,dest+=2) {
+				UINT16_T x;
+				memcpy(&x, src, 2);
+				x = (UINT16_T) ((x << 8) | (x >> 8));
+				memcpy(dest, &x, 2);
+			}
+			break;
+		case 4:
+			for (n=0;n<numel;n++,src+=4,dest+=4) {
+				UINT32_T x;
+				memcpy(&x, src, 4);
+				x = (x >> 24) | ((x >> 8) & 0xFF00) | ((x << 8) & 0xFF0000) | (x << 24);
+				memcpy(dest, &x, 4);
+			}
+			break;
+		case 8:
+			for (n=0;n<numel;n++,src+=8,dest+=8) {
+				UINT32_T lo, hi;
+				memcpy(&lo, src, 4);
+				memcpy(&hi, src+4, 4);
+				lo = (lo >> 24) | ((lo >> 8) & 0xFF00) | ((lo << 8) & 0xFF0000) | (lo << 24);
+				hi = (hi >> 24) | ((hi >> 8) & 0xFF00) | ((hi << 8) & 0xFF0000) | (hi << 24);
+				memcpy(dest, &hi, 4);
+				memcpy(dest+4, &lo, 4);
+			}
+			break;
 	}
 }
 
+static void swap_words(size_t numel, unsigned int wordsize, const void *src, void *dest) {
+	const char *s = (const char *) src;
+	char *d = (char *) dest;
+	size_t nbytes = numel * wordsize, done = 0;
+
+	if (simdLevel < 0) simdLevel = simd_supported();
+#ifdef FT_SWAP_X86
+	if (simdLevel == FT_SIMD_AVX2 && nbytes >= 32) done = swap_avx2(nbytes, wordsize, s, d);
+	else if (simdLevel == FT_SIMD_SSSE3 && nbytes >= 16) done = swap_ssse3(nbytes, wordsize, s, d);
+#endif
+	swap_scalar((nbytes - done) / wordsize, wordsize, s + done, d + done);
+}
+
+void ft_swap16(unsigned int numel, void *data) {
+	swap_words(numel, 2, data, data);
+}
+
+void ft_swap32(unsigned int numel, void *data) {
+	swap_words(numel, 4, data, data);
+}
+
+void ft_swap64(unsigned int numel, void *data) {
+	swap_words(numel, 8, data, data);
+}
+
+void ft_swap_copy(UINT32_T numel, UINT32_T wordsize, const void *src, void *dest) {
+	if (wordsize == 2 || wordsize == 4 || wordsize == 8)
+		swap_words(numel, wordsize, src, dest);
+	else
+		memcpy(dest, src, (size_t) numel * wordsize);
+}
+
 void ft_swap_data(UINT32_T numel, UINT32_T datatype, void *data) {
 	switch(datatype) {
 		case DATATYPE_CHAR:
@@ -93,10 +201,14 @@ int ft_swap_chunks_to_native(UINT32_T size, UINT32_T nchans, void *buf) {
 					ft_swap64(nchans, chunk->data);
 				}
 				break;
+			case FT_CHUNK_BUFFER_CAPACITY:
+				if (chunk->def.size >= sizeof(capacitydef_t)) {
+					ft_swap64(1, chunk->data);
+					ft_swap32(3, chunk->data + sizeof(UINT64_T));
+				}
+				break;
 			/* Add other cases here as needed */
 		}		
-		
-		offset += sizeof(ft_chunkdef_t) + chunk->def.size;
 	}
 	return 0;
 }
@@ -129,6 +241,69 @@ int ft_swap_events_to_native(UINT32_T size, void *buf) {
 
 
 /* returns 0 on success, -1 on error */
+int ft_swap_query_to_native(UINT32_T size, void *buf) {
+	UINT32_T offset = 0;
+
+	while (offset + sizeof(eventquerydef_t) <= size) {
+		eventquerydef_t *qdef = (eventquerydef_t *) ((char *) buf + offset);
+		char *arg = (char *) buf + offset + sizeof(eventquerydef_t);
+		unsigned int ws;
+
+		ft_swap32(2, qdef);
+
+		offset += sizeof(eventquerydef_t) + qdef->bufsize;
+		if (offset > size) return -1;
+
+		switch(qdef->what) {
+			case EVENTSEL_TYPE:
+			case EVENTSEL_VALUE:
+				/* a data type, followed by the elements */
+				if (qdef->bufsize < sizeof(UINT32_T)) return -1;
+				ft_swap32(1, arg);
+				ws = wordsize_from_type(*(UINT32_T *) arg);
+				if (ws == 0) return -1;
+				ft_swap_data((qdef->bufsize - sizeof(UINT32_T)) / ws, *(UINT32_T *) arg, arg + sizeof(UINT32_T));
+				break;
+			default:
+				/* a sample number */
+				if (qdef->bufsize == sizeof(INT32_T)) ft_swap32(1, arg);
+		}
+	}
+	return 0;
+}
+
+/* swaps the channelseldef_t and, for CHANSEL_INDEX, the channel numbers that follow it */
+int ft_swap_chansel_to_native(UINT32_T size, char *buf) {
+	channelseldef_t *cdef = (channelseldef_t *) buf;
+
+	if (size < sizeof(channelseldef_t)) return -1;
+	ft_swap32(4, cdef);
+	if (cdef->bufsize > size - sizeof(channelseldef_t)) return -1;
+	if (cdef->what == CHANSEL_INDEX) ft_swap32(cdef->bufsize / sizeof(UINT32_T), buf + sizeof(channelseldef_t));
+	return 0;
+}
+
+/* returns 0 on success, -1 on error */
+int ft_swap_batch_to_native(UINT32_T size, void *buf) {
+	UINT32_T offset = 0;
+
+	while (offset + sizeof(messagedef_t) <= size) {
+		messagedef_t *def = (messagedef_t *) ((char *) buf + offset);
+
+		ft_swap16(2, def); /* version + command */
+		ft_swap32(1, &def->bufsize);
+		offset += sizeof(messagedef_t);
+
+		/* request definition fault (=too big) ? */
+		if (def->bufsize > size - offset) return -1;
+		if (def->bufsize > 0) ft_swap_buf_to_native(def->command, def->bufsize, (char *) buf + offset);
+
+		/* the padding */
+		offset += (def->bufsize + FT_BATCH_ALIGN - 1) & ~(FT_BATCH_ALIGN - 1);
+	}
+	return (offset == size) ? 0 : -1;
+}
+
 int ft_swap_buf_to_native(UINT16_T command, UINT32_T bufsize, void *buf) {
 	datadef_t *ddef;
 	
@@ -137,17 +312,32 @@ int ft_swap_buf_to_native(UINT16_T command, UINT32_T bufsize, void *buf) {
 			/* This should not have a buf attached */
 			return 0;
 		case GET_DAT:
-			/* buf contains a datsel_t = 2x UINT32_T */
-			if (bufsize == 8) ft_swap32(2, buf);
+			/* buf contains a datsel_t = 2x UINT32_T, optionally followed by a channel selection */
+			if (bufsize >= 8) ft_swap32(2, buf);
+			if (bufsize > 8) return ft_swap_chansel_to_native(bufsize - 8, (char *) buf + 8);
+			return 0;
+		case GET_DAT_DECIMATED:
+			/* buf contains a decimatedsel_t = 3x UINT32_T */
+			if (bufsize >= 12) ft_swap32(3, buf);
 			return 0;
 		case GET_EVT:
 			/* buf contains a datsel_t = 2x UINT32_T */
 			if (bufsize == 8) ft_swap32(2, buf);
 			return 0;
+		case GET_EVT_QUERY:
+			/* buf contains a list of eventquerydef_t and their arguments */
+			return ft_swap_query_to_native(bufsize, buf);
 		case WAIT_DAT:
 			/* buf contains a waitdef_t = 3x UINT32_T */
 			ft_swap32(3, buf);
 			return 0;
+		case OPEN_STREAM:
+			/* buf contains the name of the stream, which is just characters */
+			return 0;
+		case SET_ENCODING:
+			/* buf contains the encoding as a UINT32_T */
+			if (bufsize >= 4) ft_swap32(1, buf);
+			return 0;
 		case PUT_DAT:
 			/* buf contains a datadef_t and after that the data */
 			ddef = (datadef_t *) buf;
@@ -161,6 +351,21 @@ int ft_swap_buf_to_native(UINT16_T command, UINT32_T bufsize, void *buf) {
 		case PUT_EVT:
 			/* buf contains multiple eventdef_t and buf's */
 			return ft_swap_events_to_native(bufsize, buf);
+		case BATCH:
+			/* buf contains several requests, see batch.h */
+			return ft_swap_batch_to_native(bufsize, buf);
+		case ADD_DETECTOR:
+			/* buf contains a detectordef_t = 1x FLOAT64_T + 6x UINT32_T, and characters */
+			if (bufsize < sizeof(detectordef_t)) return -1;
+			ft_swap64(1, buf);
+			ft_swap32(6, (char *) buf + 8);
+			return 0;
+		case CLEAR_DETECTORS:
+			return 0;
+		case GET_STATS:
+			/* buf is empty or contains the flags as a UINT32_T */
+			if (bufsize >= 4) ft_swap32(1, buf);
+			return 0;
 	}
 	return -1;
 }
@@ -182,6 +387,12 @@ int ft_swap_chunks_from_native(UINT32_T size, UINT32_T nchans, void *buf) {
 					ft_swap64(nchans, chunk->data);
 				}
 				break;
+			case FT_CHUNK_BUFFER_CAPACITY:
+				if (chunk->def.size >= sizeof(capacitydef_t)) {
+					ft_swap64(1, chunk->data);
+					ft_swap32(3, chunk->data + sizeof(UINT64_T));
+				}
+				break;
 			/* Add other cases here as needed */
 		}
 		
@@ -209,8 +420,29 @@ int ft_swap_events_from_native(UINT32_T size, void *buf) {
 }
 
 
+/* returns 0 on success, -1 on error */
+static int ft_swap_stats_from_native(UINT32_T size, void *buf) {
+	statsdef_t *sdef = (statsdef_t *) buf;
+	UINT32_T n, offset = sizeof(statsdef_t), nbuckets;
+
+	if (size < sizeof(statsdef_t)) return -1;
+	nbuckets = sdef->nbuckets;
+	for (n=0; n<sdef->ncommands; n++) {
+		char *cmd = (char *) buf + offset;
+		offset += sizeof(statscmd_t) + nbuckets*sizeof(UINT32_T);
+		if (offset > size) return -1;
+		ft_swap32(2, cmd);	/* command + count */
+		ft_swap64(3, cmd + 8);	/* bytes_in, bytes_out, total_ns */
+		ft_swap32(nbuckets, cmd + sizeof(statscmd_t));
+	}
+	ft_swap32(8, sdef); /* all fields are 32-bit */
+	return 0;
+}
+
+
 int ft_swap_from_native(UINT16_T orgCommand, message_t *msg) {
 	datadef_t *ddef;
+	decimateddef_t *dcdef;
 	UINT32_T nchans;
 	UINT32_T bufsize = msg->def->bufsize;
 	
@@ -230,11 +462,47 @@ int ft_swap_from_native(UINT16_T orgCommand, message_t *msg) {
 			ft_swap_data(ddef->nchans*ddef->nsamples, ddef->data_type, (char *)ddef + sizeof(datadef_t)); /* ddef+1 points to first data byte */
 			ft_swap32(4, ddef); /* all fields are 32-bit */
 			return 0;
+		case GET_DAT_DECIMATED:
+			/* the minima, maxima and means are all FLOAT32_T */
+			dcdef = (decimateddef_t *) msg->buf;
+			ft_swap32(dcdef->bufsize / sizeof(FLOAT32_T), (char *)dcdef + sizeof(decimateddef_t));
+			ft_swap32(6, dcdef); /* all fields are 32-bit */
+			return 0;
 		case GET_EVT:
+		case GET_EVT_QUERY:
 			return ft_swap_events_from_native(bufsize, msg->buf);
 		case WAIT_DAT:
 			ft_swap32(2, msg->buf);	/* nsamples + nevents = 32bit */
 			return 0;
+		case ADD_DETECTOR:
+			ft_swap32(1, msg->buf);	/* the number of the detector */
+			return 0;
+		case GET_STATS:
+			return ft_swap_stats_from_native(bufsize, msg->buf);
 	}
 	return -1;
 }
+
+
+int ft_swap_batch_from_native(UINT32_T reqsize, const void *reqbuf, message_t *msg) {
+	UINT32_T reqoffset = 0, offset = 0;
+	UINT32_T bufsize = msg->def->bufsize;
+	messagedef_t reqdef, def;
+	const void *itembuf;
+
+	ft_swap16(1, &msg->def->version);
+	ft_swap16(1, &msg->def->command);
+	ft_swap32(1, &msg->def->bufsize);
+
+	/* the responses come in the order of the requests, which tell how to swap them */
+	while (ft_batch_next(reqsize, reqbuf, &reqoffset, &reqdef, &itembuf) == 1) {
+		message_t item;
+		UINT32_T start = offset;
+
+		if (ft_batch_next(bufsize, msg->buf, &offset, &def, &itembuf) != 1) return -1;
+		item.def = (messagedef_t *) ((char *) msg->buf + start);
+		item.buf = (char *) msg->buf + start + sizeof(messagedef_t);
+		ft_swap_from_native(reqdef.command, &item);
+	}
+	return 0;
+}
@@ -11,9 +11,25 @@ extern "C" {
 void ft_swap16(unsigned int numel, void *data);
 void ft_swap32(unsigned int numel, void *data);
 void ft_swap64(unsigned int numel, void *data);
+
+/* swaps numel words of 1, 2, 4 or 8 bytes while copying them from src to dest,
+   which must either be the same or not overlap */
+void ft_swap_copy(UINT32_T numel, UINT32_T wordsize, const void *src, void *dest);
+
+/* instruction sets of the swap kernels, on x86 with gcc or clang */
+#define FT_SIMD_NONE   0
+#define FT_SIMD_SSSE3  1
+#define FT_SIMD_AVX2   2
+
+/* limits the swap kernels to the given instruction set, e.g. for comparing them,
+   and returns the one that is used from now on (the best the CPU supports by default) */
+int ft_swap_use_simd(int level);
+
 int ft_swap_buf_to_native(UINT16_T command, UINT32_T bufsize, void *buf);
 int ft_convert_chunks_from_native(UINT32_T size, UINT32_T nchans, void *buf);
 int ft_swap_from_native(UINT16_T orgCommand, message_t *msg);
+int ft_swap_batch_to_native(UINT32_T size, void *buf);
+int ft_swap_batch_from_native(UINT32_T reqsize, const void *reqbuf, message_t *msg);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,509 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "eventindex.h"
+#include "util.h"
+
+#define INITIAL_BUCKETS   256
+#define INITIAL_POSTINGS  16
+#define INITIAL_SAMPLES   1024
+#define MIN_UNSORTED      64      /* the unsorted tail of the sample index is merged at max(this, 1/8 of the sorted run) */
+
+/*****************************************************************************
+ * hash tables on type and value
+ *****************************************************************************/
+
+/* FNV-1a on the data type and the bytes */
+static UINT32_T hash_key(UINT32_T datatype, const char *key, UINT32_T keysize) {
+	UINT32_T h = 2166136261u, i;
+	h = (h ^ datatype) * 16777619u;
+	for (i=0; i<keysize; i++) {
+		h = (h ^ (unsigned char) key[i]) * 16777619u;
+	}
+	return h;
+}
+
+static void hash_init(ft_eventhash_t *H) {
+	H->bucket   = NULL;
+	H->nbuckets = 0;
+	H->nkeys    = 0;
+}
+
+static void free_key(ft_eventkey_t *K) {
+	if (K->list.num) free(K->list.num);
+	if (K->key) free(K->key);
+	free(K);
+}
+
+static void hash_free(ft_eventhash_t *H) {
+	UINT32_T i;
+	for (i=0; i<H->nbuckets; i++) {
+		ft_eventkey_t *K = H->bucket[i];
+		while (K) {
+			ft_eventkey_t *next = K->next;
+			free_key(K);
+			K = next;
+		}
+	}
+	if (H->bucket) free(H->bucket);
+	hash_init(H);
+}
+
+/* skips the events that are no longer in the log */
+static void trim_postings(ft_postings_t *P, UINT32_T first) {
+	while (P->start < P->size && P->num[P->start] < first) P->start++;
+	if (P->start > 0 && P->start >= P->size/2) {
+		memmove(P->num, P->num + P->start, (P->size - P->start) * sizeof(UINT32_T));
+		P->size -= P->start;
+		P->start = 0;
+	}
+}
+
+static ft_eventkey_t *hash_find(const ft_eventhash_t *H, UINT32_T hash, UINT32_T datatype, const char *key, UINT32_T keysize) {
+	ft_eventkey_t *K;
+	if (H->nbuckets == 0) return NULL;
+	for (K = H->bucket[hash % H->nbuckets]; K != NULL; K = K->next) {
+		if (K->hash == hash && K->datatype == datatype && K->keysize == keysize && memcmp(K->key, key, keysize) == 0) return K;
+	}
+	return NULL;
+}
+
+/* Called when the table is full: either drops the keys of which all events
+   have left the log, or doubles the number of buckets if most keys are alive.
+   Both leave the table at most half full.
+*/
+static int hash_grow(ft_eventhash_t *H, UINT32_T first) {
+	ft_eventkey_t **bucket, *all = NULL, *K;
+	UINT32_T i, nbuckets, nlive = 0;
+
+	/* collect all keys in one list, dropping the dead ones */
+	for (i=0; i<H->nbuckets; i++) {
+		K = H->bucket[i];
+		while (K) {
+			ft_eventkey_t *next = K->next;
+			trim_postings(&K->list, first);
+			if (K->list.start == K->list.size) {
+				free_key(K);
+			} else {
+				K->next = all;
+				all = K;
+				nlive++;
+			}
+			K = next;
+		}
+	}
+
+	nbuckets = (H->nbuckets == 0) ? INITIAL_BUCKETS : H->nbuckets;
+	if (nlive > nbuckets/2) nbuckets *= 2;
+	if (nbuckets != H->nbuckets) {
+		bucket = (ft_eventkey_t **) calloc(nbuckets, sizeof(ft_eventkey_t *));
+		if (bucket == NULL) nbuckets = H->nbuckets; /* keep the old size, it is still correct */
+		else {
+			if (H->bucket) free(H->bucket);
+			H->bucket = bucket;
+			H->nbuckets = nbuckets;
+		}
+	}
+	if (H->bucket == NULL) return -1;
+
+	memset(H->bucket, 0, H->nbuckets * sizeof(ft_eventkey_t *));
+	while (all) {
+		K = all;
+		all = K->next;
+		K->next = H->bucket[K->hash % H->nbuckets];
+		H->bucket[K->hash % H->nbuckets] = K;
+	}
+	H->nkeys = nlive;
+	return 0;
+}
+
+static int hash_add(ft_eventhash_t *H, UINT32_T first, UINT32_T num, UINT32_T datatype, const char *key, UINT32_T keysize) {
+	UINT32_T hash = hash_key(datatype, key, keysize);
+	ft_eventkey_t *K = hash_find(H, hash, datatype, key, keysize);
+	ft_postings_t *P;
+
+	if (K == NULL) {
+		if (H->nkeys >= H->nbuckets && hash_grow(H, first) != 0) return -1;
+		K = (ft_eventkey_t *) calloc(1, sizeof(ft_eventkey_t));
+		if (K == NULL) return -1;
+		K->key = (char *) malloc(keysize ? keysize : 1);
+		if (K->key == NULL) {
+			free(K);
+			return -1;
+		}
+		memcpy(K->key, key, keysize);
+		K->hash     = hash;
+		K->datatype = datatype;
+		K->keysize  = keysize;
+		K->next = H->bucket[hash % H->nbuckets];
+		H->bucket[hash % H->nbuckets] = K;
+		H->nkeys++;
+	}
+
+	P = &K->list;
+	trim_postings(P, first);
+	if (P->size == P->alloc) {
+		UINT32_T alloc = P->alloc ? 2*P->alloc : INITIAL_POSTINGS;
+		UINT32_T *list = (UINT32_T *) realloc(P->num, alloc * sizeof(UINT32_T));
+		if (list == NULL) return -1;
+		P->num = list;
+		P->alloc = alloc;
+	}
+	P->num[P->size++] = num;
+	return 0;
+}
+
+/*****************************************************************************
+ * sorted sample index
+ *****************************************************************************/
+
+/* first position in the sorted run with sample >= value */
+static UINT32_T lower_sample(const ft_eventindex_t *I, INT32_T value) {
+	UINT32_T lo = 0, hi = I->nsorted;
+	while (lo < hi) {
+		UINT32_T mid = lo + (hi - lo)/2;
+		if (I->bysample[mid].sample < value) lo = mid+1; else hi = mid;
+	}
+	return lo;
+}
+
+/* first position in the sorted run with sample > value */
+static UINT32_T upper_sample(const ft_eventindex_t *I, INT32_T value) {
+	UINT32_T lo = 0, hi = I->nsorted;
+	while (lo < hi) {
+		UINT32_T mid = lo + (hi - lo)/2;
+		if (I->bysample[mid].sample <= value) lo = mid+1; else hi = mid;
+	}
+	return lo;
+}
+
+static int compare_sample(const void *a, const void *b) {
+	const ft_samplekey_t *x = (const ft_samplekey_t *) a, *y = (const ft_samplekey_t *) b;
+	if (x->sample != y->sample) return (x->sample < y->sample) ? -1 : 1;
+	return (x->num < y->num) ? -1 : (x->num > y->num);
+}
+
+/* sorts the unsorted tail of the sample index and merges it into the sorted
+   run, from the end, so the run only moves once. Returns -1 if there is no
+   memory for a copy of the tail, which then simply stays where it is */
+static int merge_unsorted(ft_eventindex_t *I) {
+	UINT32_T ntail = I->nsample - I->nsorted, i = I->nsorted, j = ntail, k = I->nsample;
+	ft_samplekey_t *tail;
+
+	if (ntail == 0) return 0;
+	tail = (ft_samplekey_t *) malloc(ntail * sizeof(ft_samplekey_t));
+	if (tail == NULL) return -1;
+	memcpy(tail, I->bysample + I->nsorted, ntail * sizeof(ft_samplekey_t));
+	qsort(tail, ntail, sizeof(ft_samplekey_t), compare_sample);
+	while (j > 0) {
+		if (i > 0 && I->bysample[i-1].sample > tail[j-1].sample) I->bysample[--k] = I->bysample[--i];
+		else I->bysample[--k] = tail[--j];
+	}
+	free(tail);
+	I->nsorted = I->nsample;
+	return 0;
+}
+
+static int sample_add(ft_eventindex_t *I, UINT32_T first, UINT32_T live, UINT32_T num, INT32_T sample) {
+	UINT32_T ntail;
+
+	/* purge the events that have left the log once they take up half of the index */
+	if (I->nsample > 2*live + INITIAL_SAMPLES) {
+		UINT32_T i, n = 0, nsorted = 0;
+		for (i=0; i<I->nsample; i++) {
+			if (I->bysample[i].num >= first) {
+				I->bysample[n++] = I->bysample[i];
+				if (i < I->nsorted) nsorted++;
+			}
+		}
+		I->nsample = n;
+		I->nsorted = nsorted;
+	}
+
+	if (I->nsample == I->allocsample) {
+		UINT32_T alloc = I->allocsample ? 2*I->allocsample : INITIAL_SAMPLES;
+		ft_samplekey_t *list = (ft_samplekey_t *) realloc(I->bysample, alloc * sizeof(ft_samplekey_t));
+		if (list == NULL) return -1;
+		I->bysample = list;
+		I->allocsample = alloc;
+	}
+
+	/* usually the new event extends the sorted run, otherwise it goes into the tail */
+	I->bysample[I->nsample].sample = sample;
+	I->bysample[I->nsample].num    = num;
+	if (I->nsample == I->nsorted && (I->nsorted == 0 || I->bysample[I->nsorted-1].sample <= sample)) I->nsorted++;
+	I->nsample++;
+
+	ntail = I->nsample - I->nsorted;
+	if (ntail >= MIN_UNSORTED && ntail >= I->nsorted/8) merge_unsorted(I);
+	return 0;
+}
+
+/*****************************************************************************
+ * public functions
+ *****************************************************************************/
+
+void ft_eventindex_init(ft_eventindex_t *I) {
+	hash_init(&I->type);
+	hash_init(&I->value);
+	I->bysample    = NULL;
+	I->nsample     = 0;
+	I->nsorted     = 0;
+	I->allocsample = 0;
+}
+
+void ft_eventindex_free(ft_eventindex_t *I) {
+	hash_free(&I->type);
+	hash_free(&I->value);
+	if (I->bysample) free(I->bysample);
+	ft_eventindex_init(I);
+}
+
+void ft_eventindex_reset(ft_eventindex_t *I) {
+	ft_samplekey_t *bysample = I->bysample;
+	UINT32_T allocsample = I->allocsample;
+
+	hash_free(&I->type);
+	hash_free(&I->value);
+	I->bysample    = bysample;
+	I->nsample     = 0;
+	I->nsorted     = 0;
+	I->allocsample = allocsample;
+}
+
+int ft_eventindex_add(ft_eventindex_t *I, const ft_eventlog_t *L, UINT32_T num, const eventdef_t *def, const void *buf) {
+	UINT32_T wst = wordsize_from_type(def->type_type);
+	UINT32_T wsv = wordsize_from_type(def->value_type);
+	const char *type  = (const char *) buf;
+	const char *value = type + wst*def->type_numel;
+
+	if (hash_add(&I->type, L->first, num, def->type_type, type, wst*def->type_numel) != 0) return -1;
+	if (hash_add(&I->value, L->first, num, def->value_type, value, wsv*def->value_numel) != 0) return -1;
+	return sample_add(I, L->first, L->count - L->first, num, def->sample);
+}
+
+int check_event_query(UINT32_T size, const void *query) {
+	UINT32_T offset = 0;
+	int numCriteria = 0;
+
+	while (offset < size) {
+		eventquerydef_t qdef;
+		UINT32_T datatype, ws;
+
+		if (offset + sizeof(eventquerydef_t) > size) return -1;
+		memcpy(&qdef, (const char *) query + offset, sizeof(eventquerydef_t));
+		offset += sizeof(eventquerydef_t);
+		if (qdef.bufsize > size - offset) return -1;
+
+		switch (qdef.what) {
+			case EVENTSEL_TYPE:
+			case EVENTSEL_VALUE:
+				if (qdef.bufsize < sizeof(UINT32_T)) return -1;
+				memcpy(&datatype, (const char *) query + offset, sizeof(UINT32_T));
+				ws = wordsize_from_type(datatype);
+				if (ws == 0 || (qdef.bufsize - sizeof(UINT32_T)) % ws != 0) return -1;
+				break;
+			case EVENTSEL_SAMPLE:
+			case EVENTSEL_MINSAMPLE:
+			case EVENTSEL_MAXSAMPLE:
+				if (qdef.bufsize != sizeof(INT32_T)) return -1;
+				break;
+			default:
+				return -1;
+		}
+		offset += qdef.bufsize;
+		numCriteria++;
+	}
+	return numCriteria;
+}
+
+/* the parsed form of a query */
+typedef struct {
+	int         hasType, hasValue, empty;
+	UINT32_T    typeType, typeSize, valueType, valueSize;
+	const char *type, *value;
+	INT32_T     minSample, maxSample;
+} query_t;
+
+/* remembers one type or value criterion; a second one has to be the same, or nothing matches */
+static void set_key(query_t *Q, int *has, UINT32_T *datatype, UINT32_T *keysize, const char **key, const char *arg, UINT32_T argsize) {
+	UINT32_T dt;
+	memcpy(&dt, arg, sizeof(UINT32_T));
+	arg += sizeof(UINT32_T);
+	argsize -= sizeof(UINT32_T);
+	if (*has && (*datatype != dt || *keysize != argsize || memcmp(*key, arg, argsize) != 0)) Q->empty = 1;
+	*has = 1;
+	*datatype = dt;
+	*keysize = argsize;
+	*key = arg;
+}
+
+static void parse_query(query_t *Q, UINT32_T size, const void *query) {
+	UINT32_T offset = 0;
+
+	memset(Q, 0, sizeof(query_t));
+	Q->minSample = INT_MIN;
+	Q->maxSample = INT_MAX;
+
+	while (offset < size) {
+		eventquerydef_t qdef;
+		const char *arg;
+		INT32_T sample;
+
+		memcpy(&qdef, (const char *) query + offset, sizeof(eventquerydef_t));
+		arg = (const char *) query + offset + sizeof(eventquerydef_t);
+		offset += sizeof(eventquerydef_t) + qdef.bufsize;
+
+		switch (qdef.what) {
+			case EVENTSEL_TYPE:
+				set_key(Q, &Q->hasType, &Q->typeType, &Q->typeSize, &Q->type, arg, qdef.bufsize);
+				break;
+			case EVENTSEL_VALUE:
+				set_key(Q, &Q->hasValue, &Q->valueType, &Q->valueSize, &Q->value, arg, qdef.bufsize);
+				break;
+			default:
+				memcpy(&sample, arg, sizeof(INT32_T));
+				if (qdef.what != EVENTSEL_MAXSAMPLE && sample > Q->minSample) Q->minSample = sample;
+				if (qdef.what != EVENTSEL_MINSAMPLE && sample < Q->maxSample) Q->maxSample = sample;
+		}
+	}
+	if (Q->minSample > Q->maxSample) Q->empty = 1;
+}
+
+/* checks a serialized event (eventdef_t followed by its buf) against all criteria */
+static int match_event(const query_t *Q, const char *ev) {
+	eventdef_t def;
+	UINT32_T wst;
+
+	memcpy(&def, ev, sizeof(eventdef_t));
+	ev += sizeof(eventdef_t);
+	if (def.sample < Q->minSample || def.sample > Q->maxSample) return 0;
+
+	wst = wordsize_from_type(def.type_type);
+	if (Q->hasType) {
+		if (def.type_type != Q->typeType || wst*def.type_numel != Q->typeSize) return 0;
+		if (memcmp(ev, Q->type, Q->typeSize) != 0) return 0;
+	}
+	if (Q->hasValue) {
+		if (def.value_type != Q->valueType || wordsize_from_type(def.value_type)*def.value_numel != Q->valueSize) return 0;
+		if (memcmp(ev + wst*def.type_numel, Q->value, Q->valueSize) != 0) return 0;
+	}
+	return 1;
+}
+
+/* number of postings that are still in the log, moves P->start up to the first one */
+static UINT32_T live_postings(ft_postings_t *P, UINT32_T first) {
+	UINT32_T lo = P->start, hi = P->size;
+	while (lo < hi) {
+		UINT32_T mid = lo + (hi - lo)/2;
+		if (P->num[mid] < first) lo = mid+1; else hi = mid;
+	}
+	P->start = lo;
+	return P->size - lo;
+}
+
+static int compare_num(const void *a, const void *b) {
+	UINT32_T x = *(const UINT32_T *) a, y = *(const UINT32_T *) b;
+	return (x < y) ? -1 : (x > y);
+}
+
+int ft_eventindex_query(ft_eventindex_t *I, const ft_eventlog_t *L, UINT32_T size, const void *query, UINT32_T **result, UINT32_T *nresult) {
+	query_t Q;
+	ft_eventkey_t *K;
+	const UINT32_T *cand = NULL;   /* candidates from a hash table */
+	UINT32_T ncand, lo = 0, hi = 0, i, n = 0;
+	int useSamples = 0;
+	char *scratch = NULL;
+	UINT32_T scratchSize = 0;
+	UINT32_T *list;
+
+	*result  = NULL;
+	*nresult = 0;
+
+	parse_query(&Q, size, query);
+	if (Q.empty || L->count == L->first) return 0;
+
+	/* start out with all events in the log, and pick the smallest index that applies */
+	ncand = L->count - L->first;
+	if (Q.hasType) {
+		K = hash_find(&I->type, hash_key(Q.typeType, Q.type, Q.typeSize), Q.typeType, Q.type, Q.typeSize);
+		if (K == NULL) return 0;
+		ncand = live_postings(&K->list, L->first);
+		cand  = K->list.num + K->list.start;
+	}
+	if (Q.hasValue) {
+		K = hash_find(&I->value, hash_key(Q.valueType, Q.value, Q.valueSize), Q.valueType, Q.value, Q.valueSize);
+		if (K == NULL) return 0;
+		if (live_postings(&K->list, L->first) < ncand) {
+			ncand = K->list.size - K->list.start;
+			cand  = K->list.num + K->list.start;
+		}
+	}
+	if (Q.minSample != INT_MIN || Q.maxSample != INT_MAX) {
+		/* a range of the sorted run, and whatever matches in the unsorted tail */
+		UINT32_T ntail = 0;
+		lo = lower_sample(I, Q.minSample);
+		hi = upper_sample(I, Q.maxSample);
+		for (i=I->nsorted; i<I->nsample; i++) {
+			if (I->bysample[i].sample >= Q.minSample && I->bysample[i].sample <= Q.maxSample) ntail++;
+		}
+		if (hi - lo + ntail < ncand) {
+			ncand = hi - lo + ntail;
+			useSamples = 1;
+		}
+	}
+	if (ncand == 0) return 0;
+
+	list = (UINT32_T *) malloc(ncand * sizeof(UINT32_T));
+	if (list == NULL) return -1;
+
+	/* the candidates from the sample index go into the list first, the matches
+	   below never overtake them */
+	if (useSamples) {
+		UINT32_T k = 0;
+		for (i=lo; i<hi; i++) list[k++] = I->bysample[i].num;
+		for (i=I->nsorted; i<I->nsample; i++) {
+			if (I->bysample[i].sample >= Q.minSample && I->bysample[i].sample <= Q.maxSample) list[k++] = I->bysample[i].num;
+		}
+	}
+
+	for (i=0; i<ncand; i++) {
+		UINT32_T num, evsize;
+
+		if (useSamples) num = list[i];
+		else if (cand)  num = cand[i];
+		else            num = L->first + i;
+		if (num < L->first) continue;
+
+		evsize = (UINT32_T) ft_eventlog_range_size(L, num, 1);
+		if (evsize > scratchSize) {
+			char *s = (char *) realloc(scratch, evsize);
+			if (s == NULL) {
+				free(scratch);
+				free(list);
+				return -1;
+			}
+			scratch = s;
+			scratchSize = evsize;
+		}
+		ft_eventlog_read(L, num, 1, scratch);
+		if (match_event(&Q, scratch)) list[n++] = num;
+	}
+	if (scratch) free(scratch);
+
+	if (n == 0) {
+		free(list);
+		return 0;
+	}
+	/* the sample index is sorted on sample, but we return the events in their original order */
+	if (useSamples) qsort(list, n, sizeof(UINT32_T), compare_num);
+
+	*result  = list;
+	*nresult = n;
+	return 0;
+}
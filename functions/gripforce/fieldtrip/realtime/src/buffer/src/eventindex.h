@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef EVENTINDEX_H
+#define EVENTINDEX_H
+
+#include "platform_includes.h"
+#include "message.h"
+#include "eventlog.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Ascending list of event numbers that share a type or value. Events that
+    dropped out of the log are skipped by moving "start" forward.
+*/
+typedef struct {
+	UINT32_T *num;
+	UINT32_T start;
+	UINT32_T size;
+	UINT32_T alloc;
+} ft_postings_t;
+
+/** Hash table entry for one distinct type or value, i.e. datatype + bytes */
+typedef struct ft_eventkey {
+	struct ft_eventkey *next;
+	UINT32_T hash;
+	UINT32_T datatype;
+	UINT32_T keysize;
+	ft_postings_t list;
+	char *key;
+} ft_eventkey_t;
+
+typedef struct {
+	ft_eventkey_t **bucket;
+	UINT32_T nbuckets;
+	UINT32_T nkeys;
+} ft_eventhash_t;
+
+typedef struct {
+	INT32_T  sample;
+	UINT32_T num;
+} ft_samplekey_t;
+
+/** Secondary indexes on the events in an ft_eventlog_t, used for GET_EVT_QUERY.
+
+    There is one hash table on the event type and one on the event value, and
+    an array of (sample, event number) pairs. Events mostly arrive in the
+    order of their sample number, and then simply extend the sorted run at
+    the start of that array. Once an event comes in with an earlier sample
+    (e.g. a backfill), it and all later ones are appended after the run
+    unsorted, and a query scans them. When that tail has grown to 1/8 of the
+    run, it is sorted and merged into the run, so every event costs O(log n)
+    on average, however the samples arrive. Events that drop out of the log
+    are not removed right away; they are skipped while answering a query,
+    and purged once they make up more than half of an index.
+*/
+typedef struct {
+	ft_eventhash_t  type;
+	ft_eventhash_t  value;
+	ft_samplekey_t *bysample;
+	UINT32_T nsample;
+	UINT32_T nsorted;       /**< bysample[0..nsorted) is sorted on sample, the rest is not */
+	UINT32_T allocsample;
+} ft_eventindex_t;
+
+void ft_eventindex_init(ft_eventindex_t *I);
+void ft_eventindex_free(ft_eventindex_t *I);
+
+/** Removes all events from the index, but keeps the memory of the sample index */
+void ft_eventindex_reset(ft_eventindex_t *I);
+
+/** Adds event number "num" that has just been appended to log L.
+    Returns 0 on success, -1 if the index could not be grown.
+*/
+int ft_eventindex_add(ft_eventindex_t *I, const ft_eventlog_t *L, UINT32_T num, const eventdef_t *def, const void *buf);
+
+/** Checks whether "query" is a valid list of criteria as described at eventquerydef_t.
+    Returns the number of criteria, or -1 if the query is malformed.
+*/
+int check_event_query(UINT32_T size, const void *query);
+
+/** Finds the events in log L that match all criteria in "query", which must have
+    been checked with check_event_query. On success, *result is a malloc'ed list
+    of *nresult event numbers in ascending order (NULL if there are none) and 0
+    is returned, or -1 if memory could not be allocated.
+*/
+int ft_eventindex_query(ft_eventindex_t *I, const ft_eventlog_t *L, UINT32_T size, const void *query, UINT32_T **result, UINT32_T *nresult);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVENTINDEX_H */
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "eventlog.h"
+
+/* initial allocation, both are doubled whenever they are too small */
+#define INITIAL_ARENA_SIZE  (64*1024)
+#define INITIAL_INDEX_SIZE  1024
+
+UINT64_T ft_eventlog_default_bytes(UINT32_T maxevents) {
+	UINT64_T maxbytes = (UINT64_T) maxevents * FT_EVENTLOG_BYTES_PER_EVENT;
+	return (maxbytes < FT_EVENTLOG_MIN_BYTES) ? FT_EVENTLOG_MIN_BYTES : maxbytes;
+}
+
+int ft_eventlog_init(ft_eventlog_t *L, UINT32_T maxevents, UINT64_T maxbytes) {
+	if (maxevents == 0) maxevents = 1;
+	if (maxbytes == 0) maxbytes = ft_eventlog_default_bytes(maxevents);
+	L->maxevents = maxevents;
+	L->maxbytes  = maxbytes;
+	L->arenasize = (maxbytes < INITIAL_ARENA_SIZE) ? maxbytes : INITIAL_ARENA_SIZE;
+	L->indexsize = (maxevents < INITIAL_INDEX_SIZE) ? maxevents : INITIAL_INDEX_SIZE;
+	L->arena = (char *) malloc((size_t) L->arenasize);
+	L->index = (UINT64_T *) malloc((size_t) L->indexsize * sizeof(UINT64_T));
+	ft_eventlog_reset(L);
+	if (L->arena == NULL || L->index == NULL) {
+		ft_eventlog_free(L);
+		return -1;
+	}
+	return 0;
+}
+
+void ft_eventlog_free(ft_eventlog_t *L) {
+	if (L->arena) free(L->arena);
+	if (L->index) free(L->index);
+	L->arena = NULL;
+	L->index = NULL;
+	L->arenasize = 0;
+	L->indexsize = 0;
+	ft_eventlog_reset(L);
+}
+
+void ft_eventlog_attach(ft_eventlog_t *L, char *arena, UINT64_T *index, UINT32_T maxevents, UINT64_T maxbytes) {
+	L->arena     = arena;
+	L->index     = index;
+	L->maxevents = maxevents;
+	L->maxbytes  = maxbytes;
+	L->arenasize = maxbytes;
+	L->indexsize = maxevents;
+	ft_eventlog_reset(L);
+}
+
+void ft_eventlog_reset(ft_eventlog_t *L) {
+	L->tail  = 0;
+	L->first = 0;
+	L->count = 0;
+}
+
+/* copies "size" bytes to absolute arena position "pos", wrapping around the end */
+static void arena_put(ft_eventlog_t *L, UINT64_T pos, const void *src, UINT64_T size) {
+	UINT64_T start = pos % L->maxbytes;
+	UINT64_T na = L->maxbytes - start;
+	if (size <= na) {
+		memcpy(L->arena + start, src, (size_t) size);
+	} else {
+		memcpy(L->arena + start, src, (size_t) na);
+		memcpy(L->arena, (const char *) src + na, (size_t) (size - na));
+	}
+}
+
+/* copies "size" bytes from absolute arena position "pos", wrapping around the end */
+static void arena_get(const ft_eventlog_t *L, UINT64_T pos, void *dest, UINT64_T size) {
+	UINT64_T start = pos % L->maxbytes;
+	UINT64_T na = L->maxbytes - start;
+	if (size <= na) {
+		memcpy(dest, L->arena + start, (size_t) size);
+	} else {
+		memcpy(dest, L->arena + start, (size_t) na);
+		memcpy((char *) dest + na, L->arena, (size_t) (size - na));
+	}
+}
+
+int ft_eventlog_append(ft_eventlog_t *L, const eventdef_t *def, const void *buf) {
+	UINT64_T size = sizeof(eventdef_t) + def->bufsize;
+	UINT64_T need;
+
+	if (size > L->maxbytes) return -1;
+
+	/* make room in the arena; positions below arenasize are the same
+	   physical and absolute, so realloc keeps all events in place */
+	need = L->tail + size;
+	if (need > L->maxbytes) need = L->maxbytes;
+	if (need > L->arenasize) {
+		UINT64_T newsize = 2*L->arenasize;
+		char *arena;
+		if (newsize < need) newsize = need;
+		if (newsize > L->maxbytes) newsize = L->maxbytes;
+		arena = (char *) realloc(L->arena, (size_t) newsize);
+		if (arena == NULL) return -1;
+		L->arena = arena;
+		L->arenasize = newsize;
+	}
+
+	/* same for the index, which only wraps once it holds maxevents entries */
+	if (L->count < L->maxevents && L->count >= L->indexsize) {
+		UINT32_T newsize = (L->indexsize > L->maxevents/2) ? L->maxevents : 2*L->indexsize;
+		UINT64_T *index = (UINT64_T *) realloc(L->index, (size_t) newsize * sizeof(UINT64_T));
+		if (index == NULL) return -1;
+		L->index = index;
+		L->indexsize = newsize;
+	}
+
+	/* drop the oldest events until the new one fits */
+	if (L->count - L->first >= L->maxevents) L->first++;
+	while (L->first < L->count && L->tail + size - L->index[L->first % L->maxevents] > L->maxbytes) L->first++;
+
+	L->index[L->count % L->maxevents] = L->tail;
+	arena_put(L, L->tail, def, sizeof(eventdef_t));
+	arena_put(L, L->tail + sizeof(eventdef_t), buf, def->bufsize);
+	L->tail += size;
+	L->count++;
+	return 0;
+}
+
+UINT64_T ft_eventlog_range_size(const ft_eventlog_t *L, UINT32_T begevent, UINT32_T nevents) {
+	UINT64_T beg, end;
+	if (nevents == 0) return 0;
+	beg = L->index[begevent % L->maxevents];
+	end = (begevent + nevents == L->count) ? L->tail : L->index[(begevent + nevents) % L->maxevents];
+	return end - beg;
+}
+
+void ft_eventlog_read(const ft_eventlog_t *L, UINT32_T begevent, UINT32_T nevents, void *dest) {
+	UINT64_T size = ft_eventlog_range_size(L, begevent, nevents);
+	if (size > 0) arena_get(L, L->index[begevent % L->maxevents], dest, size);
+}
+
+UINT32_T ft_eventlog_recover(ft_eventlog_t *L, char *arena, UINT64_T *index) {
+	UINT32_T k, first = L->first;
+	UINT64_T pos, end;
+	eventdef_t def;
+
+	L->arena = arena;
+	L->index = index;
+	if (L->maxevents == 0 || L->maxbytes == 0 || L->first > L->count || L->count - L->first > L->maxevents) {
+		L->first = L->count = 0;
+		L->tail = 0;
+		return 0;
+	}
+
+	/* append stores the event before it is counted, so the last counted event
+	   is complete, but the tail may or may not include it yet */
+	if (L->count > L->first) {
+		pos = L->index[(L->count-1) % L->maxevents];
+		arena_get(L, pos, &def, sizeof(eventdef_t));
+		L->tail = pos + sizeof(eventdef_t) + def.bufsize;
+	}
+
+	/* walk backwards from the tail, every event has to end where the next one starts */
+	end = L->tail;
+	for (k = L->count; k > L->first; k--) {
+		pos = L->index[(k-1) % L->maxevents];
+		if (pos >= end || end - pos > L->maxbytes || L->tail - pos > L->maxbytes) break;
+		arena_get(L, pos, &def, sizeof(eventdef_t));
+		if (end - pos != sizeof(eventdef_t) + def.bufsize) break;
+		end = pos;
+	}
+	L->first = k;
+	return L->first - first;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the arena may use this many bytes per event on average before old events are dropped */
+#define FT_EVENTLOG_BYTES_PER_EVENT  128
+/* ... but never less than this, so that single events with a large value still fit */
+#define FT_EVENTLOG_MIN_BYTES        (1024*1024)
+
+/** Append-only log of events.
+
+    Events are stored back to back in one arena, in exactly the format in
+    which they travel over the wire (eventdef_t followed by its type and
+    value). A range of consecutive events therefore is one contiguous
+    piece of the arena, which is copied into the GET_EVT response with one
+    memcpy (two if the range wraps around the end of the arena).
+
+    Both the arena and the index grow on demand, so that a log with room for
+    millions of events does not cost anything until the events arrive. Once
+    either limit is reached, the oldest events are dropped, which is O(1)
+    amortized per appended event.
+
+    Positions in the arena are absolute byte counts; the physical position is
+    taken modulo maxbytes. Since the arena only grows while no position has
+    reached maxbytes yet, growing it does not move any event.
+
+    The log does not do any locking itself, dmarequest uses mutexevent.
+*/
+typedef struct {
+	char     *arena;      /**< serialized events */
+	UINT64_T *index;      /**< arena position of event k, at index[k % maxevents] */
+	UINT64_T arenasize;   /**< number of bytes allocated for the arena */
+	UINT64_T maxbytes;    /**< the arena does not grow beyond this */
+	UINT64_T tail;        /**< arena position just after the last event */
+	UINT32_T indexsize;   /**< number of entries allocated for the index */
+	UINT32_T maxevents;   /**< maximal number of events that is kept */
+	UINT32_T first;       /**< number of the oldest event that is still available */
+	UINT32_T count;       /**< number of events appended since the last reset */
+} ft_eventlog_t;
+
+/** Sets up an empty log for at most "maxevents" events, and at most "maxbytes"
+    bytes of event data. If maxbytes is 0, it is derived from maxevents.
+    Returns 0 on success, -1 if the memory could not be allocated.
+*/
+int  ft_eventlog_init(ft_eventlog_t *L, UINT32_T maxevents, UINT64_T maxbytes);
+void ft_eventlog_free(ft_eventlog_t *L);
+
+/** Returns the arena size that ft_eventlog_init uses if maxbytes is 0 */
+UINT64_T ft_eventlog_default_bytes(UINT32_T maxevents);
+
+/** Like ft_eventlog_init, but uses memory that the caller provides (e.g. a
+    file mapping, see persist.h): an arena of maxbytes bytes and an index of
+    maxevents entries, which are never grown and must not be released with
+    ft_eventlog_free.
+*/
+void ft_eventlog_attach(ft_eventlog_t *L, char *arena, UINT64_T *index, UINT32_T maxevents, UINT64_T maxbytes);
+
+/** Takes over an attached log whose owner died, possibly in the middle of
+    ft_eventlog_append, after pointing it at the (new) arena and index memory.
+    Events that are not intact are dropped from the front of the log, and
+    the tail is recomputed from the last event. Returns the number of events
+    that had to be dropped.
+*/
+UINT32_T ft_eventlog_recover(ft_eventlog_t *L, char *arena, UINT64_T *index);
+
+/** Forgets about all events, but keeps the memory */
+void ft_eventlog_reset(ft_eventlog_t *L);
+
+/** Appends one event, dropping the oldest events if necessary.
+    Returns 0 on success, -1 if the event is larger than the whole arena or
+    the arena could not be grown.
+*/
+int  ft_eventlog_append(ft_eventlog_t *L, const eventdef_t *def, const void *buf);
+
+/** Returns the number of bytes that events begevent ... begevent+nevents-1 take
+    up in the log, and on the wire. The caller has to make sure that these
+    events are still available, i.e. first <= begevent and begevent+nevents <= count.
+*/
+UINT64_T ft_eventlog_range_size(const ft_eventlog_t *L, UINT32_T begevent, UINT32_T nevents);
+
+/** Copies events begevent ... begevent+nevents-1 into dest, which must have room
+    for ft_eventlog_range_size bytes. The same restrictions on the range apply.
+*/
+void ft_eventlog_read(const ft_eventlog_t *L, UINT32_T begevent, UINT32_T nevents, void *dest);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EVENTLOG_H */
@@ -11,6 +11,7 @@
 #else
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 #endif
 
 static char *datatype_names[]={"char","uint8","uint16","uint32","uint64","int8","int16","int32","int64","float32","float64"};
@@ -115,6 +116,12 @@ ft_storage_t *ft_storage_create(const char *directory, const headerdef_t *hdef,
 	S->numEvents   = 0;
 	S->created = 1;
 	S->curSampleFile = 0;
+	S->fileStart = (UINT32_T *) malloc(sizeof(UINT32_T));
+	if (S->fileStart == NULL) {
+		if (errCode) *errCode=FT_OUT_OF_MEMORY;
+		goto cleanup;
+	}
+	S->fileStart[0] = 0;
 	
 	
 	return S;
@@ -150,6 +157,7 @@ void ft_storage_close(ft_storage_t *S) {
 	fclose(S->fHeader);
 	fclose(S->fHeaderTxt);
 	
+	free(S->fileStart);
 	free(S->dirName);
 	free(S);
 }
@@ -158,11 +166,15 @@ int ft_storage_add_samples(ft_storage_t *S, int numSamples, const void *data) {
 	long fPos = ftell(S->fSamples);
 	long addSize = S->sampleSize * numSamples;
 	
-	if ((unsigned long) fPos + (unsigned long) addSize > (unsigned long) 2*1024*1024*1024) {
+	if ((unsigned long) fPos + (unsigned long) addSize > 2UL*1024*1024*1024 && fPos > 0) {
 		/* would violate 2 GB boundary - create new file instead */
+		UINT32_T *fileStart = (UINT32_T *) realloc(S->fileStart, (S->curSampleFile + 2) * sizeof(UINT32_T));
+		if (fileStart == NULL) return FT_OUT_OF_MEMORY;
+		S->fileStart = fileStart;
 		fclose(S->fSamples);
 		
 		S->curSampleFile++;
+		S->fileStart[S->curSampleFile] = S->numSamples;
 		
 		sprintf(S->dirName + S->dirLen, "/samples%i", S->curSampleFile);
 		S->fSamples = fopen(S->dirName, "wb");
@@ -209,4 +221,40 @@ int ft_storage_add_timing(ft_storage_t *S, const ft_timing_element_t *te) {
 	return 0;
 }
 
-	
+int ft_storage_locate_sample(const ft_storage_t *S, UINT32_T sample, int *file, long *offset, UINT32_T *count) {
+	int i;
+	if (sample >= S->numSamples) return -1;
+	for (i=S->curSampleFile; S->fileStart[i] > sample; i--);
+	*file   = i;
+	*offset = (long) (sample - S->fileStart[i]) * S->sampleSize;
+	*count  = ((i < S->curSampleFile) ? S->fileStart[i+1] : S->numSamples) - sample;
+	return 0;
+}
+
+int ft_storage_sample_file(const ft_storage_t *S, int file, char *name, int size) {
+	int n;
+	if (file == 0) {
+		n = snprintf(name, size, "%.*s/samples", S->dirLen, S->dirName);
+	} else {
+		n = snprintf(name, size, "%.*s/samples%i", S->dirLen, S->dirName, file);
+	}
+	return (n > 0 && n < size) ? 0 : -1;
+}
+
+int ft_storage_remove(const char *directory) {
+	static const char *names[] = {"header", "header.txt", "samples", "events", "timing"};
+	char *name = (char *) malloc(strlen(directory) + 24);
+	int i;
+
+	if (name == NULL) return FT_OUT_OF_MEMORY;
+	for (i=0; i<5; i++) {
+		sprintf(name, "%s/%s", directory, names[i]);
+		remove(name);
+	}
+	for (i=1; ; i++) {
+		sprintf(name, "%s/samples%i", directory, i);
+		if (remove(name) != 0) break;
+	}
+	free(name);
+	return (rmdir(directory) == 0) ? 0 : FT_FILE_ERROR;
+}
@@ -32,6 +32,7 @@ typedef struct {
 	UINT32_T numChannels;
 	UINT32_T numSamples;
 	UINT32_T numEvents;
+	UINT32_T *fileStart; /* number of the first sample in "samples", "samples1", ... */
 } ft_storage_t;
 
 typedef struct {
@@ -47,6 +48,15 @@ int  ft_storage_add_events  (ft_storage_t *S, int size, const void *events);
 int  ft_storage_add_event   (ft_storage_t *S, const eventdef_t *event, const void *type, const void *value);
 int  ft_storage_add_timing  (ft_storage_t *S, const ft_timing_element_t *te);
 
+/* Sample files are split at 2 GB, this finds the file that contains the given
+   sample, the offset of the sample in there, and the number of samples from
+   there to the end of the file. Returns 0, or -1 if it has not been written. */
+int  ft_storage_locate_sample(const ft_storage_t *S, UINT32_T sample, int *file, long *offset, UINT32_T *count);
+/* writes the full name of sample file number "file" into name */
+int  ft_storage_sample_file  (const ft_storage_t *S, int file, char *name, int size);
+/* removes a directory that was written by ft_storage_create */
+int  ft_storage_remove(const char *directory);
+
 /*
 ft_storage_t *ft_storage_open(const char *directory);
 headerdef_t *ft_storage_read_header(const ft_storage_t *S);
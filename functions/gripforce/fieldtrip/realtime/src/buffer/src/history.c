@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "stream.h"
+#include "history.h"
+#include "ft_storage.h"
+
+#ifdef WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+/* one slot of the page cache */
+typedef struct {
+	int      file;       /* sample file the page belongs to, -1 if the slot is unused */
+	UINT32_T page;       /* page number within that file */
+	UINT32_T size;       /* number of valid bytes, less than a page at the end of a file */
+	int      ref;        /* used since the clock hand last passed */
+	int      next;       /* next slot in the same hash bucket, or -1 */
+	char     *data;
+} history_page_t;
+
+struct ft_history {
+	ft_storage_t      *store;
+	char              *directory;
+	pthread_mutex_t   lock;        /* protects the store, the files and the cache */
+	volatile UINT32_T spilled;     /* samples 0 ... spilled-1 are on disk */
+	int               failed;      /* writing failed, so nothing more is spilled */
+	UINT32_T          chunk;       /* number of samples in FT_HISTORY_SPILL_SIZE */
+	FILE              **files;     /* sample files opened for reading, by file number */
+	int               numfiles;
+	history_page_t    *pages;
+	int               numpages;
+	int               *bucket;     /* first slot in each hash bucket, or -1 */
+	int               numbuckets;
+	int               hand;        /* clock hand for choosing the page to evict */
+	UINT64_T          hits;
+	UINT64_T          misses;
+};
+
+static char *historyDir = NULL;
+static UINT64_T historyCache = FT_HISTORY_CACHE_SIZE;
+static pthread_mutex_t mutexhistory = PTHREAD_MUTEX_INITIALIZER;
+
+static int make_directory(const char *directory) {
+	int r;
+	#ifdef WIN32
+	r = mkdir(directory);
+	#else
+	r = mkdir(directory, 0700);
+	#endif
+	return (r == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+static int hash(int file, UINT32_T page, int numbuckets) {
+	return (int) (((UINT32_T) file * 2654435761u ^ page) % (UINT32_T) numbuckets);
+}
+
+static FILE *sample_file(struct ft_history *H, int file) {
+	char name[1024];
+
+	if (file >= H->numfiles) {
+		FILE **files = (FILE **) realloc(H->files, (file+1) * sizeof(FILE *));
+		if (files == NULL) return NULL;
+		memset(files + H->numfiles, 0, (file+1 - H->numfiles) * sizeof(FILE *));
+		H->files = files;
+		H->numfiles = file+1;
+	}
+	if (H->files[file] == NULL) {
+		if (ft_storage_sample_file(H->store, file, name, sizeof(name)) != 0) return NULL;
+		H->files[file] = fopen(name, "rb");
+		/* the cache does the buffering */
+		if (H->files[file] != NULL) setvbuf(H->files[file], NULL, _IONBF, 0);
+	}
+	return H->files[file];
+}
+
+/* returns the cached page with at least "need" valid bytes, reading it if necessary */
+static history_page_t *get_page(struct ft_history *H, int file, UINT32_T page, UINT32_T need) {
+	history_page_t *P;
+	FILE *f;
+	int i, *link, b = hash(file, page, H->numbuckets);
+
+	for (i = H->bucket[b]; i >= 0; i = H->pages[i].next) {
+		if (H->pages[i].file == file && H->pages[i].page == page) break;
+	}
+
+	if (i >= 0 && H->pages[i].size >= need) {
+		H->hits++;
+		H->pages[i].ref = 1;
+		return &H->pages[i];
+	}
+	H->misses++;
+
+	if (i < 0) {
+		/* evict a page that has not been used since the clock hand last passed it */
+		for (;;) {
+			P = &H->pages[H->hand];
+			i = H->hand;
+			H->hand = (H->hand + 1) % H->numpages;
+			if (P->file < 0 || !P->ref) break;
+			P->ref = 0;
+		}
+		if (P->file >= 0) {
+			for (link = &H->bucket[hash(P->file, P->page, H->numbuckets)]; *link != i; link = &H->pages[*link].next);
+			*link = P->next;
+		}
+		if (P->data == NULL) {
+			P->data = (char *) malloc(FT_HISTORY_PAGE_SIZE);
+			if (P->data == NULL) return NULL;
+		}
+		P->file = file;
+		P->page = page;
+		P->next = H->bucket[b];
+		H->bucket[b] = i;
+	}
+
+	/* a page at the end of the last file can still grow, so it may be read again */
+	P = &H->pages[i];
+	P->ref  = 1;
+	P->size = 0;
+	f = sample_file(H, file);
+	if (f == NULL || fseek(f, (long) page * FT_HISTORY_PAGE_SIZE, SEEK_SET) != 0) return NULL;
+	P->size = (UINT32_T) fread(P->data, 1, FT_HISTORY_PAGE_SIZE, f);
+	return (P->size >= need) ? P : NULL;
+}
+
+static int read_bytes(struct ft_history *H, int file, long offset, char *dest, size_t size) {
+	while (size > 0) {
+		UINT32_T page  = (UINT32_T) (offset / FT_HISTORY_PAGE_SIZE);
+		UINT32_T start = (UINT32_T) (offset % FT_HISTORY_PAGE_SIZE);
+		size_t n = FT_HISTORY_PAGE_SIZE - start;
+		history_page_t *P;
+
+		if (n > size) n = size;
+		P = get_page(H, file, page, start + (UINT32_T) n);
+		if (P == NULL) return -1;
+		memcpy(dest, P->data + start, n);
+		dest   += n;
+		offset += (long) n;
+		size   -= n;
+	}
+	return 0;
+}
+
+static void history_destroy(struct ft_history *H) {
+	int i;
+	for (i=0; i<H->numfiles; i++) {
+		if (H->files[i]) fclose(H->files[i]);
+	}
+	for (i=0; i<H->numpages; i++) FREE(H->pages[i].data);
+	FREE(H->files);
+	FREE(H->pages);
+	FREE(H->bucket);
+	if (H->store) ft_storage_close(H->store);
+	FREE(H->directory);
+	pthread_mutex_destroy(&H->lock);
+	free(H);
+}
+
+/*****************************************************************************/
+
+int ft_history_enable(const char *directory, UINT64_T cachesize) {
+	char *dir;
+
+	if (directory == NULL || directory[0] == 0 || make_directory(directory) != 0) {
+		fprintf(stderr, "ft_history: cannot use directory '%s'\n", directory ? directory : "");
+		return -1;
+	}
+	dir = (char *) malloc(strlen(directory) + 1);
+	if (dir == NULL) return -1;
+	strcpy(dir, directory);
+
+	pthread_mutex_lock(&mutexhistory);
+	FREE(historyDir);
+	historyDir = dir;
+	historyCache = (cachesize > 0) ? cachesize : FT_HISTORY_CACHE_SIZE;
+	pthread_mutex_unlock(&mutexhistory);
+	return 0;
+}
+
+void ft_history_create(ft_stream_t *S) {
+	struct ft_history *H;
+	UINT64_T cachesize;
+	int i, err;
+
+	if (S->header == NULL || S->data == NULL || S->history != NULL) return;
+	/* streams whose name contains a slash do not get a directory */
+	if (strchr(S->name, '/') != NULL) return;
+
+	pthread_mutex_lock(&mutexhistory);
+	if (historyDir == NULL) {
+		pthread_mutex_unlock(&mutexhistory);
+		return;
+	}
+	H = (struct ft_history *) calloc(1, sizeof(struct ft_history));
+	DIE_BAD_MALLOC(H);
+	H->directory = (char *) malloc(strlen(historyDir) + FT_STREAM_NAME_LENGTH + 16);
+	DIE_BAD_MALLOC(H->directory);
+	if (S->name[0] == 0) {
+		sprintf(H->directory, "%s/buffer", historyDir);
+	} else {
+		sprintf(H->directory, "%s/buffer@%s", historyDir, S->name);
+	}
+	cachesize = historyCache;
+	pthread_mutex_unlock(&mutexhistory);
+
+	/* the previous history of this stream does not belong to the new header */
+	ft_storage_remove(H->directory);
+	H->store = ft_storage_create(H->directory, S->header->def, S->header->buf, &err);
+	if (H->store == NULL) {
+		fprintf(stderr, "ft_history: cannot create %s, samples will only be kept in the ring\n", H->directory);
+		free(H->directory);
+		free(H);
+		return;
+	}
+
+	H->numpages = (int) (cachesize / FT_HISTORY_PAGE_SIZE);
+	if (H->numpages < 2) H->numpages = 2;
+	H->numbuckets = 2*H->numpages + 1;
+	H->pages  = (history_page_t *) calloc(H->numpages, sizeof(history_page_t));
+	H->bucket = (int *) malloc(H->numbuckets * sizeof(int));
+	DIE_BAD_MALLOC(H->pages);
+	DIE_BAD_MALLOC(H->bucket);
+	for (i=0; i<H->numpages; i++) H->pages[i].file = -1;
+	for (i=0; i<H->numbuckets; i++) H->bucket[i] = -1;
+
+	H->chunk = FT_HISTORY_SPILL_SIZE / S->data->chansize;
+	if (H->chunk == 0) H->chunk = 1;
+	pthread_mutex_init(&H->lock, NULL);
+	S->history = H;
+}
+
+void ft_history_free(ft_stream_t *S, int remove) {
+	struct ft_history *H = S->history;
+	char *directory;
+
+	if (H == NULL) return;
+	S->history = NULL;
+	directory = H->directory;
+	H->directory = NULL;
+	history_destroy(H);
+	if (remove) ft_storage_remove(directory);
+	free(directory);
+}
+
+int ft_history_active(const ft_stream_t *S) {
+	return S->history != NULL && !S->history->failed;
+}
+
+void ft_history_make_room(ft_stream_t *S, UINT32_T nsamples) {
+	struct ft_history *H = S->history;
+	ft_ring_t *R = S->data;
+	UINT32_T head, need, target;
+
+	if (H == NULL || H->failed || R == NULL || nsamples > R->capacity) return;
+
+	/* the writer owns head, and nothing is in progress while it holds mutexdata */
+	head = FT_ATOMIC_LOAD_RELAXED(&R->head);
+	if ((UINT64_T) head + nsamples <= R->capacity) return;
+	need = head + nsamples - R->capacity;
+	if (H->spilled >= need) return;
+
+	/* write a bit more than is necessary right now, to keep the writes large */
+	target = (head - need > H->chunk) ? need + H->chunk : head;
+
+	pthread_mutex_lock(&H->lock);
+	while (H->spilled < target) {
+		UINT32_T start = H->spilled % R->capacity;
+		UINT32_T n = R->capacity - start;
+		ft_timing_element_t te;
+
+		if (n > target - H->spilled) n = target - H->spilled;
+		if (ft_storage_add_samples(H->store, (int) n, R->buf + (size_t) start * R->chansize) != 0) {
+			fprintf(stderr, "ft_history: cannot write to %s, older samples will be lost\n", H->directory);
+			H->failed = 1;
+			break;
+		}
+		/* the playback utility paces the samples by this */
+		te.numSamples = (int) n;
+		te.numEvents  = 0;
+		te.time = (S->header->def->fsample > 0) ? (H->spilled + n) / S->header->def->fsample : 0;
+		ft_storage_add_timing(H->store, &te);
+		FT_ATOMIC_STORE(&H->spilled, H->spilled + n);
+	}
+	pthread_mutex_unlock(&H->lock);
+}
+
+int ft_history_read(ft_stream_t *S, UINT32_T begsample, UINT32_T nsamples, void *dest) {
+	struct ft_history *H = S->history;
+	char *out = (char *) dest;
+	int result = 0;
+
+	if (H == NULL) return -1;
+
+	pthread_mutex_lock(&H->lock);
+	if ((UINT64_T) begsample + nsamples > H->spilled) result = -1;
+	while (result == 0 && nsamples > 0) {
+		int file;
+		long offset;
+		UINT32_T n;
+
+		if (ft_storage_locate_sample(H->store, begsample, &file, &offset, &n) != 0) {
+			result = -1;
+			break;
+		}
+		if (n > nsamples) n = nsamples;
+		result = read_bytes(H, file, offset, out, (size_t) n * H->store->sampleSize);
+		out       += (size_t) n * H->store->sampleSize;
+		begsample += n;
+		nsamples  -= n;
+	}
+	pthread_mutex_unlock(&H->lock);
+	return result;
+}
+
+void ft_history_cache_stats(const ft_stream_t *S, UINT64_T *hits, UINT64_T *misses) {
+	*hits   = S->history ? S->history->hits : 0;
+	*misses = S->history ? S->history->misses : 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_HISTORY_PAGE_SIZE   (64*1024)           /* unit in which samples are read back and cached */
+#define FT_HISTORY_CACHE_SIZE  (64*1024*1024)      /* default size of the page cache */
+#define FT_HISTORY_SPILL_SIZE  (1024*1024)         /* samples are written to disk in pieces of at least this size */
+
+/** Tiered history of the samples.
+
+    The ring only holds the most recent samples, so GET_DAT normally fails
+    for anything older. A server that calls ft_history_enable writes every
+    sample to disk before the ring overwrites it, in a directory per stream
+    in the format of the recording utility (see ft_storage.h): a binary and
+    a text header, and the samples back to back in "samples", "samples1",
+    ... of at most 2 GB each. These directories can therefore be replayed
+    with the playback utility as well.
+
+    The writer spills samples to disk from within PUT_DAT, in pieces of at
+    least FT_HISTORY_SPILL_SIZE, once the ring is full. Because nothing is
+    overwritten before it is on disk, every sample before the first one in
+    the ring can be read from the history, and GET_DAT requests for these
+    samples (or for a range that starts before the ring) are answered
+    transparently. Reads go through a page cache of a fixed size, so that
+    repeatedly reading the same part of the history does not hit the disk.
+
+    The history only covers samples: old events are still dropped by the
+    event log. A new header starts a new history, and the directory of the
+    previous header of that stream is removed.
+*/
+
+struct ft_stream;
+
+/** Keeps the history of all streams that get a header from now on in
+    subdirectories of the given directory ("buffer" for the default stream,
+    "buffer@name" for named streams), with a page cache of at most cachesize
+    bytes per stream (0 selects FT_HISTORY_CACHE_SIZE). Returns 0, or -1 if
+    the directory cannot be used.
+*/
+int  ft_history_enable(const char *directory, UINT64_T cachesize);
+
+/** Starts a new history for stream S, after PUT_HDR has set up its ring.
+    Nothing happens if the history is not enabled. The caller needs to hold
+    all locks of the stream.
+*/
+void ft_history_create(struct ft_stream *S);
+
+/** Closes the history of stream S, and removes it from disk if remove!=0 */
+void ft_history_free(struct ft_stream *S, int remove);
+
+/** Returns 1 if samples that are no longer in the ring of S can be read with ft_history_read */
+int  ft_history_active(const struct ft_stream *S);
+
+/** Writer side, with mutexdata held: writes all samples that the next
+    nsamples samples will overwrite to disk, before ft_ring_reserve.
+*/
+void ft_history_make_room(struct ft_stream *S, UINT32_T nsamples);
+
+/** Copies samples begsample ... begsample+nsamples-1, which must have left
+    the ring already, into dest. Returns 0, or -1 on an error.
+*/
+int  ft_history_read(struct ft_stream *S, UINT32_T begsample, UINT32_T nsamples, void *dest);
+
+/** Returns the number of cache hits and misses of stream S so far */
+void ft_history_cache_stats(const struct ft_stream *S, UINT64_T *hits, UINT64_T *misses);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HISTORY_H */
@@ -11,6 +11,8 @@
 #include "buffer.h"
 #include "message.h"
 #include "printstruct.h"
+#include "shm.h"
+#include "compress.h"
 
 /*******************************************************************************
  * START THE BUFFER IN A SEPARATE THREAD
@@ -41,8 +43,11 @@ int close_connection(int s) {
 	int status = 0, verbose = 0;
 	if (verbose>0)
 		fprintf(stderr, "close_connection: socket = %d\n", s);
-	if (s>0)
+	if (s>0) {
+		ft_shm_detach(s);
+		ft_forget_encoding(s);
 		status = closesocket(s);	/* it is a TCP connection */
+	}
 	if (status!=0)
 		perror("close_connection");
 	return status;
@@ -51,16 +56,28 @@ int close_connection(int s) {
 /*******************************************************************************
  * OPEN CONNECTION
  * returns 0 for direct memory copy, >0 for tcp, <0 in case of error
+ * a hostname of the form shm://name selects the shared memory transport (see shm.h)
  *******************************************************************************/
 int open_connection(const char *hostname, int port) {
 	int verbose = 0;
 	int s, retry;
 	struct sockaddr_in sa;
 	struct hostent *host;
+	const char *shmname;
 #ifdef PLATFORM_WINDOWS
 	static WSADATA wsa = {0,0}; /* check version fields to only initialise once */
 #endif
 
+	if ((shmname = ft_shm_address(hostname)) != NULL) {
+		char path[256];
+		if (ft_shm_socket_path(shmname, path, sizeof(path)) != 0) return -1;
+		/* the port is ignored, requests that cannot use the shared memory go over the socket */
+		s = open_unix_connection(path);
+		if (s > 0 && ft_shm_attach(s, shmname) != 0)
+			fprintf(stderr, "open_connection: cannot use shared memory on socket %d\n", s);
+		return s;
+	}
+
 	if (port==0) {
 		if (verbose>0)
 			fprintf(stderr, "open_connection: using direct memory copy\n");
@@ -473,3 +490,51 @@ int wait_data(int server, unsigned int nsamples, unsigned int nevents, unsigned
 
 	return status;
 }
+
+/*******************************************************************************
+ * SELECT A NAMED STREAM FOR ALL FURTHER REQUESTS ON THIS CONNECTION
+ * an empty name or NULL selects the default stream
+ * returns 0 on success
+ *******************************************************************************/
+int open_stream(int server, const char *name){
+	int status = 0, verbose = 0;
+
+	/* these are used in the communication and represent statefull information */
+	message_t    *request  = NULL;
+	message_t    *response = NULL;
+
+	/* create the request */
+	request      = (message_t *)malloc(sizeof(message_t));
+	request->def = (messagedef_t *)malloc(sizeof(messagedef_t));
+	request->def->version = VERSION;
+	request->def->command = OPEN_STREAM;
+	request->def->bufsize = 0;
+	request->buf = NULL;
+
+	if (name != NULL && name[0] != 0)
+		request->def->bufsize = append(&request->buf, request->def->bufsize, (void *) name, strlen(name));
+
+	if (verbose) print_request(request->def);
+
+	/* send the request */
+	status = clientrequest(server, request, &response);
+	cleanup_message((void **)&request);
+
+	if (status) {
+		fprintf(stderr, "open_stream: error in clientrequest\n");
+		return status;
+	}
+
+	if (verbose) print_response(response->def);
+
+	if (response->def->command==OPEN_OK) {
+		status = 0;
+	}
+	else {
+		status = response->def->command;
+	}
+
+	cleanup_message((void **)&response);
+
+	return status;
+}
@@ -26,12 +26,14 @@ extern "C" {
 /* definition of simplified interface functions, see interface.c */
 int start_server(int port);
 int open_connection(const char *hostname, int port);
+int open_unix_connection(const char *name);
 int close_connection(int s);
 int read_header(int server, UINT32_T *datatype, unsigned int *nchans, float *fsample, unsigned int *nsamples, unsigned int *nevents);
 int read_data(int server, unsigned int begsample, unsigned int endsample, void *buffer);
 int write_header(int server, UINT32_T datatype, unsigned int nchans, float fsample);
 int write_data(int server, UINT32_T datatype, unsigned int nchans, unsigned int nsamples, void *buffer);
 int wait_data(int server, unsigned int nsamples, unsigned int nevents, unsigned int milliseconds);
+int open_stream(int server, const char *name);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,299 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "lockstat.h"
+#include "stream.h"
+#include "stats.h"
+#include "trace.h"
+#include "atomicops.h"
+#include "printstruct.h"
+
+typedef struct {
+	volatile UINT32_T acquired;
+	volatile UINT32_T contended;
+	volatile UINT64_T wait_ns;
+	volatile UINT64_T hold_ns;
+	volatile UINT32_T max_wait_ns;
+	volatile UINT32_T max_hold_ns;
+} lock_stats_t;
+
+typedef struct {
+	volatile UINT32_T count;
+	volatile UINT64_T ns;
+} blocked_t;
+
+volatile int ft_lockstat_active = 0;
+
+static const char *kindNames[FT_LOCK_KINDS] = {"header", "ring (read)", "ring (write)", "data", "event"};
+
+/* the entry of lockholder that goes with each kind */
+static const int kindLock[FT_LOCK_KINDS] = {0, 1, 1, 2, 3};
+
+static lock_stats_t stats[FT_LOCK_KINDS][FT_STATS_COMMANDS];
+static blocked_t blocked[FT_LOCK_KINDS][FT_STATS_COMMANDS][FT_STATS_COMMANDS];   /* by waiting and holding command */
+
+static pthread_mutex_t mutexreport = PTHREAD_MUTEX_INITIALIZER;
+static volatile UINT32_T reportSeconds = 0;
+static int reporter = 0;
+
+#ifdef FT_HAVE_ATOMIC64
+#define ADD64(p,v) FT_ATOMIC_ADD64(p,v)
+#else
+static pthread_mutex_t mutex64 = PTHREAD_MUTEX_INITIALIZER;
+#define ADD64(p,v) do { pthread_mutex_lock(&mutex64); *(p) += (v); pthread_mutex_unlock(&mutex64); } while (0)
+#endif
+
+static UINT64_T load64(volatile UINT64_T *p) {
+	UINT64_T v;
+#ifndef FT_HAVE_ATOMIC64
+	pthread_mutex_lock(&mutex64);
+#endif
+	v = *p;
+#ifndef FT_HAVE_ATOMIC64
+	pthread_mutex_unlock(&mutex64);
+#endif
+	return v;
+}
+
+static void raise_max(volatile UINT32_T *p, UINT64_T ns) {
+	UINT32_T v = (ns > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (UINT32_T) ns;
+	UINT32_T old = FT_ATOMIC_LOAD_RELAXED(p);
+	while (v > old && !FT_ATOMIC_CAS(p, old, v)) old = FT_ATOMIC_LOAD_RELAXED(p);
+}
+
+static int try_lock(ft_stream_t *S, int kind) {
+	switch (kind) {
+		case FT_LOCK_HEADER:     return pthread_mutex_trylock(&S->mutexheader);
+		case FT_LOCK_RING_READ:  return pthread_rwlock_tryrdlock(&S->rwlockring);
+		case FT_LOCK_RING_WRITE: return pthread_rwlock_trywrlock(&S->rwlockring);
+		case FT_LOCK_DATA:       return pthread_mutex_trylock(&S->mutexdata);
+		default:                 return pthread_mutex_trylock(&S->mutexevent);
+	}
+}
+
+static void take_lock(ft_stream_t *S, int kind) {
+	switch (kind) {
+		case FT_LOCK_HEADER:     pthread_mutex_lock(&S->mutexheader); break;
+		case FT_LOCK_RING_READ:  pthread_rwlock_rdlock(&S->rwlockring); break;
+		case FT_LOCK_RING_WRITE: pthread_rwlock_wrlock(&S->rwlockring); break;
+		case FT_LOCK_DATA:       pthread_mutex_lock(&S->mutexdata); break;
+		default:                 pthread_mutex_lock(&S->mutexevent); break;
+	}
+}
+
+UINT64_T ft_stream_lock(ft_stream_t *S, int kind, UINT16_T command) {
+	UINT64_T start, now;
+	UINT32_T c, h = 0;
+	int busy;
+
+	if (!ft_lockstat_active && !ft_trace_active) {
+		take_lock(S, kind);
+		return 0;
+	}
+	busy = (try_lock(S, kind) != 0);
+	start = ft_stats_now();
+	if (busy) {
+		/* whoever took it last, which is the one that has it unless they are readers */
+		h = ft_stats_command_index(S->lockholder[kindLock[kind]]);
+		take_lock(S, kind);
+	}
+	S->lockholder[kindLock[kind]] = command;
+	ft_trace_span(FT_TRACE_LOCK_WAIT, command, start);
+	if (!ft_lockstat_active) return 0;
+
+	c = ft_stats_command_index(command);
+	FT_ATOMIC_ADD(&stats[kind][c].acquired, 1);
+	if (!busy) return start;
+
+	now = ft_stats_now();
+	FT_ATOMIC_ADD(&stats[kind][c].contended, 1);
+	ADD64(&stats[kind][c].wait_ns, now - start);
+	raise_max(&stats[kind][c].max_wait_ns, now - start);
+	FT_ATOMIC_ADD(&blocked[kind][c][h].count, 1);
+	ADD64(&blocked[kind][c][h].ns, now - start);
+	return now;
+}
+
+int ft_stream_trylock(ft_stream_t *S, int kind, UINT16_T command, UINT64_T *held) {
+	*held = 0;
+	if (try_lock(S, kind) != 0) return -1;
+	S->lockholder[kindLock[kind]] = command;
+	if (!ft_lockstat_active) return 0;
+	FT_ATOMIC_ADD(&stats[kind][ft_stats_command_index(command)].acquired, 1);
+	*held = ft_stats_now();
+	return 0;
+}
+
+void ft_stream_unlock(ft_stream_t *S, int kind, UINT16_T command, UINT64_T held) {
+	if (held != 0 && ft_lockstat_active) {
+		lock_stats_t *L = &stats[kind][ft_stats_command_index(command)];
+		UINT64_T ns = ft_stats_now() - held;
+		ADD64(&L->hold_ns, ns);
+		raise_max(&L->max_hold_ns, ns);
+	}
+	switch (kind) {
+		case FT_LOCK_HEADER:     pthread_mutex_unlock(&S->mutexheader); break;
+		case FT_LOCK_RING_READ:
+		case FT_LOCK_RING_WRITE: pthread_rwlock_unlock(&S->rwlockring); break;
+		case FT_LOCK_DATA:       pthread_mutex_unlock(&S->mutexdata); break;
+		default:                 pthread_mutex_unlock(&S->mutexevent); break;
+	}
+}
+
+void ft_lockstat_reset(void) {
+	int k, c, h;
+#ifndef FT_HAVE_ATOMIC64
+	pthread_mutex_lock(&mutex64);
+#endif
+	for (k=0; k<FT_LOCK_KINDS; k++) {
+		for (c=0; c<FT_STATS_COMMANDS; c++) {
+			lock_stats_t *L = &stats[k][c];
+			L->acquired = L->contended = L->max_wait_ns = L->max_hold_ns = 0;
+			L->wait_ns = L->hold_ns = 0;
+			for (h=0; h<FT_STATS_COMMANDS; h++) {
+				blocked[k][c][h].count = 0;
+				blocked[k][c][h].ns = 0;
+			}
+		}
+	}
+#ifndef FT_HAVE_ATOMIC64
+	pthread_mutex_unlock(&mutex64);
+#endif
+}
+
+void ft_lockstat_get(int kind, UINT16_T command, ft_lockstat_t *L) {
+	lock_stats_t *K = &stats[kind][ft_stats_command_index(command)];
+	L->acquired    = FT_ATOMIC_LOAD(&K->acquired);
+	L->contended   = FT_ATOMIC_LOAD(&K->contended);
+	L->wait_ns     = load64(&K->wait_ns);
+	L->hold_ns     = load64(&K->hold_ns);
+	L->max_wait_ns = FT_ATOMIC_LOAD(&K->max_wait_ns);
+	L->max_hold_ns = FT_ATOMIC_LOAD(&K->max_hold_ns);
+}
+
+UINT64_T ft_lockstat_blocked(int kind, UINT16_T command, UINT16_T holder, UINT32_T *count) {
+	blocked_t *B = &blocked[kind][ft_stats_command_index(command)][ft_stats_command_index(holder)];
+	if (count) *count = FT_ATOMIC_LOAD(&B->count);
+	return load64(&B->ns);
+}
+
+/* a time in nanoseconds, in a unit that keeps it short */
+static void print_time(FILE *f, double ns) {
+	if (ns < 1e4)
+		fprintf(f, " %8.0fns", ns);
+	else if (ns < 1e7)
+		fprintf(f, " %8.1fus", ns/1e3);
+	else
+		fprintf(f, " %8.1fms", ns/1e6);
+}
+
+typedef struct {
+	int kind;
+	UINT32_T command, holder, count;
+	UINT64_T ns;
+} wait_row_t;
+
+static int longest_first(const void *a, const void *b) {
+	const wait_row_t *A = (const wait_row_t *) a, *B = (const wait_row_t *) b;
+	if (A->ns != B->ns) return (A->ns < B->ns) ? 1 : -1;
+	return 0;
+}
+
+void ft_lockstat_report(FILE *f) {
+	wait_row_t *row;
+	ft_lockstat_t L;
+	int k, n = 0, i;
+	UINT32_T c, h, count;
+
+	fprintf(f, "%-13s %-17s %9s %9s %10s %10s %10s %10s\n", "lock", "command", "taken", "busy", "wait mean", "wait max", "hold mean", "hold max");
+	for (k=0; k<FT_LOCK_KINDS; k++) {
+		for (c=0; c<FT_STATS_COMMANDS; c++) {
+			ft_lockstat_get(k, ft_stats_command(c), &L);
+			if (L.acquired == 0) continue;
+			fprintf(f, "%-13s %-17s %9u %9u", kindNames[k], command_name(ft_stats_command(c)), L.acquired, L.contended);
+			print_time(f, L.contended ? (double) L.wait_ns / L.contended : 0);
+			print_time(f, L.max_wait_ns);
+			print_time(f, (double) L.hold_ns / L.acquired);
+			print_time(f, L.max_hold_ns);
+			fprintf(f, "\n");
+		}
+	}
+
+	row = (wait_row_t *) malloc(FT_LOCK_KINDS * FT_STATS_COMMANDS * FT_STATS_COMMANDS * sizeof(wait_row_t));
+	if (row == NULL) return;
+	for (k=0; k<FT_LOCK_KINDS; k++) {
+		for (c=0; c<FT_STATS_COMMANDS; c++) {
+			for (h=0; h<FT_STATS_COMMANDS; h++) {
+				UINT64_T ns = ft_lockstat_blocked(k, ft_stats_command(c), ft_stats_command(h), &count);
+				if (count == 0) continue;
+				row[n].kind    = k;
+				row[n].command = c;
+				row[n].holder  = h;
+				row[n].count   = count;
+				row[n].ns      = ns;
+				n++;
+			}
+		}
+	}
+	qsort(row, n, sizeof(wait_row_t), longest_first);
+
+	fprintf(f, "%-13s %-17s %-17s %9s %10s\n", "busy lock", "waiting", "held by", "times", "waited");
+	for (i=0; i<n; i++) {
+		fprintf(f, "%-13s %-17s %-17s %9u", kindNames[row[i].kind], command_name(ft_stats_command(row[i].command)), command_name(ft_stats_command(row[i].holder)), row[i].count);
+		print_time(f, (double) row[i].ns);
+		fprintf(f, "\n");
+	}
+	if (n == 0) fprintf(f, "none\n");
+	fprintf(f, "\n");
+	fflush(f);
+	free(row);
+}
+
+static void *report_periodically(void *arg) {
+	UINT32_T elapsed = 0;
+	for (;;) {
+		UINT32_T seconds = reportSeconds;
+		usleep(100000);
+		if (seconds == 0) {
+			elapsed = 0;
+			continue;
+		}
+		if (++elapsed < 10*seconds) continue;
+		elapsed = 0;
+		if (!ft_lockstat_active) continue;
+		printf("lock statistics of the last %u s\n", seconds);
+		ft_lockstat_report(stdout);
+		ft_lockstat_reset();
+	}
+	return NULL;
+}
+
+int ft_lockstat_enable(UINT32_T seconds) {
+	int err = 0;
+	pthread_mutex_lock(&mutexreport);
+	reportSeconds = seconds;
+	if (seconds > 0 && !reporter) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, report_periodically, NULL) == 0) {
+			pthread_detach(thread);
+			reporter = 1;
+		}
+		else {
+			err = -1;
+		}
+	}
+	pthread_mutex_unlock(&mutexreport);
+	ft_lockstat_active = 1;
+	return err;
+}
+
+void ft_lockstat_disable(void) {
+	ft_lockstat_active = 0;
+	reportSeconds = 0;
+}
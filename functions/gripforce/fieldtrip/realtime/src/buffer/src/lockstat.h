@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+#include <stdio.h>
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Who waits for whom on the locks of the streams.
+
+    The requests take the locks of a stream (see dmarequest.c for their
+    order) through ft_stream_lock and ft_stream_unlock. Once lock statistics
+    are enabled, these keep for each lock and each command how often it was
+    taken, how often it was busy, how long the command waited for it and how
+    long it held it. A lock that is busy is first tried, so taking a free lock
+    costs a clock reading more than before. The stream remembers which command
+    took each of its locks last, and a command that finds a lock busy counts
+    its wait under that one, which shows which requests hold up which others.
+    Readers share rwlockring, so of those only the last one is known.
+
+    The counters are shared by all streams and servers of the process, and
+    are updated with atomic adds, like those of stats.h. ft_lockstat_report
+    prints them, and ft_lockstat_enable can start a thread that does so every
+    so many seconds for the interval since the last time.
+
+    The same calls add the lock waits to the trace (see trace.h).
+**/
+
+#define FT_LOCK_HEADER      0    /* mutexheader */
+#define FT_LOCK_RING_READ   1    /* rwlockring, shared */
+#define FT_LOCK_RING_WRITE  2    /* rwlockring, exclusive */
+#define FT_LOCK_DATA        3    /* mutexdata */
+#define FT_LOCK_EVENT       4    /* mutexevent */
+#define FT_LOCK_KINDS       5
+
+#define FT_STREAM_LOCKS     4    /* the locks themselves, i.e. both ways of taking rwlockring are one */
+
+struct ft_stream;
+
+typedef struct {
+	UINT32_T acquired;      /**< number of times the lock was taken */
+	UINT32_T contended;     /**< of which it was busy */
+	UINT64_T wait_ns;       /**< total time spent waiting for it */
+	UINT64_T hold_ns;       /**< total time it was held */
+	UINT32_T max_wait_ns;
+	UINT32_T max_hold_ns;
+} ft_lockstat_t;
+
+extern volatile int ft_lockstat_active;
+
+/** Takes lock "kind" of stream S for a request of "command". Returns the time
+    at which it got the lock, to be passed to ft_stream_unlock, or 0 if the
+    time is not needed. */
+UINT64_T ft_stream_lock(struct ft_stream *S, int kind, UINT16_T command);
+void ft_stream_unlock(struct ft_stream *S, int kind, UINT16_T command, UINT64_T held);
+
+/** Like ft_stream_lock, but gives up if the lock is busy. Returns 0 if it got
+    the lock, with the time for ft_stream_unlock in *held, and -1 otherwise. */
+int ft_stream_trylock(struct ft_stream *S, int kind, UINT16_T command, UINT64_T *held);
+
+/** Starts counting, and if seconds > 0, prints and resets the counters on
+    stdout every so many seconds. Returns 0 on success, -1 on error. */
+int ft_lockstat_enable(UINT32_T seconds);
+
+/** Stops counting, the counters keep their values */
+void ft_lockstat_disable(void);
+
+/** Sets all counters back to zero */
+void ft_lockstat_reset(void);
+
+/** The counters of one lock for one command */
+void ft_lockstat_get(int kind, UINT16_T command, ft_lockstat_t *L);
+
+/** The time that "command" waited for lock "kind" while "holder" had it,
+    and in *count, how often that happened */
+UINT64_T ft_lockstat_blocked(int kind, UINT16_T command, UINT16_T holder, UINT32_T *count);
+
+/** Prints the counters of all locks and commands that have been seen, and
+    the waits by the command that held the lock, the longest first */
+void ft_lockstat_report(FILE *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
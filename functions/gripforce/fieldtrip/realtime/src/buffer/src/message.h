@@ -84,6 +84,8 @@ typedef uint64_t UINT64_T;
 #define GET_EVT    (UINT16_T)0x0203 /* decimal 515 */
 #define GET_OK     (UINT16_T)0x0204 /* decimal 516 */
 #define GET_ERR    (UINT16_T)0x0205 /* decimal 517 */
+#define GET_EVT_QUERY (UINT16_T)0x0206 /* decimal 518, see eventquerydef_t */
+#define GET_DAT_DECIMATED (UINT16_T)0x0207 /* decimal 519, see decimatedsel_t */
 
 #define FLUSH_HDR  (UINT16_T)0x0301 /* decimal 769 */
 #define FLUSH_DAT  (UINT16_T)0x0302 /* decimal 770 */
@@ -95,6 +97,35 @@ typedef uint64_t UINT64_T;
 #define WAIT_OK    (UINT16_T)0x0404 /* decimal 1027 */
 #define WAIT_ERR   (UINT16_T)0x0405 /* decimal 1028 */
 
+#define OPEN_STREAM (UINT16_T)0x0501 /* decimal 1281, buf contains the stream name */
+#define OPEN_OK    (UINT16_T)0x0504 /* decimal 1284 */
+#define OPEN_ERR   (UINT16_T)0x0505 /* decimal 1285 */
+
+#define SET_ENCODING (UINT16_T)0x0601 /* decimal 1537, buf contains the FT_ENCODING_* as a UINT32_T */
+#define ENCODING_OK  (UINT16_T)0x0604 /* decimal 1540 */
+#define ENCODING_ERR (UINT16_T)0x0605 /* decimal 1541 */
+
+#define BATCH      (UINT16_T)0x0701 /* decimal 1793, buf contains several requests, see batch.h */
+#define BATCH_OK   (UINT16_T)0x0704 /* decimal 1796, buf contains their responses */
+#define BATCH_ERR  (UINT16_T)0x0705 /* decimal 1797 */
+
+#define SUBSCRIBE_DAT    (UINT16_T)0x0801 /* decimal 2049, see subscribedef_t and subscribe.h */
+#define SUBSCRIBE_CREDIT (UINT16_T)0x0802 /* decimal 2050, buf contains the number of pushes as a UINT32_T, not answered */
+#define UNSUBSCRIBE      (UINT16_T)0x0803 /* decimal 2051 */
+#define SUBSCRIBE_OK     (UINT16_T)0x0804 /* decimal 2052 */
+#define SUBSCRIBE_ERR    (UINT16_T)0x0805 /* decimal 2053, also pushed when a subscription ends */
+#define PUSH_DAT         (UINT16_T)0x0806 /* decimal 2054, buf contains a datasel_t, datadef_t and the samples */
+#define PUSH_EVT         (UINT16_T)0x0807 /* decimal 2055, buf contains an eventsel_t and the events */
+
+#define ADD_DETECTOR    (UINT16_T)0x0901 /* decimal 2305, see detectordef_t and detect.h */
+#define CLEAR_DETECTORS (UINT16_T)0x0902 /* decimal 2306 */
+#define DETECTOR_OK     (UINT16_T)0x0904 /* decimal 2308, buf contains the number of the new detector as a UINT32_T */
+#define DETECTOR_ERR    (UINT16_T)0x0905 /* decimal 2309 */
+
+#define GET_STATS  (UINT16_T)0x0A01 /* decimal 2561, buf is empty or contains FT_STATS_* flags as a UINT32_T, see stats.h */
+#define STATS_OK   (UINT16_T)0x0A04 /* decimal 2564, buf contains a statsdef_t and a statscmd_t per command */
+#define STATS_ERR  (UINT16_T)0x0A05 /* decimal 2565 */
+
 /* these are used in the data_t and event_t structure */
 #define DATATYPE_CHAR    (UINT32_T)0
 #define DATATYPE_UINT8   (UINT32_T)1
@@ -112,7 +143,26 @@ typedef uint64_t UINT64_T;
 */
 #define DATATYPE_UNKNOWN (UINT32_T)0xFFFFFFFF
 
-/* these are used in the specification of the event selection criteria */
+/*
+  after SET_ENCODING, this is added to the data_type of a datadef_t whose samples are encoded (see compress.h),
+  and its bufsize is the size of the encoded samples
+*/
+#define DATATYPE_ENCODED (UINT32_T)0x00010000
+
+/* these are the encodings that a connection can ask for with SET_ENCODING */
+#define FT_ENCODING_NONE  0
+#define FT_ENCODING_DELTA 1   /* per channel difference with the previous sample, zig-zag, bit-packed in blocks; integer types only */
+
+/* these are the operations of a detector, see detectordef_t */
+#define FT_DETECT_MEAN       1    /* mean over the window */
+#define FT_DETECT_DERIVATIVE 2    /* change of that mean per second */
+#define FT_DETECT_RMS        3    /* root mean square over the window */
+
+/* and the crossings of its threshold that it reports, or both */
+#define FT_DETECT_RISING  1
+#define FT_DETECT_FALLING 2
+
+/* these are used in the specification of the event selection criteria, see eventquerydef_t */
 #define EVENTSEL_TYPE   1
 #define EVENTSEL_VALUE  2
 #define EVENTSEL_SAMPLE 3     /* for an exact match */
@@ -170,7 +220,12 @@ enum {
     FT_CHUNK_NEUROMAG_ISOTRAK = 9,
 
     /** FT_CHUNK_NEUROMAG_HPIRESULT contains a .fif file as written by the Neuromag MEG acquisition software (binary) */
-    FT_CHUNK_NEUROMAG_HPIRESULT = 10
+    FT_CHUNK_NEUROMAG_HPIRESULT = 10,
+
+    /** FT_CHUNK_BUFFER_CAPACITY contains a capacitydef_t that asks the buffer server for a specific
+        size of the data and event ring. The server fills in the capacity it actually allocated, so
+        clients can read it back with GET_HDR.   */
+    FT_CHUNK_BUFFER_CAPACITY = 11
 };
 
 #pragma pack(push,1)
@@ -242,6 +297,57 @@ typedef struct {
     UINT32_T endevent;
 } eventsel_t;
 
+/* a GET_EVT_QUERY request contains one or more criteria, which all have to match.
+   Each criterion is an eventquerydef_t followed by bufsize bytes, which are
+   - for EVENTSEL_TYPE and EVENTSEL_VALUE: a UINT32_T data type followed by the
+     elements, which are compared byte for byte with the type or value of the event
+   - for EVENTSEL_SAMPLE, EVENTSEL_MINSAMPLE and EVENTSEL_MAXSAMPLE: one INT32_T
+   The response is the same as for GET_EVT, with the matching events in the order
+   in which they were put into the buffer. */
+typedef struct {
+    UINT32_T what;        /* one of EVENTSEL_* */
+    UINT32_T bufsize;     /* size of the argument that follows */
+} eventquerydef_t;
+
+/* a GET_DAT request can ask for some of the channels, and for another type of the
+   samples, by following the datasel_t with a channelseldef_t and bufsize bytes, which are
+   - for CHANSEL_INDEX: nchans UINT32_T channel numbers, starting at 0
+   - for CHANSEL_LABEL: nchans 0-terminated names, as in FT_CHUNK_CHANNEL_NAMES
+   The response is the same as for GET_DAT, with the datadef_t describing the selected
+   channels and the requested type. Older servers ignore the selection, which clients
+   can tell from the datadef_t in the response. */
+#define CHANSEL_INDEX 1
+#define CHANSEL_LABEL 2
+
+typedef struct {
+    UINT32_T what;        /* CHANSEL_INDEX or CHANSEL_LABEL */
+    UINT32_T nchans;      /* number of selected channels, 0 for all of them */
+    UINT32_T data_type;   /* type of the samples in the response, DATATYPE_UNKNOWN for the stored type */
+    UINT32_T bufsize;     /* size of the list of channels that follows */
+} channelseldef_t;
+
+/* a GET_DAT_DECIMATED request contains a decimatedsel_t, and asks for an overview of
+   the selected samples in at least "width" points. The server answers from the coarsest
+   level of its min/max/mean pyramid that has that many bins in the selection (or from
+   the samples themselves for short selections), with a decimateddef_t followed by nbins
+   bins. Each bin consists of nchans minima, nchans maxima and nchans means, and bin i
+   covers samples begsample + i*factor ... begsample + (i+1)*factor - 1. Only complete
+   bins are returned, and selections that start before the oldest bin are shortened. */
+typedef struct {
+    UINT32_T begsample;
+    UINT32_T endsample;   /* -1 for the last sample */
+    UINT32_T width;       /* number of points that will be shown, e.g. pixels */
+} decimatedsel_t;
+
+typedef struct {
+    UINT32_T nchans;
+    UINT32_T nbins;
+    UINT32_T factor;      /* number of samples per bin, 1 if these are the samples themselves */
+    UINT32_T begsample;   /* first sample of the first bin */
+    UINT32_T data_type;   /* type of the minima, maxima and means, always DATATYPE_FLOAT32 */
+    UINT32_T bufsize;     /* size of the bins that follow */
+} decimateddef_t;
+
 typedef struct {
     UINT32_T nsamples;
     UINT32_T nevents;
@@ -252,6 +358,55 @@ typedef struct {
     UINT32_T milliseconds;
 } waitdef_t;
 
+/* the request of SUBSCRIBE_DAT, optionally followed by a channelseldef_t as in GET_DAT */
+typedef struct {
+    INT32_T  begsample;     /* first sample to push, or -1 for the first new one */
+    INT32_T  begevent;      /* first event to push, or -1 for the first new one */
+    UINT32_T blocksize;     /* push at most this many samples at once, and wait for as many */
+    UINT32_T milliseconds;  /* ... but not longer than this after the first of them came in */
+    UINT32_T credit;        /* number of pushes the client can take before it grants more */
+} subscribedef_t;
+
+/* the request of ADD_DETECTOR, followed by bufsize characters with the type of its events */
+typedef struct {
+    FLOAT64_T threshold;
+    UINT32_T  channel;
+    UINT32_T  operation;    /* FT_DETECT_MEAN, FT_DETECT_DERIVATIVE or FT_DETECT_RMS */
+    UINT32_T  window;       /* in samples */
+    UINT32_T  edge;         /* FT_DETECT_RISING, FT_DETECT_FALLING, or both */
+    UINT32_T  holdoff;      /* no other event for this many samples after one */
+    UINT32_T  bufsize;
+} detectordef_t;
+
+/* the response of GET_STATS: the numbers of the ring of the current stream, and of
+   the requests that the servers of this process handled, see stats.h */
+typedef struct {
+    UINT32_T ncommands;     /* number of statscmd_t that follow */
+    UINT32_T nbuckets;      /* number of service time buckets that follow each statscmd_t */
+    UINT32_T capacity;      /* samples the ring can hold, 0 if there is no header */
+    UINT32_T nsamples;      /* samples that were written into it */
+    UINT32_T first;         /* the oldest sample that is still in it */
+    UINT32_T pinwaits;      /* times the writer had to wait for a reader that sends from the ring */
+    UINT32_T overruns;      /* GET_DAT requests for samples that had been overwritten */
+    UINT32_T bufsize;       /* size of the statscmd_t and buckets that follow */
+} statsdef_t;
+
+typedef struct {
+    UINT32_T command;       /* e.g. GET_DAT, or 0 for all commands that are not listed on their own */
+    UINT32_T count;         /* number of requests */
+    UINT64_T bytes_in;      /* size of the requests, including their messagedef_t */
+    UINT64_T bytes_out;     /* size of the responses */
+    UINT64_T total_ns;      /* sum of the service times, in nanoseconds */
+} statscmd_t;
+
+/* the capacity definition is used in FT_CHUNK_BUFFER_CAPACITY, a value of 0 means "use the server default" */
+typedef struct {
+    UINT64_T  nbytes;   /* size of the data ring in bytes */
+    FLOAT32_T seconds;  /* length of the data ring in seconds, given the sampling rate in the header */
+    UINT32_T  nsamples; /* length of the data ring in samples, takes precedence over seconds and nbytes */
+    UINT32_T  nevents;  /* number of events that are kept */
+} capacitydef_t;
+
 typedef struct {
     UINT32_T type;      /* One of FT_CHUNK_** (see above) */
     UINT32_T size;      /* Size of chunk.data, total size is given by adding sizeof(ft_chunkdef_t)=8 */
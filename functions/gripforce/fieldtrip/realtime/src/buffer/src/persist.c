@@ -0,0 +1,373 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "stream.h"
+#include "persist.h"
+#include "pyramid.h"
+#include "detect.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#endif
+
+#define FT_PERSIST_MAGIC        0x46544246   /* "FTBF" */
+#define FT_PERSIST_PATH_LENGTH  512
+
+#ifndef WIN32
+
+/* the session file of one stream, while its ring or event log are in use */
+struct ft_persist_file {
+	char          path[FT_PERSIST_PATH_LENGTH];
+	char          *base;
+	size_t        size;
+	ft_ring_t     *ring;     /* NULL once released */
+	ft_eventlog_t *event;    /* NULL once released */
+};
+
+static char directory[FT_PERSIST_PATH_LENGTH - FT_STREAM_NAME_LENGTH - 32];
+static int enabled = 0;
+
+/* FNV-1a over everything in front of the checksum */
+static UINT32_T checksum(const ft_persist_super_t *sb) {
+	const unsigned char *p = (const unsigned char *) sb;
+	UINT32_T h = 2166136261u;
+	size_t i;
+	for (i=0; i<offsetof(ft_persist_super_t, checksum); i++) h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+static UINT64_T align(UINT64_T n) {
+	return (n + FT_PERSIST_ALIGN - 1) & ~((UINT64_T) FT_PERSIST_ALIGN - 1);
+}
+
+/* path of the session file of a stream, fails for streams whose name contains a slash */
+static int session_path(const char *stream, char *path) {
+	int n;
+	if (stream[0] == 0) {
+		n = snprintf(path, FT_PERSIST_PATH_LENGTH, "%s/buffer%s", directory, FT_PERSIST_SUFFIX);
+	} else {
+		if (strchr(stream, '/') != NULL) return -1;
+		n = snprintf(path, FT_PERSIST_PATH_LENGTH, "%s/buffer@%s%s", directory, stream, FT_PERSIST_SUFFIX);
+	}
+	return (n > 0 && n < FT_PERSIST_PATH_LENGTH) ? 0 : -1;
+}
+
+static int session_name(const char *name) {
+	size_t len = strlen(name), n = strlen(FT_PERSIST_SUFFIX);
+	if (strncmp(name, "buffer", 6) != 0 || (name[6] != '.' && name[6] != '@')) return 0;
+	return len > n && strcmp(name + len - n, FT_PERSIST_SUFFIX) == 0;
+}
+
+static int valid_super(const ft_persist_super_t *sb) {
+	if (sb->magic != FT_PERSIST_MAGIC || sb->version != FT_PERSIST_VERSION || sb->checksum != checksum(sb)) return 0;
+	if (sb->capacity == 0 || sb->chansize == 0 || sb->maxevents == 0 || sb->maxbytes == 0) return 0;
+	if (memchr(sb->stream, 0, sizeof(sb->stream)) == NULL || strlen(sb->stream) > FT_STREAM_NAME_LENGTH) return 0;
+	/* the layout is what ft_persist_create would have made of it */
+	return sb->header_size >= sizeof(headerdef_t)
+		&& sb->ring_offset  == align(sb->header_offset + sb->header_size)
+		&& sb->event_offset == align(sb->ring_offset + FT_PERSIST_ALIGN + (UINT64_T) sb->capacity * sb->chansize)
+		&& sb->index_offset == sb->event_offset + FT_PERSIST_ALIGN
+		&& sb->arena_offset == align(sb->index_offset + (UINT64_T) sb->maxevents * sizeof(UINT64_T))
+		&& sb->size == align(sb->arena_offset + sb->maxbytes)
+		&& sb->header_offset == FT_PERSIST_ALIGN
+		&& (size_t) sb->size == sb->size;
+}
+
+/* a block of samples that was being written when the server died is zeroed and
+   published, and a reset that was going on is finished */
+static void recover_ring(ft_ring_t *R) {
+	UINT32_T s = R->commit, end = R->head;
+
+	memset((void *) R->pin, 0, sizeof(R->pin));
+	memset((void *) R->parked, 0, sizeof(R->parked));
+	if (end < s || end - s > R->capacity) {
+		R->commit = R->head = R->reserved = (end < s) ? end : s;
+		return;
+	}
+	while (s < end) {
+		UINT32_T start = s % R->capacity;
+		UINT32_T n = R->capacity - start;
+		if (n > end - s) n = end - s;
+		memset(R->buf + (size_t) start * R->chansize, 0, (size_t) n * R->chansize);
+		s += n;
+	}
+	R->commit = R->reserved = end;
+}
+
+/* maps a session file and makes it the contents of its stream, returns 0 or -1 */
+static int restore(const char *path) {
+	ft_persist_super_t sb;
+	struct ft_persist_file *F;
+	struct stat st;
+	ft_stream_t *S;
+	ft_ring_t *R;
+	ft_eventlog_t *L;
+	headerdef_t *hdef;
+	char *base, *evbuf = NULL;
+	UINT64_T evsize = 0;
+	UINT32_T k, dropped;
+	int fd, result = -1;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0) return -1;
+	if (pread(fd, &sb, sizeof(sb), 0) != sizeof(sb) || !valid_super(&sb) || fstat(fd, &st) != 0 || (UINT64_T) st.st_size != sb.size) {
+		fprintf(stderr, "ft_persist: %s is not a complete session file, ignoring it\n", path);
+		close(fd);
+		return -1;
+	}
+	base = (char *) mmap(NULL, (size_t) sb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("ft_persist: mmap");
+		return -1;
+	}
+
+	hdef = (headerdef_t *) (base + sb.header_offset);
+	R = (ft_ring_t *) (base + sb.ring_offset);
+	L = (ft_eventlog_t *) (base + sb.event_offset);
+	S = ft_find_stream(sb.stream, (UINT32_T) strlen(sb.stream), 1);
+	F = (struct ft_persist_file *) malloc(sizeof(struct ft_persist_file));
+
+	if (S == NULL || F == NULL || sizeof(headerdef_t) + hdef->bufsize != sb.header_size
+			|| R->capacity != sb.capacity || R->chansize != sb.chansize
+			|| L->maxevents != sb.maxevents || L->maxbytes != sb.maxbytes) {
+		fprintf(stderr, "ft_persist: cannot restore %s\n", path);
+		FREE(F);
+		munmap(base, (size_t) sb.size);
+		return -1;
+	}
+
+	pthread_mutex_lock(&S->mutexheader);
+	pthread_rwlock_wrlock(&S->rwlockring);
+	pthread_mutex_lock(&S->mutexdata);
+	pthread_mutex_lock(&S->mutexevent);
+
+	if (S->header != NULL) {
+		fprintf(stderr, "ft_persist: stream '%s' already has a header, not restoring %s\n", sb.stream, path);
+		FREE(F);
+		munmap(base, (size_t) sb.size);
+		goto unlock;
+	}
+
+	S->header = (header_t *) malloc(sizeof(header_t));
+	DIE_BAD_MALLOC(S->header);
+	S->header->def = (headerdef_t *) malloc(sizeof(headerdef_t));
+	DIE_BAD_MALLOC(S->header->def);
+	S->header->buf = malloc(hdef->bufsize);
+	DIE_BAD_MALLOC(S->header->buf);
+	memcpy(S->header->def, hdef, sizeof(headerdef_t));
+	memcpy(S->header->buf, hdef+1, hdef->bufsize);
+
+	/* the pointers in there belong to the process that died */
+	R->buf = base + sb.ring_offset + FT_PERSIST_ALIGN;
+	recover_ring(R);
+	dropped = ft_eventlog_recover(L, base + sb.arena_offset, (UINT64_T *) (base + sb.index_offset));
+	if (dropped > 0) fprintf(stderr, "ft_persist: dropped %u events from %s that were not intact\n", dropped, path);
+
+	/* the event index is not in the file, but quickly rebuilt */
+	ft_eventindex_init(&S->eventindex);
+	for (k=L->first; k<L->count; k++) {
+		UINT64_T size = ft_eventlog_range_size(L, k, 1);
+		if (size > evsize) {
+			char *p = (char *) realloc(evbuf, (size_t) size);
+			if (p == NULL) break;
+			evbuf = p;
+			evsize = size;
+		}
+		ft_eventlog_read(L, k, 1, evbuf);
+		if (ft_eventindex_add(&S->eventindex, L, k, (eventdef_t *) evbuf, evbuf + sizeof(eventdef_t)) != 0) break;
+	}
+	FREE(evbuf);
+
+	strcpy(F->path, path);
+	F->base  = base;
+	F->size  = (size_t) sb.size;
+	F->ring  = R;
+	F->event = L;
+	S->persist = F;
+	S->data  = R;
+	S->event = L;
+	S->header->def->nsamples = ft_ring_count(R);
+	S->header->def->nevents  = L->count;
+	ft_waitreg_reset(&S->waiters, S->header->def->nsamples, S->header->def->nevents);
+	/* the overview for GET_DAT_DECIMATED is not in the file either, it is filled in from the ring when it is first needed */
+	ft_pyramid_create(S);
+	ft_detect_reset(S);
+	result = 0;
+
+unlock:
+	pthread_mutex_unlock(&S->mutexevent);
+	pthread_mutex_unlock(&S->mutexdata);
+	pthread_rwlock_unlock(&S->rwlockring);
+	pthread_mutex_unlock(&S->mutexheader);
+	return result;
+}
+
+/* unmaps the file once neither the ring nor the event log is in use anymore */
+static void release(ft_stream_t *S) {
+	struct ft_persist_file *F = S->persist;
+	if (F->ring != NULL || F->event != NULL) return;
+	munmap(F->base, F->size);
+	FREE(S->persist);
+}
+
+/*****************************************************************************/
+
+int ft_persist_enable(const char *dir) {
+	char path[FT_PERSIST_PATH_LENGTH];
+	struct dirent *entry;
+	DIR *D;
+	int n = 0;
+
+	if (strlen(dir) == 0 || strlen(dir) >= sizeof(directory)) {
+		fprintf(stderr, "ft_persist: invalid directory '%s'\n", dir);
+		return -1;
+	}
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+		perror("ft_persist: mkdir");
+		return -1;
+	}
+	D = opendir(dir);
+	if (D == NULL) {
+		perror("ft_persist: opendir");
+		return -1;
+	}
+	strcpy(directory, dir);
+
+	while ((entry = readdir(D)) != NULL) {
+		if (!session_name(entry->d_name)) continue;
+		if (snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name) >= (int) sizeof(path)) continue;
+		if (restore(path) == 0) n++;
+	}
+	closedir(D);
+	enabled = 1;
+	return n;
+}
+
+int ft_persist_create(ft_stream_t *S, UINT32_T capacity, UINT32_T chansize, UINT32_T maxevents) {
+	ft_persist_super_t sb;
+	struct ft_persist_file *F;
+	char path[FT_PERSIST_PATH_LENGTH], temp[FT_PERSIST_PATH_LENGTH];
+	ft_ring_t *R;
+	ft_eventlog_t *L;
+	char *base;
+	int fd;
+
+	if (!enabled || S->header == NULL || S->persist != NULL) return -1;
+	if (session_path(S->name, path) != 0 || snprintf(temp, sizeof(temp), "%s.new", path) >= (int) sizeof(temp)) return -1;
+
+	memset(&sb, 0, sizeof(sb));
+	sb.magic         = FT_PERSIST_MAGIC;
+	sb.version       = FT_PERSIST_VERSION;
+	sb.capacity      = capacity;
+	sb.chansize      = chansize;
+	sb.maxevents     = (maxevents > 0) ? maxevents : 1;
+	sb.maxbytes      = ft_eventlog_default_bytes(sb.maxevents);
+	sb.header_offset = FT_PERSIST_ALIGN;
+	sb.header_size   = sizeof(headerdef_t) + S->header->def->bufsize;
+	sb.ring_offset   = align(sb.header_offset + sb.header_size);
+	sb.event_offset  = align(sb.ring_offset + FT_PERSIST_ALIGN + (UINT64_T) capacity * chansize);
+	sb.index_offset  = sb.event_offset + FT_PERSIST_ALIGN;
+	sb.arena_offset  = align(sb.index_offset + (UINT64_T) sb.maxevents * sizeof(UINT64_T));
+	sb.size          = align(sb.arena_offset + sb.maxbytes);
+	strcpy(sb.stream, S->name);
+	sb.checksum      = checksum(&sb);
+	if ((size_t) sb.size != sb.size) return -1;
+
+	/* whatever happens, the previous session of this stream is over */
+	unlink(path);
+
+	fd = open(temp, O_CREAT | O_TRUNC | O_RDWR, 0600);
+	if (fd < 0) {
+		perror("ft_persist: open");
+		return -1;
+	}
+	/* reserve the disk space now, touching pages that do not fit would raise SIGBUS later */
+	if (ftruncate(fd, (off_t) sb.size) != 0 || posix_fallocate(fd, 0, (off_t) sb.size) != 0) {
+		fprintf(stderr, "ft_persist: cannot allocate %lu bytes for %s, keeping the stream in memory\n", (unsigned long) sb.size, path);
+		close(fd);
+		unlink(temp);
+		return -1;
+	}
+	base = (char *) mmap(NULL, (size_t) sb.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("ft_persist: mmap");
+		unlink(temp);
+		return -1;
+	}
+
+	memcpy(base + sb.header_offset, S->header->def, sizeof(headerdef_t));
+	memcpy(base + sb.header_offset + sizeof(headerdef_t), S->header->buf, S->header->def->bufsize);
+	R = (ft_ring_t *) (base + sb.ring_offset);
+	L = (ft_eventlog_t *) (base + sb.event_offset);
+	ft_ring_attach(R, base + sb.ring_offset + FT_PERSIST_ALIGN, capacity, chansize);
+	ft_eventlog_attach(L, base + sb.arena_offset, (UINT64_T *) (base + sb.index_offset), sb.maxevents, sb.maxbytes);
+	memcpy(base, &sb, sizeof(sb));
+
+	/* only complete files get the name that ft_persist_enable looks for */
+	F = (struct ft_persist_file *) malloc(sizeof(struct ft_persist_file));
+	if (F == NULL || msync(base, (size_t) sb.ring_offset + FT_PERSIST_ALIGN, MS_SYNC) != 0 || rename(temp, path) != 0) {
+		perror("ft_persist: cannot create session file");
+		FREE(F);
+		munmap(base, (size_t) sb.size);
+		unlink(temp);
+		return -1;
+	}
+
+	strcpy(F->path, path);
+	F->base  = base;
+	F->size  = (size_t) sb.size;
+	F->ring  = R;
+	F->event = L;
+	S->persist = F;
+	S->data  = R;
+	S->event = L;
+	ft_eventindex_init(&S->eventindex);
+	return 0;
+}
+
+int ft_persist_ring_free(ft_stream_t *S) {
+	struct ft_persist_file *F = S->persist;
+	if (F == NULL || F->ring == NULL || F->ring != S->data) return 0;
+	F->ring = NULL;
+	S->data = NULL;
+	release(S);
+	return 1;
+}
+
+int ft_persist_eventlog_free(ft_stream_t *S) {
+	struct ft_persist_file *F = S->persist;
+	if (F == NULL || F->event == NULL || F->event != S->event) return 0;
+	F->event = NULL;
+	S->event = NULL;
+	release(S);
+	return 1;
+}
+
+void ft_persist_remove(ft_stream_t *S) {
+	if (S->persist != NULL) unlink(S->persist->path);
+}
+
+#else
+
+int  ft_persist_enable(const char *directory) { return -1; }
+int  ft_persist_create(ft_stream_t *S, UINT32_T capacity, UINT32_T chansize, UINT32_T maxevents) { return -1; }
+int  ft_persist_ring_free(ft_stream_t *S) { return 0; }
+int  ft_persist_eventlog_free(ft_stream_t *S) { return 0; }
+void ft_persist_remove(ft_stream_t *S) {}
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_PERSIST_SUFFIX   ".ftb"    /* session files are called buffer.ftb and buffer@stream.ftb */
+#define FT_PERSIST_ALIGN    4096      /* all parts of a session file start at a multiple of this */
+#define FT_PERSIST_VERSION  1
+
+/** Crash-persistent sessions.
+
+    Normally the header, the data ring and the event log only live in the
+    memory of the server process, so everything that was not saved by a
+    client is gone when the process dies. A server that calls
+    ft_persist_enable instead keeps each stream in a file of its own in the
+    given directory, which is mapped into memory with MAP_SHARED. Since the
+    kernel owns the pages of such a mapping, whatever the server wrote to it
+    survives the server process, even when it is killed.
+
+    A session file starts with a superblock that describes where the header,
+    the ring (an ft_ring_t followed by the samples) and the event log (an
+    ft_eventlog_t, its index and its arena) are. The superblock never changes
+    after PUT_HDR, and the file only gets its final name once it is complete,
+    so a session file is either valid or absent. The counters of the ring and
+    the event log are updated in place like in memory: after a crash, a block
+    of samples that was being written is zeroed and published like an
+    aborted PUT_DAT (see zerocopy.h), and an event that was being appended is
+    dropped.
+
+    When the server is started again, ft_persist_enable maps all session
+    files in the directory, repairs the counters and rebuilds the event
+    index. This does not read the samples, so it takes about the same time
+    for a ring of any size, and clients continue with the same sample and
+    event numbers as if nothing happened. FLUSH_HDR removes the file.
+
+    Note that this protects against the death of the server process, not of
+    the machine: pages that the kernel did not write back yet are lost in a
+    power failure. Streams whose ring lives in a session file are not
+    exported through shared memory (see shm.h).
+*/
+typedef struct {
+	UINT32_T magic;
+	UINT32_T version;
+	UINT32_T capacity;          /**< number of samples in the ring */
+	UINT32_T chansize;          /**< bytes per sample */
+	UINT32_T maxevents;
+	UINT32_T reserved;
+	UINT64_T maxbytes;          /**< size of the event arena */
+	UINT64_T size;              /**< size of the whole file */
+	UINT64_T header_offset;     /**< headerdef_t followed by the chunks */
+	UINT64_T header_size;
+	UINT64_T ring_offset;       /**< ft_ring_t, the samples follow at ring_offset + FT_PERSIST_ALIGN */
+	UINT64_T event_offset;      /**< ft_eventlog_t */
+	UINT64_T index_offset;      /**< maxevents x UINT64_T */
+	UINT64_T arena_offset;      /**< maxbytes */
+	char     stream[68];        /**< name of the stream (0-terminated), empty for the default stream */
+	UINT32_T checksum;          /**< over all of the above */
+} ft_persist_super_t;
+
+struct ft_stream;
+
+/** Keeps all streams in session files in the given directory from now on,
+    after restoring the sessions that are in there already. Returns the
+    number of streams that were restored, or -1 if the directory cannot be
+    used or persistence is not supported on this platform.
+*/
+int  ft_persist_enable(const char *directory);
+
+/** Creates the session file for stream S, whose header has just been put,
+    and sets up its ring and event log in there. Returns 0 on success, or -1
+    if persistence is not enabled or the file cannot be created, in which
+    case the caller should allocate them as usual. The caller needs to hold
+    all locks of the stream.
+*/
+int  ft_persist_create(struct ft_stream *S, UINT32_T capacity, UINT32_T chansize, UINT32_T maxevents);
+
+/** Release the ring or event log of stream S if they live in a session
+    file and return 1, otherwise return 0. The file is unmapped when both
+    are released, but it stays where it is.
+*/
+int  ft_persist_ring_free(struct ft_stream *S);
+int  ft_persist_eventlog_free(struct ft_stream *S);
+
+/** Removes the session file of stream S, e.g. after FLUSH_HDR */
+void ft_persist_remove(struct ft_stream *S);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PERSIST_H */
@@ -16,6 +16,7 @@
     #include <sys/types.h>
     #include <sys/socket.h>
     #include <sys/un.h>
+    #include <sys/uio.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <netdb.h>
@@ -33,6 +34,7 @@
     #include <sys/types.h>
     #include <sys/socket.h>
     #include <sys/un.h>
+    #include <sys/uio.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
     #include <netdb.h>
@@ -116,6 +118,7 @@
     //  #include <windows.h>
     #include <sys/socket.h>
     #include <sys/un.h>
+    #include <sys/uio.h>
     #include <netinet/in.h>
     #include <netinet/ip.h>
     #include <unistd.h>  /* for close() */
@@ -10,6 +10,28 @@
 
 #include "message.h"
 
+static const struct {
+	UINT16_T command;
+	const char *name;
+} commandNames[] = {
+	{PUT_HDR, "PUT_HDR"}, {PUT_DAT, "PUT_DAT"}, {PUT_EVT, "PUT_EVT"},
+	{GET_HDR, "GET_HDR"}, {GET_DAT, "GET_DAT"}, {GET_EVT, "GET_EVT"},
+	{GET_EVT_QUERY, "GET_EVT_QUERY"}, {GET_DAT_DECIMATED, "GET_DAT_DECIMATED"},
+	{FLUSH_HDR, "FLUSH_HDR"}, {FLUSH_DAT, "FLUSH_DAT"}, {FLUSH_EVT, "FLUSH_EVT"},
+	{WAIT_DAT, "WAIT_DAT"}, {OPEN_STREAM, "OPEN_STREAM"}, {SET_ENCODING, "SET_ENCODING"},
+	{BATCH, "BATCH"}, {SUBSCRIBE_DAT, "SUBSCRIBE_DAT"}, {SUBSCRIBE_CREDIT, "SUBSCRIBE_CREDIT"},
+	{UNSUBSCRIBE, "UNSUBSCRIBE"}, {PUSH_DAT, "PUSH_DAT"}, {PUSH_EVT, "PUSH_EVT"},
+	{ADD_DETECTOR, "ADD_DETECTOR"}, {CLEAR_DETECTORS, "CLEAR_DETECTORS"}, {GET_STATS, "GET_STATS"}
+};
+
+const char *command_name(UINT16_T command) {
+	unsigned int i;
+	for (i=0; i<sizeof(commandNames)/sizeof(commandNames[0]); i++) {
+		if (commandNames[i].command == command) return commandNames[i].name;
+	}
+	return "other";
+}
+
 void print_request(messagedef_t *request) {
 	fprintf(stderr, "request.version = 0x%04x\n", request->version);
 	fprintf(stderr, "request.command = 0x%04x\n", request->command);
@@ -20,6 +20,9 @@ void print_datasel(datasel_t *);
 void print_eventsel(eventsel_t *);
 void print_buf(void *, int);
 
+/* the name of a request, e.g. "GET_DAT", or "other" */
+const char *command_name(UINT16_T command);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "stream.h"
+#include "pyramid.h"
+
+typedef struct {
+	UINT32_T  factor;     /* number of samples per bin */
+	UINT32_T  capacity;   /* number of bins that are kept */
+	UINT32_T  first;      /* oldest bin that is kept, bin b covers samples b*factor ... (b+1)*factor-1 */
+	UINT32_T  next;       /* bin that is being filled */
+	UINT32_T  fill;       /* number of samples, or bins of the level below, in that bin */
+	FLOAT32_T *bins;      /* capacity bins of nchans minima, maxima and means */
+	double    *min;       /* the bin that is being filled */
+	double    *max;
+	double    *sum;
+} pyramid_level_t;
+
+struct ft_pyramid {
+	pthread_mutex_t lock;       /* protects the bins while they are copied */
+	UINT32_T        nchans;
+	UINT32_T        data_type;
+	UINT32_T        done;       /* all samples before this one have been added */
+	pyramid_level_t level[FT_PYRAMID_LEVELS];
+};
+
+static void reset_bin(pyramid_level_t *L, UINT32_T nchans) {
+	UINT32_T c;
+	for (c=0; c<nchans; c++) {
+		L->min[c] =  DBL_MAX;
+		L->max[c] = -DBL_MAX;
+		L->sum[c] = 0;
+	}
+	L->fill = 0;
+}
+
+/* stores the bin that is being filled on level l, and adds it to the level above */
+static void finish_bin(struct ft_pyramid *P, int l) {
+	pyramid_level_t *L = &P->level[l];
+	UINT32_T c, n = P->nchans;
+	FLOAT32_T *bin = L->bins + (size_t) (L->next % L->capacity) * 3 * n;
+
+	for (c=0; c<n; c++) {
+		bin[c]     = (FLOAT32_T) L->min[c];
+		bin[n+c]   = (FLOAT32_T) L->max[c];
+		bin[2*n+c] = (FLOAT32_T) (L->sum[c] / L->factor);
+	}
+	L->next++;
+	if (L->next - L->first > L->capacity) L->first = L->next - L->capacity;
+
+	if (l+1 < FT_PYRAMID_LEVELS) {
+		pyramid_level_t *U = &P->level[l+1];
+		for (c=0; c<n; c++) {
+			if (L->min[c] < U->min[c]) U->min[c] = L->min[c];
+			if (L->max[c] > U->max[c]) U->max[c] = L->max[c];
+			U->sum[c] += L->sum[c];
+		}
+		reset_bin(L, n);
+		if (++U->fill == FT_PYRAMID_FACTOR) finish_bin(P, l+1);
+	} else {
+		reset_bin(L, n);
+	}
+}
+
+#define ADD_SAMPLES(T) {                                    \
+	const T *x = (const T *) src;                           \
+	for (s=0; s<nsamples; s++, x += nchans) {               \
+		for (c=0; c<nchans; c++) {                          \
+			double v = (double) x[c];                       \
+			if (v < mn[c]) mn[c] = v;                       \
+			if (v > mx[c]) mx[c] = v;                       \
+			sm[c] += v;                                     \
+		}                                                   \
+		if (++L->fill == FT_PYRAMID_FACTOR) finish_bin(P, 0); \
+	}                                                       \
+}
+
+static void add_samples(struct ft_pyramid *P, const void *src, UINT32_T nsamples) {
+	pyramid_level_t *L = &P->level[0];
+	double *mn = L->min, *mx = L->max, *sm = L->sum;
+	UINT32_T s, c, nchans = P->nchans;
+
+	switch (P->data_type) {
+		case DATATYPE_UINT8:   ADD_SAMPLES(UINT8_T);   break;
+		case DATATYPE_UINT16:  ADD_SAMPLES(UINT16_T);  break;
+		case DATATYPE_UINT32:  ADD_SAMPLES(UINT32_T);  break;
+		case DATATYPE_UINT64:  ADD_SAMPLES(UINT64_T);  break;
+		case DATATYPE_INT8:    ADD_SAMPLES(INT8_T);    break;
+		case DATATYPE_INT16:   ADD_SAMPLES(INT16_T);   break;
+		case DATATYPE_INT32:   ADD_SAMPLES(INT32_T);   break;
+		case DATATYPE_INT64:   ADD_SAMPLES(INT64_T);   break;
+		case DATATYPE_FLOAT32: ADD_SAMPLES(FLOAT32_T); break;
+		case DATATYPE_FLOAT64: ADD_SAMPLES(FLOAT64_T); break;
+	}
+}
+
+static void pyramid_destroy(struct ft_pyramid *P) {
+	int l;
+	for (l=0; l<FT_PYRAMID_LEVELS; l++) {
+		FREE(P->level[l].bins);
+		FREE(P->level[l].min);
+		FREE(P->level[l].max);
+		FREE(P->level[l].sum);
+	}
+	pthread_mutex_destroy(&P->lock);
+	free(P);
+}
+
+/*****************************************************************************/
+
+void ft_pyramid_create(ft_stream_t *S) {
+	struct ft_pyramid *P;
+	UINT32_T factor, top;
+	int l;
+
+	if (S->header == NULL || S->data == NULL || S->pyramid != NULL) return;
+	if (S->header->def->data_type == DATATYPE_CHAR || wordsize_from_type(S->header->def->data_type) == 0) return;
+
+	P = (struct ft_pyramid *) calloc(1, sizeof(struct ft_pyramid));
+	DIE_BAD_MALLOC(P);
+	pthread_mutex_init(&P->lock, NULL);
+	P->nchans    = S->header->def->nchans;
+	P->data_type = S->header->def->data_type;
+
+	/* start at a sample where all levels start a new bin */
+	for (l=0, top=1; l<FT_PYRAMID_LEVELS; l++) top *= FT_PYRAMID_FACTOR;
+	P->done = (ft_ring_first(S->data) + top - 1) / top * top;
+
+	for (l=0, factor=FT_PYRAMID_FACTOR; l<FT_PYRAMID_LEVELS; l++, factor*=FT_PYRAMID_FACTOR) {
+		pyramid_level_t *L = &P->level[l];
+		L->factor   = factor;
+		L->capacity = S->data->capacity / factor + 1;
+		L->first    = P->done / factor;
+		L->next     = L->first;
+		L->bins = (FLOAT32_T *) malloc((size_t) L->capacity * 3 * P->nchans * sizeof(FLOAT32_T));
+		L->min  = (double *) malloc(P->nchans * sizeof(double));
+		L->max  = (double *) malloc(P->nchans * sizeof(double));
+		L->sum  = (double *) malloc(P->nchans * sizeof(double));
+		if (L->bins == NULL || L->min == NULL || L->max == NULL || L->sum == NULL) {
+			fprintf(stderr, "ft_pyramid: out of memory, GET_DAT_DECIMATED will not be available\n");
+			pyramid_destroy(P);
+			return;
+		}
+		reset_bin(L, P->nchans);
+	}
+	S->pyramid = P;
+}
+
+void ft_pyramid_free(ft_stream_t *S) {
+	if (S->pyramid == NULL) return;
+	pyramid_destroy(S->pyramid);
+	S->pyramid = NULL;
+}
+
+void ft_pyramid_update(ft_stream_t *S) {
+	struct ft_pyramid *P = S->pyramid;
+	ft_ring_t *R = S->data;
+	UINT32_T count;
+
+	if (P == NULL || R == NULL) return;
+	count = ft_ring_count(R);
+	if (count <= P->done) return;
+
+	pthread_mutex_lock(&P->lock);
+	while (P->done < count) {
+		/* the writer holds mutexdata, so these samples are not overwritten */
+		UINT32_T start = P->done % R->capacity;
+		UINT32_T n = R->capacity - start;
+		if (n > count - P->done) n = count - P->done;
+		add_samples(P, R->buf + (size_t) start * R->chansize, n);
+		P->done += n;
+	}
+	pthread_mutex_unlock(&P->lock);
+}
+
+int ft_pyramid_read(ft_stream_t *S, UINT32_T begsample, UINT32_T endsample, UINT32_T width, void **buf, UINT32_T *bufsize) {
+	struct ft_pyramid *P = S->pyramid;
+	pyramid_level_t *L;
+	decimateddef_t *ddef;
+	UINT32_T first, last, nbins, binsize;
+	UINT64_T size;
+	int l;
+
+	if (P == NULL || endsample < begsample) return -1;
+	if (width == 0) width = 1;
+
+	/* the coarsest level with at least "width" bins in the selection */
+	if ((UINT64_T) endsample - begsample + 1 < (UINT64_T) FT_PYRAMID_FACTOR * width) return 1;
+	for (l=FT_PYRAMID_LEVELS-1; l>0; l--) {
+		if (((UINT64_T) endsample - begsample + 1) / P->level[l].factor >= width) break;
+	}
+	L = &P->level[l];
+	binsize = 3 * P->nchans * sizeof(FLOAT32_T);
+
+	pthread_mutex_lock(&P->lock);
+
+	/* the bins that overlap with the selection, as far as they are complete and kept */
+	first = begsample / L->factor;
+	last  = endsample / L->factor + 1;
+	if (first < L->first) first = L->first;
+	if (last > L->next) last = L->next;
+	nbins = (last > first) ? last - first : 0;
+
+	size = sizeof(decimateddef_t) + (UINT64_T) nbins * binsize;
+	if (size > 0xFFFFFFFFu || (*buf = malloc((size_t) size)) == NULL) {
+		pthread_mutex_unlock(&P->lock);
+		fprintf(stderr, "ft_pyramid: cannot send %u bins\n", nbins);
+		return -1;
+	}
+
+	ddef = (decimateddef_t *) *buf;
+	ddef->nchans    = P->nchans;
+	ddef->nbins     = nbins;
+	ddef->factor    = L->factor;
+	ddef->begsample = first * L->factor;
+	ddef->data_type = DATATYPE_FLOAT32;
+	ddef->bufsize   = nbins * binsize;
+
+	/* in at most two pieces, as the bins are kept in a ring as well */
+	if (nbins > 0) {
+		UINT32_T start = first % L->capacity;
+		UINT32_T n = (L->capacity - start < nbins) ? L->capacity - start : nbins;
+		memcpy(ddef+1, L->bins + (size_t) start * 3 * P->nchans, (size_t) n * binsize);
+		if (n < nbins) memcpy((char *) (ddef+1) + (size_t) n * binsize, L->bins, (size_t) (nbins - n) * binsize);
+	}
+	pthread_mutex_unlock(&P->lock);
+
+	*bufsize = (UINT32_T) size;
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_PYRAMID_LEVELS  3    /* levels with 8, 64 and 512 samples per bin */
+#define FT_PYRAMID_FACTOR  8    /* each level combines this many bins of the level below */
+
+/** Min/max/mean pyramid for GET_DAT_DECIMATED.
+
+    Drawing an overview of a few minutes of data should not need all the
+    samples of those minutes. Next to the ring, every stream keeps the
+    minimum, maximum and mean of each channel over bins of 8 samples, over
+    bins of 64 samples made from those, and over bins of 512 samples. The
+    writer adds the samples to the bins right after it has committed them,
+    so the pyramid is always up to date with the ring, and each level keeps
+    as many bins as it takes to cover the samples in the ring.
+
+    Bins are aligned to multiples of their size, counted from the first
+    sample, and only complete bins can be read. A GET_DAT_DECIMATED request
+    is answered from the coarsest level that still has at least as many
+    bins in the selection as the client wants to show points, so that the
+    size of the response (and the work of the server) depends on the width
+    of the plot rather than on the number of samples. For short selections,
+    where even the finest level has too few bins, dmarequest returns the
+    samples themselves in the same format.
+
+    The bins are kept as FLOAT32_T, which costs 1.7 bytes per sample and
+    channel on top of the ring. Streams of DATATYPE_CHAR do not get one.
+*/
+
+struct ft_stream;
+
+/** Sets up the pyramid of stream S for its ring. The caller needs to hold
+    all locks of the stream. Samples that are in the ring already (after a
+    restore, see persist.h) are added by the next ft_pyramid_update, so that
+    restoring a session does not have to go through its whole ring.
+*/
+void ft_pyramid_create(struct ft_stream *S);
+
+void ft_pyramid_free(struct ft_stream *S);
+
+/** With mutexdata held, by the writer or by a reader that finds it free:
+    adds the samples that have been committed since the last call.
+*/
+void ft_pyramid_update(struct ft_stream *S);
+
+/** Reader side, with rwlockring held for reading: picks the level for
+    showing samples begsample ... endsample in width points and copies its
+    bins into a newly allocated buffer, which starts with the decimateddef_t.
+    Returns 0 and the size of the buffer in *bufsize, 1 if the selection is
+    too short for the pyramid and the samples themselves should be sent, or
+    -1 on an error.
+*/
+int  ft_pyramid_read(struct ft_stream *S, UINT32_T begsample, UINT32_T endsample, UINT32_T width, void **buf, UINT32_T *bufsize);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PYRAMID_H */
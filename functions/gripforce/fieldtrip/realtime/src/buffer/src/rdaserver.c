@@ -88,10 +88,13 @@ cleanup:
 
 /** Prepares "start" RDA packet with channel names determined from the corresponding chunk (or empty)
 	Also converts to little-endian if this machine is big endian
-	@param hdr  Points to headerdef_t structure, will be filled, may not be NULL
+	@param hdr  	Points to headerdef_t structure, will be filled, may not be NULL
+	@param scale	If not NULL, the resolutions are returned here as a new array of floats
+					that the samples should be multiplied with, and the start packet
+					carries resolutions of 1.0 instead. Stays NULL without resolutions.
 	@return created start item, or NULL on error (connection / out of memory)
 */
-rda_buffer_item_t *rda_aux_get_hdr_prep_start(int ft_buffer, headerdef_t *hdr) {
+rda_buffer_item_t *rda_aux_get_hdr_prep_start(int ft_buffer, headerdef_t *hdr, float **scale) {
 	rda_buffer_item_t *item = NULL;
 	const ft_chunk_t *chunk;
 	rda_msg_start_t *R;
@@ -173,6 +176,13 @@ rda_buffer_item_t *rda_aux_get_hdr_prep_start(int ft_buffer, headerdef_t *hdr) {
 		for (i=0;i<hdr->nchans;i++) dRes[i]=1.0;
 	} else {
 		memcpy(dRes, dResSource, hdr->nchans * sizeof(double));
+		if (scale != NULL && (*scale = (float *) malloc(hdr->nchans * sizeof(float))) != NULL) {
+			/* the samples get the resolutions, the client gets 1.0 */
+			for (i=0;i<hdr->nchans;i++) {
+				(*scale)[i] = (float) dRes[i];
+				dRes[i] = 1.0;
+			}
+		}
 	}
 	/* swap byte order if necessary */
 	if (_i_am_big_endian_) {
@@ -197,76 +207,125 @@ cleanup:
 }
 
 
-void rda_aux_convert_to_float(UINT32_T N, void *dest, UINT32_T data_type, const void *src) {
+/* On x86 with gcc or clang, the common sample types are converted 8 at a time
+   with AVX2 if the CPU has it (see endianutil.c for the same approach), and
+   the rest with type-specialized loops that the compiler may vectorize. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RDA_CONVERT_X86
+#include <immintrin.h>
+#endif
+
+static int convertLevel = -1;	/* not determined yet */
+
+int rda_aux_use_simd(int level) {
+	int supported = FT_SIMD_NONE;
+#ifdef RDA_CONVERT_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) supported = FT_SIMD_AVX2;
+#endif
+	convertLevel = (level >= FT_SIMD_AVX2) ? supported : FT_SIMD_NONE;
+	return convertLevel;
+}
+
+#define CONVERT_LOOP(T) {                                              \
+	const T *s = (const T *) src;                                      \
+	if (scale) for (n=0;n<N;n++) d[n] = (float) s[n] * scale[n];       \
+	else       for (n=0;n<N;n++) d[n] = (float) s[n];                  \
+}
+
+static void convert_scalar(UINT32_T N, float *d, UINT32_T data_type, const void *src, const float *scale) {
 	UINT32_T n;
-	float *d = (float *) dest;
 	switch(data_type) {
 		case DATATYPE_CHAR:
-		case DATATYPE_UINT8:
-			{
-				const UINT8_T *s = (const UINT8_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
-			break;
-		case DATATYPE_UINT16:
-			{
-				const UINT16_T *s = (const UINT16_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
-			break;
-		case DATATYPE_UINT32:
-			{
-				const UINT32_T *s = (const UINT32_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
-			break;
-		case DATATYPE_UINT64:
-			{
-				const UINT64_T *s = (const UINT64_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
-			break;
-		case DATATYPE_INT8:
-			{
-				const INT8_T *s = (const INT8_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
+		case DATATYPE_UINT8:   CONVERT_LOOP(UINT8_T);   break;
+		case DATATYPE_UINT16:  CONVERT_LOOP(UINT16_T);  break;
+		case DATATYPE_UINT32:  CONVERT_LOOP(UINT32_T);  break;
+		case DATATYPE_UINT64:  CONVERT_LOOP(UINT64_T);  break;
+		case DATATYPE_INT8:    CONVERT_LOOP(INT8_T);    break;
+		case DATATYPE_INT16:   CONVERT_LOOP(INT16_T);   break;
+		case DATATYPE_INT32:   CONVERT_LOOP(INT32_T);   break;
+		case DATATYPE_INT64:   CONVERT_LOOP(INT64_T);   break;
+		case DATATYPE_FLOAT64: CONVERT_LOOP(FLOAT64_T); break;
+		case DATATYPE_FLOAT32:
+			if (scale) CONVERT_LOOP(FLOAT32_T)
+			else memcpy(d, src, (size_t) N*sizeof(float));
 			break;
+	}
+}
+
+#ifdef RDA_CONVERT_X86
+#define STORE8(v) {                                                    \
+	__m256 x = (v);                                                    \
+	if (scale) x = _mm256_mul_ps(x, _mm256_loadu_ps(scale+i));         \
+	_mm256_storeu_ps(d+i, x);                                          \
+}
+
+/* returns how many values were converted, the rest is left to convert_scalar */
+__attribute__((target("avx2")))
+static UINT32_T convert_avx2(UINT32_T N, float *d, UINT32_T data_type, const void *src, const float *scale) {
+	UINT32_T i = 0;
+	switch(data_type) {
 		case DATATYPE_INT16:
-			{
-				const INT16_T *s = (const INT16_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
+			for (;i+8<=N;i+=8) STORE8(_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) ((const INT16_T *) src + i)))));
 			break;
-		case DATATYPE_INT32:
-			{
-				const INT32_T *s = (const INT32_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
+		case DATATYPE_UINT16:
+			for (;i+8<=N;i+=8) STORE8(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *) ((const UINT16_T *) src + i)))));
 			break;
-		case DATATYPE_INT64:
-			{
-				const INT64_T *s = (const INT64_T *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
-			}
+		case DATATYPE_INT32:
+			for (;i+8<=N;i+=8) STORE8(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *) ((const INT32_T *) src + i))));
 			break;
 		case DATATYPE_FLOAT32:
-			memcpy(dest,src,N*sizeof(float));
+			if (scale == NULL) break;
+			for (;i+8<=N;i+=8) STORE8(_mm256_loadu_ps((const float *) src + i));
 			break;
 		case DATATYPE_FLOAT64:
-			{
-				const double *s = (const double *) src;
-				for (n=0;n<N;n++) d[n] = (float) s[n];
+			for (;i+8<=N;i+=8) {
+				const double *s = (const double *) src + i;
+				__m128 lo = _mm256_cvtpd_ps(_mm256_loadu_pd(s));
+				__m128 hi = _mm256_cvtpd_ps(_mm256_loadu_pd(s+4));
+				STORE8(_mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1));
 			}
 			break;
 	}
+	return i;
 }
+#endif
 
+/* converts N values, multiplied with scale[0..N-1] if scale is not NULL */
+static void convert_run(UINT32_T N, float *d, UINT32_T data_type, const void *src, const float *scale) {
+	UINT32_T done = 0;
 
+	if (convertLevel < 0) rda_aux_use_simd(FT_SIMD_AVX2);
+#ifdef RDA_CONVERT_X86
+	if (convertLevel == FT_SIMD_AVX2) done = convert_avx2(N, d, data_type, src, scale);
+#endif
+	if (done < N) {
+		convert_scalar(N - done, d + done, data_type, (const char *) src + (size_t) done * wordsize_from_type(data_type), scale ? scale + done : NULL);
+	}
+}
+
+void rda_aux_convert_to_float(UINT32_T N, void *dest, UINT32_T data_type, const void *src) {
+	convert_run(N, (float *) dest, data_type, src, NULL);
+}
+
+void rda_aux_convert_scaled(UINT32_T nchans, UINT32_T nsamples, void *dest, UINT32_T data_type, const void *src, const float *scale) {
+	size_t rowsize = (size_t) nchans * wordsize_from_type(data_type);
+	UINT32_T j;
+
+	if (scale == NULL) {
+		convert_run(nchans*nsamples, (float *) dest, data_type, src, NULL);
+		return;
+	}
+	/* the scale factors repeat with every sample */
+	for (j=0;j<nsamples;j++) {
+		convert_run(nchans, (float *) dest + (size_t) j*nchans, data_type, (const char *) src + j*rowsize, scale);
+	}
+}
 
 /** Retrieves samples and markers and returns them in as a new 'item', or NULL on errors.
+	Float samples are multiplied with scale[0..nscale-1] if it is not NULL.
 */
-rda_buffer_item_t *rda_aux_get_samples_and_markers(int ft_buffer, const samples_events_t *last, const samples_events_t *cur, int numBlock, int use16bit) {
+rda_buffer_item_t *rda_aux_get_samples_and_markers(int ft_buffer, const samples_events_t *last, const samples_events_t *cur, int numBlock, int use16bit, const float *scale, UINT32_T nscale) {
 	rda_buffer_item_t *item = NULL;
 	int numEvt = 0,numChans = 0,numSmp = 0;
 	message_t req, *respSmp = NULL, *respEvt = NULL;
@@ -389,6 +448,10 @@ rda_buffer_item_t *rda_aux_get_samples_and_markers(int ft_buffer, const samples_
 		char *dataSrc  = ((char *) respSmp->buf + sizeof(datadef_t));
 		int numTotal = numSmp * numChans;
 
+		if (scale != NULL && nscale != numChans) {
+			/* the header changed under our feet, the next start packet will tell */
+			scale = NULL;
+		}
 		if (use16bit) {
 			if (_i_am_big_endian_) {
 				/* copy + swap the 16 bit samples */
@@ -404,7 +467,7 @@ rda_buffer_item_t *rda_aux_get_samples_and_markers(int ft_buffer, const samples_
 				memcpy(dataDest, dataSrc, bytesSamples);
 			}
 		} else {
-			rda_aux_convert_to_float(numTotal, dataDest, ddef->data_type, dataSrc);
+			rda_aux_convert_scaled(numChans, numSmp, dataDest, ddef->data_type, dataSrc, scale);
 			if (_i_am_big_endian_) ft_swap32(numTotal, dataDest);
 		}
 	}
@@ -623,6 +686,7 @@ void *_rdaserver_thread(void *arg) {
 	rda_buffer_item_t *startItem = NULL;				 	/* item containing start packet (header info) */
 	rda_buffer_item_t *firstDataItem = NULL;				/* first item in list of (mostly) data packets */
 	rda_buffer_item_t *latestItem = NULL;
+	float *scale = NULL;					/* resolutions the samples are multiplied with, see SC->scale */
 
 	headerdef_t ftHdr;			/* contains header information */
 	int i,typeOk;				/* typeOk is only interesting for 16-bit servers */
@@ -659,7 +723,8 @@ void *_rdaserver_thread(void *arg) {
 
 		/* First, in case we have no header,  we need to read it from the FT buffer	*/
 		if (startItem == NULL && opState == 0) {
-			startItem = rda_aux_get_hdr_prep_start(SC->ft_buffer, &ftHdr);
+			FREE(scale);
+			startItem = rda_aux_get_hdr_prep_start(SC->ft_buffer, &ftHdr, (SC->scale && !SC->use16bit) ? &scale : NULL);
 			if (startItem == NULL) {
 				/* no header yet, wait in select call for clients connecting */
 				selTimeout = 100000;
@@ -872,7 +937,7 @@ void *_rdaserver_thread(void *arg) {
 					/* There's new data to stream out */
 					rda_buffer_item_t *item;
 
-					item = rda_aux_get_samples_and_markers(SC->ft_buffer, &lastNum, &curNum, numBlock, SC->use16bit);
+					item = rda_aux_get_samples_and_markers(SC->ft_buffer, &lastNum, &curNum, numBlock, SC->use16bit, scale, ftHdr.nchans);
 					if (item != NULL) {
 						if (firstDataItem == NULL) {
 							firstDataItem = item;
@@ -947,6 +1012,7 @@ void *_rdaserver_thread(void *arg) {
 		free(startItem->data);
 		free(startItem);
 	}
+	FREE(scale);
 	/* ... and firstDataItem (including following list elements) */
 	while (firstDataItem!=NULL) {
 		rda_buffer_item_t *next = firstDataItem->next;
@@ -1051,6 +1117,7 @@ rda_server_ctrl_t *rda_start_server(int ft_buffer, int use16bit, int port, int b
 	SC->use16bit = use16bit;
 	SC->verbosity = 10; /* TODO: specify proper values */
 	SC->blocksize = (blocksize < 0) ? 0 : blocksize;
+	SC->scale = 0;
 
 	/* if things go wrong after this, it's because of pthread issues */
 	interr = FT_ERR_THREADING;
@@ -57,6 +57,8 @@ typedef struct {
         int blocksize;                  /**< Block size for streaming out samples, 0 => adapt to incoming data */
         int use16bit;                   /**< Flag that indicates whether 16 bit data should be streamed */
         int verbosity;                  /**< Option that determines how much status information is printed during operation */
+        volatile int scale;             /**< Flag: multiply float samples with the resolutions (FT_CHUNK_RESOLUTIONS), and send
+                                             resolutions of 1.0 to the clients, starting with the next header that is read */
 } rda_server_ctrl_t;
 
 /** Internally used data structure to keep a linked list of
@@ -84,6 +86,16 @@ typedef struct {
 */
 void rda_aux_convert_to_float(UINT32_T N, void *dest, UINT32_T data_type, const void *src);
 
+/** Converts nsamples samples of nchans channels to single precision floats, and multiplies
+    channel c with scale[c] if scale is not NULL
+*/
+void rda_aux_convert_scaled(UINT32_T nchans, UINT32_T nsamples, void *dest, UINT32_T data_type, const void *src, const float *scale);
+
+/** Limits the conversion kernels to FT_SIMD_NONE or FT_SIMD_AVX2 (see endianutil.h),
+    e.g. for comparing them, and returns the one that is used from now on
+*/
+int rda_aux_use_simd(int level);
+
 /** Starts an RDA server with a given FieldTrip connection (usually 0 for DMA), serving
     either single precision or 16 bit integer data.
         @param ft_buffer        FieldTrip connection (0 for DMA, or socket for TCP connection)
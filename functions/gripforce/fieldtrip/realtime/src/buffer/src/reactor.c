@@ -0,0 +1,806 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifdef __linux__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "stream.h"
+#include "waitreg.h"
+#include "zerocopy.h"
+#include "reactor.h"
+#include "stats.h"
+#include "trace.h"
+
+#define ROUNDS  8     /* requests of one connection in a row, before the others get a turn */
+
+/* One connection, in the states of socketserver.c (0 = reading def, 1 = reading buf,
+   2 = writing def, 3 = writing buf, 4 = writing a GET_DAT response from the ring),
+   5 while a large PUT_DAT arrives (see start_ingest), and 7 while a WAIT_DAT request waits */
+typedef struct client {
+	SOCKET sock;
+	ft_connection_t C;
+	ft_stream_t *stream;        /* selected by OPEN_STREAM, see stream.h */
+	int state;
+	messagedef_t reqdef;
+	message_t request;
+	message_t *response;
+	UINT32_T respBufSize;
+	char *curPtr;
+	UINT32_T bytesDone, bytesTotal;
+	char mergeBuffer[MERGE_THRESHOLD];
+	int tcp;                    /* SO_RCVLOWAT only works for TCP, see start_ingest */
+	int lowat;                  /* 1 while SO_RCVLOWAT is set */
+	ft_pinned_send_t pinned;    /* the GET_DAT response of state 4 */
+	/* the WAIT_DAT request of state 7 */
+	ft_waiter_t waiter;
+	ft_stream_t *waitstream;
+	struct timespec deadline;   /* also when state 5 gives up, see start_ingest */
+	UINT64_T waitstart;         /* for ft_stats_record */
+	UINT64_T phaseStart;        /* for trace.h */
+	UINT16_T traceCommand;
+	/* the epoll set of the connection, once it needs more than its socket */
+	int inner;
+	int wake[2];                /* pipe, written to by the registry of waiting clients */
+	int timer;
+	int subfd;                  /* descriptor of the subscription in "inner", or -1 */
+	struct timespec due;        /* when the subscription may have something, tv_sec=0 if not known */
+	struct client *prev, *next;
+} client_t;
+
+typedef struct {
+	int epfd;
+	int wakefd;                 /* eventfd that becomes readable when the server stops */
+	pthread_mutex_t lock;       /* protects "clients" */
+	client_t *clients;
+} reactor_t;
+
+/* what the epoll set has as data for the listening socket and the wakefd */
+static char listenTag, wakeTag;
+
+static void now_plus(struct timespec *t, long sec, long nsec) {
+	clock_gettime(CLOCK_MONOTONIC, t);
+	t->tv_sec  += sec;
+	t->tv_nsec += nsec;
+	while (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+static int passed(const struct timespec *t) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec > t->tv_sec || (now.tv_sec == t->tv_sec && now.tv_nsec >= t->tv_nsec);
+}
+
+/* reads whatever is in a non-blocking descriptor, returns the number of bytes */
+static int drain(int fd) {
+	char buf[64];
+	int n, total = 0;
+	if (fd < 0) return 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0) total += n;
+	return total;
+}
+
+static int set_nonblocking(int fd) {
+	return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, NULL) | O_NONBLOCK);
+}
+
+/* back to state 0, reading the next request */
+static void reset(client_t *c) {
+	c->state = 0;
+	c->curPtr = (char *) &c->reqdef;
+	c->bytesDone = 0;
+	c->bytesTotal = sizeof(messagedef_t);
+}
+
+/* starts writing c->response, merged into one packet if it is small (see socketserver.c) */
+static void start_response(client_t *c) {
+	ft_trace_span(FT_TRACE_EXECUTE, c->traceCommand, c->phaseStart);
+	c->phaseStart = FT_TRACE_NOW();
+	c->bytesDone = 0;
+	if (c->C.mergePackets && c->respBufSize > 0 && c->respBufSize + sizeof(messagedef_t) <= MERGE_THRESHOLD) {
+		memcpy(c->mergeBuffer, c->response->def, sizeof(messagedef_t));
+		memcpy(c->mergeBuffer + sizeof(messagedef_t), c->response->buf, c->respBufSize);
+		c->curPtr = c->mergeBuffer;
+		c->bytesTotal = c->respBufSize + sizeof(messagedef_t);
+		c->state = 3;
+	} else {
+		c->curPtr = (char *) c->response->def;
+		c->bytesTotal = sizeof(messagedef_t);
+		c->state = 2;
+	}
+}
+
+static void finish_response(client_t *c) {
+	if (c->response != NULL) {
+		FREE(c->response->buf);
+		FREE(c->response->def);
+		FREE(c->response);
+	}
+	reset(c);
+}
+
+/* gives the connection its own epoll set with the socket, the pipe and the timer */
+static int need_inner(reactor_t *R, client_t *c) {
+	struct epoll_event ev;
+
+	if (c->inner >= 0) return 0;
+	if (pipe(c->wake) != 0) {
+		c->wake[0] = c->wake[1] = -1;
+		return -1;
+	}
+	c->timer = timerfd_create(CLOCK_MONOTONIC, 0);
+	c->inner = epoll_create(4);
+	if (c->timer < 0 || c->inner < 0) return -1;
+	/* the registry must never block on the pipe, and neither must we */
+	if (set_nonblocking(c->wake[0]) < 0 || set_nonblocking(c->wake[1]) < 0 || set_nonblocking(c->timer) < 0) return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = c;
+	if (epoll_ctl(c->inner, EPOLL_CTL_ADD, c->sock, &ev) != 0) return -1;
+	if (epoll_ctl(c->inner, EPOLL_CTL_ADD, c->wake[0], &ev) != 0) return -1;
+	if (epoll_ctl(c->inner, EPOLL_CTL_ADD, c->timer, &ev) != 0) return -1;
+	/* from now on, the reactor watches the set instead of the socket */
+	if (epoll_ctl(R->epfd, EPOLL_CTL_DEL, c->sock, &ev) != 0) return -1;
+	ev.events = EPOLLONESHOT;
+	return epoll_ctl(R->epfd, EPOLL_CTL_ADD, c->inner, &ev);
+}
+
+/* puts the connection back into the epoll set of the reactor, for what it waits for now */
+static int watch(reactor_t *R, client_t *c) {
+	struct epoll_event ev;
+	struct itimerspec its;
+	const struct timespec *when = NULL;
+	int fd;
+
+	if (ft_subscription_fd(&c->C.subscription) >= 0 && need_inner(R, c) != 0) return -1;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.ptr = c;
+	if (c->state == 7) {
+		/* only a closed connection ends the wait early */
+		ev.events = EPOLLRDHUP;
+	} else {
+		ev.events = (c->state >= 2 && c->state <= 4) ? EPOLLOUT : EPOLLIN;
+	}
+	if (c->inner < 0) {
+		ev.events |= EPOLLONESHOT;
+		return epoll_ctl(R->epfd, EPOLL_CTL_MOD, c->sock, &ev);
+	}
+	if (epoll_ctl(c->inner, EPOLL_CTL_MOD, c->sock, &ev) != 0) return -1;
+
+	/* every SUBSCRIBE_DAT makes a new pipe, so its descriptor is added anew */
+	fd = (c->state == 0 && c->bytesDone == 0) ? ft_subscription_fd(&c->C.subscription) : -1;
+	if (c->subfd >= 0) epoll_ctl(c->inner, EPOLL_CTL_DEL, c->subfd, &ev);
+	c->subfd = -1;
+	if (fd >= 0) {
+		ev.events = EPOLLIN;
+		if (epoll_ctl(c->inner, EPOLL_CTL_ADD, fd, &ev) != 0) return -1;
+		c->subfd = fd;
+	}
+
+	if (c->state == 7 || c->state == 5) {
+		when = &c->deadline;
+	} else if (fd >= 0 && c->due.tv_sec != 0) {
+		when = &c->due;
+	}
+	memset(&its, 0, sizeof(its));
+	if (when != NULL) {
+		its.it_value = *when;
+		/* zero would disarm the timer */
+		if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(c->timer, TFD_TIMER_ABSTIME, &its, NULL) != 0) return -1;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	return epoll_ctl(R->epfd, EPOLL_CTL_MOD, c->inner, &ev);
+}
+
+/* answers the WAIT_DAT request with the given numbers of samples and events */
+static int answer_wait(client_t *c, const samples_events_t *current) {
+	c->response = ft_simple_response(WAIT_OK);
+	if (c->response == NULL) return -1;
+	c->response->buf = malloc(sizeof(samples_events_t));
+	if (c->response->buf == NULL) return -1;
+	memcpy(c->response->buf, current, sizeof(samples_events_t));
+	c->response->def->bufsize = sizeof(samples_events_t);
+	c->respBufSize = sizeof(samples_events_t);
+	if (c->C.swap) ft_swap_from_native(WAIT_DAT, c->response);
+	ft_stats_record(WAIT_DAT, c->waitstart, sizeof(messagedef_t) + sizeof(waitdef_t), sizeof(messagedef_t) + sizeof(samples_events_t));
+	start_response(c);
+	return 0;
+}
+
+/* Registers a WAIT_DAT request with the waiting clients of the stream and goes
+   to state 7, or answers it at once if the threshold is exceeded already.
+   Returns 1 if it was taken care of, 0 if dmarequest can answer it right away
+   (without waiting, as there is no header), and -1 if the connection should
+   be closed. */
+static int start_wait(reactor_t *R, client_t *c) {
+	ft_stream_t *S = ft_current_stream();
+	waitdef_t *wd = (waitdef_t *) c->request.buf;
+	samples_events_t current;
+	int res;
+
+	if (S->header == NULL) return 0;
+	if (need_inner(R, c) != 0) return -1;
+	/* a byte from a wait that was ended by the timer would wake us up at once */
+	drain(c->wake[0]);
+	res = ft_waitreg_arm(&S->waiters, &c->waiter, &wd->threshold, c->wake[1], &current);
+	if (res != 0) {
+		/* never passed on to dmarequest, which might block this worker in ft_waitreg_wait */
+		FREE(c->request.buf);
+		if (res > 0) return (answer_wait(c, &current) == 0) ? 1 : -1;
+		c->response = ft_simple_response(WAIT_ERR);
+		if (c->response == NULL) return -1;
+		c->respBufSize = 0;
+		if (c->C.swap) ft_swap_from_native(WAIT_DAT, c->response);
+		start_response(c);
+		return 1;
+	}
+	now_plus(&c->deadline, wd->milliseconds / 1000, (wd->milliseconds % 1000) * 1000000L);
+	c->waitstream = S;
+	FREE(c->request.buf);
+	c->state = 7;
+	return 1;
+}
+
+/* Tells whether the threshold of the WAIT_DAT request of state 7 has been
+   exceeded. If not, the waiter is armed again, as the byte in the pipe only
+   said that a count went down (see ft_waitreg_update). */
+static int wait_exceeded(client_t *c) {
+	samples_events_t threshold, current;
+
+	threshold.nsamples = c->waiter.threshold[FT_WAIT_SAMPLES];
+	threshold.nevents  = c->waiter.threshold[FT_WAIT_EVENTS];
+	ft_waitreg_disarm(&c->waitstream->waiters, &c->waiter, &current);
+	if (current.nsamples > threshold.nsamples || current.nevents > threshold.nevents) return 1;
+	/* out of memory is answered like a threshold that was exceeded */
+	return ft_waitreg_arm(&c->waitstream->waiters, &c->waiter, &threshold, c->wake[1], &current) != 0;
+}
+
+/* answers the WAIT_DAT request of state 7 with the current numbers of samples and events */
+static int finish_wait(client_t *c) {
+	samples_events_t current;
+
+	ft_waitreg_disarm(&c->waitstream->waiters, &c->waiter, &current);
+	c->waitstream = NULL;
+	drain(c->wake[0]);
+	return answer_wait(c, &current);
+}
+
+/* starts writing a pinned GET_DAT response (see zerocopy.h) from the ring, in state 4 */
+static void start_pinned(client_t *c, const ft_pinned_data_t *P) {
+	ft_trace_span(FT_TRACE_EXECUTE, c->traceCommand, c->phaseStart);
+	c->phaseStart = FT_TRACE_NOW();
+	ft_pinned_send_start(&c->pinned, P);
+	c->state = 4;
+}
+
+/* State 4: writes the pinned response as far as the socket takes it. Returns 1
+   if there is more to do, 0 if the socket would block, -1 on errors. */
+static int send_pinned(client_t *c) {
+	int res = ft_pinned_send(&c->pinned, c->sock);
+	if (res <= 0) {
+		if (res < 0) fprintf(stderr, "Cannot write to socket -- closing client connection.\n");
+		return res;
+	}
+	ft_trace_span(FT_TRACE_WRITE, c->traceCommand, c->phaseStart);
+	reset(c);
+	return 1;
+}
+
+/* takes SO_RCVLOWAT back to the default, after start_ingest */
+static void reset_lowat(client_t *c) {
+	int one = 1;
+	if (!c->lowat) return;
+	setsockopt(c->sock, SOL_SOCKET, SO_RCVLOWAT, &one, sizeof(one));
+	c->lowat = 0;
+}
+
+/* A large PUT_DAT is received straight into the ring (see zerocopy.h), but
+   only once all of it has arrived, so that the worker can take the locks of
+   the stream and give them back without waiting for the client. For TCP,
+   SO_RCVLOWAT keeps epoll from reporting the socket before that, other sockets
+   must have the whole request already. A request that is larger than the
+   window the kernel offers the client now could never arrive in full, and
+   one that has still not arrived after FT_INGEST_TIMEOUT is read into a
+   buffer after all. Returns 1 if the connection goes to state 5, 0 if the
+   request should be read into a buffer as usual, and -1 if the connection
+   should be closed. */
+static int start_ingest(reactor_t *R, client_t *c) {
+	int avail = 0, lowat = (int) c->reqdef.bufsize;
+	socklen_t len = sizeof(lowat);
+	struct tcp_info info;
+	socklen_t infolen = sizeof(info);
+
+	if (c->reqdef.bufsize > INT_MAX) return 0;
+	if (ioctl(c->sock, FIONREAD, &avail) == 0 && avail >= lowat) {
+		c->state = 5;
+		now_plus(&c->deadline, 0, FT_INGEST_TIMEOUT * 1000000L);
+		return 1;
+	}
+	if (!c->tcp) return 0;
+	if (getsockopt(c->sock, IPPROTO_TCP, TCP_INFO, &info, &infolen) != 0 || info.tcpi_rcv_ssthresh < c->reqdef.bufsize) return 0;
+	if (setsockopt(c->sock, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) != 0) return 0;
+	c->lowat = 1;
+	/* Linux lowers it to half of what the receive buffer may grow to */
+	if (getsockopt(c->sock, SOL_SOCKET, SO_RCVLOWAT, &lowat, &len) != 0 || lowat < (int) c->reqdef.bufsize) return 0;
+	/* the timer of the connection wakes us up at the deadline */
+	if (need_inner(R, c) != 0) return -1;
+	c->state = 5;
+	now_plus(&c->deadline, 0, FT_INGEST_TIMEOUT * 1000000L);
+	return 1;
+}
+
+/* State 5: receives the PUT_DAT request into the ring once it is all there.
+   Returns 1 if it was, 0 if not yet, and -1 if the connection should be closed. */
+static int ingest(client_t *c) {
+	datadef_t ddef;
+	ft_ingest_t P;
+	struct iovec iov[2], *iovp = iov;
+	int avail, iovcnt;
+	UINT64_T start;
+	ssize_t n;
+
+	if (ioctl(c->sock, FIONREAD, &avail) != 0) return -1;
+	if (avail < (int) c->reqdef.bufsize && passed(&c->deadline)) {
+		/* read what has arrived and the rest as usual, without holding anything */
+		reset_lowat(c);
+		c->request.buf = malloc(c->reqdef.bufsize);
+		if (c->request.buf == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		c->curPtr = (char *) c->request.buf;
+		c->bytesDone = 0;
+		c->bytesTotal = c->reqdef.bufsize;
+		c->state = 1;
+		return 1;
+	}
+	if (avail < (int) c->reqdef.bufsize) {
+		/* woken up by a connection that was closed, or by a signal */
+		char b;
+		n = recv(c->sock, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return -1;
+		return 0;
+	}
+	reset_lowat(c);
+	if (recv(c->sock, &ddef, sizeof(datadef_t), MSG_DONTWAIT) != sizeof(datadef_t)) return -1;
+
+	if (!ft_putdat_reserve(&c->reqdef, &ddef, &P)) {
+		/* the rest goes the usual way, and dmarequest sends the errors */
+		c->request.buf = malloc(c->reqdef.bufsize);
+		if (c->request.buf == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			return -1;
+		}
+		memcpy(c->request.buf, &ddef, sizeof(datadef_t));
+		c->curPtr = (char *) c->request.buf;
+		c->bytesDone = sizeof(datadef_t);
+		c->bytesTotal = c->reqdef.bufsize;
+		c->state = 1;
+		return 1;
+	}
+	iovcnt = ft_ingest_iovec(&P, iov);
+	while (iovcnt > 0) {
+		n = readv(c->sock, iovp, iovcnt);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			/* the samples were there, but what did not arrive is never published */
+			ft_putdat_abort(&P, NULL, 0);
+			return -1;
+		}
+		iovcnt = ft_iovec_consume(&iovp, iovcnt, (size_t) n);
+	}
+	ft_trace_span(FT_TRACE_READ_BODY, c->traceCommand, c->phaseStart);
+	c->phaseStart = FT_TRACE_NOW();
+	start = ft_stats_now();
+	ft_putdat_commit(&P);
+	ft_stats_record(PUT_DAT, start, sizeof(messagedef_t) + c->reqdef.bufsize, sizeof(messagedef_t));
+
+	c->response = ft_simple_response(PUT_OK);
+	if (c->response == NULL) return -1;
+	c->respBufSize = 0;
+	start_response(c);
+	return 1;
+}
+
+/* deals with a request that has been read completely, in native byte order */
+static int handle(ft_buffer_server_t *SC, reactor_t *R, client_t *c) {
+	ft_pinned_data_t pinned;
+	UINT64_T start = ft_stats_now();
+
+	if (c->reqdef.command == WAIT_DAT && c->reqdef.bufsize == sizeof(waitdef_t) && ((waitdef_t *) c->request.buf)->milliseconds > 0) {
+		int res;
+		c->waitstart = start;
+		res = start_wait(R, c);
+		if (res != 0) return (res > 0) ? 0 : -1;
+	}
+	if (!c->C.swap && c->C.encoding == FT_ENCODING_NONE && ft_getdat_pinned(&c->request, &pinned)) {
+		ft_stats_record(GET_DAT, start, sizeof(messagedef_t) + c->reqdef.bufsize, sizeof(messagedef_t) + pinned.def.bufsize);
+		FREE(c->request.buf);
+		start_pinned(c, &pinned);
+		return 0;
+	}
+	if (ft_connection_handle(SC, &c->C, &c->request, &c->response, &c->respBufSize) != 0) return -1;
+	if (c->response == NULL) {
+		/* not answered */
+		ft_trace_span(FT_TRACE_EXECUTE, c->traceCommand, c->phaseStart);
+		reset(c);
+		return 0;
+	}
+	start_response(c);
+	return 0;
+}
+
+/* Reads requests and writes responses of connection c until it would block.
+   Returns -1 if the connection should be closed. */
+static int serve(ft_buffer_server_t *SC, reactor_t *R, client_t *c) {
+	int rounds = 0, woken = 0;
+	ssize_t n;
+
+	/* the pipe and the timer only tell us to look, what there is to see is checked below */
+	if (c->inner >= 0) {
+		woken = drain(c->wake[0]) > 0;
+		drain(c->timer);
+	}
+
+	for (;;) {
+		if (c->state == 7) {
+			char b;
+			if (woken && !passed(&c->deadline) && !wait_exceeded(c)) {
+				/* only a count that went down, the threshold still stands */
+				woken = 0;
+			}
+			if (woken || passed(&c->deadline)) {
+				if (finish_wait(c) != 0) return -1;
+				continue;
+			}
+			/* woken up by the socket, which has to be closed or have data */
+			n = recv(c->sock, &b, 1, MSG_PEEK | MSG_DONTWAIT);
+			if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) return -1;
+			return 0;
+		}
+
+		if (c->state == 4 || c->state == 5) {
+			int res = (c->state == 4) ? send_pinned(c) : ingest(c);
+			if (res <= 0) return res;
+			continue;
+		}
+
+		/* push samples and events between two requests */
+		if (c->state == 0 && c->bytesDone == 0 && c->C.subscription.active) {
+			struct timeval tv = {3600, 0};
+			c->due.tv_sec = 0;
+			c->response = ft_subscription_next(&c->C.subscription, &tv);
+			if (c->response != NULL) {
+				c->phaseStart = FT_TRACE_NOW();
+				c->traceCommand = c->response->def->command;
+				c->respBufSize = c->response->def->bufsize;
+				c->curPtr = (char *) c->response->def;
+				c->bytesDone = 0;
+				c->bytesTotal = sizeof(messagedef_t);
+				c->state = 2;
+			} else if (tv.tv_sec < 3600) {
+				now_plus(&c->due, tv.tv_sec, tv.tv_usec * 1000L);
+			}
+		}
+
+		if (c->state < 2) {
+			/* the socket stays readable, so we will be back */
+			if (c->state == 0 && c->bytesDone == 0 && rounds >= ROUNDS) return 0;
+			if (c->state == 0 && c->bytesDone == 0) c->phaseStart = FT_TRACE_NOW();
+			n = recv(c->sock, c->curPtr + c->bytesDone, c->bytesTotal - c->bytesDone, MSG_DONTWAIT);
+			if (n == 0) {
+				if (SC->verbosity > 0) printf("Remote side closed client connection\n");
+				return -1;
+			}
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+				if (errno == EINTR) continue;
+				return -1;
+			}
+			c->bytesDone += n;
+			if (c->bytesDone < c->bytesTotal) continue;
+
+			if (c->state == 0) {
+				if (c->reqdef.version == VERSION_OE) {
+					c->C.swap = 1;
+					ft_swap16(2, &c->reqdef.version); /* version + command */
+					ft_swap32(1, &c->reqdef.bufsize);
+					c->C.reqCommand = c->reqdef.command;
+				}
+				if (c->reqdef.version != VERSION) {
+					fprintf(stderr, "Incorrect version requested - closing socket.\n");
+					return -1;
+				}
+				c->traceCommand = c->reqdef.command;
+				ft_trace_span(FT_TRACE_READ_HDR, c->traceCommand, c->phaseStart);
+				c->phaseStart = FT_TRACE_NOW();
+				if (!c->C.swap && c->C.encoding == FT_ENCODING_NONE && ft_putdat_wanted(&c->reqdef)) {
+					int res = start_ingest(R, c);
+					if (res < 0) return -1;
+					if (res > 0) {
+						rounds++;
+						continue;
+					}
+				}
+				reset_lowat(c);
+				if (c->reqdef.bufsize > 0) {
+					c->request.buf = malloc(c->reqdef.bufsize);
+					if (c->request.buf == NULL) {
+						fprintf(stderr, "Out of memory\n");
+						return -1;
+					}
+					c->curPtr = (char *) c->request.buf;
+					c->bytesDone = 0;
+					c->bytesTotal = c->reqdef.bufsize;
+					c->state = 1;
+					continue;
+				}
+			} else {
+				if (c->C.swap) ft_swap_buf_to_native(c->C.reqCommand, c->reqdef.bufsize, c->request.buf);
+				ft_trace_span(FT_TRACE_READ_BODY, c->traceCommand, c->phaseStart);
+				c->phaseStart = FT_TRACE_NOW();
+			}
+			rounds++;
+			if (handle(SC, R, c) != 0) return -1;
+			continue;
+		}
+
+		/* states 2 and 3: keep response->def back until response->buf follows (see socketserver.c) */
+		n = send(c->sock, c->curPtr + c->bytesDone, c->bytesTotal - c->bytesDone,
+		         MSG_DONTWAIT | MSG_NOSIGNAL | ((c->state == 2 && c->respBufSize > 0) ? MSG_MORE : 0));
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+			if (errno == EINTR) continue;
+			fprintf(stderr, "Cannot write to socket -- closing client connection.\n");
+			return -1;
+		}
+		c->bytesDone += n;
+		if (c->bytesDone < c->bytesTotal) continue;
+		if (c->state == 2 && c->respBufSize > 0) {
+			c->curPtr = (char *) c->response->buf;
+			c->bytesDone = 0;
+			c->bytesTotal = c->respBufSize;
+			c->state = 3;
+			continue;
+		}
+		ft_trace_span(FT_TRACE_WRITE, c->traceCommand, c->phaseStart);
+		finish_response(c);
+	}
+}
+
+static void close_client(ft_buffer_server_t *SC, reactor_t *R, client_t *c) {
+	int k;
+
+	if (c->waitstream != NULL) {
+		samples_events_t current;
+		ft_waitreg_disarm(&c->waitstream->waiters, &c->waiter, &current);
+	}
+	ft_subscription_stop(&c->C.subscription);
+
+	pthread_mutex_lock(&R->lock);
+	if (c->prev != NULL) c->prev->next = c->next; else R->clients = c->next;
+	if (c->next != NULL) c->next->prev = c->prev;
+	pthread_mutex_unlock(&R->lock);
+
+	pthread_mutex_lock(&SC->lock);
+	SC->numClients--;
+	pthread_mutex_unlock(&SC->lock);
+
+	/* which also takes them out of the epoll sets */
+	closesocket(c->sock);
+	if (c->inner >= 0) close(c->inner);
+	if (c->timer >= 0) close(c->timer);
+	for (k=0; k<2; k++) {
+		if (c->wake[k] >= 0) close(c->wake[k]);
+	}
+	FREE(c->request.buf);
+	finish_response(c);
+	ft_pinned_send_destroy(&c->pinned);
+	free(c);
+}
+
+static void accept_clients(ft_buffer_server_t *SC, reactor_t *R) {
+	struct epoll_event ev;
+
+	for (;;) {
+		struct sockaddr_storage sa;
+		socklen_t size_sa = sizeof(sa);
+		client_t *c;
+		SOCKET s = accept(SC->serverSocket, (struct sockaddr *) &sa, &size_sa);
+
+		if (s == INVALID_SOCKET) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			perror("buffer_server, accept");
+			/* out of descriptors: the listening socket stays readable, so do not spin on it */
+			if (errno == EMFILE || errno == ENFILE) usleep(10000);
+			break;
+		}
+		c = (client_t *) calloc(1, sizeof(client_t));
+		if (c == NULL || set_nonblocking(s) < 0 || ft_pinned_send_init(&c->pinned) != 0) {
+			fprintf(stderr, "Out of memory\n");
+			FREE(c);
+			closesocket(s);
+			continue;
+		}
+		c->sock = s;
+		c->tcp = (sa.ss_family == AF_INET || sa.ss_family == AF_INET6);
+		/* enable packet merging only if it's not localhost, and never for UNIX sockets */
+		c->C.mergePackets = (sa.ss_family == AF_INET && ((struct sockaddr_in *) &sa)->sin_addr.s_addr != htonl(INADDR_LOOPBACK)) ? 1 : 0;
+		c->C.swap = 0;
+		c->C.encoding = FT_ENCODING_NONE;
+		ft_subscription_init(&c->C.subscription);
+		c->request.def = &c->reqdef;
+		c->waiter.woken = 1;
+		c->inner = c->timer = c->subfd = -1;
+		c->wake[0] = c->wake[1] = -1;
+		reset(c);
+
+		if (SC->verbosity > 0) {
+			printf("Started new client with packet merging = %i\n", c->C.mergePackets);
+		}
+		pthread_mutex_lock(&R->lock);
+		c->next = R->clients;
+		if (R->clients != NULL) R->clients->prev = c;
+		R->clients = c;
+		pthread_mutex_unlock(&R->lock);
+		pthread_mutex_lock(&SC->lock);
+		SC->numClients++;
+		pthread_mutex_unlock(&SC->lock);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = c;
+		if (epoll_ctl(R->epfd, EPOLL_CTL_ADD, s, &ev) != 0) {
+			perror("buffer_server, epoll_ctl");
+			close_client(SC, R, c);
+		}
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = &listenTag;
+	if (epoll_ctl(R->epfd, EPOLL_CTL_MOD, SC->serverSocket, &ev) != 0) {
+		perror("buffer_server, epoll_ctl");
+	}
+}
+
+static void *worker(void *arg) {
+	ft_buffer_server_t *SC = (ft_buffer_server_t *) arg;
+	reactor_t *R = (reactor_t *) SC->reactor;
+
+	while (SC->keepRunning) {
+		struct epoll_event ev;
+		client_t *c;
+		int res, n = epoll_wait(R->epfd, &ev, 1, -1);
+
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			perror("buffer_server, epoll_wait");
+			break;
+		}
+		if (n == 0) continue;
+		/* level-triggered, so every worker sees it */
+		if (ev.data.ptr == &wakeTag) break;
+		if (ev.data.ptr == &listenTag) {
+			accept_clients(SC, R);
+			continue;
+		}
+
+		c = (client_t *) ev.data.ptr;
+		ft_select_stream(c->stream);
+		res = serve(SC, R, c);
+		c->stream = ft_current_stream();
+		/* after watch, another worker may have the connection */
+		if (res != 0 || watch(R, c) != 0) close_client(SC, R, c);
+	}
+	return NULL;
+}
+
+/*****************************************************************************/
+
+int ft_reactor_create(ft_buffer_server_t *SC) {
+	struct epoll_event ev;
+	reactor_t *R = (reactor_t *) calloc(1, sizeof(reactor_t));
+
+	if (R == NULL) return -1;
+	R->epfd = epoll_create(64);
+	R->wakefd = eventfd(0, 0);
+	if (R->epfd < 0 || R->wakefd < 0 || pthread_mutex_init(&R->lock, NULL) != 0) {
+		perror("ft_reactor_create");
+		if (R->epfd >= 0) close(R->epfd);
+		if (R->wakefd >= 0) close(R->wakefd);
+		free(R);
+		return -1;
+	}
+	SC->reactor = R;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &wakeTag;
+	if (epoll_ctl(R->epfd, EPOLL_CTL_ADD, R->wakefd, &ev) != 0) goto failed;
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = &listenTag;
+	if (epoll_ctl(R->epfd, EPOLL_CTL_ADD, SC->serverSocket, &ev) != 0) goto failed;
+	return 0;
+
+failed:
+	perror("ft_reactor_create, epoll_ctl");
+	ft_reactor_destroy(SC);
+	return -1;
+}
+
+void ft_reactor_destroy(ft_buffer_server_t *SC) {
+	reactor_t *R = (reactor_t *) SC->reactor;
+	if (R == NULL) return;
+	close(R->epfd);
+	close(R->wakefd);
+	pthread_mutex_destroy(&R->lock);
+	free(R);
+	SC->reactor = NULL;
+}
+
+void *ft_reactor_run(void *arg) {
+	ft_buffer_server_t *SC = (ft_buffer_server_t *) arg;
+	reactor_t *R = (reactor_t *) SC->reactor;
+	pthread_t *tids;
+	int k, started = 0;
+
+	tids = (pthread_t *) calloc(SC->numWorkers, sizeof(pthread_t));
+	if (tids != NULL) {
+		for (k=1; k<SC->numWorkers; k++) {
+			if (pthread_create(&tids[started], NULL, worker, SC) != 0) {
+				fprintf(stderr, "buffer_server: could only start %i worker threads\n", started+1);
+				break;
+			}
+			started++;
+		}
+	}
+	worker(SC);
+	for (k=0; k<started; k++) pthread_join(tids[k], NULL);
+	FREE(tids);
+
+	/* all workers are gone, so nobody else touches the connections */
+	while (R->clients != NULL) close_client(SC, R, R->clients);
+
+	pthread_mutex_lock(&SC->lock);
+	SC->numClients--;
+	pthread_mutex_unlock(&SC->lock);
+	return NULL;
+}
+
+void ft_reactor_wake(ft_buffer_server_t *SC) {
+	reactor_t *R = (reactor_t *) SC->reactor;
+	uint64_t one = 1;
+	if (R != NULL && write(R->wakefd, &one, sizeof(one)) < 0) {
+		perror("ft_reactor_wake");
+	}
+}
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "socketserver.h"
+#include "subscribe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** What a connection remembers from one request to the next, whether it has
+    a thread of its own (socketserver.c) or is served by the reactor below.
+*/
+typedef struct {
+	int      mergePackets;   /**< 1: merge small responses into one packet (see socketserver.h) */
+	int      swap;           /**< 1: the client has the other byte order */
+	UINT16_T reqCommand;     /**< command of the current request, in native byte order */
+	UINT32_T encoding;       /**< FT_ENCODING_NONE or FT_ENCODING_DELTA, see compress.h */
+#ifndef WIN32
+	ft_subscription_t subscription;
+#endif
+} ft_connection_t;
+
+/** Handles a request that has been read completely, and whose buf has been
+    swapped to native byte order already: answers the requests that belong to
+    the connection (SET_ENCODING and the subscription commands), and passes
+    the others on to the callback of the server or to dmarequest. The samples
+    of PUT_DAT and GET_DAT are decoded and encoded as the client asked for,
+    the response is swapped back to the byte order of the client, and
+    request->buf is freed. *response is NULL if the request is not answered
+    (SUBSCRIBE_CREDIT). As response->def may have been swapped, the size of
+    response->buf is returned in respBufSize. Returns -1 if the connection
+    should be closed.
+*/
+int ft_connection_handle(ft_buffer_server_t *SC, ft_connection_t *C, message_t *request, message_t **response, UINT32_T *respBufSize);
+
+/** A response without a buf, or NULL if there is no memory */
+message_t *ft_simple_response(UINT16_T command);
+
+#ifdef __linux__
+
+/** The epoll reactor, which serves all clients of a server with a fixed pool
+    of SC->numWorkers threads instead of one thread per client.
+
+    The listening socket and all client sockets are in one epoll set, with
+    EPOLLONESHOT, so a connection is only ever handled by one worker at a
+    time, and goes back into the set when that worker is done with it. The
+    workers all wait in epoll_wait, and nothing polls: an idle server does
+    not use any CPU, and a new connection is accepted at once. A connection
+    goes through the same states as in socketserver.c, but its reads and
+    writes never block. A worker reads requests and writes responses until
+    the socket would block, and after a few requests in a row it gives the
+    others a turn.
+
+    Nothing that blocks for longer than a lock is ever done by a worker.
+    WAIT_DAT is not passed on to dmarequest, but registered with the waiting
+    clients of the stream (see ft_waitreg_arm), which write a byte to a pipe
+    of the connection when the threshold is exceeded; a timerfd takes care of
+    the timeout. The same timerfd also gives a subscription (subscribe.h) its
+    latency deadline. Once a connection needs more than its socket, it gets
+    an epoll set of its own with the socket, the pipes and the timer, and it
+    is this set that goes into the epoll set of the reactor.
+
+    Large GET_DAT responses are written from the ring (see zerocopy.h). While
+    the connection waits for its socket, its pin is parked (ft_ring_park), so
+    a writer that needs the samples earlier copies the rest of the response
+    instead of waiting for the client. Large PUT_DAT requests are received
+    into the ring, but only once they have arrived completely (for TCP,
+    SO_RCVLOWAT tells epoll to wait for that), as the locks of the stream
+    cannot be kept while another worker may continue with the connection.
+    Requests that do not fit in the TCP window of the moment, or that have
+    not all arrived after FT_INGEST_TIMEOUT, are read into a buffer as usual.
+
+    The stream that a connection selected is kept with the connection, and
+    selected in the worker whenever the connection is handled.
+*/
+
+/** Creates the epoll set and the wake-up descriptor of server SC, returns 0 on success */
+int  ft_reactor_create(ft_buffer_server_t *SC);
+
+/** The server thread: serves clients with SC->numWorkers threads (including
+    this one) until SC->keepRunning is 0, then closes all connections.
+*/
+void *ft_reactor_run(void *arg);
+
+/** Frees what ft_reactor_create made, once the server thread has finished */
+void ft_reactor_destroy(ft_buffer_server_t *SC);
+
+/** Wakes up all workers, after SC->keepRunning has been set to 0 */
+void ft_reactor_wake(ft_buffer_server_t *SC);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REACTOR_H */
@@ -0,0 +1,256 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringbuffer.h"
+
+int ft_ring_init(ft_ring_t *R, UINT32_T capacity, UINT32_T chansize) {
+	ft_ring_attach(R, (char *) malloc((size_t) capacity * chansize), capacity, chansize);
+	return (R->buf == NULL) ? -1 : 0;
+}
+
+void ft_ring_attach(ft_ring_t *R, char *buf, UINT32_T capacity, UINT32_T chansize) {
+	R->capacity = capacity;
+	R->chansize = chansize;
+	R->head     = 0;
+	R->commit   = 0;
+	R->reserved = 0;
+	R->pinwaits = 0;
+	R->pinrevokes = 0;
+	memset((void *) R->pin, 0, sizeof(R->pin));
+	memset((void *) R->parked, 0, sizeof(R->parked));
+	memset((void *) R->revoked, 0, sizeof(R->revoked));
+	R->buf      = buf;
+}
+
+void ft_ring_free(ft_ring_t *R) {
+	if (R->buf) {
+		free(R->buf);
+		R->buf = NULL;
+	}
+	R->capacity = 0;
+	R->head = R->commit = R->reserved = 0;
+}
+
+void ft_ring_reset(ft_ring_t *R) {
+	FT_ATOMIC_STORE(&R->head, 0);
+	FT_ATOMIC_STORE(&R->commit, 0);
+	R->reserved = 0;
+}
+
+UINT32_T ft_ring_count(const ft_ring_t *R) {
+	return FT_ATOMIC_LOAD(&R->commit);
+}
+
+UINT32_T ft_ring_first(const ft_ring_t *R) {
+	UINT32_T n = FT_ATOMIC_LOAD(&R->commit), h = FT_ATOMIC_LOAD(&R->head);
+	/* an aborted block may have taken slots beyond the committed samples */
+	if (h - n > R->capacity) h = n;
+	return (h > R->capacity) ? h - R->capacity : 0;
+}
+
+/* takes pin i away from a reader that parked it, returns 0 if it is not parked */
+static int evict_pin(ft_ring_t *R, int i) {
+	UINT32_T expected = 1;
+	if (!FT_ATOMIC_CAS(&R->parked[i], expected, 2)) return 0;
+	R->evict[i](R->evictarg[i]);
+	/* in this order, so that whoever gets the pin next finds it unparked */
+	FT_ATOMIC_STORE(&R->parked[i], 0);
+	FT_ATOMIC_STORE(&R->revoked[i], 0);
+	FT_ATOMIC_STORE(&R->pin[i], 0);
+	return 1;
+}
+
+/* stops waiting for pin i, which is in the way of a block that ends at "end" */
+static void revoke_pin(ft_ring_t *R, int i, UINT32_T end) {
+	UINT32_T p;
+
+	FT_ATOMIC_STORE(&R->revoked[i], 1);
+	FT_ATOMIC_ADD(&R->pinrevokes, 1);
+	/* the reader has to be able to see this before any of the slots change */
+	FT_FENCE_FULL();
+	/* unless it has just given the pin back, and another reader pinned
+	   samples that we do not need */
+	p = FT_ATOMIC_LOAD(&R->pin[i]);
+	if (p == 0 || end - (p-1) <= R->capacity) FT_ATOMIC_STORE(&R->revoked[i], 0);
+}
+
+int ft_ring_reserve(ft_ring_t *R, UINT32_T nsamples, ft_ring_segment_t seg[2]) {
+	UINT32_T start, na, p, waited = 0;
+	int i;
+
+	if (nsamples > R->capacity) return 0;
+
+	/* the writer owns the counters, so relaxed loads are enough here; head
+	   only moves if the block reaches beyond what an aborted one claimed */
+	start = FT_ATOMIC_LOAD_RELAXED(&R->commit);
+	R->reserved = start + nsamples;
+	if (nsamples > FT_ATOMIC_LOAD_RELAXED(&R->head) - start) FT_ATOMIC_STORE(&R->head, start + nsamples);
+	/* make sure readers see the new head before any of the slots change */
+	FT_FENCE_FULL();
+
+	/* readers that pinned slots we are about to overwrite are still sending
+	   them, so wait until they are done (ft_ring_pin makes this rare), or
+	   take the pins away from those that wait for their socket; a reader
+	   that does not finish within FT_RING_PIN_TIMEOUT loses its pin */
+	for (i=0; i<FT_RING_PINS; i++) {
+		p = FT_ATOMIC_LOAD(&R->pin[i]);
+		if (p == 0 || start + nsamples - (p-1) <= R->capacity || FT_ATOMIC_LOAD(&R->revoked[i])) continue;
+		FT_ATOMIC_ADD(&R->pinwaits, 1);
+		for (;;) {
+			if (!evict_pin(R, i)) {
+				if (waited >= FT_RING_PIN_TIMEOUT*10) {
+					revoke_pin(R, i, start + nsamples);
+					break;
+				}
+				usleep(100);
+				waited++;
+			}
+			p = FT_ATOMIC_LOAD(&R->pin[i]);
+			if (p == 0 || start + nsamples - (p-1) <= R->capacity) break;
+		}
+	}
+
+	start = start % R->capacity;
+	na = R->capacity - start;
+	seg[0].ptr = R->buf + (size_t) start * R->chansize;
+	if (nsamples <= na) {
+		seg[0].nsamples = nsamples;
+		seg[1].ptr = NULL;
+		seg[1].nsamples = 0;
+		return 1;
+	}
+	seg[0].nsamples = na;
+	seg[1].ptr = R->buf;
+	seg[1].nsamples = nsamples - na;
+	return 2;
+}
+
+void ft_ring_commit(ft_ring_t *R) {
+	FT_ATOMIC_STORE(&R->commit, R->reserved);
+}
+
+void ft_ring_abort(ft_ring_t *R) {
+	R->reserved = FT_ATOMIC_LOAD_RELAXED(&R->commit);
+}
+
+int ft_ring_write(ft_ring_t *R, const void *src, UINT32_T nsamples) {
+	ft_ring_segment_t seg[2];
+	int i, n;
+
+	n = ft_ring_reserve(R, nsamples, seg);
+	if (n == 0) return -1;
+
+	for (i=0; i<n; i++) {
+		memcpy(seg[i].ptr, src, (size_t) seg[i].nsamples * R->chansize);
+		src = (const char *) src + (size_t) seg[i].nsamples * R->chansize;
+	}
+	ft_ring_commit(R);
+	return 0;
+}
+
+int ft_ring_read(const ft_ring_t *R, UINT32_T begsample, UINT32_T nsamples, void *dest) {
+	return ft_ring_read_from(R, R->buf, begsample, nsamples, dest);
+}
+
+int ft_ring_read_from(const ft_ring_t *R, const char *buf, UINT32_T begsample, UINT32_T nsamples, void *dest) {
+	UINT32_T commit, head, start, na;
+
+	commit = FT_ATOMIC_LOAD(&R->commit);
+	if (begsample + nsamples > commit) return FT_RING_NOTYET;
+	if (commit - begsample > R->capacity) return FT_RING_OVERWRITTEN;
+
+	start = begsample % R->capacity;
+	na = R->capacity - start;
+	if (nsamples <= na) {
+		memcpy(dest, buf + (size_t) start * R->chansize, (size_t) nsamples * R->chansize);
+	} else {
+		memcpy(dest, buf + (size_t) start * R->chansize, (size_t) na * R->chansize);
+		memcpy((char *) dest + (size_t) na * R->chansize, buf, (size_t) (nsamples - na) * R->chansize);
+	}
+
+	/* the copy has to be finished before we look at the writer's position again */
+	FT_FENCE_ACQUIRE();
+	head = FT_ATOMIC_LOAD(&R->head);
+
+	/* slot "begsample" is overwritten as soon as the writer claims begsample+capacity */
+	if (head - begsample > R->capacity) return FT_RING_OVERWRITTEN;
+	return FT_RING_OK;
+}
+
+int ft_ring_pin(ft_ring_t *R, UINT32_T begsample, UINT32_T nsamples, UINT32_T headroom, ft_ring_segment_t seg[2], int *pin) {
+	UINT32_T commit, head, start, na, expected;
+	int i;
+
+	commit = FT_ATOMIC_LOAD(&R->commit);
+	if (begsample + nsamples > commit) return FT_RING_NOTYET;
+	if (commit - begsample > R->capacity) return FT_RING_OVERWRITTEN;
+	if (headroom >= R->capacity || commit - begsample > R->capacity - headroom) return FT_RING_NOPIN;
+
+	for (i=0; i<FT_RING_PINS; i++) {
+		expected = 0;
+		if (FT_ATOMIC_CAS(&R->pin[i], expected, begsample + 1)) break;
+	}
+	if (i == FT_RING_PINS) return FT_RING_NOPIN;
+
+	/* the writer publishes head before looking at the pins, we publish the pin
+	   before looking at head, so at least one of us sees the other */
+	FT_FENCE_FULL();
+	head = FT_ATOMIC_LOAD(&R->head);
+	if (head - begsample > R->capacity) {
+		FT_ATOMIC_STORE(&R->pin[i], 0);
+		return FT_RING_OVERWRITTEN;
+	}
+
+	start = begsample % R->capacity;
+	na = R->capacity - start;
+	seg[0].ptr = R->buf + (size_t) start * R->chansize;
+	if (nsamples <= na) {
+		seg[0].nsamples = nsamples;
+		seg[1].ptr = NULL;
+		seg[1].nsamples = 0;
+	} else {
+		seg[0].nsamples = na;
+		seg[1].ptr = R->buf;
+		seg[1].nsamples = nsamples - na;
+	}
+	*pin = i;
+	return FT_RING_OK;
+}
+
+int ft_ring_pin_check(const ft_ring_t *R, int pin) {
+	/* whatever was taken from the slots has to be taken before we look */
+	FT_FENCE_ACQUIRE();
+	return FT_ATOMIC_LOAD(&R->revoked[pin]) ? FT_RING_OVERWRITTEN : FT_RING_OK;
+}
+
+int ft_ring_unpin(ft_ring_t *R, int pin) {
+	int res = ft_ring_pin_check(R, pin);
+	/* in this order, so that whoever gets the pin next finds it valid */
+	FT_ATOMIC_STORE(&R->revoked[pin], 0);
+	FT_ATOMIC_STORE(&R->pin[pin], 0);
+	return res;
+}
+
+void ft_ring_park(ft_ring_t *R, int pin, ft_ring_evict_t evict, void *arg) {
+	R->evict[pin] = evict;
+	R->evictarg[pin] = arg;
+	FT_ATOMIC_STORE(&R->parked[pin], 1);
+}
+
+int ft_ring_unpark(ft_ring_t *R, int pin) {
+	UINT32_T expected = 1;
+	return FT_ATOMIC_CAS(&R->parked[pin], expected, 0) ? 1 : 0;
+}
+
+void ft_ring_unpin_all(ft_ring_t *R) {
+	int i;
+	for (i=0; i<FT_RING_PINS; i++) {
+		while (FT_ATOMIC_LOAD(&R->pin[i]) != 0) {
+			if (!evict_pin(R, i)) usleep(100);
+		}
+	}
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include "platform_includes.h"
+#include "message.h"
+#include "atomicops.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* return values of ft_ring_read */
+#define FT_RING_OK           0
+#define FT_RING_NOTYET      -1   /* (part of) the selection has not been written yet */
+#define FT_RING_OVERWRITTEN -2   /* (part of) the selection has already been overwritten */
+#define FT_RING_NOPIN       -3   /* the selection is too close to being overwritten, or no pin is free */
+
+/* maximal number of readers that can have samples pinned at the same time */
+#define FT_RING_PINS        16
+
+/* the writer waits about this many milliseconds for a pin before it revokes it */
+#define FT_RING_PIN_TIMEOUT 10
+
+/** Called by the writer to take away a parked pin, see ft_ring_park */
+typedef void (*ft_ring_evict_t)(void *arg);
+
+/** Sample ring for one writer and any number of concurrent readers.
+
+    The writer announces the samples it is about to write by advancing "head",
+    copies them into the ring, and then publishes them by advancing "commit".
+    Readers never take a lock: they check that the selection is committed,
+    copy it out, and afterwards re-read "head" to find out whether the writer
+    has started overwriting (part of) what they just copied. In that case the
+    copy is discarded and FT_RING_OVERWRITTEN is returned. Both counters are
+    absolute sample numbers, so they also serve as the sample count that is
+    reported in the header.
+
+    A block that was reserved but never completed is given back with
+    ft_ring_abort: the next block starts at "commit" again. "head" stays where
+    it was, because the slots up to there may have been partially written and
+    readers have to keep treating them as overwritten. It is therefore the
+    highest sample number the writer ever claimed, not the end of the block
+    it is currently writing, which is kept in "reserved".
+
+    Only one thread may write at any time; callers with multiple writers need
+    to serialize ft_ring_reserve/ft_ring_commit (dmarequest uses mutexdata).
+
+    Readers that cannot copy, because they hand the ring memory itself to the
+    socket layer, pin their first sample instead (see ft_ring_pin). A pin is
+    a read epoch: as long as it is held, ft_ring_reserve will not hand out
+    the slots from that sample on, and the writer waits if it would. Pins are
+    only granted with some headroom, so this should be rare, but the writer
+    never waits longer than FT_RING_PIN_TIMEOUT: after that, it revokes the
+    pin and goes on. The reader finds out with ft_ring_pin_check or when it
+    unpins, and has to throw away whatever it took from the ring meanwhile.
+    A reader that has to wait for its socket before it can send more parks
+    its pin (see ft_ring_park); the writer then does not wait for it at all,
+    but has the reader copy what it still needs and takes the pin away.
+*/
+typedef struct {
+	char     *buf;                /**< ring memory, capacity x chansize bytes */
+	UINT32_T capacity;            /**< number of samples (all channels) the ring can hold */
+	UINT32_T chansize;            /**< number of bytes per sample, i.e. wordsize x nchans */
+	volatile UINT32_T head;       /**< samples claimed by the writer, may still be in progress */
+	volatile UINT32_T commit;     /**< samples completely written and visible to readers */
+	volatile UINT32_T pin[FT_RING_PINS]; /**< first pinned sample + 1, or 0 if the pin is free */
+	volatile UINT32_T pinwaits;   /**< number of times the writer had to wait for a pin */
+	volatile UINT32_T pinrevokes; /**< number of pins the writer stopped waiting for */
+	UINT32_T reserved;            /**< end of the block being written, only used by the writer */
+	volatile UINT32_T parked[FT_RING_PINS]; /**< 1 while the pin may be taken away, 2 while it is */
+	ft_ring_evict_t evict[FT_RING_PINS];    /**< what takes a parked pin away */
+	void    *evictarg[FT_RING_PINS];
+	volatile UINT32_T revoked[FT_RING_PINS]; /**< 1 once the writer no longer waits for the pin */
+} ft_ring_t;
+
+/** Describes a contiguous part of the ring memory */
+typedef struct {
+	char     *ptr;
+	UINT32_T nsamples;
+} ft_ring_segment_t;
+
+/** Allocates the ring memory for "capacity" samples of "chansize" bytes each.
+    Returns 0 on success, -1 if the memory could not be allocated.
+*/
+int  ft_ring_init(ft_ring_t *R, UINT32_T capacity, UINT32_T chansize);
+
+/** Like ft_ring_init, but uses memory that the caller provides (e.g. shared
+    memory, see shm.h) and that must not be released with ft_ring_free.
+*/
+void ft_ring_attach(ft_ring_t *R, char *buf, UINT32_T capacity, UINT32_T chansize);
+void ft_ring_free(ft_ring_t *R);
+
+/** Forgets about all samples, must not be called concurrently with readers */
+void ft_ring_reset(ft_ring_t *R);
+
+/** Returns the number of samples that have been committed so far */
+UINT32_T ft_ring_count(const ft_ring_t *R);
+
+/** Returns the first sample number that is still available in the ring */
+UINT32_T ft_ring_first(const ft_ring_t *R);
+
+/** Writer side: claims room for "nsamples" and returns the one or two ring
+    segments (second one in case of wrapping) that the caller should fill.
+    Returns the number of segments, or 0 if nsamples exceeds the capacity.
+    Readers will detect if any of the claimed slots held samples they copy.
+*/
+int  ft_ring_reserve(ft_ring_t *R, UINT32_T nsamples, ft_ring_segment_t seg[2]);
+
+/** Writer side: publishes the samples claimed by the last ft_ring_reserve */
+void ft_ring_commit(ft_ring_t *R);
+
+/** Writer side: gives back the samples claimed by the last ft_ring_reserve
+    without publishing them. The slots they occupied stay lost to readers.
+*/
+void ft_ring_abort(ft_ring_t *R);
+
+/** Writer side: convenience function that reserves, copies and commits.
+    Returns 0 on success, -1 if nsamples exceeds the capacity.
+*/
+int  ft_ring_write(ft_ring_t *R, const void *src, UINT32_T nsamples);
+
+/** Reader side: copies samples begsample ... begsample+nsamples-1 into dest.
+    Returns FT_RING_OK, FT_RING_NOTYET or FT_RING_OVERWRITTEN.
+*/
+int  ft_ring_read(const ft_ring_t *R, UINT32_T begsample, UINT32_T nsamples, void *dest);
+
+/** Same as ft_ring_read, for a ring that lives in memory shared with another
+    process, where "buf" is the address of the ring memory in this process.
+*/
+int  ft_ring_read_from(const ft_ring_t *R, const char *buf, UINT32_T begsample, UINT32_T nsamples, void *dest);
+
+/** Reader side: returns the one or two ring segments that hold samples
+    begsample ... begsample+nsamples-1, and keeps the writer from overwriting
+    them until ft_ring_unpin(R, *pin) is called, or for FT_RING_PIN_TIMEOUT
+    once the writer needs them. The selection is only pinned if the writer can
+    still add at least "headroom" samples before it reaches begsample,
+    otherwise FT_RING_NOPIN is returned and the caller should copy with
+    ft_ring_read. Returns FT_RING_OK, FT_RING_NOTYET, FT_RING_OVERWRITTEN or
+    FT_RING_NOPIN.
+*/
+int  ft_ring_pin(ft_ring_t *R, UINT32_T begsample, UINT32_T nsamples, UINT32_T headroom, ft_ring_segment_t seg[2], int *pin);
+
+/** Reader side: returns FT_RING_OK if everything that was taken from the pinned
+    slots so far is valid, or FT_RING_OVERWRITTEN if the writer revoked the pin,
+    in which case the writer may have started overwriting them already.
+*/
+int  ft_ring_pin_check(const ft_ring_t *R, int pin);
+
+/** Reader side: gives the pin back, returns the same as ft_ring_pin_check */
+int  ft_ring_unpin(ft_ring_t *R, int pin);
+
+/** Reader side: lets the writer take the pin away instead of waiting for it,
+    while the reader is not using the pinned memory. The writer then calls
+    evict(arg) from its own thread, which has to copy what the reader still
+    needs, and afterwards frees the pin itself; evict must not block on
+    anything but a short lock that the reader holds around ft_ring_unpark.
+*/
+void ft_ring_park(ft_ring_t *R, int pin, ft_ring_evict_t evict, void *arg);
+
+/** Reader side: takes back a parked pin before using the pinned memory again.
+    Returns 1 if the pin is still held. Returns 0 if the writer is taking it
+    away, in which case evict has been or will be called, and neither the pin
+    nor the ring may be touched anymore.
+*/
+int  ft_ring_unpark(ft_ring_t *R, int pin);
+
+/** Writer side: waits until nothing is pinned anymore, taking away parked
+    pins. Must be called before the ring is reset or freed, at a time when
+    nobody can pin (dmarequest holds rwlockring for writing).
+*/
+void ft_ring_unpin_all(ft_ring_t *R);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RINGBUFFER_H */
@@ -0,0 +1,490 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "buffer.h"
+#include "stream.h"
+#include "shm.h"
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
+
+#define FT_SHM_MAGIC 0x46545348   /* "FTSH" */
+
+static int valid_name(const char *name) {
+	size_t i, len = strlen(name);
+	if (len == 0 || len > FT_SHM_NAME_LENGTH) return 0;
+	for (i=0; i<len; i++) {
+		if (!isalnum((unsigned char) name[i]) && name[i] != '_' && name[i] != '-' && name[i] != '.') return 0;
+	}
+	return 1;
+}
+
+const char *ft_shm_address(const char *address) {
+	size_t n = strlen(FT_SHM_PREFIX);
+	if (address == NULL || strncmp(address, FT_SHM_PREFIX, n) != 0) return NULL;
+	return valid_name(address + n) ? address + n : NULL;
+}
+
+int ft_shm_socket_path(const char *name, char *path, size_t size) {
+	int n = snprintf(path, size, "%s/ft_%s.sock", FT_SHM_SOCKET_DIR, name);
+	return (n > 0 && (size_t) n < size) ? 0 : -1;
+}
+
+#ifndef WIN32
+
+/* name of the control object of a stream, fails for streams whose name contains a slash */
+static int control_name(const char *name, const char *stream, char *dest) {
+	int n;
+	if (stream[0] == 0) {
+		n = snprintf(dest, FT_SHM_OBJECT_LENGTH, "/ft_%s", name);
+	} else {
+		if (strchr(stream, '/') != NULL) return -1;
+		n = snprintf(dest, FT_SHM_OBJECT_LENGTH, "/ft_%s@%s", name, stream);
+	}
+	return (n > 0 && n < FT_SHM_OBJECT_LENGTH) ? 0 : -1;
+}
+
+/*****************************************************************************
+ * server side
+ *****************************************************************************/
+
+struct ft_shm_export {
+	char   control[FT_SHM_OBJECT_LENGTH];   /* name of the control object */
+	ft_shm_control_t *ctl;
+	char   data[FT_SHM_OBJECT_LENGTH];      /* name of the current data object */
+	char  *base;                            /* its mapping, NULL if there is none */
+	size_t size;
+	UINT32_T instance;                      /* of the last ring, never re-used */
+};
+
+static char exportName[FT_SHM_NAME_LENGTH+1] = "";
+static pthread_mutex_t mutexexport = PTHREAD_MUTEX_INITIALIZER;
+
+static void begin_update(struct ft_shm_export *E) {
+	FT_ATOMIC_STORE(&E->ctl->seq, E->ctl->seq + 1);
+	/* clients must see the odd counter before anything changes */
+	FT_FENCE_FULL();
+}
+
+static void end_update(struct ft_shm_export *E) {
+	FT_ATOMIC_STORE(&E->ctl->seq, E->ctl->seq + 1);
+}
+
+int ft_shm_enable(const char *name) {
+	if (!valid_name(name)) {
+		fprintf(stderr, "ft_shm_enable: invalid name '%s'\n", name);
+		return -1;
+	}
+	pthread_mutex_lock(&mutexexport);
+	strcpy(exportName, name);
+	pthread_mutex_unlock(&mutexexport);
+	return 0;
+}
+
+/* creates the control object of stream S on first use, returns NULL if S is not exported */
+static struct ft_shm_export *get_export(ft_stream_t *S) {
+	struct ft_shm_export *E;
+	char name[FT_SHM_NAME_LENGTH+1];
+	void *ctl;
+	int fd;
+
+	if (S->shm != NULL) return S->shm;
+
+	pthread_mutex_lock(&mutexexport);
+	strcpy(name, exportName);
+	pthread_mutex_unlock(&mutexexport);
+	if (name[0] == 0) return NULL;
+
+	E = (struct ft_shm_export *) calloc(1, sizeof(struct ft_shm_export));
+	if (E == NULL) return NULL;
+	if (control_name(name, S->name, E->control) != 0) {
+		free(E);
+		return NULL;
+	}
+
+	/* an existing object is re-used, so that clients that still have it mapped see the new rings */
+	fd = shm_open(E->control, O_CREAT | O_RDWR, 0600);
+	if (fd < 0) {
+		perror("ft_shm: shm_open");
+		free(E);
+		return NULL;
+	}
+	if (ftruncate(fd, sizeof(ft_shm_control_t)) != 0) {
+		perror("ft_shm: ftruncate");
+		close(fd);
+		free(E);
+		return NULL;
+	}
+	ctl = mmap(NULL, sizeof(ft_shm_control_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ctl == MAP_FAILED) {
+		perror("ft_shm: mmap");
+		free(E);
+		return NULL;
+	}
+	E->ctl = (ft_shm_control_t *) ctl;
+
+	/* a server that did not stop cleanly may have left its ring behind */
+	E->ctl->seq |= 1;
+	FT_FENCE_FULL();
+	if (E->ctl->instance != 0 && E->ctl->data[0] != 0) {
+		E->ctl->data[FT_SHM_OBJECT_LENGTH-1] = 0;
+		shm_unlink(E->ctl->data);
+	}
+	E->instance = E->ctl->instance;
+	E->ctl->data[0] = 0;
+	E->ctl->magic = FT_SHM_MAGIC;
+	end_update(E);
+
+	S->shm = E;
+	return E;
+}
+
+ft_ring_t *ft_shm_ring_alloc(ft_stream_t *S, UINT32_T capacity, UINT32_T chansize, UINT32_T nchans, UINT32_T data_type) {
+	struct ft_shm_export *E = get_export(S);
+	size_t size = FT_SHM_DATA_OFFSET + (size_t) capacity * chansize;
+	UINT32_T instance;
+	void *base;
+	int fd;
+
+	if (E == NULL) return NULL;
+	if ((size - FT_SHM_DATA_OFFSET) / chansize != capacity) return NULL;
+
+	/* clients recognise a new ring by its instance number */
+	instance = E->instance + 1;
+	if (instance == 0) instance = 1;
+	if (snprintf(E->data, FT_SHM_OBJECT_LENGTH, "%s.%u", E->control, instance) >= FT_SHM_OBJECT_LENGTH) return NULL;
+
+	fd = shm_open(E->data, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		shm_unlink(E->data);
+		fd = shm_open(E->data, O_CREAT | O_EXCL | O_RDWR, 0600);
+	}
+	if (fd < 0) {
+		perror("ft_shm: shm_open");
+		return NULL;
+	}
+	/* reserve the memory now, touching pages that do not fit would raise SIGBUS later */
+	if (ftruncate(fd, size) != 0 || posix_fallocate(fd, 0, size) != 0) {
+		fprintf(stderr, "ft_shm: cannot allocate %lu bytes of shared memory, using private memory\n", (unsigned long) size);
+		close(fd);
+		shm_unlink(E->data);
+		return NULL;
+	}
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		perror("ft_shm: mmap");
+		shm_unlink(E->data);
+		return NULL;
+	}
+	E->base = (char *) base;
+	E->size = size;
+	E->instance = instance;
+	ft_ring_attach((ft_ring_t *) E->base, E->base + FT_SHM_DATA_OFFSET, capacity, chansize);
+
+	begin_update(E);
+	E->ctl->instance  = instance;
+	E->ctl->nchans    = nchans;
+	E->ctl->data_type = data_type;
+	E->ctl->size      = size;
+	strcpy(E->ctl->data, E->data);
+	end_update(E);
+
+	return (ft_ring_t *) E->base;
+}
+
+int ft_shm_ring_free(ft_stream_t *S) {
+	struct ft_shm_export *E = S->shm;
+
+	if (E == NULL || E->base == NULL || (char *) S->data != E->base) return 0;
+
+	begin_update(E);
+	E->ctl->instance = 0;
+	E->ctl->data[0] = 0;
+	end_update(E);
+
+	/* clients that still have it mapped keep their copy until they notice */
+	munmap(E->base, E->size);
+	shm_unlink(E->data);
+	E->base = NULL;
+	E->size = 0;
+	S->data = NULL;
+	return 1;
+}
+
+void ft_shm_begin_update(ft_stream_t *S) {
+	if (S->shm != NULL) begin_update(S->shm);
+}
+
+void ft_shm_end_update(ft_stream_t *S) {
+	if (S->shm != NULL) end_update(S->shm);
+}
+
+void ft_shm_export_free(ft_stream_t *S) {
+	struct ft_shm_export *E = S->shm;
+
+	if (E == NULL) return;
+	ft_shm_ring_free(S);
+	begin_update(E);
+	E->ctl->instance = 0;
+	end_update(E);
+	munmap(E->ctl, sizeof(ft_shm_control_t));
+	shm_unlink(E->control);
+	free(E);
+	S->shm = NULL;
+}
+
+/*****************************************************************************
+ * client side
+ *****************************************************************************/
+
+typedef struct {
+	char name[FT_SHM_NAME_LENGTH+1];
+	char control[FT_SHM_OBJECT_LENGTH];   /* empty if the stream cannot be exported */
+	const ft_shm_control_t *ctl;          /* NULL if not mapped (yet) */
+	UINT32_T    instance;                 /* of the mapped ring, 0 if none */
+	const char *base;
+	size_t      size;
+	UINT32_T    nchans;
+	UINT32_T    data_type;
+	unsigned long local;
+} ft_shm_client_t;
+
+/* indexed by the socket, protected by mutexclients */
+static ft_shm_client_t *shmClients[FT_SHM_MAX_SOCKET];
+static pthread_mutex_t mutexclients = PTHREAD_MUTEX_INITIALIZER;
+
+static ft_shm_client_t *get_client(int server) {
+	ft_shm_client_t *C;
+	if (server <= 0 || server >= FT_SHM_MAX_SOCKET) return NULL;
+	pthread_mutex_lock(&mutexclients);
+	C = shmClients[server];
+	pthread_mutex_unlock(&mutexclients);
+	return C;
+}
+
+static void unmap_data(ft_shm_client_t *C) {
+	if (C->base != NULL) munmap((void *) C->base, C->size);
+	C->base = NULL;
+	C->size = 0;
+	C->instance = 0;
+}
+
+static void unmap_control(ft_shm_client_t *C) {
+	unmap_data(C);
+	if (C->ctl != NULL) munmap((void *) C->ctl, sizeof(ft_shm_control_t));
+	C->ctl = NULL;
+}
+
+static int map_control(ft_shm_client_t *C) {
+	struct stat st;
+	void *ctl;
+	int fd;
+
+	if (C->control[0] == 0) return -1;
+	fd = shm_open(C->control, O_RDONLY, 0);
+	if (fd < 0) return -1;
+	/* the server might not have sized it yet */
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(ft_shm_control_t)) {
+		close(fd);
+		return -1;
+	}
+	ctl = mmap(NULL, sizeof(ft_shm_control_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ctl == MAP_FAILED) return -1;
+	if (((ft_shm_control_t *) ctl)->magic != FT_SHM_MAGIC) {
+		munmap(ctl, sizeof(ft_shm_control_t));
+		return -1;
+	}
+	C->ctl = (const ft_shm_control_t *) ctl;
+	return 0;
+}
+
+/* maps the ring that the control object describes at sequence number seq */
+static int map_data(ft_shm_client_t *C, UINT32_T seq) {
+	char data[FT_SHM_OBJECT_LENGTH];
+	UINT32_T instance, nchans, data_type;
+	UINT64_T size;
+	struct stat st;
+	void *base;
+	int fd;
+
+	instance  = C->ctl->instance;
+	nchans    = C->ctl->nchans;
+	data_type = C->ctl->data_type;
+	size      = C->ctl->size;
+	memcpy(data, C->ctl->data, FT_SHM_OBJECT_LENGTH);
+	data[FT_SHM_OBJECT_LENGTH-1] = 0;
+	FT_FENCE_ACQUIRE();
+	if (FT_ATOMIC_LOAD(&C->ctl->seq) != seq) return -1;
+
+	unmap_data(C);
+	fd = shm_open(data, O_RDONLY, 0);
+	if (fd < 0) return -1;
+	if (fstat(fd, &st) != 0 || (UINT64_T) st.st_size != size) {
+		close(fd);
+		return -1;
+	}
+	base = mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) return -1;
+
+	C->base      = (const char *) base;
+	C->size      = (size_t) size;
+	C->instance  = instance;
+	C->nchans    = nchans;
+	C->data_type = data_type;
+	return 0;
+}
+
+int ft_shm_attach(int server, const char *name) {
+	ft_shm_client_t *C;
+
+	if (server <= 0 || server >= FT_SHM_MAX_SOCKET || !valid_name(name)) return -1;
+	C = (ft_shm_client_t *) calloc(1, sizeof(ft_shm_client_t));
+	if (C == NULL) return -1;
+	strcpy(C->name, name);
+	control_name(name, "", C->control);
+	/* the control object only exists once the server got a header, so this may fail */
+	map_control(C);
+
+	pthread_mutex_lock(&mutexclients);
+	if (shmClients[server] != NULL) {
+		unmap_control(shmClients[server]);
+		free(shmClients[server]);
+	}
+	shmClients[server] = C;
+	pthread_mutex_unlock(&mutexclients);
+	return 0;
+}
+
+void ft_shm_detach(int server) {
+	ft_shm_client_t *C;
+
+	if (server <= 0 || server >= FT_SHM_MAX_SOCKET) return;
+	pthread_mutex_lock(&mutexclients);
+	C = shmClients[server];
+	shmClients[server] = NULL;
+	pthread_mutex_unlock(&mutexclients);
+
+	if (C != NULL) {
+		unmap_control(C);
+		free(C);
+	}
+}
+
+void ft_shm_select_stream(int server, const char *stream, UINT32_T length) {
+	ft_shm_client_t *C = get_client(server);
+	char name[FT_SHM_OBJECT_LENGTH];
+
+	if (C == NULL) return;
+	unmap_control(C);
+	if (length >= FT_SHM_OBJECT_LENGTH) length = FT_SHM_OBJECT_LENGTH-1;
+	memcpy(name, stream, length);
+	name[length] = 0;
+	if (control_name(C->name, name, C->control) != 0) C->control[0] = 0;
+}
+
+int ft_shm_request(int server, const message_t *request, message_t **response_ptr) {
+	ft_shm_client_t *C;
+	const ft_ring_t *R;
+	message_t *response;
+	datadef_t *ddef;
+	datasel_t datasel;
+	UINT32_T seq, nsamples, n;
+
+	if (request->def->command != GET_DAT) return -1;
+	/* channel selections need the header, so the server answers those */
+	if (request->def->bufsize != 0 && request->def->bufsize != sizeof(datasel_t)) return -1;
+	if ((C = get_client(server)) == NULL) return -1;
+	if (C->ctl == NULL && map_control(C) != 0) return -1;
+
+	seq = FT_ATOMIC_LOAD(&C->ctl->seq);
+	if ((seq & 1) || C->ctl->instance == 0) return -1;
+	if (C->ctl->instance != C->instance && map_data(C, seq) != 0) return -1;
+	R = (const ft_ring_t *) C->base;
+
+	/* the same selection as in dmarequest, errors are reported by the server */
+	nsamples = ft_ring_count(R);
+	if (request->def->bufsize) {
+		memcpy(&datasel, request->buf, sizeof(datasel_t));
+		if (datasel.endsample == (UINT32_T) -1) datasel.endsample = nsamples - 1;
+	} else {
+		datasel.begsample = (nsamples > R->capacity) ? nsamples - R->capacity : 0;
+		datasel.endsample = nsamples - 1;
+	}
+	if (nsamples == 0 || datasel.begsample >= nsamples || datasel.endsample >= nsamples || datasel.endsample < datasel.begsample) return -1;
+	if (nsamples - datasel.begsample > R->capacity) return -1;
+	n = datasel.endsample - datasel.begsample + 1;
+	if ((UINT64_T) n * R->chansize + sizeof(datadef_t) > 0xFFFFFFFFu) return -1;
+
+	response = (message_t *) malloc(sizeof(message_t));
+	DIE_BAD_MALLOC(response);
+	response->def = (messagedef_t *) malloc(sizeof(messagedef_t));
+	DIE_BAD_MALLOC(response->def);
+	response->buf = malloc(sizeof(datadef_t) + (size_t) n * R->chansize);
+	DIE_BAD_MALLOC(response->buf);
+	ddef = (datadef_t *) response->buf;
+
+	/* the copy is only valid if the server did not touch the ring in the meantime */
+	if (ft_ring_read_from(R, C->base + FT_SHM_DATA_OFFSET, datasel.begsample, n, ddef + 1) != FT_RING_OK) goto discard;
+	FT_FENCE_ACQUIRE();
+	if (FT_ATOMIC_LOAD(&C->ctl->seq) != seq) goto discard;
+
+	ddef->nchans    = C->nchans;
+	ddef->nsamples  = n;
+	ddef->data_type = C->data_type;
+	ddef->bufsize   = n * R->chansize;
+	response->def->version = VERSION;
+	response->def->command = GET_OK;
+	response->def->bufsize = sizeof(datadef_t) + ddef->bufsize;
+	*response_ptr = response;
+	C->local++;
+	return 0;
+
+discard:
+	FREE(response->buf);
+	FREE(response->def);
+	FREE(response);
+	return -1;
+}
+
+unsigned long ft_shm_local_requests(int server) {
+	ft_shm_client_t *C = get_client(server);
+	return (C == NULL) ? 0 : C->local;
+}
+
+#else /* WIN32 */
+
+int ft_shm_enable(const char *name) {
+	fprintf(stderr, "ft_shm_enable: shared memory is not supported on this platform\n");
+	return -1;
+}
+
+ft_ring_t *ft_shm_ring_alloc(ft_stream_t *S, UINT32_T capacity, UINT32_T chansize, UINT32_T nchans, UINT32_T data_type) {
+	return NULL;
+}
+
+int  ft_shm_ring_free(ft_stream_t *S) { return 0; }
+void ft_shm_begin_update(ft_stream_t *S) {}
+void ft_shm_end_update(ft_stream_t *S) {}
+void ft_shm_export_free(ft_stream_t *S) {}
+int  ft_shm_attach(int server, const char *name) { return -1; }
+void ft_shm_detach(int server) {}
+void ft_shm_select_stream(int server, const char *stream, UINT32_T length) {}
+int  ft_shm_request(int server, const message_t *request, message_t **response_ptr) { return -1; }
+unsigned long ft_shm_local_requests(int server) { return 0; }
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include "platform_includes.h"
+#include "message.h"
+#include "ringbuffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* addresses of the form shm://name select the shared memory transport */
+#define FT_SHM_PREFIX         "shm://"
+#define FT_SHM_NAME_LENGTH    48      /* maximal length of "name" */
+#define FT_SHM_OBJECT_LENGTH  160     /* maximal length of the name of a shared memory object */
+#define FT_SHM_SOCKET_DIR     "/tmp"  /* where the control sockets live */
+#define FT_SHM_DATA_OFFSET    4096    /* the samples start at this offset in the data object */
+#define FT_SHM_MAX_SOCKET     1024    /* clients can only attach to sockets below this number */
+
+/** Shared memory transport for clients on the same host as the buffer.
+
+    A server started with the address shm://name exports the data ring of
+    every stream through POSIX shared memory, and listens for everything else
+    on the UNIX domain socket FT_SHM_SOCKET_DIR/ft_name.sock, which serves as
+    the control channel for writes, waits and all other requests.
+
+    Each stream has a small control object, /ft_name for the default stream
+    and /ft_name@stream for named streams, that describes the current ring.
+    The ring itself (an ft_ring_t followed by the samples) lives in a data
+    object of its own, which is replaced whenever the header changes, so that
+    clients never see a mapping shrink under their feet. The control object
+    is protected by a sequence counter that is odd while the server changes
+    the ring: clients read samples lock-free like any other ring reader (see
+    ringbuffer.h), and discard what they read if the counter changed.
+
+    On the client side, open_connection and FtConnection::connect attach to
+    the shared memory when given a shm:// address, and tcprequest answers
+    GET_DAT requests from the mapped ring without any system call. Whenever
+    that is not possible, the request simply goes over the socket.
+*/
+typedef struct {
+	UINT32_T magic;
+	volatile UINT32_T seq;          /**< odd while the server changes the ring */
+	UINT32_T instance;              /**< changes with every new ring, 0 if there is none */
+	UINT32_T nchans;
+	UINT32_T data_type;
+	UINT64_T size;                  /**< size of the data object in bytes */
+	char     data[FT_SHM_OBJECT_LENGTH];   /**< name of the data object */
+} ft_shm_control_t;
+
+struct ft_stream;
+
+/** Returns the name in a shm:// address, or NULL if address is not a valid one */
+const char *ft_shm_address(const char *address);
+
+/** Writes the path of the control socket of shm://name into path, returns 0 or -1 */
+int  ft_shm_socket_path(const char *name, char *path, size_t size);
+
+/** Server side: exports the rings of all streams that get a header from now
+    on under the given name. Returns 0 on success, -1 if the name is invalid
+    or shared memory is not supported on this platform.
+*/
+int  ft_shm_enable(const char *name);
+
+/** Server side: allocates the ring of stream S in shared memory and publishes
+    it. Returns NULL if the stream is not exported, or if the shared memory
+    cannot be created, in which case the caller should allocate the ring as
+    usual. The caller needs to hold the locks of the stream for writing.
+*/
+ft_ring_t *ft_shm_ring_alloc(struct ft_stream *S, UINT32_T capacity, UINT32_T chansize, UINT32_T nchans, UINT32_T data_type);
+
+/** Server side: releases the ring of stream S if it was allocated by
+    ft_shm_ring_alloc and returns 1, otherwise returns 0.
+*/
+int  ft_shm_ring_free(struct ft_stream *S);
+
+/** Server side: must surround any other change of the ring, e.g. a reset */
+void ft_shm_begin_update(struct ft_stream *S);
+void ft_shm_end_update(struct ft_stream *S);
+
+/** Server side: removes the shared memory objects of stream S */
+void ft_shm_export_free(struct ft_stream *S);
+
+/** Client side: maps the shared memory of shm://name for requests over the
+    given (control) socket. Returns 0 on success, -1 otherwise.
+*/
+int  ft_shm_attach(int server, const char *name);
+void ft_shm_detach(int server);
+
+/** Client side: to be called after OPEN_STREAM succeeded on the given socket */
+void ft_shm_select_stream(int server, const char *stream, UINT32_T length);
+
+/** Client side: answers the request from shared memory if possible and returns
+    0, otherwise returns -1 and the request should be sent over the socket.
+*/
+int  ft_shm_request(int server, const message_t *request, message_t **response_ptr);
+
+/** Client side: the number of requests that were answered from shared memory */
+unsigned long ft_shm_local_requests(int server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHM_H */
@@ -10,6 +10,14 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <socketserver.h>
+#include "zerocopy.h"
+#include "shm.h"
+#include "compress.h"
+#include "stream.h"
+#include "subscribe.h"
+#include "reactor.h"
+#include "stats.h"
+#include "trace.h"
 
 /************************************************************************
  * This function deals with the incoming client requests in a loop until
@@ -22,8 +30,15 @@
  *             the request (the "buf" part")
  *   state = 2 means we are in the process of writing the response (def)
  *   state = 3 means ... writing the 2nd. part of the response ("buf")
+ *   state = 4 means we are writing a GET_DAT response straight from the
+ *             ring with ft_pinned_send (see zerocopy.h), which keeps track
+ *             of what is left to write, and parks the pin while it waits
+ *   state = 5 means we are reading the datadef_t of a large PUT_DAT request
+ *             on its own, so that we know where the samples go
+ *   state = 6 means we are receiving the samples of that request straight
+ *             into the ring with readv (see zerocopy.h)
  *
- * On top of those 4 states, we maintain two variables "bytesDone" and
+ * On top of those states, we maintain two variables "bytesDone" and
  * "bytesTotal" that determine how many bytes we've read/written within
  * the current state, and how many bytes we need to process in total,
  * and a variable "curPtr" which points to the memory region we currently
@@ -38,13 +53,214 @@
  * The actual processing of the message happens before moving to state 2
  * and consists of 
  *   1) possibly swapping the message to native endianness
- *   2) calling dmarequest or the user-supplied callback function
- *   3) possibly swapping back to remote endianness
+ *   2) possibly decoding the samples of a PUT_DAT request (see compress.h)
+ *   3) calling dmarequest or the user-supplied callback function
+ *   4) possibly encoding the samples of a GET_DAT response
+ *   5) possibly swapping back to remote endianness
+ * A large GET_DAT for a client with the other endianness is answered from
+ * the ring instead, and swapped while it is copied (steps 3 to 5 in one).
+ * SET_ENCODING is answered here, as the encoding belongs to the connection.
+ *
+ * A connection with a subscription (see subscribe.h) also goes from state 0
+ * to state 2 without a request, whenever there is something to push and the
+ * client is not in the middle of sending one. The pipe that wakes us up for
+ * new samples and events is watched by select next to the socket.
+ * SUBSCRIBE_DAT, SUBSCRIBE_CREDIT and UNSUBSCRIBE are handled here as well,
+ * and SUBSCRIBE_CREDIT is not answered.
+ *
+ * On Linux, a server without a callback does not start a thread per client,
+ * but serves all of them from an epoll reactor with the same states (see
+ * reactor.h). Either way, a request that has been read is handled by
+ * ft_connection_handle below.
  ************************************************************************/
+
+static int serverWorkers = FT_SERVER_WORKERS;
+
+void ft_set_server_workers(int n) {
+	serverWorkers = (n > 0) ? n : 0;
+}
+
+message_t *ft_simple_response(UINT16_T command) {
+	message_t *response = (message_t *) malloc(sizeof(message_t));
+	if (response == NULL) return NULL;
+	response->buf = NULL;
+	response->def = (messagedef_t *) malloc(sizeof(messagedef_t));
+	if (response->def == NULL) {
+		free(response);
+		return NULL;
+	}
+	response->def->version = VERSION;
+	response->def->command = command;
+	response->def->bufsize = 0;
+	return response;
+}
+
+/* Answers a GET_DAT request of a client with the other byte order straight
+   from the ring (see zerocopy.h): the samples are swapped while they are
+   copied into the response, instead of being copied by dmarequest and
+   swapped in a second pass. The response is in the byte order of the client
+   already. Returns 0 if dmarequest should answer the request instead.
+*/
+/* the type of the samples of the current stream, DATATYPE_UNKNOWN if it has no header yet */
+static UINT32_T current_data_type(void) {
+	ft_stream_t *S = ft_current_stream();
+	UINT32_T data_type = DATATYPE_UNKNOWN;
+	UINT64_T held = ft_stream_lock(S, FT_LOCK_HEADER, SET_ENCODING);
+	if (S->header != NULL) data_type = S->header->def->data_type;
+	ft_stream_unlock(S, FT_LOCK_HEADER, SET_ENCODING, held);
+	return data_type;
+}
+
+static int swapped_from_ring(const message_t *request, message_t **response) {
+	ft_pinned_data_t P;
+	UINT32_T wordsize;
+	char *dest;
+	int k;
+
+	if (!ft_getdat_pinned(request, &P)) return 0;
+	wordsize = wordsize_from_type(P.ddef.data_type);
+	*response = ft_simple_response(GET_OK);
+	if (*response != NULL) (*response)->buf = malloc(P.def.bufsize);
+	if (*response == NULL || (*response)->buf == NULL) {
+		ft_getdat_release(&P);
+		cleanup_message((void **) response);
+		*response = NULL;
+		return 0;
+	}
+
+	dest = (char *) (*response)->buf + sizeof(datadef_t);
+	for (k=0; k<2; k++) {
+		UINT32_T numel = P.seg[k].nsamples * P.ddef.nchans;
+		ft_swap_copy(numel, wordsize, P.seg[k].ptr, dest);
+		dest += (size_t) numel * wordsize;
+	}
+	/* if the writer did not wait for us, dmarequest copies it again */
+	if (ft_getdat_release(&P) != FT_RING_OK) {
+		cleanup_message((void **) response);
+		*response = NULL;
+		return 0;
+	}
+
+	memcpy((*response)->buf, &P.ddef, sizeof(datadef_t));
+	ft_swap32(4, (*response)->buf);
+	(*response)->def->bufsize = P.def.bufsize;
+	return 1;
+}
+
+int ft_connection_handle(ft_buffer_server_t *SC, ft_connection_t *C, message_t *request, message_t **response, UINT32_T *respBufSize) {
+	messagedef_t *reqdef = request->def;
+	UINT16_T command = reqdef->command;
+	UINT32_T bytesIn = sizeof(messagedef_t) + reqdef->bufsize;
+	UINT64_T start = ft_stats_now();
+	int res, swapped = 0;
+
+	*response = NULL;
+#ifndef WIN32
+	if (reqdef->command == SUBSCRIBE_CREDIT) {
+		/* not answered */
+		ft_subscription_credit(&C->subscription, reqdef->bufsize, request->buf);
+		FREE(request->buf);
+		ft_stats_record(command, start, bytesIn, 0);
+		return 0;
+	}
+	if (reqdef->command == SUBSCRIBE_DAT) {
+		/* pushes are not swapped or encoded, and a callback has its own streams */
+		int ok = !C->swap && SC->callback == NULL && ft_subscription_start(&C->subscription, request) == 0;
+		*response = ft_simple_response(ok ? SUBSCRIBE_OK : SUBSCRIBE_ERR);
+	} else if (reqdef->command == UNSUBSCRIBE) {
+		ft_subscription_stop(&C->subscription);
+		*response = ft_simple_response(SUBSCRIBE_OK);
+	} else if (reqdef->command == OPEN_STREAM) {
+		/* a subscription belongs to the stream it was made on */
+		ft_subscription_stop(&C->subscription);
+	}
+	if (*response != NULL) {
+		/* answered already */
+	} else
+#endif
+	if (reqdef->command == SET_ENCODING) {
+		/* only between machines of the same endianness, and not for samples that would not get smaller */
+		UINT32_T asked = (reqdef->bufsize == sizeof(UINT32_T)) ? *(UINT32_T *) request->buf : (UINT32_T) -1;
+		int ok = !C->swap && (asked == FT_ENCODING_NONE || asked == FT_ENCODING_DELTA);
+		if (ok && asked == FT_ENCODING_DELTA && SC->callback == NULL) {
+			UINT32_T data_type = current_data_type();
+			ok = data_type == DATATYPE_UNKNOWN || ft_delta_supported(data_type);
+		}
+		if (ok) C->encoding = asked;
+		*response = ft_simple_response(ok ? ENCODING_OK : ENCODING_ERR);
+	} else if (C->encoding != FT_ENCODING_NONE && reqdef->command == PUT_DAT && ft_samples_encoded(request->buf, reqdef->bufsize)) {
+		/* the samples are handed on as if they had been sent as they are */
+		UINT32_T size;
+		void *decoded = ft_decode_samples(request->buf, reqdef->bufsize, &size);
+		if (decoded == NULL) {
+			fprintf(stderr, "buffer_socket_func: cannot decode the samples of PUT_DAT\n");
+			*response = ft_simple_response(PUT_ERR);
+		} else {
+			free(request->buf);
+			request->buf = decoded;
+			reqdef->bufsize = size;
+		}
+	}
+	if (*response != NULL) {
+		/* answered already */
+	} else if (C->swap && SC->callback == NULL && C->encoding == FT_ENCODING_NONE && reqdef->command == GET_DAT
+			&& swapped_from_ring(request, response)) {
+		/* only the message definition is left to swap */
+		swapped = 1;
+	} else if (SC->callback != NULL) {
+		/* User supplied a callback function in ft_start_buffer_server */
+		res = SC->callback(request, response, SC->user_data);
+		if (res != 0 || *response == NULL || (*response)->def == NULL) {
+			fprintf(stderr, "buffer_socket_func: an unexpected error occurred in user-defined request handler\n");
+			return -1;
+		}
+	} else {
+		/* No callback, use normal dmarequest */
+		res = dmarequest(request, response);
+		if (res != 0 || *response == NULL || (*response)->def == NULL) {
+			fprintf(stderr, "buffer_socket_func: an unexpected error occurred in dmarequest\n");
+			return -1;
+		}
+	}
+	
+	/* Ok, the request has been handled, results are in response.
+	   Encode the samples if the client asked for that ...
+	*/
+	if (C->encoding != FT_ENCODING_NONE && reqdef->command == GET_DAT && (*response)->def->command == GET_OK) {
+		UINT32_T size;
+		void *encoded = ft_encode_samples((*response)->buf, (*response)->def->bufsize, &size);
+		if (encoded != NULL) {
+			free((*response)->buf);
+			(*response)->buf = encoded;
+			(*response)->def->bufsize = size;
+		}
+	}
+
+	/* ... swap the response to the remote endianness, if necessary ... */
+	*respBufSize = (*response)->def->bufsize;
+	if (swapped) {
+		ft_swap16(2, (*response)->def);	/* version + command */
+		ft_swap32(1, &(*response)->def->bufsize);
+	} else if (C->swap && C->reqCommand == BATCH)
+		ft_swap_batch_from_native(reqdef->bufsize, request->buf, *response);
+	else if (C->swap)
+		ft_swap_from_native(C->reqCommand, *response);
+
+	/* ... and free the memory pointed to by request->buf, which the swap of
+	   a BATCH response still needed.
+	*/
+	if (request->buf != NULL) {
+		free(request->buf);
+		request->buf = NULL;
+	}
+	ft_stats_record(command, start, bytesIn, sizeof(messagedef_t) + *respBufSize);
+	return 0;
+}
+
 void *_buffer_socket_func(void *arg) {
 	SOCKET sock;
 	ft_buffer_server_t *SC;
-	int mergePackets;
+	ft_connection_t conn;
 	messagedef_t reqdef;
 	message_t request;
 	message_t *response = NULL;
@@ -52,22 +268,41 @@ void *_buffer_socket_func(void *arg) {
 	int bytesDone, bytesTotal;
 	char mergeBuffer[MERGE_THRESHOLD];
 	char *curPtr;	/* points at buffer that needs to be filled or written out */
-	int swap = 0;	
 	int canRead, canWrite;
-	UINT16_T reqCommand;
-	UINT32_T respBufSize;
+	UINT32_T respBufSize = 0;
 	fd_set readSet, writeSet;
+#ifndef WIN32
+	ft_pinned_data_t pinned;
+	ft_pinned_send_t pinsend;          /* writes it in state 4 */
+	UINT64_T start, phaseStart = 0;    /* the latter for trace.h */
+	UINT16_T traceCommand = 0;
+	ft_ingest_t ingest;
+	datadef_t ingestdef;
+	size_t received = 0;
+	UINT64_T ingestDeadline = 0;
+	struct iovec iov[2], *iovp = NULL;
+	int iovcnt = 0;
+#endif
 
 	if (arg==NULL) return NULL;
 		
 	/* copy over necessary variables and free the given structure */
 	SC 			 = ((ft_buffer_socket_t *) arg)->server;
 	sock 		 = ((ft_buffer_socket_t *) arg)->clientSocket;
-	mergePackets = ((ft_buffer_socket_t *) arg)->mergePackets;
+	conn.mergePackets = ((ft_buffer_socket_t *) arg)->mergePackets;
 	free(arg);
+#ifndef WIN32
+	if (ft_pinned_send_init(&pinsend) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		closesocket(sock);
+		return NULL;
+	}
+#endif
+	conn.swap = 0;
+	conn.encoding = FT_ENCODING_NONE;
 	
 	if (SC->verbosity > 0) {
-		printf("Started new client thread with packet merging = %i\n", mergePackets);
+		printf("Started new client thread with packet merging = %i\n", conn.mergePackets);
 	}
 	
     pthread_mutex_lock(&SC->lock);
@@ -79,28 +314,104 @@ void *_buffer_socket_func(void *arg) {
 	bytesDone = 0;
 	bytesTotal = sizeof(messagedef_t);
 	curPtr = (char *) request.def;
+#ifndef WIN32
+	ft_subscription_init(&conn.subscription);
+#endif
 
 	while (SC->keepRunning) {
 		int sel, res, n;
+		int maxfd = (int) sock;
 		struct timeval tv = {0, 10000}; /* 10ms */
 	
 		FD_ZERO(&readSet);
 		FD_ZERO(&writeSet);
-		if (state < 2) {
+#ifndef WIN32
+		/* push samples and events between two requests */
+		if (state == 0 && bytesDone == 0 && conn.subscription.active) {
+			response = ft_subscription_next(&conn.subscription, &tv);
+			if (response != NULL) {
+				phaseStart = FT_TRACE_NOW();
+				traceCommand = response->def->command;
+				respBufSize = response->def->bufsize;
+				curPtr = (char *) response->def;
+				bytesDone = 0;
+				bytesTotal = sizeof(messagedef_t);
+				state = 2;
+			}
+			else if (conn.subscription.active) {
+				FD_SET(ft_subscription_fd(&conn.subscription), &readSet);
+				if (ft_subscription_fd(&conn.subscription) > maxfd) maxfd = ft_subscription_fd(&conn.subscription);
+			}
+		}
+#endif
+		if (state < 2 || state >= 5) {
 			FD_SET(sock, &readSet);
 		} else {
 			FD_SET(sock, &writeSet);
 		}
-		sel = select((int) sock+1, &readSet, &writeSet, NULL, &tv);
-		if (sel == 0) continue;
+		sel = select(maxfd+1, &readSet, &writeSet, NULL, &tv);
+#ifndef WIN32
+		/* a client that is slow to send its samples must not keep other writers
+		   waiting for mutexdata, so the rest is read into a buffer as usual */
+		if (state == 6 && ft_stats_now() > ingestDeadline) {
+			request.buf = malloc(reqdef.bufsize);
+			if (request.buf == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				break;
+			}
+			memcpy(request.buf, &ingestdef, sizeof(datadef_t));
+			ft_putdat_abort(&ingest, (char *) request.buf + sizeof(datadef_t), received);
+			curPtr = request.buf;
+			bytesDone = sizeof(datadef_t) + received;
+			bytesTotal = reqdef.bufsize;
+			state = 1;
+		}
+#endif
+		if (sel == 0 || (sel < 0 && errno == EINTR)) continue;
 		if (sel < 0) {
 			fprintf(stderr, "Error in 'select' operation - closing client connection.\n");
 			break;
 		}
 		canRead = FD_ISSET(sock, &readSet);
 		canWrite = FD_ISSET(sock, &writeSet);
+
+#ifndef WIN32
+		if (state == 6 && canRead) {
+			n = readv(sock, iovp, iovcnt);
+			if (n<=0) {
+				/* socket was closed */
+				if (SC->verbosity>0) {
+					printf("Remote side closed client connection\n");
+				}
+				break;
+			}
+			received += n;
+			iovcnt = ft_iovec_consume(&iovp, iovcnt, n);
+			if (iovcnt > 0) continue;
+			/* all samples are in the ring, publish them and acknowledge */
+			ft_trace_span(FT_TRACE_READ_BODY, PUT_DAT, phaseStart);
+			phaseStart = FT_TRACE_NOW();
+			start = ft_stats_now();
+			ft_putdat_commit(&ingest);
+			ft_stats_record(PUT_DAT, start, sizeof(messagedef_t) + reqdef.bufsize, sizeof(messagedef_t));
+			response = ft_simple_response(PUT_OK);
+			if (response == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				break;
+			}
+			ft_trace_span(FT_TRACE_EXECUTE, PUT_DAT, phaseStart);
+			phaseStart = FT_TRACE_NOW();
+			respBufSize = 0;
+			curPtr = (char *) response->def;
+			bytesDone = 0;
+			bytesTotal = sizeof(messagedef_t);
+			state = 2;
+			continue;
+		}
+#endif
 		
 		if (canRead) {
+			if (state == 0 && bytesDone == 0) phaseStart = FT_TRACE_NOW();
 			n = recv(sock, curPtr + bytesDone, bytesTotal - bytesDone, 0);
 			if (n<=0) {
 				/* socket was closed */
@@ -115,15 +426,28 @@ void *_buffer_socket_func(void *arg) {
 			if (state == 0) {
 				/* we've read the request.def completely */
 				if (reqdef.version==VERSION_OE) {
-					swap = 1;
+					conn.swap = 1;
 					ft_swap16(2, &reqdef.version); /* version + command */
 					ft_swap32(1, &reqdef.bufsize);
-					reqCommand = reqdef.command;		
+					conn.reqCommand = reqdef.command;		
 				}
 				if (reqdef.version!=VERSION) {
 					fprintf(stderr,"Incorrect version requested - closing socket.\n");
 					break;
 				}
+				traceCommand = reqdef.command;
+				ft_trace_span(FT_TRACE_READ_HDR, traceCommand, phaseStart);
+				phaseStart = FT_TRACE_NOW();
+#ifndef WIN32
+				/* Large PUT_DAT requests: read the datadef_t first, in state 5 */
+				if (SC->callback == NULL && !conn.swap && conn.encoding == FT_ENCODING_NONE && ft_putdat_wanted(&reqdef)) {
+					curPtr = (char *) &ingestdef;
+					bytesDone = 0;
+					bytesTotal = sizeof(datadef_t);
+					state = 5;
+					continue;
+				}
+#endif
 				if (reqdef.bufsize > 0) {
 					request.buf = malloc(reqdef.bufsize);
 					if (request.buf == NULL) {
@@ -136,43 +460,70 @@ void *_buffer_socket_func(void *arg) {
 					state = 1;
 					continue;
 				} 
+#ifndef WIN32
+			} else if (state == 5) {
+				/* receive the samples into the ring in state 6 if possible ... */
+				if (ft_putdat_reserve(&reqdef, &ingestdef, &ingest)) {
+					iovp = iov;
+					iovcnt = ft_ingest_iovec(&ingest, iov);
+					received = 0;
+					ingestDeadline = ft_stats_now() + (UINT64_T) FT_INGEST_TIMEOUT * 1000000;
+					state = 6;
+					continue;
+				}
+				/* ... or else read the rest of the request as usual */
+				request.buf = malloc(reqdef.bufsize);
+				if (request.buf == NULL) {
+					fprintf(stderr, "Out of memory\n");
+					break;
+				}
+				memcpy(request.buf, &ingestdef, sizeof(datadef_t));
+				curPtr = request.buf;
+				bytesDone = sizeof(datadef_t);
+				bytesTotal = reqdef.bufsize;
+				state = 1;
+				continue;
+#endif
 			} else {
 				/* Reaching this point means that the state=1, and that we've 
 				   read request.buf completely, so swap the endianness if 
 				   necessary, and then move on to handling the request.
 				*/	
-				if (swap) ft_swap_buf_to_native(reqCommand, reqdef.bufsize, request.buf);
+				if (conn.swap) ft_swap_buf_to_native(conn.reqCommand, reqdef.bufsize, request.buf);
+				ft_trace_span(FT_TRACE_READ_BODY, traceCommand, phaseStart);
+				phaseStart = FT_TRACE_NOW();
 			}
 			
-			/* Request has been read completely, now deal with it */
-			if (SC->callback != NULL) {
-				/* User supplied a callback function in ft_start_buffer_server */
-				res = SC->callback(&request, &response, SC->user_data);
-				if (res != 0 || response == NULL || response->def == NULL) {
-					fprintf(stderr, "buffer_socket_func: an unexpected error occurred in user-defined request handler\n");
-					break;
-				}
-			} else {
-				/* No callback, use normal dmarequest */
-				res = dmarequest(&request, &response);
-				if (res != 0 || response == NULL || response->def == NULL) {
-					fprintf(stderr, "buffer_socket_func: an unexpected error occurred in dmarequest\n");
-					break;
+#ifndef WIN32
+			/* Large GET_DAT responses are not copied, but written from the ring in state 4 */
+			start = ft_stats_now();
+			if (SC->callback == NULL && !conn.swap && conn.encoding == FT_ENCODING_NONE && ft_getdat_pinned(&request, &pinned)) {
+				ft_stats_record(GET_DAT, start, sizeof(messagedef_t) + reqdef.bufsize, sizeof(messagedef_t) + pinned.def.bufsize);
+				if (request.buf != NULL) {
+					free(request.buf);
+					request.buf = NULL;
 				}
+				ft_pinned_send_start(&pinsend, &pinned);
+				ft_trace_span(FT_TRACE_EXECUTE, traceCommand, phaseStart);
+				phaseStart = FT_TRACE_NOW();
+				state = 4;
+				continue;
 			}
-			
-			/* Ok, the request has been handled, results are in response.
-			   We can free the memory pointed to by request.buf ...
-			*/
-			if (request.buf != NULL) {
-				free(request.buf);
-				request.buf = NULL;
+#endif
+
+			/* Request has been read completely, now deal with it */
+			if (ft_connection_handle(SC, &conn, &request, &response, &respBufSize) != 0) break;
+			ft_trace_span(FT_TRACE_EXECUTE, traceCommand, phaseStart);
+			phaseStart = FT_TRACE_NOW();
+			if (response == NULL) {
+				/* not answered, go back to reading the next request */
+				state = 0;
+				curPtr = (char *) request.def;
+				bytesDone = 0;
+				bytesTotal = sizeof(messagedef_t);
+				continue;
 			}
-			
-			/* ... swap the response to the remote endianness, if necessary ... */
-			respBufSize = response->def->bufsize;
-			if (swap) ft_swap_from_native(reqCommand, response);
-		
+
 			/* ... and then start writing back the response. To reduce latency,
 			   we try to merge response->def and response->buf if they are small, 
 			   so we can send it in one go over TCP. To fit the merged packet into 
@@ -181,7 +532,7 @@ void *_buffer_socket_func(void *arg) {
 			   Otherwise, we move to state=2, transmit response->def, move to state=3,
 			   and there transmit response->buf.
 			*/
-			if (mergePackets && respBufSize > 0 && respBufSize + sizeof(messagedef_t) <= MERGE_THRESHOLD) {
+			if (conn.mergePackets && respBufSize > 0 && respBufSize + sizeof(messagedef_t) <= MERGE_THRESHOLD) {
 				memcpy(mergeBuffer, response->def, sizeof(messagedef_t));
 				memcpy(mergeBuffer + sizeof(messagedef_t), response->buf, respBufSize);
 				
@@ -198,8 +549,32 @@ void *_buffer_socket_func(void *arg) {
 			canWrite = 1;
 		}
 		
+#ifndef WIN32
+		if (state == 4 && canWrite) {
+			/* does not block, the pin is parked while the socket is full */
+			res = ft_pinned_send(&pinsend, sock);
+			if (res < 0) {
+				fprintf(stderr, "Cannot write to socket -- closing client connection.\n");
+				break;
+			}
+			if (res == 0) continue;
+			ft_trace_span(FT_TRACE_WRITE, traceCommand, phaseStart);
+			state = 0;
+			curPtr = (char *) request.def;
+			bytesDone = 0;
+			bytesTotal = sizeof(messagedef_t);
+			continue;
+		}
+#endif
+
 		if (state >= 2 && canWrite) {
-			n = send(sock, curPtr + bytesDone, bytesTotal - bytesDone, 0);
+			int flags = 0;
+#ifdef MSG_MORE
+			/* keep response->def back until response->buf follows, otherwise
+			   Nagle's algorithm holds the buf until the client acknowledges the def */
+			if (state == 2 && respBufSize > 0) flags = MSG_MORE;
+#endif
+			n = send(sock, curPtr + bytesDone, bytesTotal - bytesDone, flags);
 			if (n<=0) {
 				/* socket was closed */
 				fprintf(stderr, "Cannot write to socket -- closing client connection.\n");
@@ -217,6 +592,7 @@ void *_buffer_socket_func(void *arg) {
 			/* Reaching this point means we are done with writing out the response,
 			   so we will now free the allocated memory, and reset to state=0.
 			*/
+			ft_trace_span(FT_TRACE_WRITE, traceCommand, phaseStart);
 			if (response->buf) free(response->buf);
 			free(response->def);
 			free(response);
@@ -232,6 +608,12 @@ void *_buffer_socket_func(void *arg) {
     SC->numClients--;
     pthread_mutex_unlock(&SC->lock);
 	
+#ifndef WIN32
+	ft_pinned_send_destroy(&pinsend);
+	/* samples that did not arrive completely are not published */
+	if (state == 6) ft_putdat_abort(&ingest, NULL, 0);
+	ft_subscription_stop(&conn.subscription);
+#endif
 	closesocket(sock);
 	if (request.buf!=NULL) free(request.buf);
     if (response!=NULL) {
@@ -369,6 +751,20 @@ ft_buffer_server_t *ft_start_buffer_server(int port, const char *name, ft_reques
 		goto cleanup;
 #else
 		struct sockaddr_un sa;
+		const char *shmname = ft_shm_address(name);
+		char path[sizeof(sa.sun_path)];
+
+		/* shm://name: export the rings, and use a UNIX domain socket for everything else */
+		if (shmname != NULL) {
+			if (ft_shm_socket_path(shmname, path, sizeof(path)) != 0 || ft_shm_enable(shmname) != 0) {
+				fprintf(stderr, "ft_start_buffer_server: invalid shared memory name '%s'\n", name);
+				goto cleanup;
+			}
+			/* left behind by a server that did not stop cleanly */
+			unlink(path);
+			name = path;
+		}
+
 		/* UNIX domain socket */
 		s = socket(AF_UNIX, SOCK_STREAM, 0);
 		if (s == INVALID_SOCKET) {
@@ -442,6 +838,22 @@ ft_buffer_server_t *ft_start_buffer_server(int port, const char *name, ft_reques
 		goto cleanup;
 	}
 	
+#ifdef __linux__
+	/* serve the clients from a few worker threads, unless a callback might block them */
+	SC->numWorkers = (callback == NULL) ? serverWorkers : 0;
+	SC->reactor = NULL;
+	if (SC->numWorkers > 0 && ft_reactor_create(SC) != 0) {
+		fprintf(stderr, "start_tcp_server: falling back to one thread per client\n");
+		SC->numWorkers = 0;
+	}
+	if (SC->reactor != NULL) {
+		if (pthread_create(&SC->threadID, NULL, ft_reactor_run, SC) == 0) return SC;
+		ft_reactor_destroy(SC);
+	} else
+#else
+	SC->numWorkers = 0;
+	SC->reactor = NULL;
+#endif
 	/* create thread with default attributes */
 	if (pthread_create(&SC->threadID, NULL, _buffer_server_func, SC) == 0) {
 		/* everything went fine - thread should be running now */
@@ -464,11 +876,24 @@ cleanup:
 	return NULL;
 }		
 
+ft_buffer_server_t *ft_start_buffer_server_capacity(int port, const char *name, ft_request_callback_t callback, void *user_data, const capacitydef_t *capacity) {
+	ft_set_default_capacity(capacity);
+	return ft_start_buffer_server(port, name, callback, user_data);
+}
+
 void ft_stop_buffer_server(ft_buffer_server_t *S) {
 	if (S==NULL) return;
 	
 	S->keepRunning = 0;
+#ifdef __linux__
+	if (S->reactor != NULL) ft_reactor_wake(S);
+#endif
 	pthread_join(S->threadID, NULL);
 	pthread_detach(S->threadID);
+#ifdef __linux__
+	ft_reactor_destroy(S);
+#endif
+	/* so that another server can listen on the same port */
+	closesocket(S->serverSocket);
 	free(S);
 }
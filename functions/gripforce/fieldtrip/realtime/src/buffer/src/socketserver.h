@@ -12,6 +12,7 @@
 #include "buffer.h"
 
 #define MERGE_THRESHOLD 4096    /* TODO: optimize this value? Maybe look at MTU size */
+#define FT_SERVER_WORKERS 4     /* default number of worker threads of the epoll reactor, see reactor.h */
 
 #ifdef __cplusplus
 extern "C" {
@@ -44,6 +45,8 @@ typedef struct {
         pthread_mutex_t lock;           /**< Mutex to protect the "numClients" member, commonly used by all threads */
         ft_request_callback_t callback; /**< Callback function to be called *instead* of dmarequest */
         void *user_data;                /**< Pointer to user-defined data structure, passed on to callback */
+        int numWorkers;                 /**< Worker threads of the epoll reactor (Linux), 0: one thread per client */
+        void *reactor;                  /**< The reactor (see reactor.h), or NULL */
 } ft_buffer_server_t;
 
 /** Small helper structure that is passed to client threads. Get's allocated
@@ -61,6 +64,8 @@ typedef struct {
         requests on this socket.
         TCP sockets are created for positive port numbers (name is ignored), 
         UNIX domain sockets are created for port=0 (name needs to be a UNIX pathname).
+        For port=0 and a name of the form shm://name, the data rings are also
+        exported through shared memory (see shm.h).
 
         If callback!=NULL, that function is called like
                 callback(request, &response, user_data)
@@ -72,6 +77,22 @@ typedef struct {
 */      
 ft_buffer_server_t *ft_start_buffer_server(int port, const char *name, ft_request_callback_t callback, void *user_data);
 
+/** Same as ft_start_buffer_server, but also sets the default capacity of the data and
+        event ring (see capacitydef_t in message.h). This default is used whenever a client
+        sends a header without a FT_CHUNK_BUFFER_CAPACITY chunk. Passing capacity=NULL
+        restores the built-in defaults.
+*/
+ft_buffer_server_t *ft_start_buffer_server_capacity(int port, const char *name, ft_request_callback_t callback, void *user_data, const capacitydef_t *capacity);
+
+/** Sets the number of worker threads that serve all clients of the servers that
+        are started afterwards, using epoll (see reactor.h). This is only available on
+        Linux, and n=0 goes back to one thread per client, which is what the other
+        platforms always do. Servers with a callback also keep one thread per client,
+        since a callback may block (e.g. in WAIT_DAT) and would then keep its worker
+        from serving anybody else.
+*/
+void ft_set_server_workers(int n);
+
 /** Stops background thread(s), closes the sockets, and disposes the control structure S.
         S cannot be used anymore after this call. 
 */
@@ -0,0 +1,189 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "platform.h"
+#include "stats.h"
+#include "atomicops.h"
+#ifdef PLATFORM_WINDOWS
+#include <windows.h>
+#endif
+
+#ifndef CLOCK_MONOTONIC
+/* the replacement in clock_gettime.c ignores the clock anyway */
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+/* the commands that are counted on their own, everything else goes under 0 */
+static const UINT16_T commands[FT_STATS_COMMANDS] = {
+	PUT_HDR, PUT_DAT, PUT_EVT, GET_HDR, GET_DAT, GET_EVT, GET_EVT_QUERY, GET_DAT_DECIMATED,
+	FLUSH_HDR, FLUSH_DAT, FLUSH_EVT, WAIT_DAT, OPEN_STREAM, SET_ENCODING, BATCH,
+	SUBSCRIBE_DAT, SUBSCRIBE_CREDIT, UNSUBSCRIBE, PUSH_DAT, PUSH_EVT,
+	ADD_DETECTOR, CLEAR_DETECTORS, GET_STATS, 0
+};
+
+#define NCOMMANDS FT_STATS_COMMANDS
+
+typedef struct {
+	volatile UINT32_T count;
+	volatile UINT64_T bytes_in;
+	volatile UINT64_T bytes_out;
+	volatile UINT64_T total_ns;
+	volatile UINT32_T bucket[FT_STATS_BUCKETS];
+} command_stats_t;
+
+static command_stats_t stats[NCOMMANDS];
+static volatile UINT32_T overruns = 0;
+
+#ifdef FT_HAVE_ATOMIC64
+#define ADD64(p,v) FT_ATOMIC_ADD64(p,v)
+#else
+/* only the sums take this, the counts remain lock-free */
+static pthread_mutex_t mutex64 = PTHREAD_MUTEX_INITIALIZER;
+#define ADD64(p,v) do { pthread_mutex_lock(&mutex64); *(p) += (v); pthread_mutex_unlock(&mutex64); } while (0)
+#endif
+
+UINT32_T ft_stats_command_index(UINT16_T command) {
+	UINT32_T i;
+	for (i=0; i<NCOMMANDS-1; i++) {
+		if (commands[i] == command) break;
+	}
+	return i;
+}
+
+UINT16_T ft_stats_command(UINT32_T index) {
+	return (index < NCOMMANDS) ? commands[index] : 0;
+}
+
+/* position of the highest bit that is set, v > 0 */
+static UINT32_T highest_bit(UINT64_T v) {
+#if defined(COMPILER_GCC) || defined(__clang__)
+	return 63 - __builtin_clzll(v);
+#else
+	UINT32_T e = 0;
+	while (v >>= 1) e++;
+	return e;
+#endif
+}
+
+UINT32_T ft_stats_bucket(UINT64_T ns) {
+	UINT32_T e, i;
+	if (ns < 8) return (UINT32_T) ns;
+	/* 8 buckets between 2^e and 2^(e+1), told apart by the 3 bits below the highest */
+	e = highest_bit(ns);
+	i = (e-2)*8 + (UINT32_T) ((ns >> (e-3)) & 7);
+	return (i < FT_STATS_BUCKETS) ? i : FT_STATS_BUCKETS-1;
+}
+
+UINT64_T ft_stats_bucket_low(UINT32_T i) {
+	if (i < 8) return i;
+	return (UINT64_T) (8 + i%8) << (i/8 - 1);
+}
+
+double ft_stats_percentile(const UINT32_T *bucket, UINT32_T nbuckets, double q) {
+	UINT64_T total = 0, sum = 0;
+	UINT32_T i;
+
+	for (i=0; i<nbuckets; i++) total += bucket[i];
+	if (total == 0) return 0;
+	for (i=0; i<nbuckets; i++) {
+		sum += bucket[i];
+		if (sum > 0 && sum >= q*total) break;
+	}
+	if (i >= nbuckets-1) return (double) ft_stats_bucket_low(nbuckets-1);
+	return 0.5*((double) ft_stats_bucket_low(i) + (double) ft_stats_bucket_low(i+1));
+}
+
+UINT64_T ft_stats_now(void) {
+#ifdef PLATFORM_WINDOWS
+	static LARGE_INTEGER frequency = {0};
+	LARGE_INTEGER counter;
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (UINT64_T) ((double) counter.QuadPart * 1e9 / (double) frequency.QuadPart);
+#else
+	struct timespec ts = {0, 0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (UINT64_T) ts.tv_sec * 1000000000u + (UINT64_T) ts.tv_nsec;
+#endif
+}
+
+void ft_stats_record(UINT16_T command, UINT64_T start, UINT32_T bytesIn, UINT32_T bytesOut) {
+	command_stats_t *C = stats + ft_stats_command_index(command);
+	UINT64_T end = ft_stats_now();
+	UINT64_T ns = (end > start) ? end - start : 0;
+
+	FT_ATOMIC_ADD(&C->bucket[ft_stats_bucket(ns)], 1);
+	FT_ATOMIC_ADD(&C->count, 1);
+	ADD64(&C->bytes_in, bytesIn);
+	ADD64(&C->bytes_out, bytesOut);
+	ADD64(&C->total_ns, ns);
+}
+
+void ft_stats_overrun(void) {
+	FT_ATOMIC_ADD(&overruns, 1);
+}
+
+void ft_stats_reset(void) {
+	UINT32_T i, j;
+	for (i=0; i<NCOMMANDS; i++) {
+		command_stats_t *C = stats + i;
+		FT_ATOMIC_STORE(&C->count, 0);
+		for (j=0; j<FT_STATS_BUCKETS; j++) FT_ATOMIC_STORE(&C->bucket[j], 0);
+#ifndef FT_HAVE_ATOMIC64
+		pthread_mutex_lock(&mutex64);
+#endif
+		C->bytes_in = C->bytes_out = C->total_ns = 0;
+#ifndef FT_HAVE_ATOMIC64
+		pthread_mutex_unlock(&mutex64);
+#endif
+	}
+	FT_ATOMIC_STORE(&overruns, 0);
+}
+
+void *ft_stats_snapshot(UINT32_T *size) {
+	UINT32_T i, j, n = 0, cmdsize = sizeof(statscmd_t) + FT_STATS_BUCKETS*sizeof(UINT32_T);
+	statsdef_t *def;
+	char *buf, *dest;
+
+	buf = (char *) malloc(sizeof(statsdef_t) + NCOMMANDS*cmdsize);
+	if (buf == NULL) return NULL;
+	dest = buf + sizeof(statsdef_t);
+
+	for (i=0; i<NCOMMANDS; i++) {
+		command_stats_t *C = stats + i;
+		statscmd_t cmd;
+		UINT32_T *bucket = (UINT32_T *) (dest + sizeof(statscmd_t));
+
+		cmd.count = FT_ATOMIC_LOAD(&C->count);
+		if (cmd.count == 0) continue;
+		cmd.command = commands[i];
+#ifndef FT_HAVE_ATOMIC64
+		pthread_mutex_lock(&mutex64);
+#endif
+		cmd.bytes_in  = C->bytes_in;
+		cmd.bytes_out = C->bytes_out;
+		cmd.total_ns  = C->total_ns;
+#ifndef FT_HAVE_ATOMIC64
+		pthread_mutex_unlock(&mutex64);
+#endif
+		memcpy(dest, &cmd, sizeof(statscmd_t));
+		for (j=0; j<FT_STATS_BUCKETS; j++) bucket[j] = FT_ATOMIC_LOAD_RELAXED(&C->bucket[j]);
+		dest += cmdsize;
+		n++;
+	}
+
+	def = (statsdef_t *) buf;
+	memset(def, 0, sizeof(statsdef_t));
+	def->ncommands = n;
+	def->nbuckets  = FT_STATS_BUCKETS;
+	def->overruns  = FT_ATOMIC_LOAD(&overruns);
+	def->bufsize   = n*cmdsize;
+	*size = sizeof(statsdef_t) + n*cmdsize;
+	return buf;
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Service times and sizes of the requests that the servers handle.
+
+    Every request that a server answers is counted under its command, with
+    the size of the request and the response, and the time from when it was
+    read until the response was ready to be sent. The time is kept in a
+    histogram with 8 buckets per power of two, i.e. to within 12.5%, from
+    1 ns to about 18 minutes, so that percentiles can be read off without
+    keeping the individual times. Counting is lock-free, a few atomic adds
+    on a per-command record, and the counters are shared by all servers of
+    the process.
+
+    GET_STATS returns a statsdef_t with the state of the ring of the current
+    stream, followed by a statscmd_t and FT_STATS_BUCKETS counts for each
+    command that has been seen. With FT_STATS_RESET as the (optional)
+    UINT32_T in the request, the counters start at zero again after they have
+    been read; requests that are handled in the meantime may be counted
+    partially. See utilities/buffer/buffer_stats.c for a client.
+**/
+
+#define FT_STATS_BUCKETS  304        /* up to 2^40 ns, longer times go into the last bucket */
+#define FT_STATS_RESET    1          /* flag in a GET_STATS request */
+#define FT_STATS_COMMANDS 24         /* commands that are counted on their own, including 0 for all others */
+
+/** Returns a monotonic time in nanoseconds, to pass to ft_stats_record */
+UINT64_T ft_stats_now(void);
+
+/** Counts a request for "command" that was read at "start" and has been
+    answered now. The sizes include the messagedef_t. */
+void ft_stats_record(UINT16_T command, UINT64_T start, UINT32_T bytesIn, UINT32_T bytesOut);
+
+/** Counts a GET_DAT for samples that had been overwritten in the meantime */
+void ft_stats_overrun(void);
+
+/** Sets all counters back to zero */
+void ft_stats_reset(void);
+
+/** Allocates a GET_STATS response with a copy of the counters, and returns
+    its size in *size, or NULL if out of memory. The ring fields of the
+    statsdef_t at the start are left at zero for the caller to fill in. */
+void *ft_stats_snapshot(UINT32_T *size);
+
+/** The position of "command" among the FT_STATS_COMMANDS commands that are
+    counted, and the command at a position, for other per-command counters */
+UINT32_T ft_stats_command_index(UINT16_T command);
+UINT16_T ft_stats_command(UINT32_T index);
+
+/** The bucket that a time of "ns" nanoseconds goes into, and the smallest
+    time that goes into bucket "i" */
+UINT32_T ft_stats_bucket(UINT64_T ns);
+UINT64_T ft_stats_bucket_low(UINT32_T i);
+
+/** Returns the time in nanoseconds below which the fraction "q" (0..1) of
+    the counts in the given buckets lies, as the middle of its bucket, or
+    0 if there are no counts */
+double ft_stats_percentile(const UINT32_T *bucket, UINT32_T nbuckets, double q);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "stream.h"
+#include "shm.h"
+#include "persist.h"
+#include "history.h"
+#include "pyramid.h"
+#include "detect.h"
+
+static ft_stream_t defaultStream;
+static ft_stream_t *namedStreams = NULL;   /* linked list, protected by mutexstreams */
+static int numStreams = 0;
+static pthread_mutex_t mutexstreams = PTHREAD_MUTEX_INITIALIZER;
+
+/* the stream selected by the calling thread, NULL means the default stream */
+static pthread_key_t currentStream;
+static pthread_once_t streamsOnce = PTHREAD_ONCE_INIT;
+
+static void stream_init(ft_stream_t *S, const char *name, UINT32_T length) {
+	memset(S, 0, sizeof(ft_stream_t));
+	memcpy(S->name, name, length);
+	S->name[length] = 0;
+	pthread_mutex_init(&S->mutexheader, NULL);
+	pthread_rwlock_init(&S->rwlockring, NULL);
+	pthread_mutex_init(&S->mutexdata, NULL);
+	pthread_mutex_init(&S->mutexevent, NULL);
+	ft_waitreg_init(&S->waiters);
+}
+
+static void stream_destroy(ft_stream_t *S) {
+	ft_stream_free_event(S);
+	ft_stream_free_data(S);
+	ft_stream_free_header(S);
+	ft_shm_export_free(S);
+	ft_detect_free(S);
+	ft_waitreg_destroy(&S->waiters);
+	pthread_mutex_destroy(&S->mutexevent);
+	pthread_mutex_destroy(&S->mutexdata);
+	pthread_rwlock_destroy(&S->rwlockring);
+	pthread_mutex_destroy(&S->mutexheader);
+}
+
+static void streams_once(void) {
+	stream_init(&defaultStream, "", 0);
+	pthread_key_create(&currentStream, NULL);
+}
+
+/*****************************************************************************/
+
+ft_stream_t *ft_default_stream(void) {
+	pthread_once(&streamsOnce, streams_once);
+	return &defaultStream;
+}
+
+ft_stream_t *ft_find_stream(const char *name, UINT32_T length, int create) {
+	ft_stream_t *S;
+	UINT32_T i;
+
+	pthread_once(&streamsOnce, streams_once);
+	if (length == 0) return &defaultStream;
+	if (length > FT_STREAM_NAME_LENGTH) return NULL;
+	for (i=0; i<length; i++) {
+		if (name[i] <= ' ' || name[i] > '~') return NULL;
+	}
+
+	pthread_mutex_lock(&mutexstreams);
+	for (S = namedStreams; S != NULL; S = S->next) {
+		if (strlen(S->name) == length && memcmp(S->name, name, length) == 0) break;
+	}
+	if (S == NULL && create && numStreams < FT_MAX_STREAMS) {
+		S = (ft_stream_t *) malloc(sizeof(ft_stream_t));
+		if (S != NULL) {
+			stream_init(S, name, length);
+			S->next = namedStreams;
+			namedStreams = S;
+			numStreams++;
+		}
+	}
+	pthread_mutex_unlock(&mutexstreams);
+	return S;
+}
+
+ft_stream_t *ft_current_stream(void) {
+	ft_stream_t *S;
+	pthread_once(&streamsOnce, streams_once);
+	S = (ft_stream_t *) pthread_getspecific(currentStream);
+	return (S == NULL) ? &defaultStream : S;
+}
+
+void ft_select_stream(ft_stream_t *S) {
+	pthread_once(&streamsOnce, streams_once);
+	pthread_setspecific(currentStream, (S == &defaultStream) ? NULL : S);
+}
+
+/*****************************************************************************/
+
+void ft_stream_free_header(ft_stream_t *S) {
+	if (S->header) {
+		FREE(S->header->def);
+		FREE(S->header->buf);
+		FREE(S->header);
+	}
+}
+
+void ft_stream_free_data(ft_stream_t *S) {
+	ft_history_free(S, 0);
+	ft_pyramid_free(S);
+	/* zero-copy GET_DAT responses that are still being sent keep the ring */
+	if (S->data) ft_ring_unpin_all(S->data);
+	if (S->data && !ft_persist_ring_free(S) && !ft_shm_ring_free(S)) {
+		ft_ring_free(S->data);
+		FREE(S->data);
+	}
+	if (S->header) S->header->def->nsamples = 0;
+}
+
+void ft_stream_free_event(ft_stream_t *S) {
+	if (S->event) {
+		ft_eventindex_free(&S->eventindex);
+		if (!ft_persist_eventlog_free(S)) {
+			ft_eventlog_free(S->event);
+			FREE(S->event);
+		}
+	}
+	if (S->header) S->header->def->nevents = 0;
+}
+
+void ft_free_streams(void) {
+	ft_stream_t *S;
+
+	pthread_once(&streamsOnce, streams_once);
+
+	pthread_mutex_lock(&mutexstreams);
+	S = namedStreams;
+	namedStreams = NULL;
+	numStreams = 0;
+	pthread_mutex_unlock(&mutexstreams);
+
+	while (S != NULL) {
+		ft_stream_t *next = S->next;
+		stream_destroy(S);
+		free(S);
+		S = next;
+	}
+
+	/* the default stream stays around, but without any contents */
+	pthread_mutex_lock(&defaultStream.mutexheader);
+	pthread_rwlock_wrlock(&defaultStream.rwlockring);
+	pthread_mutex_lock(&defaultStream.mutexdata);
+	pthread_mutex_lock(&defaultStream.mutexevent);
+	ft_stream_free_event(&defaultStream);
+	ft_stream_free_data(&defaultStream);
+	ft_stream_free_header(&defaultStream);
+	ft_shm_export_free(&defaultStream);
+	ft_detect_free(&defaultStream);
+	pthread_mutex_unlock(&defaultStream.mutexevent);
+	pthread_mutex_unlock(&defaultStream.mutexdata);
+	pthread_rwlock_unlock(&defaultStream.rwlockring);
+	pthread_mutex_unlock(&defaultStream.mutexheader);
+	ft_waitreg_reset(&defaultStream.waiters, 0, 0);
+}
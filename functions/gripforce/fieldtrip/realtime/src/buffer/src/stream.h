@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "platform_includes.h"
+#include "message.h"
+#include "ringbuffer.h"
+#include "eventlog.h"
+#include "eventindex.h"
+#include "waitreg.h"
+#include "lockstat.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_STREAM_NAME_LENGTH 64    /* maximal length of a stream name */
+#define FT_MAX_STREAMS        64    /* maximal number of named streams in one process */
+
+/** One independent buffer, i.e. a header with its data ring and event log.
+
+    A server process always has the default (unnamed) stream, which is what
+    clients get unless they send OPEN_STREAM with a name. Named streams are
+    created on first use and live until ft_free_streams; their rings are
+    only allocated when a header is put, so an unused stream is cheap.
+
+    Each stream has its own set of locks, so clients of different streams
+    never wait for each other. See dmarequest.c for the order of locking.
+*/
+typedef struct ft_stream {
+	char name[FT_STREAM_NAME_LENGTH+1];
+	header_t        *header;
+	ft_ring_t       *data;
+	ft_eventlog_t   *event;
+	ft_eventindex_t  eventindex;    /**< only valid while event!=NULL */
+
+	/* these are used for fine-tuning the sample number of incoming events */
+	struct timespec putdat_clock;
+	struct timespec putevt_clock;
+
+	pthread_mutex_t  mutexheader;
+	pthread_rwlock_t rwlockring;
+	pthread_mutex_t  mutexdata;
+	pthread_mutex_t  mutexevent;
+	volatile UINT16_T lockholder[FT_STREAM_LOCKS]; /**< the command that took each of the locks above last, see lockstat.h */
+	ft_waitreg_t     waiters;       /**< blocked WAIT_DAT requests */
+	struct ft_shm_export *shm;      /**< shared memory export of the ring, see shm.h */
+	struct ft_persist_file *persist; /**< session file with the ring and events, see persist.h */
+	struct ft_history *history;     /**< samples that have left the ring, see history.h */
+	struct ft_pyramid *pyramid;     /**< min/max/mean overview of the ring, see pyramid.h */
+	struct ft_detectors *detect;    /**< threshold detectors on the samples, see detect.h */
+
+	struct ft_stream *next;
+} ft_stream_t;
+
+/** Returns the default stream */
+ft_stream_t *ft_default_stream(void);
+
+/** Looks up the stream with the given name (not necessarily 0-terminated), and
+    creates it if it does not exist yet and create!=0. An empty name refers to
+    the default stream. Names may consist of up to FT_STREAM_NAME_LENGTH printable
+    characters without spaces. Returns NULL for invalid names, or if the stream
+    does not exist and cannot be created.
+*/
+ft_stream_t *ft_find_stream(const char *name, UINT32_T length, int create);
+
+/** The stream that requests from the calling thread go to. Server threads
+    handle one client connection each, so this is a per-connection setting,
+    which is changed by an OPEN_STREAM request.
+*/
+ft_stream_t *ft_current_stream(void);
+void ft_select_stream(ft_stream_t *S);
+
+/** These free the header, data ring and event log of a stream. The caller
+    needs to hold the corresponding locks. */
+void ft_stream_free_header(ft_stream_t *S);
+void ft_stream_free_data(ft_stream_t *S);
+void ft_stream_free_event(ft_stream_t *S);
+
+/** Frees all streams, only to be called when no client can be active anymore */
+void ft_free_streams(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STREAM_H */
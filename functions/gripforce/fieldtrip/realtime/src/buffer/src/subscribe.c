@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#endif
+
+#include "buffer.h"
+#include "subscribe.h"
+#include "chansel.h"
+#include "history.h"
+#include "stats.h"
+
+/* number of failed reads in a row after which a subscription ends */
+#define MAX_FAILURES 3
+
+/* a message with a buf of the given size, or NULL */
+static message_t *new_message(UINT16_T command, UINT32_T bufsize) {
+	message_t *msg = (message_t *) malloc(sizeof(message_t));
+	if (msg == NULL) return NULL;
+	msg->def = (messagedef_t *) malloc(sizeof(messagedef_t));
+	msg->buf = (bufsize > 0) ? malloc(bufsize) : NULL;
+	if (msg->def == NULL || (bufsize > 0 && msg->buf == NULL)) {
+		FREE(msg->def);
+		FREE(msg->buf);
+		free(msg);
+		return NULL;
+	}
+	msg->def->version = VERSION;
+	msg->def->command = command;
+	msg->def->bufsize = bufsize;
+	return msg;
+}
+
+static void free_message(message_t *msg) {
+	if (msg == NULL) return;
+	FREE(msg->buf);
+	FREE(msg->def);
+	free(msg);
+}
+
+/* puts "sel" in front of the buf of a GET_OK response, and turns it into the given push */
+static message_t *make_push(message_t *response, UINT16_T command, const void *sel, UINT32_T selsize) {
+	char *buf = (char *) malloc(selsize + response->def->bufsize);
+	if (buf == NULL) {
+		free_message(response);
+		return NULL;
+	}
+	memcpy(buf, sel, selsize);
+	if (response->def->bufsize > 0) memcpy(buf + selsize, response->buf, response->def->bufsize);
+	FREE(response->buf);
+	response->buf = buf;
+	response->def->command = command;
+	response->def->bufsize += selsize;
+	return response;
+}
+
+#ifndef WIN32
+
+void ft_subscription_init(ft_subscription_t *U) {
+	memset(U, 0, sizeof(ft_subscription_t));
+	U->waiter.woken = 1;
+	U->wakefd[0] = U->wakefd[1] = -1;
+}
+
+int ft_subscription_start(ft_subscription_t *U, const message_t *request) {
+	ft_stream_t *S = ft_current_stream();
+	subscribedef_t sub;
+	samples_events_t count;
+	UINT32_T selsize;
+	int k;
+
+	if (request->def->bufsize < sizeof(subscribedef_t)) return -1;
+	memcpy(&sub, request->buf, sizeof(subscribedef_t));
+	if (sub.blocksize == 0 || sub.begsample < -1 || sub.begevent < -1) return -1;
+	selsize = request->def->bufsize - sizeof(subscribedef_t);
+
+	/* a channel selection is checked against the header if there is one already */
+	if (selsize > 0) {
+		ft_chansel_t chansel;
+		int valid = 1;
+		UINT64_T held = ft_stream_lock(S, FT_LOCK_HEADER, SUBSCRIBE_DAT);
+		if (S->header != NULL) {
+			valid = (ft_chansel_parse(S->header, selsize, (const char *) request->buf + sizeof(subscribedef_t), &chansel) == 0);
+			if (valid) ft_chansel_free(&chansel);
+		}
+		ft_stream_unlock(S, FT_LOCK_HEADER, SUBSCRIBE_DAT, held);
+		if (!valid) return -1;
+	}
+
+	ft_subscription_stop(U);
+
+	if (selsize > 0) {
+		U->selbuf = (char *) malloc(selsize);
+		if (U->selbuf == NULL) return -1;
+		memcpy(U->selbuf, (const char *) request->buf + sizeof(subscribedef_t), selsize);
+	}
+	/* the writer must never block on the pipe, and neither must we */
+	if (pipe(U->wakefd) != 0) {
+		perror("ft_subscription_start, pipe");
+		U->wakefd[0] = U->wakefd[1] = -1;
+		FREE(U->selbuf);
+		return -1;
+	}
+	for (k=0; k<2; k++) fcntl(U->wakefd[k], F_SETFL, fcntl(U->wakefd[k], F_GETFL) | O_NONBLOCK);
+
+	U->stream = S;
+	ft_waitreg_disarm(&S->waiters, &U->waiter, &count);
+	U->nextsample   = (sub.begsample < 0) ? count.nsamples : (UINT32_T) sub.begsample;
+	U->nextevent    = (sub.begevent < 0) ? count.nevents : (UINT32_T) sub.begevent;
+	U->blocksize    = sub.blocksize;
+	U->milliseconds = sub.milliseconds;
+	U->credit       = sub.credit;
+	U->pending      = 0;
+	U->selsize      = selsize;
+	U->active       = 1;
+	return 0;
+}
+
+void ft_subscription_stop(ft_subscription_t *U) {
+	samples_events_t count;
+	int k;
+
+	if (U->stream != NULL) ft_waitreg_disarm(&U->stream->waiters, &U->waiter, &count);
+	for (k=0; k<2; k++) {
+		if (U->wakefd[k] >= 0) close(U->wakefd[k]);
+		U->wakefd[k] = -1;
+	}
+	FREE(U->selbuf);
+	U->selsize = 0;
+	U->stream = NULL;
+	U->active = 0;
+}
+
+void ft_subscription_credit(ft_subscription_t *U, UINT32_T bufsize, const void *buf) {
+	UINT32_T credit;
+	if (bufsize < sizeof(UINT32_T)) return;
+	memcpy(&credit, buf, sizeof(UINT32_T));
+	U->credit = (U->credit > 0xFFFFFFFFu - credit) ? 0xFFFFFFFFu : U->credit + credit;
+}
+
+int ft_subscription_fd(const ft_subscription_t *U) {
+	return U->active ? U->wakefd[0] : -1;
+}
+
+/* milliseconds since "since" */
+static double elapsed_ms(const struct timeval *since) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - since->tv_sec) * 1000.0 + (now.tv_usec - since->tv_usec) / 1000.0;
+}
+
+/* pushes up to one block of samples from nextsample on, or returns NULL if they cannot be read */
+static message_t *push_samples(ft_subscription_t *U, UINT32_T nsamples) {
+	ft_stream_t *S = U->stream;
+	messagedef_t def;
+	message_t request, *response = NULL;
+	datasel_t datasel;
+	char *buf;
+	UINT32_T n;
+	UINT64_T held;
+
+	/* the samples of a client that fell behind may have been overwritten already */
+	held = ft_stream_lock(S, FT_LOCK_RING_READ, PUSH_DAT);
+	if (S->data != NULL && !ft_history_active(S) && U->nextsample < ft_ring_first(S->data))
+		U->nextsample = ft_ring_first(S->data);
+	ft_stream_unlock(S, FT_LOCK_RING_READ, PUSH_DAT, held);
+	if (U->nextsample >= nsamples) return NULL;
+
+	n = nsamples - U->nextsample;
+	if (n > U->blocksize) n = U->blocksize;
+	datasel.begsample = U->nextsample;
+	datasel.endsample = U->nextsample + n - 1;
+
+	/* this is just a GET_DAT, with the channel selection of the subscription */
+	if ((buf = (char *) malloc(sizeof(datasel_t) + U->selsize)) == NULL) return NULL;
+	memcpy(buf, &datasel, sizeof(datasel_t));
+	if (U->selsize > 0) memcpy(buf + sizeof(datasel_t), U->selbuf, U->selsize);
+	def.version = VERSION;
+	def.command = GET_DAT;
+	def.bufsize = sizeof(datasel_t) + U->selsize;
+	request.def = &def;
+	request.buf = buf;
+
+	if (dmarequest(&request, &response) != 0 || response == NULL || response->def->command != GET_OK) {
+		free_message(response);
+		free(buf);
+		return NULL;
+	}
+	free(buf);
+
+	U->nextsample += n;
+	return make_push(response, PUSH_DAT, &datasel, sizeof(datasel_t));
+}
+
+/* pushes the events from nextevent on, or returns NULL if they cannot be read */
+static message_t *push_events(ft_subscription_t *U, UINT32_T nevents) {
+	ft_stream_t *S = U->stream;
+	messagedef_t def;
+	message_t request, *response = NULL;
+	eventsel_t eventsel;
+	UINT32_T n;
+	UINT64_T held;
+
+	held = ft_stream_lock(S, FT_LOCK_EVENT, PUSH_EVT);
+	if (S->event != NULL && U->nextevent < S->event->first) U->nextevent = S->event->first;
+	ft_stream_unlock(S, FT_LOCK_EVENT, PUSH_EVT, held);
+	if (U->nextevent >= nevents) return NULL;
+
+	n = nevents - U->nextevent;
+	if (n > FT_SUBSCRIBE_MAX_EVENTS) n = FT_SUBSCRIBE_MAX_EVENTS;
+	eventsel.begevent = U->nextevent;
+	eventsel.endevent = U->nextevent + n - 1;
+
+	def.version = VERSION;
+	def.command = GET_EVT;
+	def.bufsize = sizeof(eventsel_t);
+	request.def = &def;
+	request.buf = &eventsel;
+
+	if (dmarequest(&request, &response) != 0 || response == NULL || response->def->command != GET_OK) {
+		free_message(response);
+		return NULL;
+	}
+
+	U->nextevent += n;
+	return make_push(response, PUSH_EVT, &eventsel, sizeof(eventsel_t));
+}
+
+message_t *ft_subscription_next(ft_subscription_t *U, struct timeval *timeout) {
+	ft_stream_t *S = U->stream;
+	samples_events_t count, threshold;
+	int failures = 0;
+	char drain[64];
+
+	if (!U->active) return NULL;
+
+	/* whatever woke us up, we look at the counts ourselves */
+	while (read(U->wakefd[0], drain, sizeof(drain)) > 0) {}
+	ft_waitreg_disarm(&S->waiters, &U->waiter, &count);
+
+	for (;;) {
+		message_t *push = NULL;
+		UINT64_T start = 0;
+		int tried = 0;
+
+		/* counts that went down were flushed, or belong to a new header */
+		if (count.nsamples < U->nextsample) {
+			U->nextsample = 0;
+			U->pending = 0;
+		}
+		if (count.nevents < U->nextevent) U->nextevent = 0;
+
+		/* the client sends SUBSCRIBE_CREDIT over the socket, which select watches anyway */
+		if (U->credit == 0) return NULL;
+
+		if (count.nevents > U->nextevent) {
+			start = ft_stats_now();
+			push = push_events(U, count.nevents);
+			tried = 1;
+		}
+		else if (count.nsamples > U->nextsample) {
+			if (!U->pending) {
+				U->pending = 1;
+				gettimeofday(&U->since, NULL);
+			}
+			if (count.nsamples - U->nextsample >= U->blocksize || elapsed_ms(&U->since) >= U->milliseconds) {
+				start = ft_stats_now();
+				push = push_samples(U, count.nsamples);
+				tried = 1;
+				if (push != NULL) U->pending = 0;
+			}
+		}
+
+		if (push != NULL) {
+			U->credit--;
+			ft_stats_record(push->def->command, start, 0, sizeof(messagedef_t) + push->def->bufsize);
+			return push;
+		}
+		if (tried) {
+			/* a flush, a new header or an overrun came in between, so look again */
+			if (++failures < MAX_FAILURES) {
+				ft_waitreg_disarm(&S->waiters, &U->waiter, &count);
+				continue;
+			}
+			fprintf(stderr, "ft_subscription_next: cannot read from the stream, ending the subscription\n");
+			ft_subscription_stop(U);
+			return new_message(SUBSCRIBE_ERR, 0);
+		}
+
+		/* nothing to push yet: wait for the first new sample or event, or for the rest of the block */
+		threshold.nsamples = U->pending ? U->nextsample + U->blocksize - 1 : U->nextsample;
+		threshold.nevents  = U->nextevent;
+		if (ft_waitreg_arm(&S->waiters, &U->waiter, &threshold, U->wakefd[1], &count) == 1) continue;
+
+		if (U->pending) {
+			double left = U->milliseconds - elapsed_ms(&U->since);
+			long usec = (left > 0) ? (long) (left * 1000.0) + 1 : 0;
+			if (usec < timeout->tv_sec * 1000000L + timeout->tv_usec) {
+				timeout->tv_sec  = usec / 1000000L;
+				timeout->tv_usec = usec % 1000000L;
+			}
+		}
+		return NULL;
+	}
+}
+
+#endif
+
+int ft_subscribe(int server, const subscribedef_t *sub, UINT32_T selsize, const void *sel) {
+	message_t *request, *response = NULL;
+	int result;
+
+	request = new_message(SUBSCRIBE_DAT, sizeof(subscribedef_t) + selsize);
+	if (request == NULL) return -1;
+	memcpy(request->buf, sub, sizeof(subscribedef_t));
+	if (selsize > 0) memcpy((char *) request->buf + sizeof(subscribedef_t), sel, selsize);
+
+	result = tcprequest(server, request, &response);
+	free_message(request);
+	if (result < 0 || response == NULL || response->def->command != SUBSCRIBE_OK) result = -1;
+	free_message(response);
+	return result;
+}
+
+int ft_grant_credit(int server, UINT32_T credit) {
+	/* not answered, so it is only written */
+	char packet[sizeof(messagedef_t) + sizeof(UINT32_T)];
+	messagedef_t def;
+
+	def.version = VERSION;
+	def.command = SUBSCRIBE_CREDIT;
+	def.bufsize = sizeof(UINT32_T);
+	memcpy(packet, &def, sizeof(messagedef_t));
+	memcpy(packet + sizeof(messagedef_t), &credit, sizeof(UINT32_T));
+	return (bufwrite(server, packet, sizeof(packet)) == sizeof(packet)) ? 0 : -1;
+}
+
+int ft_receive(int server, message_t **message) {
+	messagedef_t def;
+	message_t *msg;
+
+	*message = NULL;
+	if (bufread(server, &def, sizeof(messagedef_t)) != sizeof(messagedef_t)) return -1;
+	if ((msg = new_message(def.command, def.bufsize)) == NULL) return -1;
+	msg->def->version = def.version;
+	if (def.bufsize > 0 && bufread(server, msg->buf, def.bufsize) != def.bufsize) {
+		free_message(msg);
+		return -1;
+	}
+	*message = msg;
+	return 0;
+}
+
+int ft_unsubscribe(int server) {
+	messagedef_t def;
+	message_t *msg;
+
+	def.version = VERSION;
+	def.command = UNSUBSCRIBE;
+	def.bufsize = 0;
+	if (bufwrite(server, &def, sizeof(messagedef_t)) != sizeof(messagedef_t)) return -1;
+	for (;;) {
+		int done;
+		if (ft_receive(server, &msg) != 0) return -1;
+		done = (msg->def->command == SUBSCRIBE_OK);
+		free_message(msg);
+		if (done) return 0;
+	}
+}
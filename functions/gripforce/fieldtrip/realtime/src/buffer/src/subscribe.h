@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef SUBSCRIBE_H
+#define SUBSCRIBE_H
+
+#include "platform_includes.h"
+#include "message.h"
+#include "stream.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FT_SUBSCRIBE_MAX_EVENTS  256   /* events per PUSH_EVT */
+
+/** Samples and events that are pushed by the server, instead of polled by the client.
+
+    A client sends SUBSCRIBE_DAT with a subscribedef_t, optionally followed
+    by a channel selection as in GET_DAT (see chansel.h), and the server
+    answers with SUBSCRIBE_OK. From then on, the server sends PUSH_DAT
+    messages with the samples from begsample onwards as soon as PUT_DAT has
+    put them into the ring: either blocksize samples at once, or whatever
+    there is once the first of them has waited for the given number of
+    milliseconds. New events are sent in PUSH_EVT messages right away. Each
+    push starts with the datasel_t or eventsel_t of what it contains, so a
+    client that fell so far behind that samples or events were overwritten
+    can tell what it missed.
+
+    Every push uses up one credit, and the server stops pushing when it has
+    none left. The client grants more with SUBSCRIBE_CREDIT, which is the
+    only request that is not answered, typically one credit for every push
+    it has dealt with. The samples wait in the ring in the meantime, so a
+    slow client never makes the server buffer more than its credit, and the
+    writer never waits for it.
+
+    The server only pushes between two requests, and waits for new samples
+    and events with select, on a pipe that the WAIT_DAT registry (see
+    waitreg.h) writes to as soon as PUT_DAT or PUT_EVT publishes what it is
+    waiting for, so a push is one network hop behind the writer. A client
+    should only send SUBSCRIBE_CREDIT and UNSUBSCRIBE on a subscribed
+    connection: other requests are answered, but pushes may come first.
+    After the SUBSCRIBE_OK that answers UNSUBSCRIBE, nothing is pushed
+    anymore. If the subscription cannot go on, for instance because a new
+    header no longer has the selected channels, the server pushes
+    SUBSCRIBE_ERR and ends it.
+
+    Subscriptions are handled by the socket server (see socketserver.c) on
+    connections that have the same endianness as the server; dmarequest
+    refuses them. Pushed samples are never encoded (see compress.h).
+*/
+
+#ifndef WIN32
+
+/** Server side: the subscription of one connection */
+typedef struct {
+	int          active;
+	ft_stream_t  *stream;
+	ft_waiter_t  waiter;        /* registered in the WAIT_DAT registry of the stream while idle */
+	int          wakefd[2];     /* the pipe that the registry writes to */
+	UINT32_T     nextsample;    /* first sample that has not been pushed */
+	UINT32_T     nextevent;     /* first event that has not been pushed */
+	UINT32_T     blocksize;
+	UINT32_T     milliseconds;
+	UINT32_T     credit;
+	int          pending;       /* 1 if there are samples that wait for more, since "since" */
+	struct timeval since;
+	UINT32_T     selsize;       /* the channel selection, as in GET_DAT */
+	char         *selbuf;
+} ft_subscription_t;
+
+void ft_subscription_init(ft_subscription_t *U);
+
+/** Starts (or replaces) the subscription of a SUBSCRIBE_DAT request on the
+    current stream, returns 0 or -1 if the request is not valid
+*/
+int  ft_subscription_start(ft_subscription_t *U, const message_t *request);
+
+/** Ends the subscription, after which nothing is pushed anymore */
+void ft_subscription_stop(ft_subscription_t *U);
+
+/** Adds the credit of a SUBSCRIBE_CREDIT request */
+void ft_subscription_credit(ft_subscription_t *U, UINT32_T bufsize, const void *buf);
+
+/** The file descriptor that becomes readable when there is something to push, or -1 */
+int  ft_subscription_fd(const ft_subscription_t *U);
+
+/** Returns the next message to push, or NULL if there is nothing to push
+    yet, in which case *timeout is lowered to the time after which there
+    might be, and the subscription is registered to be woken up before that.
+*/
+message_t *ft_subscription_next(ft_subscription_t *U, struct timeval *timeout);
+
+#endif
+
+/** Client side: subscribes with the given definition and channel selection
+    (selsize bytes at sel, starting with a channelseldef_t, or none), returns
+    0, or -1 if the server refused
+*/
+int ft_subscribe(int server, const subscribedef_t *sub, UINT32_T selsize, const void *sel);
+
+/** Client side: grants the server this many more pushes, returns 0 or -1 */
+int ft_grant_credit(int server, UINT32_T credit);
+
+/** Client side: waits for the next message from the server, which is a
+    PUSH_DAT, PUSH_EVT or SUBSCRIBE_ERR, or the response to a request.
+    Returns 0, or -1 if the connection was closed.
+*/
+int ft_receive(int server, message_t **message);
+
+/** Client side: ends the subscription, and discards the pushes that were
+    already on their way. Returns 0, or -1 if the connection was closed.
+*/
+int ft_unsubscribe(int server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SUBSCRIBE_H */
@@ -7,7 +7,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include "buffer.h"
+#include "shm.h"
+#include "compress.h"
+#include "zerocopy.h"
 
 #define MERGE_THRESHOLD 4096 /* TODO: optimize this value? Maybe look at MTU size */
 
@@ -17,9 +21,28 @@
  *******************************************************************************/
 int tcprequest(int server, const message_t *request, message_t **response_ptr) {
   unsigned int n, total;
+  UINT32_T encoding = ft_connection_encoding(server);
+  messagedef_t encodeddef;
+  message_t encoded;
 
   /* this will hold the response */
   message_t *response;
+
+  /* on a shm:// connection, GET_DAT is answered from the shared ring if possible */
+  if (ft_shm_request(server, request, response_ptr) == 0) return 0;
+
+  /* if the server agreed on an encoding, send the samples of PUT_DAT encoded (see compress.h) */
+  encoded.buf = NULL;
+  if (encoding != FT_ENCODING_NONE && request->def->command == PUT_DAT) {
+    encoded.buf = ft_encode_samples(request->buf, request->def->bufsize, &encodeddef.bufsize);
+    if (encoded.buf != NULL) {
+      encodeddef.version = request->def->version;
+      encodeddef.command = request->def->command;
+      encoded.def = &encodeddef;
+      request = &encoded;
+    }
+  }
+
   response      = (message_t*)malloc(sizeof(message_t));
   response->def = (messagedef_t*)malloc(sizeof(messagedef_t));
   DIE_BAD_MALLOC(response->def);
@@ -52,6 +75,30 @@ int tcprequest(int server, const message_t *request, message_t **response_ptr) {
       goto cleanup;
     }
   }
+#ifndef WIN32
+  /* Otherwise, send "def" and "buf" with one writev, so that they do not go out as two
+     writes, the second of which Nagle's algorithm would hold back until the first is acked
+   */
+  else {
+    struct iovec iov[2], *iovp = iov;
+    int iovcnt = 2;
+
+    iov[0].iov_base = request->def;
+    iov[0].iov_len  = sizeof(messagedef_t);
+    iov[1].iov_base = request->buf;
+    iov[1].iov_len  = request->def->bufsize;
+    while (iovcnt > 0) {
+      ssize_t nw = writev(server, iovp, iovcnt);
+      if (nw < 0 && errno == EINTR) continue;
+      if (nw <= 0) break;
+      iovcnt = ft_iovec_consume(&iovp, iovcnt, (size_t) nw);
+    }
+    if (iovcnt > 0) {
+      fprintf(stderr, "tcprequest: could not write the request\n");
+      goto cleanup;
+    }
+  }
+#else
   /* Otherwise, send "def" and "buf" in separate pieces. This might introduce latencies
      if the other end runs Windows :-(
    */
@@ -69,6 +116,7 @@ int tcprequest(int server, const message_t *request, message_t **response_ptr) {
          goto cleanup;
        }
      }
+#endif
 
      /* read the response from the server, first the message definition */
      if ((n = bufread(server, response->def, sizeof(messagedef_t))) != sizeof(messagedef_t)) {
@@ -90,12 +138,30 @@ int tcprequest(int server, const message_t *request, message_t **response_ptr) {
        }
      }
 
+     /* samples that the server sent encoded */
+     if (encoding != FT_ENCODING_NONE && response->def->command == GET_OK && ft_samples_encoded(response->buf, response->def->bufsize)) {
+       UINT32_T size;
+       void *decoded = ft_decode_samples(response->buf, response->def->bufsize, &size);
+       if (decoded == NULL) {
+         fprintf(stderr, "tcprequest: cannot decode the samples\n");
+         goto cleanup;
+       }
+       free(response->buf);
+       response->buf = decoded;
+       response->def->bufsize = size;
+     }
+
+     /* the shared ring of the new stream has to be mapped from now on */
+     if (response->def->command == OPEN_OK) ft_shm_select_stream(server, (const char *) request->buf, request->def->bufsize);
+
      /* everything went fine, return with the response */
      /* print_response(response->def); */
+     FREE(encoded.buf);
      return 0;
 
 cleanup:
      /* there was a problem, clear the response and return */
+     FREE(encoded.buf);
      FREE(response->def);
      FREE(response->buf);
      FREE(response);
@@ -13,6 +13,9 @@
 /* these are for changing the socket to non-blocking mode */
 #include <fcntl.h>
 #include <errno.h>
+#if !defined(PLATFORM_WIN32) && !defined(PLATFORM_WIN64)
+#include <poll.h>
+#endif
 
 #include <pthread.h>
 #include "buffer.h"
@@ -182,8 +185,15 @@ void *tcpserver(void *arg) {
       }
 #else
       if (errno==EWOULDBLOCK) {
-        pthread_testcancel();
-        usleep(ACCEPTSLEEP);
+        /* sleep until a client connects, poll is a cancellation point */
+        struct pollfd pfd;
+        pfd.fd      = s;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, -1)<0 && errno!=EINTR) {
+          perror("tcpserver poll");
+          goto cleanup;
+        }
       }
       else {
         perror("tcpserver accept");
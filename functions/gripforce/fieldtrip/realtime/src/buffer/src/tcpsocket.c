@@ -9,17 +9,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <errno.h>
 
 #include "buffer.h"
 #include <pthread.h>
 #include "extern.h"
+#include "zerocopy.h"
+#include "stats.h"
+#include "trace.h"
 
-#ifdef ENABLE_POLLING
+#if defined(ENABLE_POLLING) || !defined(WIN32)
   #include <poll.h>
 #endif
 
 #define THREADSLEEP      1000000  /* in microseconds */
-#define POLLSLEEP        100      /* in microseconds */
 #define MERGE_THRESHOLD  4096     /* TODO: optimize this value? Maybe look at MTU size */
 
 typedef struct {
@@ -27,6 +30,17 @@ typedef struct {
         int fd;
 } threadlocal_t;
 
+#ifndef WIN32
+static void cleanup_pinned(void *arg) {
+        ft_pinned_send_destroy((ft_pinned_send_t *) arg);
+}
+
+static void cleanup_ingest(void *arg) {
+        /* nothing of an incomplete block is published */
+        ft_putdat_abort((ft_ingest_t *) arg, NULL, 0);
+}
+#endif
+
 void cleanup_tcpsocket(void *arg) {
         threadlocal_t *threadlocal;
         threadlocal = (threadlocal_t *)arg;
@@ -59,6 +73,14 @@ void *tcpsocket(void *arg) {
 	/* these are used for communication over the TCP socket */
 	int client = 0;
 	message_t *request = NULL, *response = NULL;
+	UINT32_T bytesIn;
+	UINT64_T start, phaseStart;
+	UINT16_T traceCommand;
+#ifndef WIN32
+	ft_pinned_data_t pinned;
+	ft_pinned_send_t pinsend;
+	ft_ingest_t ingest;
+#endif
 
     threadlocal_t threadlocal;
     threadlocal.message = NULL;
@@ -96,27 +118,32 @@ void *tcpsocket(void *arg) {
 		/* wait for data to become available or until the connection is closed */
 		/* thohar: i think this is not neccessary as we dont need a timeout. */
 		/* roboos: we need it to detect when the socket is closed by the client */
+		/* only asking for input (POLLHUP and POLLERR come anyway) lets poll sleep until
+		   there is something to do, instead of returning at once for the writable socket */
 		while (1) {
 			fds.fd      = client;
-			fds.events  = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI | POLLOUT | POLLWRNORM | POLLWRBAND | POLLERR | POLLNVAL;
+			fds.events  = POLLIN | POLLRDNORM | POLLRDBAND | POLLPRI;
 			fds.revents = 0;
 
-			if (poll(&fds, 1, 1)==-1) {
+			if (poll(&fds, 1, -1)==-1) {
+				if (errno==EINTR) continue;
 				perror("poll");
 				goto cleanup;
 			}
 
-			if (fds.revents & POLLHUP)
-				goto cleanup;				/* the connection has been closed */
-			else if (fds.revents & POLLERR)
+			if (fds.revents & POLLIN)
+				break;						/* data is available, process the message (or find the end of it) */
+			else if (fds.revents & (POLLHUP | POLLERR | POLLNVAL))
 				goto cleanup;				/* the connection has been closed */
-			else if (fds.revents & POLLIN)
-				break;						/* data is available, process the message */
-			else
-				usleep(POLLSLEEP);			/* wait for data or closed connection */
 		}
 #endif
 
+		if (ft_trace_active) {
+			/* the header is only traced from when it starts to come in */
+			char peek;
+			recv(client, &peek, 1, MSG_PEEK);
+		}
+		phaseStart = FT_TRACE_NOW();
 		if ((n = bufread(client, request->def, sizeof(messagedef_t))) != sizeof(messagedef_t)) {
 			if (verbose>0) fprintf(stderr, "tcpsocket: packet size = %d, should be %lu\n", n, sizeof(messagedef_t));
 			goto cleanup;
@@ -133,7 +160,96 @@ void *tcpsocket(void *arg) {
 			if (verbose>0) fprintf(stderr, "tcpsocket: incorrect request version\n");
 			goto cleanup;
 		}
+		traceCommand = request->def->command;
+		ft_trace_span(FT_TRACE_READ_HDR, traceCommand, phaseStart);
+		phaseStart = FT_TRACE_NOW();
 		
+#ifndef WIN32
+		/* large PUT_DAT requests are received straight into the ring, without copying */
+		if (!swap && ft_putdat_wanted(request->def)) {
+			datadef_t ddef;
+			int have = sizeof(datadef_t);
+			if ((n = bufread(client, &ddef, sizeof(datadef_t))) != sizeof(datadef_t)) {
+				if (verbose>0) fprintf(stderr, "tcpsocket: read size = %d, should be %lu\n", n, sizeof(datadef_t));
+				goto cleanup;
+			}
+			if (ft_putdat_reserve(request->def, &ddef, &ingest)) {
+				struct iovec iov[2], *iovp = iov;
+				int iovcnt = ft_ingest_iovec(&ingest, iov);
+				size_t received = 0;
+				UINT64_T deadline = ft_stats_now() + (UINT64_T) FT_INGEST_TIMEOUT * 1000000;
+				int closed = 0;
+				messagedef_t respdef;
+
+				pthread_cleanup_push(cleanup_ingest, &ingest);
+				while (iovcnt > 0) {
+					struct pollfd pfd;
+					UINT64_T now = ft_stats_now();
+					ssize_t nr;
+
+					if (now >= deadline) break;
+					pfd.fd = client;
+					pfd.events = POLLIN;
+					nr = poll(&pfd, 1, (int) ((deadline - now) / 1000000) + 1);
+					if (nr == 0) continue;
+					if (nr > 0) nr = readv(client, iovp, iovcnt);
+					if (nr < 0 && errno == EINTR) continue;
+					if (nr <= 0) {
+						closed = 1;
+						break;
+					}
+					received += nr;
+					iovcnt = ft_iovec_consume(&iovp, iovcnt, (size_t) nr);
+				}
+				pthread_cleanup_pop(0);
+
+				if (iovcnt == 0) {
+					ft_trace_span(FT_TRACE_READ_BODY, traceCommand, phaseStart);
+					start = ft_stats_now();
+					ft_putdat_commit(&ingest);
+					ft_stats_record(PUT_DAT, start, sizeof(messagedef_t) + request->def->bufsize, sizeof(messagedef_t));
+					ft_trace_span(FT_TRACE_EXECUTE, traceCommand, start);
+					phaseStart = FT_TRACE_NOW();
+					cleanup_message(&request);
+					request = NULL;
+
+					respdef.version = VERSION;
+					respdef.command = PUT_OK;
+					respdef.bufsize = 0;
+					if ((n = bufwrite(client, &respdef, sizeof(messagedef_t))) != sizeof(messagedef_t)) {
+						if (verbose>0) fprintf(stderr, "tcpsocket: write size = %d, should be %lu\n", n, sizeof(messagedef_t));
+						goto cleanup;
+					}
+					ft_trace_span(FT_TRACE_WRITE, traceCommand, phaseStart);
+					continue;
+				}
+				if (closed) {
+					/* nothing of the incomplete block is published */
+					ft_putdat_abort(&ingest, NULL, 0);
+					if (verbose>0) fprintf(stderr, "tcpsocket: could not read all samples\n");
+					goto cleanup;
+				}
+				/* the client is too slow to keep other writers waiting for mutexdata,
+				   so give back the room and read the rest of the request as usual */
+				request->buf = malloc(request->def->bufsize);
+				DIE_BAD_MALLOC(request->buf);
+				memcpy(request->buf, &ddef, sizeof(datadef_t));
+				ft_putdat_abort(&ingest, (char *) request->buf + sizeof(datadef_t), received);
+				have += (int) received;
+			}
+			/* otherwise, read the rest and let dmarequest deal with it */
+			if (request->buf == NULL) {
+				request->buf = malloc(request->def->bufsize);
+				DIE_BAD_MALLOC(request->buf);
+				memcpy(request->buf, &ddef, sizeof(datadef_t));
+			}
+			n = have + bufread(client, (char *) request->buf + have, request->def->bufsize - have);
+			if (n != request->def->bufsize) {
+				if (verbose>0) fprintf(stderr, "tcpsocket: read size = %d, should be %d\n", n, request->def->bufsize);
+				goto cleanup;
+			}
+		} else
+#endif
 		if (request->def->bufsize>0) {
 			request->buf = malloc(request->def->bufsize);
 			DIE_BAD_MALLOC(request->buf);
@@ -144,10 +260,53 @@ void *tcpsocket(void *arg) {
 		}
 		
 		if (swap && request->def->bufsize > 0) ft_swap_buf_to_native(reqCommand, request->def->bufsize, request->buf);
+		if (request->def->bufsize > 0) {
+			ft_trace_span(FT_TRACE_READ_BODY, traceCommand, phaseStart);
+			phaseStart = FT_TRACE_NOW();
+		}
 
 		if (verbose>1) print_request(request->def);
 		if (verbose>1) print_buf(request->buf, request->def->bufsize);
 
+		start = ft_stats_now();
+		bytesIn = sizeof(messagedef_t) + request->def->bufsize;
+
+#ifndef WIN32
+		/* large GET_DAT responses are sent straight from the ring, without copying */
+		if (!swap && ft_getdat_pinned(request, &pinned)) {
+			int res = -1;
+
+			ft_stats_record(GET_DAT, start, bytesIn, sizeof(messagedef_t) + pinned.def.bufsize);
+			ft_trace_span(FT_TRACE_EXECUTE, traceCommand, phaseStart);
+			phaseStart = FT_TRACE_NOW();
+			cleanup_message(&request);
+			request = NULL;
+
+			if (ft_pinned_send_init(&pinsend) != 0) {
+				ft_getdat_release(&pinned);
+				goto cleanup;
+			}
+			ft_pinned_send_start(&pinsend, &pinned);
+			pthread_cleanup_push(cleanup_pinned, &pinsend);
+			/* a client that does not read must not keep the writer waiting,
+			   so the pin is parked whenever we have to wait for the socket */
+			while ((res = ft_pinned_send(&pinsend, client)) == 0) {
+				struct pollfd pfd;
+				pfd.fd = client;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, -1) == -1 && errno != EINTR) break;
+			}
+			pthread_cleanup_pop(1);
+
+			if (res <= 0) {
+				if (verbose>0) fprintf(stderr, "tcpsocket: could not write pinned response\n");
+				goto cleanup;
+			}
+			ft_trace_span(FT_TRACE_WRITE, traceCommand, phaseStart);
+			continue;
+		}
+#endif
+
 		if ((status = dmarequest(request, &response)) != 0) {
 			if (verbose>0) fprintf(stderr, "tcpsocket: an unexpected error occurred\n");
 			goto cleanup;
@@ -160,7 +319,13 @@ void *tcpsocket(void *arg) {
 		if (verbose>1) print_buf(request->buf, request->def->bufsize);
 		
 		respBufSize = response->def->bufsize;
-		if (swap) ft_swap_from_native(reqCommand, response);
+		if (swap && reqCommand == BATCH)
+			ft_swap_batch_from_native(request->def->bufsize, request->buf, response);
+		else if (swap)
+			ft_swap_from_native(reqCommand, response);
+		ft_stats_record(request->def->command, start, bytesIn, sizeof(messagedef_t) + respBufSize);
+		ft_trace_span(FT_TRACE_EXECUTE, traceCommand, phaseStart);
+		phaseStart = FT_TRACE_NOW();
 
 		/* we don't need the request anymore */
 		cleanup_message(&request);
@@ -193,6 +358,7 @@ void *tcpsocket(void *arg) {
 			}
 		}
 
+		ft_trace_span(FT_TRACE_WRITE, traceCommand, phaseStart);
 		cleanup_message(&response);
         response = NULL;
 
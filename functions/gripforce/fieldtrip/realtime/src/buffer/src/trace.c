@@ -0,0 +1,221 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "trace.h"
+#include "atomicops.h"
+#include "printstruct.h"
+
+typedef struct {
+	UINT64_T start;
+	UINT32_T duration;     /* in ns, at most 4 seconds */
+	UINT16_T phase;
+	UINT16_T command;
+} span_t;
+
+/* the spans of one thread at a time, see trace.h */
+typedef struct trace_ring {
+	span_t *span;
+	volatile UINT32_T count;   /* spans written, of which the last "nspans" are kept */
+	int row;                   /* the row in the timeline */
+	int taken;                 /* by a thread that is still running */
+	struct trace_ring *next;
+} trace_ring_t;
+
+volatile int ft_trace_active = 0;
+
+static const char *phaseNames[] = {"read header", "read body", "lock wait", "execute", "write"};
+
+static pthread_mutex_t mutextrace = PTHREAD_MUTEX_INITIALIZER;  /* protects everything below */
+static pthread_key_t ringKey;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static trace_ring_t *rings = NULL;
+static int numRings = 0;
+static UINT32_T nspans = 0;       /* a power of two, fixed by the first ft_trace_enable */
+static char *traceFile = NULL;
+static UINT64_T origin = 0;       /* time 0 of the timeline */
+static int dumper = 0;            /* whether the thread that waits for signals runs */
+
+/* the ring goes to the next thread that starts */
+static void release_ring(void *arg) {
+	trace_ring_t *R = (trace_ring_t *) arg;
+	pthread_mutex_lock(&mutextrace);
+	R->taken = 0;
+	pthread_mutex_unlock(&mutextrace);
+}
+
+static void trace_once(void) {
+	pthread_key_create(&ringKey, release_ring);
+}
+
+static trace_ring_t *thread_ring(void) {
+	trace_ring_t *R = (trace_ring_t *) pthread_getspecific(ringKey);
+	if (R != NULL) return R;
+
+	pthread_mutex_lock(&mutextrace);
+	for (R = rings; R != NULL; R = R->next) {
+		if (!R->taken) break;
+	}
+	if (R == NULL && (R = (trace_ring_t *) calloc(1, sizeof(trace_ring_t))) != NULL) {
+		R->span = (span_t *) malloc(nspans * sizeof(span_t));
+		if (R->span == NULL) {
+			free(R);
+			R = NULL;
+		} else {
+			R->row  = ++numRings;
+			R->next = rings;
+			rings = R;
+		}
+	}
+	if (R != NULL) R->taken = 1;
+	pthread_mutex_unlock(&mutextrace);
+	if (R != NULL) pthread_setspecific(ringKey, R);
+	return R;
+}
+
+void ft_trace_span(int phase, UINT16_T command, UINT64_T start) {
+	trace_ring_t *R;
+	UINT64_T end;
+	span_t *s;
+
+	if (start == 0 || !ft_trace_active) return;
+	end = ft_stats_now();
+	if ((R = thread_ring()) == NULL) return;
+	s = R->span + (R->count & (nspans-1));
+	s->start    = start;
+	s->duration = (end - start > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (UINT32_T) (end - start);
+	s->phase    = (UINT16_T) phase;
+	s->command  = command;
+	/* the dump only reads spans that have been counted */
+	FT_ATOMIC_STORE(&R->count, R->count + 1);
+}
+
+/* writes the spans that are not overwritten while we copy them, with the lock held;
+   the oldest one of a full ring may be written to at any time, so that is left out */
+static void dump_ring(FILE *f, trace_ring_t *R, span_t *copy, int *first) {
+	UINT32_T count = FT_ATOMIC_LOAD(&R->count), n = (count < nspans) ? count : nspans, i, after;
+
+	for (i=0; i<n; i++) copy[i] = R->span[(count - n + i) & (nspans-1)];
+	after = FT_ATOMIC_LOAD(&R->count);
+
+	fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", *first ? "" : ",\n", R->row, R->row);
+	*first = 0;
+	for (i=0; i<n; i++) {
+		span_t *s = copy + i;
+		/* the writer may have come round to this one in the meantime */
+		if (after - (count - n + i) >= nspans) continue;
+		if (s->start < origin || s->phase > FT_TRACE_WRITE) continue;
+		fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"command\":\"%s\"}}",
+				phaseNames[s->phase], command_name(s->command), R->row, 1e-3 * (double) (s->start - origin), 1e-3 * (double) s->duration, command_name(s->command));
+	}
+}
+
+int ft_trace_dump(void) {
+	trace_ring_t *R;
+	span_t *copy;
+	char *temp;
+	FILE *f;
+	int first = 1;
+
+	pthread_mutex_lock(&mutextrace);
+	if (traceFile == NULL || (copy = (span_t *) malloc(nspans * sizeof(span_t))) == NULL) {
+		pthread_mutex_unlock(&mutextrace);
+		return -1;
+	}
+	/* written next to it and renamed, so that nobody reads half a file */
+	temp = (char *) malloc(strlen(traceFile) + 5);
+	if (temp != NULL) sprintf(temp, "%s.tmp", traceFile);
+	if (temp == NULL || (f = fopen(temp, "w")) == NULL) {
+		fprintf(stderr, "ft_trace_dump: cannot write to %s\n", traceFile);
+		free(temp);
+		free(copy);
+		pthread_mutex_unlock(&mutextrace);
+		return -1;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (R = rings; R != NULL; R = R->next) dump_ring(f, R, copy, &first);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+#ifdef WIN32
+	remove(traceFile);
+#endif
+	rename(temp, traceFile);
+	free(temp);
+	free(copy);
+	pthread_mutex_unlock(&mutextrace);
+	return 0;
+}
+
+static void dump_at_exit(void) {
+	if (ft_trace_active) ft_trace_dump();
+}
+
+#ifndef WIN32
+static sigset_t traceSignals;
+
+static void *wait_for_signals(void *arg) {
+	for (;;) {
+		int sig;
+		if (sigwait(&traceSignals, &sig) != 0) continue;
+		ft_trace_dump();
+		if (sig != SIGUSR1) {
+			ft_trace_active = 0;
+			exit(0);
+		}
+	}
+	return NULL;
+}
+#endif
+
+int ft_trace_enable(const char *filename, UINT32_T n, int flags) {
+	char *name;
+
+	pthread_once(&traceOnce, trace_once);
+	if (filename == NULL || (name = strdup(filename)) == NULL) return -1;
+
+	pthread_mutex_lock(&mutextrace);
+	if (nspans == 0) {
+		nspans = 1;
+		while (nspans < (n ? n : FT_TRACE_SPANS) && nspans < 0x80000000u) nspans *= 2;
+		atexit(dump_at_exit);
+	}
+	if (traceFile) free(traceFile);
+	traceFile = name;
+	origin = ft_stats_now();
+
+#ifndef WIN32
+	if (!dumper) {
+		pthread_t thread;
+		sigemptyset(&traceSignals);
+		sigaddset(&traceSignals, SIGUSR1);
+		if (flags & FT_TRACE_DUMP_ON_EXIT) {
+			sigaddset(&traceSignals, SIGINT);
+			sigaddset(&traceSignals, SIGTERM);
+		}
+		/* threads that are started from here on inherit this */
+		pthread_sigmask(SIG_BLOCK, &traceSignals, NULL);
+		if (pthread_create(&thread, NULL, wait_for_signals, NULL) == 0) {
+			pthread_detach(thread);
+			dumper = 1;
+		}
+	}
+#endif
+	pthread_mutex_unlock(&mutextrace);
+	ft_trace_active = 1;
+	return 0;
+}
+
+void ft_trace_disable(void) {
+	if (!ft_trace_active) return;
+	ft_trace_active = 0;
+	ft_trace_dump();
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "platform_includes.h"
+#include "message.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** A timeline of what the servers spend their time on, for the Chrome trace
+    viewer (chrome://tracing) or Perfetto (ui.perfetto.dev).
+
+    Once enabled, every request is split into spans for reading its header,
+    reading its body, executing it and writing the response, and every wait
+    for a lock of a stream while executing it gets a span of its own (see
+    ft_stream_lock in lockstat.h). Each
+    thread writes its spans into a ring of its own, without locking, which
+    keeps the most recent ones. A thread that ends hands its ring on to the
+    next thread that starts, so there is a ring for each thread that runs at
+    the same time, and they show up as the rows of the timeline.
+
+    The rings are written to a file in the Trace Event Format (JSON) by
+    ft_trace_dump, when the process exits, and on SIGUSR1. The signal is
+    taken by a thread of its own with sigwait, so ft_trace_enable has to be
+    called before any servers are started, for their threads to inherit the
+    blocked signal. With FT_TRACE_DUMP_ON_EXIT, the same goes for SIGINT and
+    SIGTERM, after which the process exits. A dump overwrites the previous
+    one, and the rings stay as they are.
+
+    Reading the clock twice per span is all that tracing costs while it is
+    enabled; when it is not, FT_TRACE_NOW and ft_trace_span check a flag.
+**/
+
+#define FT_TRACE_READ_HDR   0
+#define FT_TRACE_READ_BODY  1
+#define FT_TRACE_LOCK_WAIT  2
+#define FT_TRACE_EXECUTE    3
+#define FT_TRACE_WRITE      4
+
+#define FT_TRACE_SPANS      65536   /* default number of spans that each thread keeps */
+
+#define FT_TRACE_DUMP_ON_EXIT 1     /* flag for ft_trace_enable */
+
+extern volatile int ft_trace_active;
+
+/** The time at which a span starts, or 0 if tracing is not enabled */
+#define FT_TRACE_NOW()  (ft_trace_active ? ft_stats_now() : 0)
+
+/** Adds a span of the calling thread for the given command from "start"
+    (from FT_TRACE_NOW) until now. Does nothing if start is 0. */
+void ft_trace_span(int phase, UINT16_T command, UINT64_T start);
+
+/** Starts tracing into rings of "nspans" spans each (0 for FT_TRACE_SPANS,
+    rounded up to a power of two), to be written to "filename". The size of
+    the rings is fixed by the first call. Returns 0 on success, -1 on error. */
+int ft_trace_enable(const char *filename, UINT32_T nspans, int flags);
+
+/** Stops adding spans, and writes them out */
+void ft_trace_disable(void);
+
+/** Writes the spans of all rings to the file, returns 0 on success */
+int ft_trace_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>       /* for strerror */
+#include <errno.h>
 
 #include <time.h>
 #include <sys/time.h>
@@ -16,6 +17,7 @@
 
 #include "buffer.h"
 #include "extern.h"
+#include "zerocopy.h"
 
 unsigned int bufread(int s, void *buf, unsigned int numel) {
 		unsigned int numcall = 0, numread = 0, verbose = 0;
@@ -68,6 +70,171 @@ unsigned int bufwrite(int s, const void *buf, unsigned int numel) {
 		return numwrite;
 }
 
+#ifndef WIN32
+int ft_pinned_iovec(ft_pinned_data_t *P, struct iovec *iov) {
+	int n = 2;
+	iov[0].iov_base = &P->def;
+	iov[0].iov_len  = sizeof(messagedef_t);
+	iov[1].iov_base = &P->ddef;
+	iov[1].iov_len  = sizeof(datadef_t);
+	if (P->seg[0].nsamples > 0) {
+		iov[n].iov_base = P->seg[0].ptr;
+		iov[n].iov_len  = (size_t) P->seg[0].nsamples * P->ring->chansize;
+		n++;
+	}
+	if (P->seg[1].nsamples > 0) {
+		iov[n].iov_base = P->seg[1].ptr;
+		iov[n].iov_len  = (size_t) P->seg[1].nsamples * P->ring->chansize;
+		n++;
+	}
+	return n;
+}
+
+int ft_ingest_iovec(ft_ingest_t *P, struct iovec *iov) {
+	int n = 0, i;
+	for (i=0; i<2; i++) {
+		if (P->seg[i].nsamples == 0) continue;
+		iov[n].iov_base = P->seg[i].ptr;
+		iov[n].iov_len  = (size_t) P->seg[i].nsamples * P->ring->chansize;
+		n++;
+	}
+	return n;
+}
+
+int ft_iovec_consume(struct iovec **iov, int iovcnt, size_t n) {
+	while (iovcnt > 0 && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		iovcnt--;
+	}
+	if (iovcnt > 0) {
+		(*iov)->iov_base = (char *) (*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+	return iovcnt;
+}
+
+int ft_pinned_send_init(ft_pinned_send_t *T) {
+	memset(T, 0, sizeof(*T));
+	if (pthread_mutex_init(&T->lock, NULL) != 0) return -1;
+	if (pthread_cond_init(&T->evict, NULL) != 0) {
+		pthread_mutex_destroy(&T->lock);
+		return -1;
+	}
+	return 0;
+}
+
+void ft_pinned_send_destroy(ft_pinned_send_t *T) {
+	ft_pinned_send_stop(T);
+	pthread_cond_destroy(&T->evict);
+	pthread_mutex_destroy(&T->lock);
+}
+
+void ft_pinned_send_start(ft_pinned_send_t *T, const ft_pinned_data_t *P) {
+	T->P = *P;
+	T->iovp = T->iov;
+	T->iovcnt = ft_pinned_iovec(&T->P, T->iov);
+	/* the last byte is written from "last" once the pin is given back */
+	T->iov[T->iovcnt-1].iov_len--;
+	T->last = ((char *) T->iov[T->iovcnt-1].iov_base)[T->iov[T->iovcnt-1].iov_len];
+	T->parked = 0;
+	T->evicted = 0;
+	T->copy = NULL;
+}
+
+/* Called by a writer that needs the samples of the parked pin, see ft_ring_park */
+static void evict_pinned(void *arg) {
+	ft_pinned_send_t *T = (ft_pinned_send_t *) arg;
+	size_t size = 0;
+	int k;
+
+	pthread_mutex_lock(&T->lock);
+	for (k=0; k<T->iovcnt; k++) size += T->iovp[k].iov_len;
+	/* a revoked pin (see ft_ring_unpin_all) may have been overwritten already */
+	if (size < FT_ZEROCOPY_EVICT_MAX && ft_ring_pin_check(T->P.ring, T->P.pin) == FT_RING_OK) T->copy = (char *) malloc(size + 1);
+	if (T->copy != NULL) {
+		for (size=0, k=0; k<T->iovcnt; k++) {
+			memcpy(T->copy + size, T->iovp[k].iov_base, T->iovp[k].iov_len);
+			size += T->iovp[k].iov_len;
+		}
+		T->copy[size] = T->last;
+		T->iov[0].iov_base = T->copy;
+		T->iov[0].iov_len  = size + 1;
+		T->iovp = T->iov;
+		T->iovcnt = 1;
+	}
+	T->evicted = 1;
+	pthread_cond_signal(&T->evict);
+	pthread_mutex_unlock(&T->lock);
+}
+
+/* takes back the parked pin, returns -1 if the writer took it without making a copy */
+static int unpark_pinned(ft_pinned_send_t *T) {
+	int state;
+
+	T->parked = 0;
+	if (ft_ring_unpark(T->P.ring, T->P.pin)) return 0;
+
+	/* the writer is done with the pin as soon as the copy is made; T must
+	   stay where it is until then, so this wait cannot be cancelled */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+	pthread_mutex_lock(&T->lock);
+	while (!T->evicted) pthread_cond_wait(&T->evict, &T->lock);
+	pthread_mutex_unlock(&T->lock);
+	pthread_setcancelstate(state, NULL);
+	T->P.ring = NULL;
+	return (T->copy == NULL) ? -1 : 0;
+}
+
+int ft_pinned_send(ft_pinned_send_t *T, int sock) {
+	struct msghdr msg;
+	ssize_t n;
+	int flags = MSG_DONTWAIT;
+
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	if (T->parked && unpark_pinned(T) < 0) return -1;
+	for (;;) {
+		while (T->iovcnt > 0) {
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = T->iovp;
+			msg.msg_iovlen = T->iovcnt;
+			n = sendmsg(sock, &msg, flags);
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				/* the writer does not have to wait for the client, see evict_pinned */
+				if (T->P.ring != NULL) {
+					T->parked = 1;
+					ft_ring_park(T->P.ring, T->P.pin, evict_pinned, T);
+				}
+				return 0;
+			}
+			if (n <= 0) return -1;
+			/* the writer may have been overwriting what just went out */
+			if (T->P.ring != NULL && ft_ring_pin_check(T->P.ring, T->P.pin) != FT_RING_OK) return -1;
+			T->iovcnt = ft_iovec_consume(&T->iovp, T->iovcnt, (size_t) n);
+		}
+		if (T->P.ring == NULL) break;
+		/* everything from the ring went out intact, so the client can have the rest */
+		if (ft_getdat_release(&T->P) != FT_RING_OK) return -1;
+		T->iov[0].iov_base = &T->last;
+		T->iov[0].iov_len  = 1;
+		T->iovp = T->iov;
+		T->iovcnt = 1;
+	}
+	ft_pinned_send_stop(T);
+	return 1;
+}
+
+void ft_pinned_send_stop(ft_pinned_send_t *T) {
+	if (T->parked) unpark_pinned(T);
+	if (T->P.ring != NULL) ft_getdat_release(&T->P);
+	FREE(T->copy);
+	T->iovcnt = 0;
+}
+#endif
+
 unsigned int append(void **buf1, unsigned int bufsize1, void *buf2, unsigned int bufsize2) {
 		int verbose = 0;
 
@@ -121,6 +288,44 @@ void check_datatypes() {
 		if (sizeof(eventdef_t)    !=32) { fprintf(stderr, "invalid size of eventdef_t  \n"); exit(-1); }
 		if (sizeof(datasel_t)     !=8 ) { fprintf(stderr, "invalid size of datasel_t   \n"); exit(-1); }
 		if (sizeof(eventsel_t)    !=8 ) { fprintf(stderr, "invalid size of eventsel_t  \n"); exit(-1); }
+		if (sizeof(capacitydef_t) !=20) { fprintf(stderr, "invalid size of capacitydef_t\n"); exit(-1); }
+}
+
+/** Parses one command line option that specifies the capacity of the buffer, i.e.
+	-samples N, -seconds S, -bytes N (with optional k, M or G suffix) or -events N.
+	Returns 1 if the option was recognized and stored in "capacity", 0 if the option
+	is not a capacity option, and -1 if the value is invalid.
+*/
+int parse_capacity_option(const char *option, const char *value, capacitydef_t *capacity) {
+	char *end;
+	double v;
+
+	if (option == NULL || option[0] != '-') return 0;
+	if (strcmp(option, "-samples") && strcmp(option, "-seconds") && strcmp(option, "-bytes") && strcmp(option, "-events")) return 0;
+	if (value == NULL) return -1;
+
+	v = strtod(value, &end);
+	if (end == value || v <= 0) return -1;
+
+	if (!strcmp(option, "-bytes")) {
+		switch (*end) {
+			case 'k': case 'K': v *= 1024.0; end++; break;
+			case 'm': case 'M': v *= 1024.0*1024.0; end++; break;
+			case 'g': case 'G': v *= 1024.0*1024.0*1024.0; end++; break;
+		}
+	}
+	if (*end == 'B' || *end == 'b') end++;
+	if (*end != 0) return -1;
+
+	if (!strcmp(option, "-samples"))
+		capacity->nsamples = (UINT32_T) v;
+	else if (!strcmp(option, "-seconds"))
+		capacity->seconds = (FLOAT32_T) v;
+	else if (!strcmp(option, "-bytes"))
+		capacity->nbytes = (UINT64_T) v;
+	else
+		capacity->nevents = (UINT32_T) v;
+	return 1;
 }
 
 unsigned int wordsize_from_type(UINT32_T data_type) {
@@ -15,6 +15,7 @@ void check_datatypes();
 unsigned int wordsize_from_type(UINT32_T data_type);
 const ft_chunk_t *find_chunk(const void *buf, unsigned int offset0, unsigned int size, UINT32_T chunk_type);
 int check_event_array(unsigned int size, const void *buf);
+int parse_capacity_option(const char *option, const char *value, capacitydef_t *capacity);
 
 #ifdef __cplusplus
 }
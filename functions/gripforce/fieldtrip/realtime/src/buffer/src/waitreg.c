@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "waitreg.h"
+
+#define INITIAL_WAITERS 16
+
+void ft_waitreg_init(ft_waitreg_t *R) {
+	pthread_mutex_init(&R->lock, NULL);
+	R->heap[0] = R->heap[1] = NULL;
+	R->size = R->alloc = 0;
+	R->count[0] = R->count[1] = 0;
+	R->wakeups = 0;
+}
+
+void ft_waitreg_destroy(ft_waitreg_t *R) {
+	if (R->heap[0]) free(R->heap[0]);
+	if (R->heap[1]) free(R->heap[1]);
+	R->heap[0] = R->heap[1] = NULL;
+	R->size = R->alloc = 0;
+	pthread_mutex_destroy(&R->lock);
+}
+
+/*****************************************************************************
+ * binary min-heaps on threshold[k], each waiter knows its position in heappos[k]
+ *****************************************************************************/
+
+static void heap_set(ft_waitreg_t *R, int k, UINT32_T pos, ft_waiter_t *W) {
+	R->heap[k][pos] = W;
+	W->heappos[k] = pos;
+}
+
+static void heap_up(ft_waitreg_t *R, int k, UINT32_T pos) {
+	ft_waiter_t *W = R->heap[k][pos];
+	while (pos > 0) {
+		UINT32_T parent = (pos-1)/2;
+		if (R->heap[k][parent]->threshold[k] <= W->threshold[k]) break;
+		heap_set(R, k, pos, R->heap[k][parent]);
+		pos = parent;
+	}
+	heap_set(R, k, pos, W);
+}
+
+static void heap_down(ft_waitreg_t *R, int k, UINT32_T pos) {
+	ft_waiter_t *W = R->heap[k][pos];
+	for (;;) {
+		UINT32_T child = 2*pos+1;
+		if (child >= R->size) break;
+		if (child+1 < R->size && R->heap[k][child+1]->threshold[k] < R->heap[k][child]->threshold[k]) child++;
+		if (W->threshold[k] <= R->heap[k][child]->threshold[k]) break;
+		heap_set(R, k, pos, R->heap[k][child]);
+		pos = child;
+	}
+	heap_set(R, k, pos, W);
+}
+
+/* removes W from both heaps */
+static void registry_remove(ft_waitreg_t *R, ft_waiter_t *W) {
+	int k;
+
+	R->size--;
+	for (k=0; k<2; k++) {
+		UINT32_T pos = W->heappos[k];
+		ft_waiter_t *M = R->heap[k][R->size];
+		if (pos == R->size) continue;
+		/* move the last element into the hole, it can go either way */
+		heap_set(R, k, pos, M);
+		heap_up(R, k, pos);
+		heap_down(R, k, M->heappos[k]);
+	}
+}
+
+static int registry_add(ft_waitreg_t *R, ft_waiter_t *W) {
+	int k;
+	if (R->size == R->alloc) {
+		UINT32_T alloc = R->alloc ? 2*R->alloc : INITIAL_WAITERS;
+		for (k=0; k<2; k++) {
+			ft_waiter_t **heap = (ft_waiter_t **) realloc(R->heap[k], alloc * sizeof(ft_waiter_t *));
+			if (heap == NULL) return -1;
+			R->heap[k] = heap;
+		}
+		R->alloc = alloc;
+	}
+	R->size++;
+	for (k=0; k<2; k++) {
+		heap_set(R, k, R->size-1, W);
+		heap_up(R, k, R->size-1);
+	}
+	return 0;
+}
+
+/* signals everyone whose threshold on count[k] has been exceeded, with the lock held */
+static void wake_exceeded(ft_waitreg_t *R, int k) {
+	while (R->size > 0 && R->heap[k][0]->threshold[k] < R->count[k]) {
+		ft_waiter_t *W = R->heap[k][0];
+		registry_remove(R, W);
+		W->woken = 1;
+		R->wakeups++;
+#ifndef WIN32
+		if (W->wakefd >= 0) {
+			/* a full pipe already has the reader's attention */
+			char c = 0;
+			if (write(W->wakefd, &c, 1) < 0) {}
+			continue;
+		}
+#endif
+		pthread_cond_signal(&W->cond);
+	}
+}
+
+/* A count that went down is not waited for by anybody, but a waiter with a
+   wakefd may keep a position in the stream (subscribe.h) that is now past the
+   end. It gets a byte to look at the counts, and stays registered. */
+static void remind_armed(ft_waitreg_t *R) {
+#ifndef WIN32
+	UINT32_T i;
+	for (i=0; i<R->size; i++) {
+		ft_waiter_t *W = R->heap[0][i];
+		if (W->wakefd >= 0) {
+			char c = 0;
+			if (write(W->wakefd, &c, 1) < 0) {}
+		}
+	}
+#endif
+}
+
+/*****************************************************************************
+ * public functions
+ *****************************************************************************/
+
+void ft_waitreg_update(ft_waitreg_t *R, int what, UINT32_T count) {
+	pthread_mutex_lock(&R->lock);
+	if (count < R->count[what]) remind_armed(R);
+	R->count[what] = count;
+	wake_exceeded(R, what);
+	pthread_mutex_unlock(&R->lock);
+}
+
+void ft_waitreg_reset(ft_waitreg_t *R, UINT32_T nsamples, UINT32_T nevents) {
+	pthread_mutex_lock(&R->lock);
+	if (nsamples < R->count[FT_WAIT_SAMPLES] || nevents < R->count[FT_WAIT_EVENTS]) remind_armed(R);
+	R->count[FT_WAIT_SAMPLES] = nsamples;
+	R->count[FT_WAIT_EVENTS]  = nevents;
+	wake_exceeded(R, FT_WAIT_SAMPLES);
+	wake_exceeded(R, FT_WAIT_EVENTS);
+	pthread_mutex_unlock(&R->lock);
+}
+
+int ft_waitreg_wait(ft_waitreg_t *R, const samples_events_t *threshold, const struct timespec *deadline, samples_events_t *current) {
+	ft_waiter_t W;
+	int result = 1;
+
+	pthread_mutex_lock(&R->lock);
+	if (R->count[FT_WAIT_SAMPLES] <= threshold->nsamples && R->count[FT_WAIT_EVENTS] <= threshold->nevents) {
+		if (deadline == NULL) {
+			result = 0;
+		}
+		else {
+			W.threshold[FT_WAIT_SAMPLES] = threshold->nsamples;
+			W.threshold[FT_WAIT_EVENTS]  = threshold->nevents;
+			W.woken = 0;
+			W.wakefd = -1;
+			pthread_cond_init(&W.cond, NULL);
+
+			if (registry_add(R, &W) != 0) {
+				result = -1;
+			}
+			else {
+				while (!W.woken) {
+					if (pthread_cond_timedwait(&W.cond, &R->lock, deadline) == ETIMEDOUT) break;
+				}
+				/* on a timeout, we are still registered */
+				if (!W.woken) {
+					registry_remove(R, &W);
+					result = 0;
+				}
+			}
+			pthread_cond_destroy(&W.cond);
+		}
+	}
+	current->nsamples = R->count[FT_WAIT_SAMPLES];
+	current->nevents  = R->count[FT_WAIT_EVENTS];
+	pthread_mutex_unlock(&R->lock);
+	return result;
+}
+
+int ft_waitreg_arm(ft_waitreg_t *R, ft_waiter_t *W, const samples_events_t *threshold, int wakefd, samples_events_t *current) {
+	int result = 1;
+
+	pthread_mutex_lock(&R->lock);
+	if (R->count[FT_WAIT_SAMPLES] <= threshold->nsamples && R->count[FT_WAIT_EVENTS] <= threshold->nevents) {
+		W->threshold[FT_WAIT_SAMPLES] = threshold->nsamples;
+		W->threshold[FT_WAIT_EVENTS]  = threshold->nevents;
+		W->woken  = 0;
+		W->wakefd = wakefd;
+		if (registry_add(R, W) != 0) {
+			W->woken = 1;
+			result = -1;
+		}
+		else {
+			result = 0;
+		}
+	}
+	current->nsamples = R->count[FT_WAIT_SAMPLES];
+	current->nevents  = R->count[FT_WAIT_EVENTS];
+	pthread_mutex_unlock(&R->lock);
+	return result;
+}
+
+void ft_waitreg_disarm(ft_waitreg_t *R, ft_waiter_t *W, samples_events_t *current) {
+	pthread_mutex_lock(&R->lock);
+	if (!W->woken) {
+		registry_remove(R, W);
+		W->woken = 1;
+	}
+	current->nsamples = R->count[FT_WAIT_SAMPLES];
+	current->nevents  = R->count[FT_WAIT_EVENTS];
+	pthread_mutex_unlock(&R->lock);
+}
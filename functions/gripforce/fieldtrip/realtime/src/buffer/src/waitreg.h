@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef WAITREG_H
+#define WAITREG_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include "platform_includes.h"
+#include "message.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the two quantities a client can wait for */
+#define FT_WAIT_SAMPLES 0
+#define FT_WAIT_EVENTS  1
+
+/** One blocked WAIT_DAT request, lives on the stack of the waiting thread */
+typedef struct {
+	pthread_cond_t cond;
+	UINT32_T threshold[2];   /**< wake up as soon as nsamples or nevents exceeds this */
+	UINT32_T heappos[2];     /**< position in the two heaps of the registry */
+	int      woken;
+	int      wakefd;         /**< if >= 0, a byte is written to this file descriptor instead (see ft_waitreg_arm) */
+} ft_waiter_t;
+
+/** Registry of blocked WAIT_DAT requests.
+
+    The waiters are kept in two binary min-heaps, one ordered on the sample
+    threshold and one on the event threshold. Whenever PUT_DAT or PUT_EVT
+    updates the number of samples or events, only the waiters at the top of
+    the heap whose threshold has been exceeded are removed and signalled,
+    each on its own condition variable; all others keep sleeping. The
+    registry also keeps the counts themselves, so a waiter can check and
+    start waiting under the same lock, and no update can get lost.
+*/
+typedef struct {
+	pthread_mutex_t lock;
+	ft_waiter_t **heap[2];
+	UINT32_T size;           /**< number of waiters, which are in both heaps */
+	UINT32_T alloc;          /**< allocated length of both heaps */
+	UINT32_T count[2];       /**< current number of samples and events */
+	unsigned long wakeups;   /**< number of waiters that have been signalled */
+} ft_waitreg_t;
+
+#define FT_WAITREG_INITIALIZER {PTHREAD_MUTEX_INITIALIZER, {NULL, NULL}, 0, 0, {0, 0}, 0}
+
+void ft_waitreg_init(ft_waitreg_t *R);
+void ft_waitreg_destroy(ft_waitreg_t *R);
+
+/** Sets the number of samples (what=FT_WAIT_SAMPLES) or events (FT_WAIT_EVENTS),
+    and wakes up the waiters whose threshold is now exceeded. The count may also
+    go down (e.g. after a flush), which wakes nobody that blocks in
+    ft_waitreg_wait, but writes a byte to the wakefd of every waiter of
+    ft_waitreg_arm, without removing it from the registry.
+*/
+void ft_waitreg_update(ft_waitreg_t *R, int what, UINT32_T count);
+
+/** Sets both counts, e.g. after PUT_HDR or FLUSH_HDR */
+void ft_waitreg_reset(ft_waitreg_t *R, UINT32_T nsamples, UINT32_T nevents);
+
+/** Blocks until the number of samples exceeds threshold->nsamples or the number
+    of events exceeds threshold->nevents, or until the absolute time "deadline"
+    has passed (deadline==NULL means do not wait at all). The counts at the time
+    of returning are written to "current".
+    Returns 1 if the condition was met, 0 on timeout, -1 if out of memory.
+*/
+int ft_waitreg_wait(ft_waitreg_t *R, const samples_events_t *threshold, const struct timespec *deadline, samples_events_t *current);
+
+/** Registers a waiter that does not block, for a thread that waits in
+    select or poll instead (see subscribe.h): when the threshold is exceeded,
+    the waiter is removed from the registry and one byte is written to the
+    non-blocking file descriptor wakefd. A byte is also written, while the
+    waiter stays registered, when a count goes down. Returns 0 if it was registered, 1 if
+    the threshold was already exceeded, in which case it was not, and -1 if
+    out of memory. The counts are written to "current" in any case.
+*/
+int ft_waitreg_arm(ft_waitreg_t *R, ft_waiter_t *W, const samples_events_t *threshold, int wakefd, samples_events_t *current);
+
+/** Removes a waiter of ft_waitreg_arm if it is still registered, after which
+    nothing is written to its wakefd anymore, and gives the current counts.
+    W->woken has to be set for a waiter that was never armed.
+*/
+void ft_waitreg_disarm(ft_waitreg_t *R, ft_waiter_t *W, samples_events_t *current);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* WAITREG_H */
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include "platform_includes.h"
+#include "message.h"
+#include "ringbuffer.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* GET_DAT responses of at least this many bytes are sent straight from the ring */
+#define FT_ZEROCOPY_THRESHOLD  (64*1024)
+
+/* a selection is only pinned if the writer is at least capacity/FT_ZEROCOPY_HEADROOM
+   samples away from overwriting it, otherwise the response is copied as usual */
+#define FT_ZEROCOPY_HEADROOM   8
+
+/* PUT_DAT requests of at least this many bytes are received straight into the ring */
+#define FT_INGEST_THRESHOLD    (64*1024)
+
+struct ft_stream;
+
+/** A GET_DAT response that still lives in the ring of the stream. The socket
+    layer sends def, ddef and the one or two segments with a single writev,
+    and then calls ft_getdat_release. Until then, the samples are pinned, and
+    the ring can neither be written over them nor be reset or freed (see
+    ft_ring_unpin_all), so the release must not be forgotten. No lock of the
+    stream is held in between, so the release may come from another thread,
+    and a pin that waits for a slow client can be parked (see ft_ring_park).
+    A pin that is held for longer than FT_RING_PIN_TIMEOUT while the writer
+    needs the samples is revoked; the release then returns FT_RING_OVERWRITTEN
+    and what was sent cannot be trusted.
+*/
+typedef struct {
+	messagedef_t def;
+	datadef_t    ddef;
+	ft_ring_segment_t seg[2];   /**< seg[1].nsamples is 0 if the selection does not wrap */
+	ft_ring_t   *ring;
+	int          pin;
+} ft_pinned_data_t;
+
+/** If request is a GET_DAT that can be answered from the ring without copying,
+    pins the selected samples, fills in P and returns 1. Otherwise returns 0, in
+    which case the request should be handled by dmarequest as usual (this also
+    covers all errors). ft_getdat_release has to be called exactly once after
+    the response has been sent, or the client has gone, and returns FT_RING_OK
+    or FT_RING_OVERWRITTEN (see ft_ring_unpin).
+*/
+int  ft_getdat_pinned(const message_t *request, ft_pinned_data_t *P);
+int  ft_getdat_release(ft_pinned_data_t *P);
+
+/** Changes the minimal size of responses that are sent without copying, 0 disables it */
+void ft_set_zerocopy_threshold(UINT32_T nbytes);
+
+/* if the samples of a PUT_DAT have not all arrived this many milliseconds after
+   ft_putdat_reserve, the socket layer gives up receiving them into the ring */
+#define FT_INGEST_TIMEOUT      100
+
+/** A PUT_DAT request whose samples are received straight into the ring of the
+    stream, instead of into a temporary buffer that dmarequest copies from.
+    The socket layer reads the message definition and the datadef_t, calls
+    ft_putdat_reserve, receives the samples into the one or two segments, and
+    then calls ft_putdat_commit. In between, mutexdata of the stream is held,
+    so other writers of the same stream wait, but readers do not. To keep a
+    slow or stalled client from holding it for long, the socket layer calls
+    ft_putdat_abort instead if the samples do not arrive within
+    FT_INGEST_TIMEOUT, and reads the rest of the request as usual.
+*/
+typedef struct {
+	ft_ring_segment_t seg[2];   /**< seg[1].nsamples is 0 if the block does not wrap */
+	ft_ring_t   *ring;
+	struct ft_stream *stream;
+	UINT64_T     held[2];       /**< when rwlockring and mutexdata were taken, see lockstat.h */
+} ft_ingest_t;
+
+/** Returns 1 if a request with this definition (in native byte order) should
+    be received with ft_putdat_reserve, i.e. if it is a large enough PUT_DAT.
+    The datadef_t then has to be read first, on its own.
+*/
+int  ft_putdat_wanted(const messagedef_t *def);
+
+/** Validates the PUT_DAT request against the header of the current stream and
+    reserves room for the samples in the ring. Returns 1 on success. Returns 0
+    if the request cannot be received directly; the caller should then read the
+    remainder of it and pass it to dmarequest as usual (this also covers all
+    errors). Only requests that contain exactly the samples described by ddef
+    are accepted.
+*/
+int  ft_putdat_reserve(const messagedef_t *def, const datadef_t *ddef, ft_ingest_t *P);
+
+/** Publishes the samples, which must all have been received, and wakes up
+    the waiting clients.
+*/
+void ft_putdat_commit(ft_ingest_t *P);
+
+/** Gives back the reserved room without publishing anything, e.g. because
+    the connection broke off. If dest is not NULL, the "nbytes" that did arrive
+    are copied there first, so the request can be completed in a temporary
+    buffer and passed to dmarequest.
+*/
+void ft_putdat_abort(ft_ingest_t *P, void *dest, size_t nbytes);
+
+/** Changes the minimal size of PUT_DAT requests that are received directly, 0 disables it */
+void ft_set_ingest_threshold(UINT32_T nbytes);
+
+#ifndef WIN32
+/* a writer that takes away a parked pin (see ft_ring_park) copies what the
+   client still has to get, but only up to this many bytes, because it holds
+   mutexdata meanwhile; a client that is further behind loses its connection */
+#define FT_ZEROCOPY_EVICT_MAX  (4*1024*1024)
+
+/** Writes a pinned GET_DAT response to a socket without ever blocking on it,
+    for the socket layers. Whenever the socket is full, the pin is parked until
+    the next ft_pinned_send, so a writer never waits for a slow client, but
+    makes a copy of the rest instead, which is then written in its place.
+    If the writer revokes the pin while a part is being written, the samples
+    that went out may be overwritten ones, so the connection has to be closed;
+    to make sure that such a client never gets a complete response, the last
+    byte is kept back until the pin is given back without being revoked.
+    The lock and condition are set up once with ft_pinned_send_init, and the
+    structure must not move while a response is in progress.
+*/
+typedef struct {
+	ft_pinned_data_t P;         /**< P.ring is NULL once the pin is given back or taken away */
+	struct iovec iov[4], *iovp;
+	int iovcnt;
+	int parked;                 /**< 1 while the writer may take the pin away */
+	pthread_mutex_t lock;       /**< protects "evicted" and "copy" */
+	pthread_cond_t evict;       /**< signalled once the writer has taken the pin away */
+	int evicted;
+	char *copy;                 /**< what the writer copied, NULL if it was too much */
+	char last;                  /**< the last byte of the response, see above */
+} ft_pinned_send_t;
+
+int  ft_pinned_send_init(ft_pinned_send_t *T);
+void ft_pinned_send_destroy(ft_pinned_send_t *T);
+
+/** Takes over the pinned response P, which ft_pinned_send then writes */
+void ft_pinned_send_start(ft_pinned_send_t *T, const ft_pinned_data_t *P);
+
+/** Writes as much of the response as the socket takes. Returns 1 once all of
+    it has been written and the pin is given back, 0 if the socket is full (the
+    caller then waits until it is writable and calls again), and -1 if the
+    connection broke, the pin was revoked, or the writer could not copy the
+    rest of the response.
+*/
+int  ft_pinned_send(ft_pinned_send_t *T, int sock);
+
+/** Gives back the pin or the copy of a response that is not written completely,
+    e.g. because the connection is closed; does nothing if there is none.
+*/
+void ft_pinned_send_stop(ft_pinned_send_t *T);
+
+/** Fills iov with the parts of the response, returns the number of entries (at most 4) */
+int  ft_pinned_iovec(ft_pinned_data_t *P, struct iovec *iov);
+
+/** Fills iov with the reserved ring segments, returns the number of entries (at most 2) */
+int  ft_ingest_iovec(ft_ingest_t *P, struct iovec *iov);
+
+/** Skips n bytes that have been written or read from the iovec array, returns the new number of entries */
+int  ft_iovec_consume(struct iovec **iov, int iovcnt, size_t n);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZEROCOPY_H */
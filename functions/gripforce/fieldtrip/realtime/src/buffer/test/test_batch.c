@@ -0,0 +1,327 @@
+/*
+ * Sends BATCH requests (see batch.h) over a local TCP connection. The header,
+ * samples and events of a stream are put in one batch and read back in one
+ * batch, while a second connection keeps adding blocks of samples with an
+ * event each: every GET_HDR and GET_DAT in a batch of the reader should see
+ * as many events as blocks, and the same number of samples. The round trip
+ * of a polling cycle of GET_HDR, GET_DAT and GET_EVT is timed as separate
+ * requests and as one batch.
+ *
+ * Use as
+ *    ./test_batch [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_batch"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "batch.h"
+#include "testutil.h"
+
+#define NCHANS    4
+#define BLOCKSIZE 10
+#define CAPACITY  200
+#define NBLOCKS   2000
+
+static message_t *new_batch(void) {
+	message_t *batch = (message_t *) calloc(1, sizeof(message_t));
+	batch->def = (messagedef_t *) calloc(1, sizeof(messagedef_t));
+	batch->def->version = VERSION;
+	batch->def->command = BATCH;
+	return batch;
+}
+
+static void add(message_t *batch, UINT16_T command, const void *buf, UINT32_T bufsize) {
+	messagedef_t def;
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	if (ft_batch_append(batch, &def, buf) != 0) {
+		fprintf(stderr, "test_batch: out of memory\n");
+		exit(1);
+	}
+}
+
+/* sends the batch and returns the commands of the responses in result, or -1 */
+static int send_batch(int server, message_t *batch, message_t **response, UINT16_T *result, int max) {
+	messagedef_t def;
+	const void *buf;
+	UINT32_T offset = 0;
+	int n = 0;
+
+	release(response);
+	if (clientrequest(server, batch, response) != 0 || (*response)->def->command != BATCH_OK) return -1;
+	while (n < max && ft_batch_next((*response)->def->bufsize, (*response)->buf, &offset, &def, &buf) == 1) {
+		result[n++] = def.command;
+	}
+	return n;
+}
+
+/* a block of samples that contain their own number, followed by an event at its first sample */
+static void add_block(message_t *batch, UINT32_T block) {
+	char data[sizeof(datadef_t) + BLOCKSIZE*NCHANS*sizeof(INT32_T)];
+	char event[sizeof(eventdef_t) + 3 + sizeof(INT32_T)];
+	datadef_t *ddef = (datadef_t *) data;
+	eventdef_t *edef = (eventdef_t *) event;
+	INT32_T *samples = (INT32_T *) (ddef+1);
+	INT32_T value = (INT32_T) block;
+	UINT32_T i;
+
+	ddef->nchans    = NCHANS;
+	ddef->nsamples  = BLOCKSIZE;
+	ddef->data_type = DATATYPE_INT32;
+	ddef->bufsize   = BLOCKSIZE*NCHANS*sizeof(INT32_T);
+	for (i=0; i<BLOCKSIZE*NCHANS; i++) samples[i] = (INT32_T) (block*BLOCKSIZE + i/NCHANS);
+
+	memset(edef, 0, sizeof(eventdef_t));
+	edef->type_type   = DATATYPE_CHAR;
+	edef->type_numel  = 3;
+	edef->value_type  = DATATYPE_INT32;
+	edef->value_numel = 1;
+	edef->sample      = (INT32_T) (block*BLOCKSIZE);
+	edef->bufsize     = 3 + sizeof(INT32_T);
+	memcpy(edef+1, "blk", 3);
+	memcpy((char *) (edef+1) + 3, &value, sizeof(INT32_T));
+
+	add(batch, PUT_DAT, data, sizeof(data));
+	add(batch, PUT_EVT, event, sizeof(event));
+}
+
+/* arg points to the socket and the result */
+static void *writer(void *arg) {
+	int server = ((int *) arg)[0], failed = 0;
+	message_t *response = NULL;
+	UINT16_T result[2];
+	UINT32_T block;
+
+	for (block=1; block<NBLOCKS; block++) {
+		message_t *batch = new_batch();
+		add_block(batch, block);
+		if (send_batch(server, batch, &response, result, 2) != 2 || result[0] != PUT_OK || result[1] != PUT_OK) failed = 1;
+		release(&batch);
+	}
+	release(&response);
+	((int *) arg)[1] = failed;
+	return NULL;
+}
+
+/* reads the header and the samples in one batch, and checks that they agree with each other */
+static int check_snapshot(int server, message_t *poll, message_t **response) {
+	messagedef_t def;
+	const void *buf;
+	headerdef_t hdef;
+	datadef_t ddef;
+	INT32_T last;
+	UINT32_T offset = 0;
+
+	release(response);
+	if (clientrequest(server, poll, response) != 0 || (*response)->def->command != BATCH_OK) return 0;
+	if (ft_batch_next((*response)->def->bufsize, (*response)->buf, &offset, &def, &buf) != 1 || def.command != GET_OK) return 0;
+	memcpy(&hdef, buf, sizeof(hdef));
+	if (ft_batch_next((*response)->def->bufsize, (*response)->buf, &offset, &def, &buf) != 1 || def.command != GET_OK) return 0;
+	memcpy(&ddef, buf, sizeof(ddef));
+	memcpy(&last, (const char *) buf + sizeof(datadef_t) + ddef.bufsize - sizeof(INT32_T), sizeof(INT32_T));
+
+	return hdef.nsamples == hdef.nevents*BLOCKSIZE && (UINT32_T) last == hdef.nsamples - 1;
+}
+
+static int check_refused(int server) {
+	message_t *batch = new_batch(), *response = NULL;
+	waitdef_t wd;
+	UINT16_T result[4];
+	int failed = 0;
+
+	/* an empty batch has no responses */
+	failed |= check(send_batch(server, batch, &response, result, 4) == 0, "an empty batch failed");
+
+	/* WAIT_DAT would block with the locks of the stream */
+	memset(&wd, 0, sizeof(wd));
+	add(batch, GET_HDR, NULL, 0);
+	add(batch, WAIT_DAT, &wd, sizeof(wd));
+	failed |= check(send_batch(server, batch, &response, result, 4) < 0 && response != NULL && response->def->command == BATCH_ERR, "WAIT_DAT in a batch was accepted");
+
+	/* as would a batch within a batch */
+	batch->def->bufsize = 0;
+	add(batch, BATCH, NULL, 0);
+	failed |= check(send_batch(server, batch, &response, result, 4) < 0, "a batch within a batch was accepted");
+
+	/* a request that does not fit */
+	batch->def->bufsize = 0;
+	add(batch, GET_HDR, NULL, 0);
+	((messagedef_t *) batch->buf)->bufsize = 100;
+	failed |= check(send_batch(server, batch, &response, result, 4) < 0, "a malformed batch was accepted");
+
+	release(&response);
+	release(&batch);
+	return failed;
+}
+
+/* a batch from the other endianness should come out the same as the native one */
+static int check_swap(void) {
+	message_t *request = new_batch(), *response = new_batch();
+	messagedef_t def;
+	datasel_t sel = {3, 7};
+	waitdef_t wd = {{100, 5}, 250};
+	samples_events_t nse = {100, 5};
+	char *native;
+	UINT32_T offset = 0;
+	const void *buf;
+	int ok;
+
+	add(request, GET_HDR, NULL, 0);
+	add(request, GET_DAT, &sel, sizeof(sel));
+	add(request, WAIT_DAT, &wd, sizeof(wd));
+	native = (char *) malloc(request->def->bufsize);
+	memcpy(native, request->buf, request->def->bufsize);
+
+	/* the requests as they would come from the other side */
+	while (ft_batch_next(request->def->bufsize, native, &offset, &def, &buf) == 1) {
+		char *p = (char *) buf - sizeof(messagedef_t);
+		ft_swap16(2, p);
+		ft_swap32(1, p + 4);
+		ft_swap32(def.bufsize/4, (char *) buf);
+	}
+	ok = ft_swap_batch_to_native(request->def->bufsize, native) == 0 && memcmp(native, request->buf, request->def->bufsize) == 0;
+
+	/* and the responses back */
+	response->def->command = BATCH_OK;
+	add(response, GET_ERR, NULL, 0);
+	add(response, GET_ERR, NULL, 0);
+	add(response, WAIT_OK, &nse, sizeof(nse));
+	ok = ok && ft_swap_batch_from_native(request->def->bufsize, request->buf, response) == 0;
+	offset = 2*(sizeof(messagedef_t));
+	def = *(messagedef_t *) ((char *) response->buf + offset);
+	ft_swap32(1, &def.bufsize);
+	ft_swap32(2, (char *) response->buf + offset + sizeof(messagedef_t));
+	ok = ok && def.bufsize == sizeof(nse) && memcmp((char *) response->buf + offset + sizeof(messagedef_t), &nse, sizeof(nse)) == 0;
+
+	free(native);
+	release(&request);
+	release(&response);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	int reps = (argc>2) ? atoi(argv[2]) : 200;
+	char hdr[sizeof(headerdef_t) + sizeof(ft_chunkdef_t) + sizeof(capacitydef_t)];
+	headerdef_t *hdef = (headerdef_t *) hdr;
+	ft_chunkdef_t *chunkdef = (ft_chunkdef_t *) (hdef+1);
+	capacitydef_t *cap = (capacitydef_t *) (chunkdef+1);
+	ft_buffer_server_t *server;
+	message_t *batch, *poll, *response = NULL, request;
+	messagedef_t def;
+	datasel_t datsel;
+	eventsel_t evtsel;
+	UINT16_T result[8];
+	pthread_t thread;
+	int client, other, k, n, snapshots = 0, consistent = 0, failed = 0;
+	int writing[2];
+	double t0, separate, batched;
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_batch: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	other = open_connection("localhost", port);
+	if (client < 0 || other < 0) {
+		fprintf(stderr, "test_batch: could not connect\n");
+		return 1;
+	}
+
+	/* header, first block and its event, all at once */
+	memset(hdr, 0, sizeof(hdr));
+	hdef->nchans    = NCHANS;
+	hdef->fsample   = 1000;
+	hdef->data_type = DATATYPE_INT32;
+	hdef->bufsize   = sizeof(ft_chunkdef_t) + sizeof(capacitydef_t);
+	chunkdef->type  = FT_CHUNK_BUFFER_CAPACITY;
+	chunkdef->size  = sizeof(capacitydef_t);
+	cap->nsamples   = CAPACITY;
+	batch = new_batch();
+	add(batch, PUT_HDR, hdr, sizeof(hdr));
+	add_block(batch, 0);
+	add(batch, GET_HDR, NULL, 0);
+	n = send_batch(client, batch, &response, result, 8);
+	failed |= check(n == 4 && result[0] == PUT_OK && result[1] == PUT_OK && result[2] == PUT_OK && result[3] == GET_OK, "PUT_HDR, PUT_DAT and PUT_EVT in a batch failed");
+	release(&batch);
+
+	/* the polling cycle, while the other connection keeps writing */
+	poll = new_batch();
+	add(poll, GET_HDR, NULL, 0);
+	add(poll, GET_DAT, NULL, 0);
+	writing[0] = other;
+	pthread_create(&thread, NULL, writer, writing);
+	for (k=0; k<NBLOCKS; k++) {
+		snapshots++;
+		consistent += check_snapshot(client, poll, &response);
+	}
+	pthread_join(thread, NULL);
+	failed |= check(writing[1] == 0, "the writer failed");
+	failed |= check(consistent == snapshots, "a batch saw samples without their events");
+	failed |= check(check_snapshot(client, poll, &response), "the last snapshot is not complete");
+	release(&response);
+	release(&poll);
+	printf("%i snapshots while writing, %i consistent\n", snapshots, consistent);
+
+	/* one round trip instead of three, for the newest block and its event */
+	datsel.begsample = (NBLOCKS - 1)*BLOCKSIZE;
+	datsel.endsample = NBLOCKS*BLOCKSIZE - 1;
+	evtsel.begevent  = NBLOCKS - 1;
+	evtsel.endevent  = NBLOCKS - 1;
+	def.version = VERSION;
+	request.def = &def;
+	t0 = now();
+	for (k=0; k<reps; k++) {
+		def.command = GET_HDR;
+		def.bufsize = 0;
+		request.buf = NULL;
+		failed |= clientrequest(client, &request, &response) != 0;
+		release(&response);
+		def.command = GET_DAT;
+		def.bufsize = sizeof(datsel);
+		request.buf = &datsel;
+		failed |= clientrequest(client, &request, &response) != 0;
+		release(&response);
+		def.command = GET_EVT;
+		def.bufsize = sizeof(evtsel);
+		request.buf = &evtsel;
+		failed |= clientrequest(client, &request, &response) != 0;
+		release(&response);
+	}
+	separate = (now() - t0) / reps;
+	poll = new_batch();
+	add(poll, GET_HDR, NULL, 0);
+	add(poll, GET_DAT, &datsel, sizeof(datsel));
+	add(poll, GET_EVT, &evtsel, sizeof(evtsel));
+	t0 = now();
+	for (k=0; k<reps; k++) {
+		n = send_batch(client, poll, &response, result, 8);
+		failed |= check(n == 3 && result[0] == GET_OK && result[1] == GET_OK && result[2] == GET_OK, "the polling batch failed");
+	}
+	batched = (now() - t0) / reps;
+	release(&poll);
+	release(&response);
+	printf("GET_HDR + GET_DAT + GET_EVT: %.3f ms as separate requests, %.3f ms as one batch\n", 1e3*separate, 1e3*batched);
+
+	failed |= check_refused(client);
+	failed |= check(check_swap(), "the batch is not swapped correctly");
+
+	close_connection(client);
+	close_connection(other);
+	ft_stop_buffer_server(server);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
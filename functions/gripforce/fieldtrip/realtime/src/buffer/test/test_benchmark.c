@@ -1,191 +1,493 @@
 /*
+ * Benchmark of the buffer with a number of writers and readers at the same
+ * time. Each writer is a thread that puts a header into a stream of its own
+ * (OPEN_STREAM) and then writes blocks of samples at the given sampling rate,
+ * or as fast as it can. Each reader is a thread that follows the samples of
+ * one of the streams, either by blocking in WAIT_DAT or, as MATLAB does, by
+ * polling with GET_HDR, and fetches the new samples with GET_DAT.
+ *
+ * The latency of a block is the time from when its writer sends the PUT_DAT
+ * until a reader has received it with GET_DAT. It is kept in the histogram
+ * of stats.h, and reported as percentiles over all readers, together with
+ * the throughput of the writers and readers.
+ *
+ * The clients talk to a server in this process over TCP or a UNIX domain
+ * socket, or call dmarequest directly, unless another server is given with
+ * -host. The scenarios are those of the experiments that use the buffer:
+ *
+ *    gripforce    2 channels at 500 Hz, one sample per PUT_DAT as the Python
+ *                 writer does it, read by MATLAB polling every 10 ms
+ *    biosemi      280 channels at 2048 Hz in blocks of 32 samples, read by
+ *                 two clients with WAIT_DAT
+ *    fmri         64x64x24 voxels (98304 "channels") of INT16, two volumes
+ *                 per second, read with WAIT_DAT
+ *    throughput   32 channels in blocks of 512 samples, as fast as possible
+ *    all          each of the above
+ *
+ * and every setting can be changed with the options that follow.
+ *
  * Use as
- *    ./test_benchmark localhost 1972 32 512 1
+ *    ./test_benchmark [scenario] [-writers N] [-readers N] [-channels N] [-block N]
+ *                     [-rate HZ] [-type int16|int32|float32|float64] [-transport tcp|unix|direct]
+ *                     [-poll MS] [-seconds S] [-port N] [-host NAME]
  *
- * Copyright (C) 2008, Christian Hesse & Robert Oostenveld
- * F.C. Donders Centre for Cognitive Neuroimaging, Radboud University Nijmegen,
- * Kapittelweg 29, 6525 EN Nijmegen, The Netherlands
+ * where -rate 0 writes as fast as possible, -poll 0 reads with WAIT_DAT and
+ * -poll MS polls every MS milliseconds.
  *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
  */
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
-#include "buffer.h"
+#include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 
-int main(int argc, char *argv[]) {
-  host_t host;
-  
-    /* these variables are for the threading */
-  int rc;
-  pthread_t tid;
-  
-    /* these variables are for writing the data */
-  int i, j, k, status = 0, verbose = 0, samplecount = 0;
-  time_t tic, toc;
-  time_t elapsed;
-  
-  /* these represent the acquisition system properties */
-  int fsample        = 512; /* this is just for the header */
-  int nchans         = 32;
-  int nsamples       = 64;
-  int stateless      = 0;	  /* boolean */
-  
-  /* these are used in the communication and represent statefull information */
-  int server             = -1;
-  message_t    *request  = NULL;
-  message_t    *response = NULL;
-  header_t     *header   = NULL;
-  data_t       *data     = NULL;
-  event_t      *event    = NULL;
-    
-  
-    /* start with defaults */
-  sprintf(host.name, DEFAULT_HOSTNAME);
-  host.port = DEFAULT_PORT;
-  
-  if (argc>1)
-    sprintf(host.name, argv[1]);
-  
-  if (argc>2)
-    host.port = atoi(argv[2]);
-  
-  if (argc>3)
-    nchans = atoi(argv[3]);
-  
-  if (argc>4)
-    nsamples = atoi(argv[4]);
-  
-  if (argc>5)
-    stateless = atoi(argv[5]);
-  
-
-  check_datatypes();
-  
-  if (verbose>0) fprintf(stderr, "test_benchmark: host.name =  %s\n", host.name);
-  if (verbose>0) fprintf(stderr, "test_benchmark: host.port =  %d\n", host.port);
-
-  /* allocate the elements that will be used in the communication */
-  request      = malloc(sizeof(message_t));
-  request->def = malloc(sizeof(messagedef_t));
-  request->buf = NULL;
-  request->def->version = VERSION;
-  request->def->bufsize = 0;
-  
-  header      = malloc(sizeof(header_t));
-  header->def = malloc(sizeof(headerdef_t));
-  header->buf = NULL;
-  
-  data      = malloc(sizeof(data_t));
-  data->def = malloc(sizeof(datadef_t));
-  data->buf = NULL;
-  
-  event      = malloc(sizeof(event_t));
-  event->def = malloc(sizeof(eventdef_t));
-  event->buf = NULL;
-  
-  /* define the header */
-  header->def->nchans    = nchans;
-  header->def->nsamples  = 0;
-  header->def->nevents   = 0;
-  header->def->fsample   = fsample;
-  header->def->data_type = DATATYPE_FLOAT32;
-  header->def->bufsize   = 0;
-  FREE(header->buf);
-  
-  /* define the constant part of the data and allocate space for the variable part */
-  data->def->nchans    = nchans;
-  data->def->nsamples  = nsamples;
-  data->def->data_type = DATATYPE_FLOAT32;
-  data->def->bufsize   = WORDSIZE_FLOAT32*nchans*nsamples;
-  FREE(data->buf);
-  data->buf            = malloc(WORDSIZE_FLOAT32*nchans*nsamples);
-    
-    /* create the random data */
-    for (j=0; j<nsamples; j++)
-      for (i=0; i<nchans;    i++)
-        ((FLOAT32_T *)(data->buf))[j*nchans+i] = 2.0*((FLOAT32_T)rand())/RAND_MAX - 1.0;
-  
-  /* initialization phase, send the header */
-  request->def->command = PUT_HDR;
-  request->def->bufsize = append(&request->buf, request->def->bufsize, header->def, sizeof(headerdef_t));
-  request->def->bufsize = append(&request->buf, request->def->bufsize, header->buf, header->def->bufsize);
-  
-  server = open_connection(host.name, host.port);
-  status = clientrequest(server, request, &response);
-  if (verbose>0) fprintf(stderr, "test_benchmark: clientrequest returned %d\n", status);
-  if (status) {
-    fprintf(stderr, "random: err1\n");
-    goto cleanup;
-  }
-  
-  if (stateless) {
-    status = close_connection(server);
-    if (status) {
-      fprintf(stderr, "random: err2\n");
-      goto cleanup;
-    }
-  }
-  
-  cleanup_message(&request);
-  cleanup_message(&response);
-  request = NULL;
-  response = NULL;
-  
-  tic = time(NULL);
-  
-  while (1) {
-    
-    /* create the request */
-    request      = malloc(sizeof(message_t));
-    request->def = malloc(sizeof(messagedef_t));
-    request->buf = NULL;
-    request->def->version = VERSION;
-    request->def->bufsize = 0;
-    request->def->command = PUT_DAT;
-    request->def->bufsize = append(&request->buf, request->def->bufsize, data->def, sizeof(datadef_t));
-    request->def->bufsize = append(&request->buf, request->def->bufsize, data->buf, data->def->bufsize);
-    
-    if (stateless)
-      server = open_connection(host.name, host.port);
-    
-    status = clientrequest(server, request, &response);
-    if (verbose>0) fprintf(stderr, "random: clientrequest returned %d\n", status);
-    if (status) {
-      fprintf(stderr, "random: err3\n");
-      goto cleanup;
-    }
-
-    if (stateless) {
-      status = close_connection(server);
-      if (status) {
-        fprintf(stderr, "random: err4\n");
-        goto cleanup;
-      }
-    }
-
-    cleanup_message(&request);
-    cleanup_message(&response);
-    request = NULL;
-    response = NULL;
-    
-    samplecount += nsamples*nchans;
-    toc = time(NULL);
-    elapsed = toc-tic;
-    
-   fprintf(stderr, "samplecount = %d, elapsed = %d, samples/sec = %f\n", samplecount, elapsed, ((float)(samplecount))/((float)elapsed));
-    
-  } /* while(1) */
-  
-  cleanup:
-    cleanup_event(&event);
-    cleanup_data(&data);
-    cleanup_header(&header);
-    cleanup_message(&request);
-    cleanup_message(&response);
-    
-    pthread_exit(0);
-    return 0;
+#include "buffer.h"
+#include "socketserver.h"
+#include "stats.h"
+
+#define MAX_CLIENTS  64
+#define NSTAMPS      65536      /* blocks whose send time is remembered, per writer */
+#define WAIT_MS      100        /* longest WAIT_DAT, so that readers notice the end */
+#define DRAIN_MS     2000       /* how long readers may take to catch up at the end */
+
+#define TRANSPORT_TCP     0
+#define TRANSPORT_UNIX    1
+#define TRANSPORT_DIRECT  2
+
+typedef struct {
+	const char *name;
+	int writers;
+	int readers;
+	UINT32_T nchans;
+	UINT32_T blocksize;
+	double rate;           /* samples per second, 0 for as fast as possible */
+	UINT32_T data_type;
+	int poll;              /* milliseconds between GET_HDR, 0 for WAIT_DAT */
+	double seconds;
+	int transport;
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+	{"gripforce",  1, 1,     2,   1,  500, DATATYPE_FLOAT64, 10, 10, TRANSPORT_TCP},
+	{"biosemi",    1, 2,   280,  32, 2048, DATATYPE_FLOAT32,  0, 10, TRANSPORT_TCP},
+	{"fmri",       1, 1, 98304,   1,    2, DATATYPE_INT16,    0, 20, TRANSPORT_TCP},
+	{"throughput", 1, 1,    32, 512,    0, DATATYPE_FLOAT32,  0,  5, TRANSPORT_TCP},
+};
+
+#define NSCENARIOS (sizeof(scenarios)/sizeof(scenarios[0]))
+
+static const char *typeNames[]  = {"int16", "int32", "float32", "float64"};
+static const UINT32_T typeCodes[] = {DATATYPE_INT16, DATATYPE_INT32, DATATYPE_FLOAT32, DATATYPE_FLOAT64};
+static const char *transportNames[] = {"tcp", "unix", "direct"};
+
+typedef struct {
+	const scenario_t *sc;
+	int id;
+	volatile UINT64_T *stamp;        /* of the writer of the stream */
+	volatile UINT32_T nsamples;      /* written so far, for a writer */
+	volatile int finished;           /* the writer has sent its last block */
+	UINT32_T delivered;              /* samples received, for a reader */
+	UINT32_T overruns;               /* samples skipped because the reader fell behind */
+	UINT32_T errors;
+	UINT32_T bucket[FT_STATS_BUCKETS];
+	UINT64_T maxLatency;
+	double elapsed;
+} client_t;
+
+/* shared by the clients of one run */
+static const char *hostname = NULL;
+static int port = 1972;
+static char unixPath[64];
+static volatile int stopping = 0;
+static client_t writers[MAX_CLIENTS];
+static client_t readers[MAX_CLIENTS];
+
+static const char *type_name(UINT32_T data_type) {
+	unsigned int i;
+	for (i=0; i<sizeof(typeCodes)/sizeof(typeCodes[0]); i++) {
+		if (typeCodes[i] == data_type) return typeNames[i];
+	}
+	return "other";
 }
 
+static int connect_to(const scenario_t *sc) {
+	if (hostname != NULL) return open_connection(hostname, port);
+	if (sc->transport == TRANSPORT_DIRECT) return 0;
+#ifndef PLATFORM_WINDOWS
+	if (sc->transport == TRANSPORT_UNIX) return open_unix_connection(unixPath);
+#endif
+	return open_connection("localhost", port);
+}
+
+/* sends a request, and returns the command of the response, or 0 */
+static UINT16_T request(int server, UINT16_T command, void *buf, UINT32_T bufsize, message_t **response) {
+	messagedef_t def;
+	message_t req;
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	req.def = &def;
+	req.buf = buf;
+	*response = NULL;
+	if (clientrequest(server, &req, response) != 0 || *response == NULL || (*response)->def == NULL) {
+		cleanup_message((void **) response);
+		return 0;
+	}
+	return (*response)->def->command;
+}
+
+static UINT16_T simple_request(int server, UINT16_T command, void *buf, UINT32_T bufsize) {
+	message_t *response;
+	UINT16_T result = request(server, command, buf, bufsize, &response);
+	cleanup_message((void **) &response);
+	return result;
+}
+
+/* every writer has a stream of its own */
+static int select_stream(int server, int id) {
+	char name[32];
+	sprintf(name, "bench%d", id);
+	return open_stream(server, name) == 0;
+}
+
+/* a ring of 10 seconds, or of 256 blocks if there is no rate, in whole blocks */
+static UINT32_T ring_samples(const scenario_t *sc) {
+	UINT32_T blocks = (sc->rate > 0) ? (UINT32_T) (10 * sc->rate / sc->blocksize) : 256;
+	return ((blocks < 4) ? 4 : blocks) * sc->blocksize;
+}
+
+static int put_header(int server, const scenario_t *sc) {
+	struct {
+		headerdef_t def;
+		ft_chunkdef_t chunkdef;
+		capacitydef_t cap;
+	} hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.def.nchans    = sc->nchans;
+	hdr.def.fsample   = (float) (sc->rate > 0 ? sc->rate : 1000);
+	hdr.def.data_type = sc->data_type;
+	hdr.def.bufsize   = sizeof(ft_chunkdef_t) + sizeof(capacitydef_t);
+	hdr.chunkdef.type = FT_CHUNK_BUFFER_CAPACITY;
+	hdr.chunkdef.size = sizeof(capacitydef_t);
+	hdr.cap.nsamples  = ring_samples(sc);
+	return simple_request(server, PUT_HDR, &hdr, sizeof(hdr)) == PUT_OK;
+}
+
+static void *write_blocks(void *arg) {
+	client_t *W = (client_t *) arg;
+	const scenario_t *sc = W->sc;
+	UINT32_T rawsize = sc->blocksize * sc->nchans * wordsize_from_type(sc->data_type), k;
+	char *buf = (char *) malloc(sizeof(datadef_t) + rawsize);
+	datadef_t *ddef = (datadef_t *) buf;
+	UINT64_T start, due, t;
+	int server = connect_to(sc);
+
+	if (buf == NULL || server < 0 || !select_stream(server, W->id)) {
+		fprintf(stderr, "test_benchmark: writer %d cannot connect\n", W->id);
+		W->errors++;
+		W->finished = 1;
+		FREE(buf);
+		return NULL;
+	}
+	ddef->nchans    = sc->nchans;
+	ddef->nsamples  = sc->blocksize;
+	ddef->data_type = sc->data_type;
+	ddef->bufsize   = rawsize;
+	for (k=0; k<rawsize; k++) buf[sizeof(datadef_t) + k] = (char) (k*7 + W->id);
+
+	start = ft_stats_now();
+	for (k=0; !stopping; k++) {
+		if (sc->rate > 0) {
+			/* the time at which the last sample of this block has been acquired */
+			due = start + (UINT64_T) (1e9 * (k+1) * sc->blocksize / sc->rate);
+			while ((t = ft_stats_now()) < due && !stopping) usleep((due - t > 2000000) ? 2000 : (useconds_t) ((due - t)/1000));
+			if (stopping) break;
+		}
+		W->stamp[k % NSTAMPS] = ft_stats_now();
+		if (simple_request(server, PUT_DAT, buf, sizeof(datadef_t) + rawsize) != PUT_OK) {
+			W->errors++;
+			break;
+		}
+		W->nsamples += sc->blocksize;
+	}
+	W->elapsed = 1e-9 * (double) (ft_stats_now() - start);
+	W->finished = 1;
+
+	if (server > 0) close_connection(server);
+	free(buf);
+	return NULL;
+}
+
+/* the number of samples in the stream, once there are more than "seen", or after a while */
+static int wait_for_samples(int server, const scenario_t *sc, UINT32_T seen, UINT32_T *nsamples) {
+	message_t *response;
+	UINT16_T result;
+
+	if (sc->poll > 0) {
+		usleep(1000 * sc->poll);
+		result = request(server, GET_HDR, NULL, 0, &response);
+		if (result == GET_OK) *nsamples = ((headerdef_t *) response->buf)->nsamples;
+	}
+	else {
+		waitdef_t wd;
+		wd.threshold.nsamples = seen;
+		wd.threshold.nevents  = 0xFFFFFFFF;
+		wd.milliseconds       = WAIT_MS;
+		result = request(server, WAIT_DAT, &wd, sizeof(wd), &response);
+		if (result == WAIT_OK) *nsamples = ((samples_events_t *) response->buf)->nsamples;
+	}
+	cleanup_message((void **) &response);
+	return result == GET_OK || result == WAIT_OK;
+}
+
+static void *read_blocks(void *arg) {
+	client_t *R = (client_t *) arg;
+	const scenario_t *sc = R->sc;
+	client_t *W = writers + R->id % sc->writers;
+	UINT32_T seen = 0, nsamples = 0, b;
+	UINT64_T t, drained = 0;
+	int server = connect_to(sc);
+
+	if (server < 0 || !select_stream(server, W->id)) {
+		fprintf(stderr, "test_benchmark: reader %d cannot connect\n", R->id);
+		R->errors++;
+		return NULL;
+	}
+
+	/* until the writer has stopped and everything has been read, or that takes too long */
+	for (;;) {
+		if (stopping) {
+			if (drained == 0) drained = ft_stats_now() + (UINT64_T) DRAIN_MS * 1000000u;
+			if ((W->finished && seen >= W->nsamples) || ft_stats_now() > drained) break;
+		}
+		if (!wait_for_samples(server, sc, seen, &nsamples)) {
+			R->errors++;
+			break;
+		}
+		if (nsamples <= seen) continue;
+
+		/* more than half the ring behind, so the oldest would be overwritten while we copy them */
+		if (nsamples - seen > ring_samples(sc)/2) {
+			UINT32_T skip = nsamples - ring_samples(sc)/2 - seen;
+			skip -= skip % sc->blocksize;
+			R->overruns += skip;
+			seen += skip;
+		}
+
+		{
+			datasel_t sel;
+			message_t *response;
+			sel.begsample = seen;
+			sel.endsample = nsamples - 1;
+			if (request(server, GET_DAT, &sel, sizeof(sel), &response) != GET_OK) {
+				/* the writer overtook us anyway */
+				cleanup_message((void **) &response);
+				R->overruns += nsamples - seen;
+				seen = nsamples;
+				continue;
+			}
+			t = ft_stats_now();
+			cleanup_message((void **) &response);
+		}
+
+		/* the blocks that are complete now */
+		for (b = seen / sc->blocksize; (b+1)*sc->blocksize <= nsamples; b++) {
+			UINT64_T ns = t - W->stamp[b % NSTAMPS];
+			R->bucket[ft_stats_bucket(ns)]++;
+			if (ns > R->maxLatency) R->maxLatency = ns;
+		}
+		R->delivered += nsamples - seen;
+		seen = nsamples;
+	}
+
+	if (server > 0) close_connection(server);
+	return NULL;
+}
+
+static void print_time(double ns) {
+	if (ns < 1e4)
+		printf(" %8.0fns", ns);
+	else if (ns < 1e7)
+		printf(" %8.1fus", ns/1e3);
+	else
+		printf(" %8.1fms", ns/1e6);
+}
+
+/* the histogram has the upper edges of its buckets, which can be beyond the longest one */
+static void print_percentile(const UINT32_T *bucket, double p, UINT64_T maxLatency) {
+	double ns = ft_stats_percentile(bucket, FT_STATS_BUCKETS, p);
+	print_time((ns > maxLatency) ? (double) maxLatency : ns);
+}
+
+static int run(const scenario_t *sc) {
+	ft_buffer_server_t *server = NULL;
+	pthread_t wthread[MAX_CLIENTS], rthread[MAX_CLIENTS];
+	UINT32_T bucket[FT_STATS_BUCKETS], written = 0, delivered = 0, overruns = 0, errors = 0, blocks = 0;
+	UINT32_T chansize = sc->nchans * wordsize_from_type(sc->data_type);
+	UINT64_T maxLatency = 0;
+	double elapsed = 0;
+	int setup, i, j;
+
+	if (hostname == NULL && sc->transport != TRANSPORT_DIRECT) {
+		if (sc->transport == TRANSPORT_UNIX) {
+			sprintf(unixPath, "/tmp/test_benchmark.%d", (int) getpid());
+			server = ft_start_buffer_server(0, unixPath, NULL, NULL);
+		}
+		else {
+			server = ft_start_buffer_server(port, NULL, NULL, NULL);
+		}
+		if (server == NULL) {
+			fprintf(stderr, "test_benchmark: cannot start a server\n");
+			return 1;
+		}
+		server->verbosity = 0;
+	}
+
+	/* the headers are there before any reader starts */
+	stopping = 0;
+	memset(writers, 0, sizeof(writers));
+	memset(readers, 0, sizeof(readers));
+	setup = connect_to(sc);
+	for (i=0; i<sc->writers; i++) {
+		writers[i].sc = sc;
+		writers[i].id = i;
+		writers[i].stamp = (volatile UINT64_T *) calloc(NSTAMPS, sizeof(UINT64_T));
+		if (setup < 0 || writers[i].stamp == NULL || !select_stream(setup, i) || !put_header(setup, sc)) {
+			fprintf(stderr, "test_benchmark: cannot put the header of stream %d\n", i);
+			return 1;
+		}
+	}
+	if (setup > 0) close_connection(setup);
+
+	for (i=0; i<sc->readers; i++) {
+		readers[i].sc = sc;
+		readers[i].id = i;
+		pthread_create(&rthread[i], NULL, read_blocks, &readers[i]);
+	}
+	for (i=0; i<sc->writers; i++) pthread_create(&wthread[i], NULL, write_blocks, &writers[i]);
+	usleep((useconds_t) (sc->seconds * 1e6));
+	stopping = 1;
+	for (i=0; i<sc->writers; i++) pthread_join(wthread[i], NULL);
+	for (i=0; i<sc->readers; i++) pthread_join(rthread[i], NULL);
+
+	memset(bucket, 0, sizeof(bucket));
+	for (i=0; i<sc->writers; i++) {
+		written += writers[i].nsamples;
+		errors  += writers[i].errors;
+		if (writers[i].elapsed > elapsed) elapsed = writers[i].elapsed;
+		free((void *) writers[i].stamp);
+	}
+	for (i=0; i<sc->readers; i++) {
+		delivered += readers[i].delivered;
+		overruns  += readers[i].overruns;
+		errors    += readers[i].errors;
+		for (j=0; j<FT_STATS_BUCKETS; j++) {
+			bucket[j] += readers[i].bucket[j];
+			blocks    += readers[i].bucket[j];
+		}
+		if (readers[i].maxLatency > maxLatency) maxLatency = readers[i].maxLatency;
+	}
+	if (elapsed <= 0) elapsed = sc->seconds;
+
+	printf("%s: %d writer(s), %d reader(s) with %s, %u channels of %s in blocks of %u",
+			sc->name, sc->writers, sc->readers, sc->poll ? "GET_HDR polling" : "WAIT_DAT", sc->nchans, type_name(sc->data_type), sc->blocksize);
+	if (sc->rate > 0) printf(" at %g Hz", sc->rate);
+	printf(", over %s for %g s\n", hostname ? hostname : transportNames[sc->transport], sc->seconds);
+	printf("  written   %10u samples %10.0f samples/s %10.2f MB/s\n", written, written / elapsed, written * (double) chansize / elapsed / 1e6);
+	printf("  delivered %10u samples %10.0f samples/s %10.2f MB/s, %u skipped by readers that fell behind\n",
+			delivered, delivered / elapsed, delivered * (double) chansize / elapsed / 1e6, overruns);
+	printf("  latency of %u blocks:", blocks);
+	printf(" p50"); print_percentile(bucket, 0.5, maxLatency);
+	printf(" p99"); print_percentile(bucket, 0.99, maxLatency);
+	printf(" p99.9"); print_percentile(bucket, 0.999, maxLatency);
+	printf(" max"); print_time((double) maxLatency);
+	printf("\n");
+	if (sc->rate > 0 && written < 0.95 * sc->rate * elapsed * sc->writers) printf("  the writers could not keep up with %g Hz\n", sc->rate);
+	if (errors) printf("  %u requests failed\n", errors);
+	fflush(stdout);
+
+	if (server != NULL) ft_stop_buffer_server(server);
+	if (sc->transport == TRANSPORT_UNIX && hostname == NULL) unlink(unixPath);
+	return errors > 0 || written == 0 || delivered + overruns < written * (UINT32_T) (sc->readers / sc->writers);
+}
+
+static int lookup(const char *value, const char **names, int n) {
+	int i;
+	for (i=0; i<n; i++) {
+		if (!strcmp(value, names[i])) return i;
+	}
+	fprintf(stderr, "test_benchmark: unknown value '%s'\n", value);
+	exit(1);
+	return -1;
+}
+
+int main(int argc, char *argv[]) {
+	scenario_t sc[NSCENARIOS];
+	int i, n = 1, arg = 1, failed = 0;
+	unsigned int k;
+
+	check_datatypes();
+	memcpy(sc, scenarios, sizeof(scenarios));
+
+	/* the scenario, if any, and then the settings that differ from it */
+	if (argc > 1 && argv[1][0] != '-') {
+		arg = 2;
+		if (!strcmp(argv[1], "all")) {
+			n = NSCENARIOS;
+		}
+		else {
+			for (k=0; k<NSCENARIOS && strcmp(argv[1], scenarios[k].name); k++);
+			if (k == NSCENARIOS) {
+				fprintf(stderr, "test_benchmark: unknown scenario '%s'\n", argv[1]);
+				return 1;
+			}
+			sc[0] = scenarios[k];
+		}
+	}
+	else {
+		sc[0] = scenarios[NSCENARIOS-1];
+	}
+
+	for (; arg+1 < argc; arg += 2) {
+		const char *option = argv[arg], *value = argv[arg+1];
+		for (i=0; i<n; i++) {
+			if      (!strcmp(option, "-writers"))   sc[i].writers   = atoi(value);
+			else if (!strcmp(option, "-readers"))   sc[i].readers   = atoi(value);
+			else if (!strcmp(option, "-channels"))  sc[i].nchans    = atoi(value);
+			else if (!strcmp(option, "-block"))     sc[i].blocksize = atoi(value);
+			else if (!strcmp(option, "-rate"))      sc[i].rate      = atof(value);
+			else if (!strcmp(option, "-type"))      sc[i].data_type = typeCodes[lookup(value, typeNames, 4)];
+			else if (!strcmp(option, "-transport")) sc[i].transport = lookup(value, transportNames, 3);
+			else if (!strcmp(option, "-poll"))      sc[i].poll      = atoi(value);
+			else if (!strcmp(option, "-seconds"))   sc[i].seconds   = atof(value);
+			else if (!strcmp(option, "-port"))     port = atoi(value);
+			else if (!strcmp(option, "-host"))     hostname = value;
+			else {
+				fprintf(stderr, "test_benchmark: unknown option '%s'\n", option);
+				return 1;
+			}
+		}
+	}
+	if (arg < argc) {
+		fprintf(stderr, "test_benchmark: option '%s' needs a value\n", argv[arg]);
+		return 1;
+	}
+
+	for (i=0; i<n; i++) {
+		if (sc[i].writers < 1 || sc[i].writers > MAX_CLIENTS || sc[i].readers < 0 || sc[i].readers > MAX_CLIENTS
+				|| sc[i].nchans == 0 || sc[i].blocksize == 0 || sc[i].rate < 0 || sc[i].seconds <= 0) {
+			fprintf(stderr, "test_benchmark: invalid settings for %s\n", sc[i].name);
+			return 1;
+		}
+#ifdef PLATFORM_WINDOWS
+		if (sc[i].transport == TRANSPORT_UNIX) sc[i].transport = TRANSPORT_TCP;
+#endif
+		failed |= run(&sc[i]);
+	}
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
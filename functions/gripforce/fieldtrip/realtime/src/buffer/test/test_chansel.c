@@ -0,0 +1,255 @@
+/*
+ * Reads a few channels of a 280-channel buffer over a local TCP connection,
+ * once by reading all channels and picking and converting them in the
+ * client, and once by letting the server select and convert them (see
+ * chansel.h). It prints the number of bytes and the time per read for both,
+ * and checks selections by number and by name, conversions, and requests
+ * that the server should refuse.
+ *
+ * Use as
+ *    ./test_chansel [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_chansel"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "testutil.h"
+
+#define NCHANS    280
+#define NSAMPLES  20000
+#define BLOCKSIZE 1000
+#define MB        (1024*1024)
+
+/* value of channel c in sample s, which is exact in all types with at least 32 bits */
+static INT32_T value(UINT32_T s, UINT32_T c) {
+	return (INT32_T) (s*NCHANS + c);
+}
+
+static void put_local(UINT16_T command, void *buf, UINT32_T bufsize) {
+	messagedef_t def;
+	message_t msg, *resp = NULL;
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	msg.def = &def;
+	msg.buf = buf;
+	if (dmarequest(&msg, &resp) != 0 || resp == NULL || resp->def->command != PUT_OK) {
+		fprintf(stderr, "test_chansel: local request %x failed\n", command);
+		exit(1);
+	}
+	cleanup_message((void **) &resp);
+}
+
+/* the channel names of a BioSemi system with 256 EEG, 8 external and 16 auxiliary channels */
+static UINT32_T channel_names(char *names) {
+	UINT32_T c, size = 0;
+	for (c=0; c<NCHANS; c++) {
+		if (c < 256)
+			size += sprintf(names + size, "%c%u", 'A' + c/32, c%32 + 1) + 1;
+		else if (c < 264)
+			size += sprintf(names + size, "EXG%u", c - 256 + 1) + 1;
+		else
+			size += sprintf(names + size, "AUX%u", c - 264 + 1) + 1;
+	}
+	return size;
+}
+
+static void fill_buffer(void) {
+	char *hdr = (char *) malloc(sizeof(headerdef_t) + sizeof(ft_chunkdef_t) + NCHANS*8);
+	char *buf = (char *) malloc(sizeof(datadef_t) + BLOCKSIZE*NCHANS*sizeof(INT32_T));
+	headerdef_t *hdef = (headerdef_t *) hdr;
+	ft_chunkdef_t *chunkdef = (ft_chunkdef_t *) (hdef+1);
+	datadef_t *ddef = (datadef_t *) buf;
+	INT32_T *samples = (INT32_T *) (ddef+1);
+	UINT32_T i, j;
+
+	memset(hdef, 0, sizeof(headerdef_t));
+	chunkdef->type  = FT_CHUNK_CHANNEL_NAMES;
+	chunkdef->size  = channel_names((char *) (chunkdef+1));
+	hdef->nchans    = NCHANS;
+	hdef->fsample   = 2048;
+	hdef->data_type = DATATYPE_INT32;
+	hdef->bufsize   = sizeof(ft_chunkdef_t) + chunkdef->size;
+	put_local(PUT_HDR, hdr, sizeof(headerdef_t) + hdef->bufsize);
+
+	for (i=0; i<NSAMPLES; i+=BLOCKSIZE) {
+		for (j=0; j<BLOCKSIZE*NCHANS; j++) samples[j] = value(i + j/NCHANS, j%NCHANS);
+		ddef->nchans    = NCHANS;
+		ddef->nsamples  = BLOCKSIZE;
+		ddef->data_type = DATATYPE_INT32;
+		ddef->bufsize   = BLOCKSIZE*NCHANS*sizeof(INT32_T);
+		put_local(PUT_DAT, buf, sizeof(datadef_t) + ddef->bufsize);
+	}
+	free(hdr);
+	free(buf);
+}
+
+/* sends a GET_DAT request with the given selection, returns the size of the response or -1 */
+static int get_data(int server, UINT32_T begsample, UINT32_T endsample, const channelseldef_t *cdef, const void *arg, char *dest) {
+	char req[sizeof(datasel_t) + sizeof(channelseldef_t) + 4096];
+	datasel_t *sel = (datasel_t *) req;
+	UINT32_T size = sizeof(datasel_t);
+
+	sel->begsample = begsample;
+	sel->endsample = endsample;
+	if (cdef != NULL) {
+		memcpy(sel+1, cdef, sizeof(channelseldef_t));
+		memcpy((char *) (sel+1) + sizeof(channelseldef_t), arg, cdef->bufsize);
+		size += sizeof(channelseldef_t) + cdef->bufsize;
+	}
+	return get_request(server, GET_DAT, req, size, dest);
+}
+
+/* checks the response to a selection of the given channels in the given type */
+static int check_response(const char *dest, UINT32_T begsample, UINT32_T nsamples, UINT32_T nchans, const UINT32_T *chans, UINT32_T data_type) {
+	const datadef_t *ddef = (const datadef_t *) dest;
+	const char *data = (const char *) (ddef+1);
+	UINT32_T s, k;
+
+	if (ddef->nchans != nchans || ddef->nsamples != nsamples || ddef->data_type != data_type) return 0;
+	if (ddef->bufsize != nsamples*nchans*wordsize_from_type(data_type)) return 0;
+	for (s=0; s<nsamples; s++) {
+		for (k=0; k<nchans; k++) {
+			double v, expected = (double) value(begsample + s, chans ? chans[k] : k);
+			UINT32_T i = s*nchans + k;
+			switch (data_type) {
+				case DATATYPE_INT32:   v = ((const INT32_T *) data)[i];   break;
+				case DATATYPE_INT64:   v = (double) ((const INT64_T *) data)[i];   break;
+				case DATATYPE_FLOAT32: v = ((const FLOAT32_T *) data)[i]; break;
+				case DATATYPE_FLOAT64: v = ((const FLOAT64_T *) data)[i]; break;
+				default: return 0;
+			}
+			if (v != expected) return 0;
+		}
+	}
+	return 1;
+}
+
+/* a swapped request should come out the same as the native one */
+static int check_swap(void) {
+	UINT32_T native[6+3], swapped[6+3], i;
+	channelseldef_t *cdef = (channelseldef_t *) (native+2);
+
+	native[0] = 10;
+	native[1] = 20;
+	cdef->what      = CHANSEL_INDEX;
+	cdef->nchans    = 3;
+	cdef->data_type = DATATYPE_FLOAT64;
+	cdef->bufsize   = 3*sizeof(UINT32_T);
+	native[6] = 1;
+	native[7] = 256;
+	native[8] = 65536;
+	memcpy(swapped, native, sizeof(native));
+	ft_swap32(6+3, swapped);
+	if (ft_swap_buf_to_native(GET_DAT, sizeof(swapped), swapped) != 0) return 0;
+	for (i=0; i<6+3; i++) {
+		if (swapped[i] != native[i]) return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	int reps = repetitions(argc, argv, 2, 20);
+	UINT32_T n = 2048, begsample = NSAMPLES - n, endsample = NSAMPLES - 1;
+	UINT32_T scattered[] = {0, 1, 2, 100, 279, 5, 6, 256, 257};
+	UINT32_T exg[] = {256, 257}, bad[] = {3, NCHANS};
+	const char labels[] = "EXG1\0EXG2";
+	ft_buffer_server_t *server;
+	channelseldef_t cdef;
+	double *grip;
+	char *dest;
+	int client, k, size = -1, failed = 0;
+	double t0, full, selected;
+
+	fill_buffer();
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_chansel: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	if (client < 0) {
+		fprintf(stderr, "test_chansel: could not connect\n");
+		return 1;
+	}
+	dest = (char *) malloc(sizeof(datadef_t) + n*NCHANS*sizeof(FLOAT64_T));
+	grip = (double *) malloc(n*2*sizeof(double));
+
+	/* two channels as double: everything over the wire, and picking them out in the client */
+	t0 = now();
+	for (k=0; k<reps; k++) {
+		const INT32_T *samples = (const INT32_T *) (dest + sizeof(datadef_t));
+		UINT32_T s;
+		size = get_data(client, begsample, endsample, NULL, NULL, dest);
+		for (s=0; s<n; s++) {
+			grip[2*s]   = samples[s*NCHANS + exg[0]];
+			grip[2*s+1] = samples[s*NCHANS + exg[1]];
+		}
+	}
+	full = (now() - t0) / reps;
+	failed |= check(size == sizeof(datadef_t) + n*NCHANS*sizeof(INT32_T) && grip[2*n-1] == value(endsample, exg[1]), "wrong samples without a selection");
+	printf("all channels:        %8i bytes, %7.3f ms/read\n", size, 1e3*full);
+
+	/* the same, selected and converted by the server */
+	cdef.what      = CHANSEL_LABEL;
+	cdef.nchans    = 2;
+	cdef.data_type = DATATYPE_FLOAT64;
+	cdef.bufsize   = sizeof(labels);
+	t0 = now();
+	for (k=0; k<reps; k++) size = get_data(client, begsample, endsample, &cdef, labels, dest);
+	selected = (now() - t0) / reps;
+	failed |= check(size > 0 && check_response(dest, begsample, n, 2, exg, DATATYPE_FLOAT64), "wrong samples for EXG1 and EXG2");
+	printf("EXG1, EXG2 (double): %8i bytes, %7.3f ms/read\n", size, 1e3*selected);
+
+	/* channels by number, in any order */
+	cdef.what      = CHANSEL_INDEX;
+	cdef.nchans    = sizeof(scattered)/sizeof(UINT32_T);
+	cdef.data_type = DATATYPE_FLOAT32;
+	cdef.bufsize   = sizeof(scattered);
+	size = get_data(client, begsample, endsample, &cdef, scattered, dest);
+	failed |= check(size > 0 && check_response(dest, begsample, n, cdef.nchans, scattered, DATATYPE_FLOAT32), "wrong samples for channels by number");
+
+	/* all channels in another type, and in the stored type */
+	cdef.nchans    = 0;
+	cdef.data_type = DATATYPE_INT64;
+	cdef.bufsize   = 0;
+	size = get_data(client, begsample, endsample, &cdef, NULL, dest);
+	failed |= check(size > 0 && check_response(dest, begsample, n, NCHANS, NULL, DATATYPE_INT64), "wrong samples for all channels as int64");
+	cdef.data_type = DATATYPE_UNKNOWN;
+	size = get_data(client, 0, 99, &cdef, NULL, dest);
+	failed |= check(size > 0 && check_response(dest, 0, 100, NCHANS, NULL, DATATYPE_INT32), "wrong samples for all channels");
+
+	/* requests that should be refused */
+	cdef.what      = CHANSEL_INDEX;
+	cdef.nchans    = 2;
+	cdef.data_type = DATATYPE_FLOAT32;
+	cdef.bufsize   = sizeof(bad);
+	failed |= check(get_data(client, 0, 99, &cdef, bad, dest) < 0, "channel out of range was accepted");
+	cdef.what      = CHANSEL_LABEL;
+	cdef.bufsize   = sizeof("EXG1\0EXG9");
+	failed |= check(get_data(client, 0, 99, &cdef, "EXG1\0EXG9", dest) < 0, "unknown channel name was accepted");
+	cdef.nchans    = 0;
+	cdef.data_type = DATATYPE_CHAR;
+	cdef.bufsize   = 0;
+	failed |= check(get_data(client, 0, 99, &cdef, NULL, dest) < 0, "conversion to char was accepted");
+
+	failed |= check(check_swap(), "the selection is not swapped correctly");
+
+	close_connection(client);
+	ft_stop_buffer_server(server);
+	free(dest);
+	free(grip);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
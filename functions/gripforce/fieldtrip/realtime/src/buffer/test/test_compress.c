@@ -0,0 +1,265 @@
+/*
+ * Checks the delta encoding of samples (see compress.h): round trips of all
+ * supported types, including blocks that need all bits and odd sizes, the
+ * size and the encode/decode speed for EEG-like signals, and PUT_DAT and
+ * GET_DAT over a local TCP connection that asked for the encoding, which
+ * is refused for a stream of floats.
+ *
+ * Use as
+ *    ./test_compress [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_compress"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "compress.h"
+#include "testutil.h"
+
+#define NCHANS    64
+#define NSAMPLES  32768
+
+static UINT32_T seed = 12345;
+
+static UINT32_T random32(void) {
+	seed = seed * 1664525u + 1013904223u;
+	return seed;
+}
+
+/* uniform noise in [-amplitude, amplitude] */
+static double noise(double amplitude) {
+	return amplitude * ((random32() >> 8) / (double) (1 << 24) * 2 - 1);
+}
+
+/* a slow rhythm plus noise on every channel, like EEG sampled at 2 kHz */
+static void eeg_like(UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, void *dest) {
+	UINT32_T s, c;
+	double *walk = (double *) calloc(nchans, sizeof(double));
+
+	for (s=0; s<nsamples; s++) {
+		for (c=0; c<nchans; c++) {
+			double v;
+			walk[c] += noise(4);
+			v = walk[c] + 200*sin(2*M_PI*10*s/2048.0 + c) + noise(16);
+			switch (data_type) {
+				case DATATYPE_INT16:   ((INT16_T *) dest)[s*nchans+c] = (INT16_T) v; break;
+				case DATATYPE_INT32:   ((INT32_T *) dest)[s*nchans+c] = (INT32_T) (256*v) + 1000000; break;
+			}
+		}
+	}
+	free(walk);
+}
+
+/* encodes and decodes, returns the size of the encoding or 0 on a mismatch */
+static UINT32_T round_trip(UINT32_T data_type, UINT32_T nchans, UINT32_T nsamples, const void *src) {
+	UINT32_T wordsize = wordsize_from_type(data_type);
+	UINT32_T n = nchans*nsamples;
+	char *enc = (char *) malloc(ft_delta_bound(n, wordsize));
+	char *dec = (char *) malloc(n*wordsize + 1);
+	UINT32_T size = ft_delta_encode(data_type, nchans, nsamples, src, enc);
+
+	if (size == 0 || size > ft_delta_bound(n, wordsize) ||
+			ft_delta_decode(data_type, nchans, nsamples, enc, size, dec) != 0 || memcmp(src, dec, n*wordsize) != 0) {
+		size = 0;
+	}
+	/* a truncated encoding must be refused */
+	if (size > 0 && n > 0 && ft_delta_decode(data_type, nchans, nsamples, enc, size - 1, dec) == 0) size = 0;
+	free(enc);
+	free(dec);
+	return size;
+}
+
+static int check_round_trips(void) {
+	UINT32_T types[] = {DATATYPE_INT16, DATATYPE_UINT16, DATATYPE_INT32, DATATYPE_UINT32};
+	UINT32_T shapes[][2] = {{1,1}, {1,127}, {1,128}, {1,129}, {3,1000}, {129,7}, {280,64}, {64,0}};
+	UINT32_T *buf = (UINT32_T *) malloc(280*1000*4);
+	UINT32_T t, k, i, failed = 0;
+
+	for (t=0; t<sizeof(types)/sizeof(types[0]); t++) {
+		for (k=0; k<sizeof(shapes)/sizeof(shapes[0]); k++) {
+			UINT32_T nchans = shapes[k][0], nsamples = shapes[k][1];
+			UINT32_T nwords = (nchans*nsamples*wordsize_from_type(types[t]) + 3) / 4;
+			char what[100];
+
+			/* random bits, which need the full width in every block */
+			for (i=0; i<nwords; i++) buf[i] = random32();
+			sprintf(what, "round trip of random type %u, %u x %u", types[t], nchans, nsamples);
+			failed |= check(round_trip(types[t], nchans, nsamples, buf) > 0 || nchans*nsamples == 0, what);
+
+			/* extremes next to each other */
+			for (i=0; i<nwords; i++) buf[i] = (i % 3) ? 0x80008000u : 0x7FFF7FFFu;
+			sprintf(what, "round trip of extremes type %u, %u x %u", types[t], nchans, nsamples);
+			failed |= check(round_trip(types[t], nchans, nsamples, buf) > 0 || nchans*nsamples == 0, what);
+
+			/* constant, which takes no bits at all after the first sample */
+			for (i=0; i<nwords; i++) buf[i] = 0x12345678u;
+			sprintf(what, "round trip of constant type %u, %u x %u", types[t], nchans, nsamples);
+			failed |= check(round_trip(types[t], nchans, nsamples, buf) > 0 || nchans*nsamples == 0, what);
+		}
+	}
+	/* floats are not encoded at all */
+	for (i=0; i<1000; i++) buf[i] = random32();
+	failed |= check(!ft_delta_supported(DATATYPE_FLOAT32) && ft_delta_encode(DATATYPE_FLOAT32, 1, 1000, buf, buf + 1000) == 0, "FLOAT32 samples were encoded");
+	free(buf);
+	return failed;
+}
+
+/* prints the size and speed for one type, returns 1 if the encoding does not save anything */
+static int measure(UINT32_T data_type, const char *name, int reps) {
+	UINT32_T wordsize = wordsize_from_type(data_type);
+	UINT32_T n = NCHANS*NSAMPLES, size = 0;
+	char *src = (char *) malloc(n*wordsize);
+	char *enc = (char *) malloc(ft_delta_bound(n, wordsize));
+	char *dec = (char *) malloc(n*wordsize);
+	double t0, tenc = 1e9, tdec = 1e9, mb = n*wordsize / (1024.0*1024.0);
+	int k, failed = 0;
+
+	/* the best of a few rounds, as other processes get in the way */
+	eeg_like(data_type, NCHANS, NSAMPLES, src);
+	for (k=0; k<reps; k++) {
+		t0 = now();
+		size = ft_delta_encode(data_type, NCHANS, NSAMPLES, src, enc);
+		if (now() - t0 < tenc) tenc = now() - t0;
+		t0 = now();
+		ft_delta_decode(data_type, NCHANS, NSAMPLES, enc, size, dec);
+		if (now() - t0 < tdec) tdec = now() - t0;
+	}
+
+	failed |= check(memcmp(src, dec, n*wordsize) == 0, "EEG-like samples do not come back");
+	failed |= check(size < n*wordsize, "EEG-like samples do not get smaller");
+	printf("%-8s %6.2f MB -> %6.2f MB (%4.2fx), encode %7.1f MB/s, decode %7.1f MB/s\n",
+			name, mb, size / (1024.0*1024.0), (double) n*wordsize / size, mb / tenc, mb / tdec);
+	free(src);
+	free(enc);
+	free(dec);
+	return failed;
+}
+
+/* sends a request as it is and reads the response into dest, returns the response command */
+static UINT16_T raw_request(int server, UINT16_T command, const void *buf, UINT32_T bufsize, char *dest, UINT32_T *respsize) {
+	messagedef_t def, respdef;
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	if (bufwrite(server, &def, sizeof(def)) != sizeof(def)) return 0;
+	if (bufsize > 0 && bufwrite(server, buf, bufsize) != bufsize) return 0;
+	if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef)) return 0;
+	if (bufread(server, dest, respdef.bufsize) != respdef.bufsize) return 0;
+	*respsize = respdef.bufsize;
+	return respdef.command;
+}
+
+static int check_connection(int port) {
+	UINT32_T nsamples = 2048, rawsize = NCHANS*nsamples*sizeof(INT32_T), respsize = 0, encoding;
+	char *samples = (char *) malloc(sizeof(datadef_t) + rawsize);
+	char *dest = (char *) malloc(sizeof(datadef_t) + rawsize);
+	datadef_t *ddef = (datadef_t *) samples;
+	headerdef_t hdef;
+	datasel_t sel;
+	messagedef_t def;
+	message_t request, *response = NULL;
+	int client, raw, failed = 0;
+
+	client = open_connection("localhost", port);
+	raw = open_connection("localhost", port);
+	if (client < 0 || raw < 0) {
+		fprintf(stderr, "test_compress: could not connect\n");
+		return 1;
+	}
+	failed |= check(ft_request_encoding(client, FT_ENCODING_DELTA) == 0 && ft_connection_encoding(client) == FT_ENCODING_DELTA, "the server did not agree on the encoding");
+
+	/* header and samples go through tcprequest, which encodes PUT_DAT */
+	memset(&hdef, 0, sizeof(hdef));
+	hdef.nchans    = NCHANS;
+	hdef.fsample   = 2048;
+	hdef.data_type = DATATYPE_INT32;
+	def.version = VERSION;
+	def.command = PUT_HDR;
+	def.bufsize = sizeof(hdef);
+	request.def = &def;
+	request.buf = &hdef;
+	failed |= check(clientrequest(client, &request, &response) == 0 && response->def->command == PUT_OK, "PUT_HDR failed");
+	cleanup_message((void **) &response);
+
+	ddef->nchans    = NCHANS;
+	ddef->nsamples  = nsamples;
+	ddef->data_type = DATATYPE_INT32;
+	ddef->bufsize   = rawsize;
+	eeg_like(DATATYPE_INT32, NCHANS, nsamples, ddef+1);
+	def.command = PUT_DAT;
+	def.bufsize = sizeof(datadef_t) + rawsize;
+	request.buf = samples;
+	failed |= check(clientrequest(client, &request, &response) == 0 && response->def->command == PUT_OK, "encoded PUT_DAT failed");
+	cleanup_message((void **) &response);
+	failed |= check(ddef->data_type == DATATYPE_INT32, "the request of the caller was changed");
+
+	/* and come back the same, through tcprequest which decodes GET_DAT */
+	sel.begsample = 0;
+	sel.endsample = nsamples - 1;
+	def.command = GET_DAT;
+	def.bufsize = sizeof(sel);
+	request.buf = &sel;
+	failed |= check(clientrequest(client, &request, &response) == 0 && response->def->command == GET_OK &&
+			response->def->bufsize == sizeof(datadef_t) + rawsize && memcmp(response->buf, samples, sizeof(datadef_t) + rawsize) == 0,
+			"the samples did not come back the same");
+	cleanup_message((void **) &response);
+
+	/* on the wire: plain without asking, smaller after asking */
+	failed |= check(raw_request(raw, GET_DAT, &sel, sizeof(sel), dest, &respsize) == GET_OK && respsize == sizeof(datadef_t) + rawsize, "the samples were encoded without asking");
+	encoding = FT_ENCODING_DELTA;
+	failed |= check(raw_request(raw, SET_ENCODING, &encoding, sizeof(encoding), dest, &respsize) == ENCODING_OK, "SET_ENCODING failed");
+	failed |= check(raw_request(raw, GET_DAT, &sel, sizeof(sel), dest, &respsize) == GET_OK && ft_samples_encoded(dest, respsize), "the samples were not encoded");
+	printf("GET_DAT of %u x %u int32: %u bytes on the wire instead of %u\n", NCHANS, nsamples, respsize, (UINT32_T) (sizeof(datadef_t) + rawsize));
+
+	/* requests that should be refused */
+	encoding = 99;
+	failed |= check(raw_request(raw, SET_ENCODING, &encoding, sizeof(encoding), dest, &respsize) == ENCODING_ERR, "an unknown encoding was accepted");
+	memset((char *) (ddef+1), 0x7F, 64);
+	ddef->data_type = DATATYPE_INT32 | DATATYPE_ENCODED;
+	ddef->bufsize   = 64;
+	failed |= check(raw_request(raw, PUT_DAT, samples, sizeof(datadef_t) + 64, dest, &respsize) == PUT_ERR, "a broken encoding was accepted");
+
+	/* and on a stream of floats, which would not get smaller */
+	hdef.data_type = DATATYPE_FLOAT32;
+	failed |= check(raw_request(raw, PUT_HDR, &hdef, sizeof(hdef), dest, &respsize) == PUT_OK, "PUT_HDR of floats failed");
+	encoding = FT_ENCODING_DELTA;
+	failed |= check(raw_request(raw, SET_ENCODING, &encoding, sizeof(encoding), dest, &respsize) == ENCODING_ERR, "the encoding was accepted for FLOAT32 samples");
+
+	close_connection(client);
+	close_connection(raw);
+	failed |= check(ft_connection_encoding(client) == FT_ENCODING_NONE, "the encoding outlived the connection");
+	free(samples);
+	free(dest);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	int reps = (argc>2) ? atoi(argv[2]) : 20;
+	ft_buffer_server_t *server;
+	int failed = 0;
+
+	failed |= check_round_trips();
+	failed |= measure(DATATYPE_INT16, "int16", reps);
+	failed |= measure(DATATYPE_INT32, "int32", reps);
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_compress: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	failed |= check_connection(port);
+	ft_stop_buffer_server(server);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
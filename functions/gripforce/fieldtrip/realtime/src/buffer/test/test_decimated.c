@@ -0,0 +1,190 @@
+/*
+ * Writes a few minutes of 32 channels into a ring of 60000 samples, and reads
+ * overviews of it with GET_DAT_DECIMATED over a local TCP connection (see
+ * pyramid.h). The bins of each level are checked against the minima, maxima
+ * and means of the samples that were written, and the time and size of an
+ * overview of the whole ring are compared with those of reading all samples.
+ *
+ * Use as
+ *    ./test_decimated [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_decimated"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "testutil.h"
+
+#define NCHANS    32
+#define NSAMPLES  200000
+#define CAPACITY  60000
+#define BLOCKSIZE 1000
+
+/* a sawtooth with a different period and sign on every channel */
+static double value(UINT32_T s, UINT32_T c) {
+	INT16_T v = (INT16_T) (s % (100 + 7*c));
+	return (c % 2) ? v : -v;
+}
+
+/* puts samples 0 ... nsamples-1 of the sawtooth into the buffer in this process */
+static void put_sawtooth(UINT32_T nsamples) {
+	if (!put_samples(-1, NCHANS, DATATYPE_INT16, 0, nsamples, BLOCKSIZE, value)) {
+		fprintf(stderr, "test_decimated: PUT_DAT failed\n");
+		exit(1);
+	}
+}
+
+static int get_decimated(int server, UINT32_T begsample, UINT32_T endsample, UINT32_T width, char *dest) {
+	decimatedsel_t sel;
+	sel.begsample = begsample;
+	sel.endsample = endsample;
+	sel.width     = width;
+	return get_request(server, GET_DAT_DECIMATED, &sel, sizeof(sel), dest);
+}
+
+/* checks every bin of a response against the samples that were written,
+ * given the number of samples in the ring at the time of the request */
+static int check_bins(const char *dest, UINT32_T begsample, UINT32_T endsample, UINT32_T count, UINT32_T factor) {
+	const decimateddef_t *ddef = (const decimateddef_t *) dest;
+	const FLOAT32_T *bin = (const FLOAT32_T *) (ddef+1);
+	UINT32_T b, c, s, end;
+
+	if (ddef->nchans != NCHANS || ddef->factor != factor || ddef->data_type != DATATYPE_FLOAT32) return 0;
+	if (ddef->bufsize != ddef->nbins*3*NCHANS*sizeof(FLOAT32_T) || ddef->nbins == 0) return 0;
+	/* aligned, overlapping with the selection, and complete */
+	if (ddef->begsample % factor != 0 || ddef->begsample > begsample) return 0;
+	if (ddef->begsample + factor <= begsample && factor > 1) return 0;
+	end = (endsample/factor + 1) * factor;
+	if (end > count - count%factor) end = count - count%factor;
+	if (ddef->begsample + ddef->nbins*factor != end) return 0;
+
+	for (b=0; b<ddef->nbins; b++, bin += 3*NCHANS) {
+		for (c=0; c<NCHANS; c++) {
+			double mn = 1e9, mx = -1e9, sum = 0;
+			for (s=ddef->begsample + b*factor; s<ddef->begsample + (b+1)*factor; s++) {
+				double v = value(s, c);
+				if (v < mn) mn = v;
+				if (v > mx) mx = v;
+				sum += v;
+			}
+			if (bin[c] != (FLOAT32_T) mn || bin[NCHANS+c] != (FLOAT32_T) mx || bin[2*NCHANS+c] != (FLOAT32_T) (sum/factor)) {
+				fprintf(stderr, "test_decimated: bin %u of factor %u, channel %u: %g %g %g instead of %g %g %g\n",
+						b, factor, c, bin[c], bin[NCHANS+c], bin[2*NCHANS+c], mn, mx, sum/factor);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+/* a swapped response should come out the same as the native one */
+static int check_swap(void) {
+	UINT32_T native[6+6], swapped[6+6], i;
+	decimateddef_t *ddef = (decimateddef_t *) swapped;
+	FLOAT32_T *bins = (FLOAT32_T *) (ddef+1);
+	messagedef_t def;
+	message_t msg;
+
+	ddef->nchans    = 2;
+	ddef->nbins     = 1;
+	ddef->factor    = 8;
+	ddef->begsample = 1024;
+	ddef->data_type = DATATYPE_FLOAT32;
+	ddef->bufsize   = 6*sizeof(FLOAT32_T);
+	for (i=0; i<6; i++) bins[i] = 0.5f + i;
+	memcpy(native, swapped, sizeof(native));
+
+	def.command = GET_OK;
+	def.bufsize = sizeof(swapped);
+	msg.def = &def;
+	msg.buf = swapped;
+	if (ft_swap_from_native(GET_DAT_DECIMATED, &msg) != 0) return 0;
+	ft_swap32(6+6, swapped);
+	for (i=0; i<6+6; i++) {
+		if (swapped[i] != native[i]) return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	int reps = repetitions(argc, argv, 2, 10);
+	UINT32_T first = NSAMPLES - CAPACITY, last = NSAMPLES - 1;
+	ft_buffer_server_t *server;
+	const decimateddef_t *ddef;
+	datasel_t datsel;
+	char *dest;
+	int client, k, size = -1, failed = 0;
+	double t0, full, decimated;
+
+	if (check(put_header(-1, NCHANS, DATATYPE_INT16, CAPACITY, 0), "PUT_HDR failed")) return 1;
+	put_sawtooth(NSAMPLES);
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_decimated: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	if (client < 0) {
+		fprintf(stderr, "test_decimated: could not connect\n");
+		return 1;
+	}
+	dest = (char *) malloc(sizeof(datadef_t) + CAPACITY*NCHANS*sizeof(INT16_T) + 4096*3*NCHANS*sizeof(FLOAT32_T));
+	ddef = (const decimateddef_t *) dest;
+
+	/* all samples in the ring, and an overview of them for a plot that is 100 points wide */
+	datsel.begsample = first;
+	datsel.endsample = last;
+	t0 = now();
+	for (k=0; k<reps; k++) size = get_request(client, GET_DAT, &datsel, sizeof(datsel), dest);
+	full = (now() - t0) / reps;
+	failed |= check(size == sizeof(datadef_t) + CAPACITY*NCHANS*sizeof(INT16_T), "wrong size of the samples");
+	printf("all samples:  %9i bytes, %7.3f ms/read\n", size, 1e3*full);
+
+	t0 = now();
+	for (k=0; k<reps; k++) size = get_decimated(client, first, (UINT32_T) -1, 100, dest);
+	decimated = (now() - t0) / reps;
+	failed |= check(size > 0 && check_bins(dest, first, last, NSAMPLES, 512), "wrong bins for the whole ring");
+	printf("overview:     %9i bytes, %7.3f ms/read, %u bins of %u samples\n", size, 1e3*decimated, ddef->nbins, ddef->factor);
+
+	/* the finer levels, from selections that do not start on a bin */
+	size = get_decimated(client, NSAMPLES - 8003, last, 1000, dest);
+	failed |= check(size > 0 && check_bins(dest, NSAMPLES - 8003, last, NSAMPLES, 8), "wrong bins of 8 samples");
+	size = get_decimated(client, NSAMPLES - 20001, NSAMPLES - 1001, 250, dest);
+	failed |= check(size > 0 && check_bins(dest, NSAMPLES - 20001, NSAMPLES - 1001, NSAMPLES, 64), "wrong bins of 64 samples");
+
+	/* too short for the pyramid: the samples themselves */
+	size = get_decimated(client, last - 99, last, 200, dest);
+	failed |= check(size > 0 && ddef->nbins == 100 && check_bins(dest, last - 99, last, NSAMPLES, 1), "wrong samples for a short selection");
+
+	/* samples that have left the ring are not sent */
+	size = get_decimated(client, 0, 1000, 100, dest);
+	failed |= check(size > 0 && ddef->nbins == 0, "samples that are no longer there were sent");
+
+	/* requests that should be refused */
+	failed |= check(get_decimated(client, 0, NSAMPLES, 100, dest) < 0, "a selection past the end was accepted");
+	failed |= check(get_decimated(client, 200, 100, 100, dest) < 0, "an empty selection was accepted");
+
+	/* after FLUSH_DAT, the pyramid starts over with the new samples */
+	failed |= check(request(-1, FLUSH_DAT, NULL, 0) == FLUSH_OK, "FLUSH_DAT failed");
+	put_sawtooth(5000);
+	size = get_decimated(client, 0, (UINT32_T) -1, 10, dest);
+	failed |= check(size > 0 && check_bins(dest, 0, 4999, 5000, 64), "wrong bins after FLUSH_DAT");
+
+	failed |= check(check_swap(), "the response is not swapped correctly");
+
+	close_connection(client);
+	ft_stop_buffer_server(server);
+	free(dest);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
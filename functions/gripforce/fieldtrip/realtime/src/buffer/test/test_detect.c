@@ -0,0 +1,205 @@
+/*
+ * Adds detectors (see detect.h) to a buffer with a force channel that steps
+ * from 0 to 10 at sample 500, while a writer thread puts it in blocks of 16
+ * samples every millisecond. A client that waits with WAIT_DAT over a local
+ * TCP connection should be woken up by the events of the mean and derivative
+ * detectors within the block of the crossing, and the events should have the
+ * right sample, type and value. A square wave on the other channel checks
+ * the holdoff between events in both directions. Finally, the time the
+ * writer spends on the detectors is compared with a PUT_DAT without them.
+ *
+ * Use as
+ *    ./test_detect [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_detect"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "testutil.h"
+
+#define NCHANS    2
+#define BLOCKSIZE 16
+#define STEP      500     /* sample at which the force steps up */
+#define NSAMPLES  2048
+#define HOLDOFF   100
+
+/* channel 0 is a square wave of period 10, channel 1 the force */
+static double value(UINT32_T s, UINT32_T c) {
+	if (c == 0) return (s % 10 < 5) ? 1.0 : -1.0;
+	return (s >= STEP) ? 10.0 : 0.0;
+}
+
+/* puts samples first ... first+nsamples-1 into the buffer in this process */
+static int put_force(UINT32_T first, UINT32_T nsamples) {
+	return put_samples(-1, NCHANS, DATATYPE_FLOAT32, first, nsamples, nsamples, value);
+}
+
+/* adds a detector, returns its number or -1 */
+static int add_detector(int server, UINT32_T channel, UINT32_T operation, UINT32_T window, double threshold, UINT32_T edge, UINT32_T holdoff, const char *type) {
+	char buf[sizeof(detectordef_t) + 64];
+	detectordef_t *def = (detectordef_t *) buf;
+	message_t *response;
+	int num = -1;
+
+	def->threshold = threshold;
+	def->channel   = channel;
+	def->operation = operation;
+	def->window    = window;
+	def->edge      = edge;
+	def->holdoff   = holdoff;
+	def->bufsize   = (type != NULL) ? strlen(type) : 0;
+	if (def->bufsize > 0) memcpy(def+1, type, def->bufsize);
+	response = send_request(server, ADD_DETECTOR, buf, sizeof(detectordef_t) + def->bufsize);
+	if (response != NULL && response->def->command == DETECTOR_OK && response->def->bufsize == sizeof(UINT32_T)) num = (int) *(UINT32_T *) response->buf;
+	release(&response);
+	return num;
+}
+
+static void *writer(void *arg) {
+	UINT32_T s;
+	for (s=0; s<NSAMPLES; s+=BLOCKSIZE) {
+		if (!put_force(s, BLOCKSIZE)) *(int *) arg = 1;
+		usleep(1000);
+	}
+	return NULL;
+}
+
+/* the sample, type and value of event "num" */
+static int get_event(int server, UINT32_T num, INT32_T *sample, char *type, double *val) {
+	eventsel_t sel;
+	message_t *response;
+	const eventdef_t *def;
+	int ok;
+
+	sel.begevent = sel.endevent = num;
+	response = send_request(server, GET_EVT, &sel, sizeof(sel));
+	ok = response != NULL && response->def->command == GET_OK;
+	if (ok) {
+		def = (const eventdef_t *) response->buf;
+		ok = def->type_type == DATATYPE_CHAR && def->type_numel < 32 && def->value_type == DATATYPE_FLOAT64 && def->value_numel == 1;
+		if (ok) {
+			*sample = def->sample;
+			memcpy(type, def+1, def->type_numel);
+			type[def->type_numel] = 0;
+			memcpy(val, (const char *) (def+1) + def->type_numel, sizeof(double));
+		}
+	}
+	release(&response);
+	return ok;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1976;
+	int reps = (argc>2) ? atoi(argv[2]) : 200;
+	ft_buffer_server_t *server;
+	message_t *response;
+	waitdef_t wd;
+	samples_events_t woken = {0, 0};
+	pthread_t thread;
+	int client, failed = 0, writeFailed = 0, k, squeeze = 0, slope = 0, square = 0;
+	UINT32_T nevents, i;
+	INT32_T last = NSAMPLES - HOLDOFF;
+	double t0, plain, detecting;
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_detect: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	if (client < 0) {
+		fprintf(stderr, "test_detect: could not connect\n");
+		return 1;
+	}
+
+	if (check(put_header(-1, NCHANS, DATATYPE_FLOAT32, 0, 0), "PUT_HDR failed")) return 1;
+	failed |= check(add_detector(client, 1, FT_DETECT_MEAN, 20, 5.0, FT_DETECT_RISING, 0, "squeeze") == 0, "adding the mean detector failed");
+	failed |= check(add_detector(client, 1, FT_DETECT_DERIVATIVE, 20, 100.0, FT_DETECT_RISING, 0, NULL) == 1, "adding the derivative detector failed");
+	failed |= check(add_detector(client, NCHANS, FT_DETECT_MEAN, 20, 5.0, FT_DETECT_RISING, 0, NULL) < 0, "a detector for a channel that does not exist was added");
+	failed |= check(add_detector(client, 0, 17, 20, 5.0, FT_DETECT_RISING, 0, NULL) < 0, "a detector with an unknown operation was added");
+
+	/* the client waits for the squeeze without looking at any sample */
+	pthread_create(&thread, NULL, writer, &writeFailed);
+	wd.threshold.nsamples = 0xFFFFFFFEu;
+	wd.threshold.nevents  = 0;
+	wd.milliseconds = 5000;
+	response = send_request(client, WAIT_DAT, &wd, sizeof(wd));
+	failed |= check(response != NULL && response->def->command == WAIT_OK, "WAIT_DAT failed");
+	if (response != NULL && response->def->command == WAIT_OK) memcpy(&woken, response->buf, sizeof(woken));
+	release(&response);
+	pthread_join(thread, NULL);
+	failed |= check(writeFailed == 0, "the writer failed");
+	/* the block with the crossing ends at sample 511 */
+	failed |= check(woken.nevents > 0 && woken.nsamples <= (STEP/BLOCKSIZE + 2)*BLOCKSIZE, "WAIT_DAT did not return within a block of the crossing");
+	printf("WAIT_DAT returned at %u samples, the crossing was at sample %i\n", woken.nsamples, STEP);
+
+	/* both directions of a square wave, with a holdoff */
+	failed |= check(add_detector(client, 0, FT_DETECT_MEAN, 2, 0.0, FT_DETECT_RISING | FT_DETECT_FALLING, HOLDOFF, "square") == 2, "adding the square wave detector failed");
+	for (i=NSAMPLES; i<2*NSAMPLES; i+=BLOCKSIZE) failed |= check(put_force(i, BLOCKSIZE), "PUT_DAT failed");
+
+	/* look at all events */
+	response = send_request(client, GET_HDR, NULL, 0);
+	nevents = (response != NULL && response->def->command == GET_OK) ? ((headerdef_t *) response->buf)->nevents : 0;
+	release(&response);
+	for (i=0; i<nevents; i++) {
+		INT32_T sample;
+		char type[32];
+		double val;
+		if (!get_event(client, i, &sample, type, &val)) {
+			failed |= check(0, "GET_EVT failed");
+			break;
+		}
+		if (strcmp(type, "squeeze") == 0) {
+			squeeze++;
+			/* samples STEP ... STEP+10 make the mean 5.5 */
+			failed |= check(sample == STEP + 10 && val == 5.5, "the squeeze is not at the right sample");
+		}
+		else if (strcmp(type, "detector") == 0) {
+			slope++;
+			failed |= check(sample == STEP && val == 500.0, "the slope is not at the right sample");
+		}
+		else if (strcmp(type, "square") == 0) {
+			square++;
+			failed |= check(sample >= NSAMPLES && sample - last >= HOLDOFF, "two events within the holdoff");
+			last = sample;
+		}
+	}
+	failed |= check(squeeze == 1 && slope == 1, "not exactly one squeeze and one slope");
+	failed |= check(square >= NSAMPLES/HOLDOFF - 1 && square <= NSAMPLES/HOLDOFF + 1, "the square wave did not give one event per holdoff");
+	printf("%u events: %i squeeze, %i slope, %i square\n", nevents, squeeze, slope, square);
+
+	/* after CLEAR_DETECTORS, nothing is detected anymore */
+	failed |= check(request(client, CLEAR_DETECTORS, NULL, 0) == DETECTOR_OK, "CLEAR_DETECTORS failed");
+	failed |= check(request(-1, FLUSH_DAT, NULL, 0) == FLUSH_OK, "FLUSH_DAT failed");
+	failed |= check(put_force(0, 1024), "PUT_DAT failed");
+	response = send_request(client, GET_HDR, NULL, 0);
+	failed |= check(response != NULL && ((headerdef_t *) response->buf)->nevents == nevents, "an event came after CLEAR_DETECTORS");
+	release(&response);
+
+	/* the cost for the writer */
+	t0 = now();
+	for (k=0; k<reps; k++) put_force(0, 1024);
+	plain = now() - t0;
+	for (k=0; k<4; k++) add_detector(-1, k%NCHANS, 1 + k%3, 20, 1e9, FT_DETECT_RISING, 0, NULL);
+	t0 = now();
+	for (k=0; k<reps; k++) put_force(0, 1024);
+	detecting = now() - t0;
+	printf("PUT_DAT of 1024 samples: %.1f us, %.1f us with 4 detectors (%.1f ns per sample and detector)\n",
+	       1e6*plain/reps, 1e6*detecting/reps, 1e9*(detecting - plain)/reps/1024/4);
+
+	close_connection(client);
+	ft_stop_buffer_server(server);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
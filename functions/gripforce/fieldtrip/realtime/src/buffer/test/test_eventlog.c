@@ -0,0 +1,131 @@
+/*
+ * Stores a large number of trigger events in the event log and reads them
+ * back in blocks, and compares the time this takes with the previous scheme
+ * of a fixed array of events with two mallocs per event.
+ *
+ * Use as
+ *    ./test_eventlog [numevents] [maxevents] [blocksize]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+#include "eventlog.h"
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+/* fills in a "Trigger" event with an INT32 value, returns the size of the buffer */
+static UINT32_T make_event(eventdef_t *def, char *buf, UINT32_T num) {
+	INT32_T value = (INT32_T) num;
+	def->type_type   = DATATYPE_CHAR;
+	def->type_numel  = 7;
+	def->value_type  = DATATYPE_INT32;
+	def->value_numel = 1;
+	def->sample      = 10*num;
+	def->offset      = 0;
+	def->duration    = 0;
+	def->bufsize     = 7 + sizeof(INT32_T);
+	memcpy(buf, "Trigger", 7);
+	memcpy(buf+7, &value, sizeof(INT32_T));
+	return def->bufsize;
+}
+
+/* checks that "buf" holds events begevent ... begevent+nevents-1 back to back */
+static int check_events(const char *buf, UINT32_T begevent, UINT32_T nevents) {
+	UINT32_T i, offset = 0;
+	for (i=0; i<nevents; i++) {
+		eventdef_t def;
+		INT32_T value;
+		memcpy(&def, buf+offset, sizeof(eventdef_t));
+		offset += sizeof(eventdef_t);
+		memcpy(&value, buf+offset+7, sizeof(INT32_T));
+		offset += def.bufsize;
+		if (def.sample != 10*(begevent+i) || value != (INT32_T) (begevent+i) || memcmp(buf+offset-def.bufsize, "Trigger", 7)) {
+			fprintf(stderr, "test_eventlog: event %u is not correct\n", begevent+i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	UINT32_T numevents = (argc>1) ? atoi(argv[1]) : 2000000;
+	UINT32_T maxevents = (argc>2) ? atoi(argv[2]) : 1000000;
+	UINT32_T blocksize = (argc>3) ? atoi(argv[3]) : 1000;
+	ft_eventlog_t L;
+	event_t *old;
+	eventdef_t def;
+	char buf[64], *dest;
+	UINT32_T i, j, first;
+	double t0, tlog, told, tread;
+
+	printf("numevents = %u, maxevents = %u, blocksize = %u\n", numevents, maxevents, blocksize);
+
+	if (ft_eventlog_init(&L, maxevents, 0) != 0) {
+		fprintf(stderr, "test_eventlog: out of memory\n");
+		return 1;
+	}
+
+	/* append everything to the log */
+	t0 = now();
+	for (i=0; i<numevents; i++) {
+		make_event(&def, buf, i);
+		if (ft_eventlog_append(&L, &def, buf) != 0) {
+			fprintf(stderr, "test_eventlog: cannot append event %u\n", i);
+			return 1;
+		}
+	}
+	tlog = now() - t0;
+
+	first = (numevents > maxevents) ? numevents - maxevents : 0;
+	if (L.count != numevents || L.first != first) {
+		fprintf(stderr, "test_eventlog: expected events %u ... %u, got %u ... %u\n", first, numevents-1, L.first, L.count-1);
+		return 1;
+	}
+
+	/* read back all remaining events in blocks, including the ones that wrap */
+	dest = (char *) malloc((size_t) blocksize * (sizeof(eventdef_t) + 16));
+	DIE_BAD_MALLOC(dest);
+	t0 = now();
+	for (i=first; i<numevents; i+=blocksize) {
+		UINT32_T n = (numevents - i < blocksize) ? numevents - i : blocksize;
+		ft_eventlog_read(&L, i, n, dest);
+		if (check_events(dest, i, n) != 0) return 1;
+	}
+	tread = now() - t0;
+	free(dest);
+	ft_eventlog_free(&L);
+
+	/* the same with the previous fixed array of separately allocated events */
+	old = (event_t *) calloc(maxevents, sizeof(event_t));
+	DIE_BAD_MALLOC(old);
+	t0 = now();
+	for (i=0; i<numevents; i++) {
+		j = i % maxevents;
+		FREE(old[j].def);
+		FREE(old[j].buf);
+		old[j].def = (eventdef_t *) malloc(sizeof(eventdef_t));
+		old[j].buf = malloc(make_event(old[j].def, buf, i));
+		memcpy(old[j].buf, buf, old[j].def->bufsize);
+	}
+	told = now() - t0;
+	for (j=0; j<maxevents; j++) {
+		FREE(old[j].def);
+		FREE(old[j].buf);
+	}
+	free(old);
+
+	printf("event log:   %8.1f ns per event append, %8.1f ns per event read\n", 1e9*tlog/numevents, 1e9*tread/(numevents-first));
+	printf("malloc/free: %8.1f ns per event append\n", 1e9*told/numevents);
+	printf("all events read back correctly\n");
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * Fills the (in-process) buffer with a large number of events of a few
+ * different types, and compares GET_EVT_QUERY against fetching all events
+ * with GET_EVT and filtering them locally, both for speed and for the result.
+ * The second half of the events is a backfill of samples in between those of
+ * the first half, which the sample index has to take in without slowing down.
+ *
+ * Use as
+ *    ./test_evtquery [numevents] [numqueries]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+
+static const char *types[] = {"Trigger", "Response", "Stimulus", "Marker"};
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+static message_t *request(UINT16_T command, void *buf, UINT32_T bufsize) {
+	messagedef_t def;
+	message_t msg, *resp = NULL;
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	msg.def = &def;
+	msg.buf = buf;
+	if (dmarequest(&msg, &resp) != 0 || resp == NULL) {
+		fprintf(stderr, "test_evtquery: dmarequest failed\n");
+		exit(1);
+	}
+	return resp;
+}
+
+static void free_response(message_t *resp) {
+	FREE(resp->buf);
+	FREE(resp->def);
+	FREE(resp);
+}
+
+/* appends a criterion with a string or INT32 argument to the query in buf */
+static UINT32_T add_criterion(char *buf, UINT32_T size, UINT32_T what, const char *str, INT32_T sample) {
+	eventquerydef_t qd;
+	qd.what = what;
+	if (str) {
+		UINT32_T datatype = DATATYPE_CHAR;
+		qd.bufsize = sizeof(UINT32_T) + strlen(str);
+		memcpy(buf + size, &qd, sizeof(qd));
+		memcpy(buf + size + sizeof(qd), &datatype, sizeof(UINT32_T));
+		memcpy(buf + size + sizeof(qd) + sizeof(UINT32_T), str, strlen(str));
+	} else {
+		qd.bufsize = sizeof(INT32_T);
+		memcpy(buf + size, &qd, sizeof(qd));
+		memcpy(buf + size + sizeof(qd), &sample, sizeof(INT32_T));
+	}
+	return size + sizeof(qd) + qd.bufsize;
+}
+
+/* number of events in buf with the given type and minsample <= sample <= maxsample */
+static UINT32_T filter_events(const char *buf, UINT32_T size, const char *type, INT32_T minsample, INT32_T maxsample) {
+	UINT32_T offset = 0, n = 0;
+	while (offset < size) {
+		const eventdef_t *ed = (const eventdef_t *) (buf + offset);
+		const char *evtype = buf + offset + sizeof(eventdef_t);
+		if (ed->sample >= minsample && ed->sample <= maxsample && ed->type_numel == strlen(type) && memcmp(evtype, type, ed->type_numel) == 0) n++;
+		offset += sizeof(eventdef_t) + ed->bufsize;
+	}
+	return n;
+}
+
+int main(int argc, char *argv[]) {
+	UINT32_T numevents  = (argc>1) ? atoi(argv[1]) : 1000000;
+	UINT32_T numqueries = (argc>2) ? atoi(argv[2]) : 100;
+	capacitydef_t capacity = {0, 0, 0, 0};
+	headerdef_t hdr;
+	message_t *resp;
+	char *evbuf, query[256];
+	UINT32_T i, block = 1000, total = 0;
+	double t0, tput, tquery = 0, tfull = 0;
+	unsigned long bytesQuery = 0, bytesFull = 0;
+
+	capacity.nevents = numevents;
+	ft_set_default_capacity(&capacity);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.nchans    = 1;
+	hdr.fsample   = 1000;
+	hdr.data_type = DATATYPE_FLOAT32;
+	resp = request(PUT_HDR, &hdr, sizeof(hdr));
+	free_response(resp);
+
+	/* put the events in blocks, each event has a type from the list and an INT32 value */
+	evbuf = (char *) malloc(block * (sizeof(eventdef_t) + 16));
+	DIE_BAD_MALLOC(evbuf);
+	t0 = now();
+	while (total < numevents) {
+		UINT32_T size = 0;
+		for (i=0; i<block && total<numevents; i++, total++) {
+			eventdef_t ed;
+			const char *type = types[total % 4];
+			INT32_T value = (INT32_T) total;
+			memset(&ed, 0, sizeof(ed));
+			ed.type_type   = DATATYPE_CHAR;
+			ed.type_numel  = strlen(type);
+			ed.value_type  = DATATYPE_INT32;
+			ed.value_numel = 1;
+			ed.sample      = (total < numevents/2) ? 20*total : 20*(total - numevents/2) + 10;
+			ed.bufsize     = ed.type_numel + sizeof(INT32_T);
+			memcpy(evbuf + size, &ed, sizeof(ed));
+			memcpy(evbuf + size + sizeof(ed), type, ed.type_numel);
+			memcpy(evbuf + size + sizeof(ed) + ed.type_numel, &value, sizeof(INT32_T));
+			size += sizeof(ed) + ed.bufsize;
+		}
+		resp = request(PUT_EVT, evbuf, size);
+		if (resp->def->command != PUT_OK) {
+			fprintf(stderr, "test_evtquery: PUT_EVT failed\n");
+			return 1;
+		}
+		free_response(resp);
+	}
+	tput = now() - t0;
+	free(evbuf);
+
+	srand(1);
+	for (i=0; i<numqueries; i++) {
+		INT32_T minsample = 10 * (rand() % numevents);
+		INT32_T maxsample = minsample + 10 * (rand() % 2000);
+		const char *type = types[rand() % 4];
+		UINT32_T size, nquery, nfull;
+
+		size = add_criterion(query, 0, EVENTSEL_TYPE, type, 0);
+		size = add_criterion(query, size, EVENTSEL_MINSAMPLE, NULL, minsample);
+		size = add_criterion(query, size, EVENTSEL_MAXSAMPLE, NULL, maxsample);
+
+		t0 = now();
+		resp = request(GET_EVT_QUERY, query, size);
+		tquery += now() - t0;
+		if (resp->def->command != GET_OK) {
+			fprintf(stderr, "test_evtquery: GET_EVT_QUERY failed\n");
+			return 1;
+		}
+		nquery = check_event_array(resp->def->bufsize, resp->buf);
+		bytesQuery += resp->def->bufsize;
+		if (filter_events(resp->buf, resp->def->bufsize, type, minsample, maxsample) != nquery) {
+			fprintf(stderr, "test_evtquery: query returned events that do not match\n");
+			return 1;
+		}
+		free_response(resp);
+
+		t0 = now();
+		resp = request(GET_EVT, NULL, 0);
+		nfull = filter_events(resp->buf, resp->def->bufsize, type, minsample, maxsample);
+		tfull += now() - t0;
+		bytesFull += resp->def->bufsize;
+		free_response(resp);
+
+		if (nfull != nquery) {
+			fprintf(stderr, "test_evtquery: query returned %u events, expected %u\n", nquery, nfull);
+			return 1;
+		}
+	}
+
+	printf("%u events, half of them backfilled, PUT_EVT %.3f us per event\n", numevents, 1e6*tput/numevents);
+	printf("%u queries for one type in a random sample range\n", numqueries);
+	printf("GET_EVT_QUERY:        %10.3f ms per query, %12.0f bytes per response\n", 1e3*tquery/numqueries, (double) bytesQuery/numqueries);
+	printf("GET_EVT + filtering:  %10.3f ms per query, %12.0f bytes per response\n", 1e3*tfull/numqueries, (double) bytesFull/numqueries);
+	printf("all queries returned the correct events\n");
+	return 0;
+}
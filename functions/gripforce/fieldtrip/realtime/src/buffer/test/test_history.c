@@ -0,0 +1,138 @@
+/*
+ * Writes many times the capacity of a small ring into a buffer that keeps
+ * the history of its samples on disk (see history.h), while a second thread
+ * keeps reading ranges that have just left the ring. Afterwards, it checks
+ * old ranges, ranges that start on disk and end in the ring, and FLUSH_DAT,
+ * and compares the time of reading old samples from the disk with reading
+ * them from the page cache.
+ *
+ * Use as
+ *    ./test_history [directory] [number of samples]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#define TEST_NAME "test_history"
+
+#include "buffer.h"
+#include "stream.h"
+#include "history.h"
+#include "testutil.h"
+
+#define NCHANS    64
+#define CAPACITY  10000
+#define BLOCKSIZE 100
+#define CACHESIZE (8*1024*1024)
+
+static volatile int writing = 1;
+static volatile UINT32_T written = 0;
+
+/* writes samples first ... first+nsamples-1 block by block, so that the reader can follow */
+static int put_data(UINT32_T first, UINT32_T nsamples) {
+	UINT32_T i;
+	int ok = 1;
+
+	for (i=0; i<nsamples && ok; i+=BLOCKSIZE) {
+		ok = put_samples(-1, NCHANS, DATATYPE_FLOAT32, first + i, BLOCKSIZE, BLOCKSIZE, NULL);
+		written = first + i + BLOCKSIZE;
+	}
+	return ok;
+}
+
+/* reads samples beg ... end and checks that they were written by put_data(first, ...) */
+static int get_data(UINT32_T beg, UINT32_T end, UINT32_T first) {
+	datasel_t sel;
+	message_t *resp;
+	UINT32_T i;
+	int ok;
+
+	sel.begsample = beg;
+	sel.endsample = end;
+	resp = send_request(-1, GET_DAT, &sel, sizeof(sel));
+	ok = (resp != NULL && resp->def->command == GET_OK);
+	if (ok) {
+		const float *samples = (const float *) ((const datadef_t *) resp->buf + 1);
+		ok = (((const datadef_t *) resp->buf)->nsamples == end-beg+1);
+		for (i=0; ok && i<(end-beg+1)*NCHANS; i+=NCHANS/4) ok = (samples[i] == (float) (first + beg + i/NCHANS));
+	}
+	release(&resp);
+	return ok;
+}
+
+/* keeps reading the samples that are just about to leave the ring, or just did */
+static void *reader(void *arg) {
+	int *failed = (int *) arg;
+	UINT32_T n = 0;
+
+	while (writing) {
+		UINT32_T end = written;
+		if (end > CAPACITY + 500) {
+			UINT32_T beg = end - CAPACITY - 500;
+			if (!get_data(beg, beg + 999, 0)) *failed = 1;
+			n++;
+		}
+	}
+	printf("%u reads across the end of the ring while writing\n", n);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dir = (argc>1) ? argv[1] : "/tmp/test_history";
+	UINT32_T total = (argc>2) ? atoi(argv[2]) : 200000;
+	char path[1024];
+	struct stat st;
+	UINT64_T hits, misses;
+	pthread_t thread;
+	int failed = 0, rfailed = 0, k;
+	double t0, cold, warm;
+
+	total -= total % BLOCKSIZE;
+	if (ft_history_enable(dir, CACHESIZE) != 0) return 1;
+	if (check(put_header(-1, NCHANS, DATATYPE_FLOAT32, CAPACITY, 0), "PUT_HDR failed")) return 1;
+
+	t0 = now();
+	pthread_create(&thread, NULL, reader, &rfailed);
+	failed |= check(put_data(0, total), "PUT_DAT failed");
+	writing = 0;
+	pthread_join(thread, NULL);
+	printf("wrote %u samples (%u MB) through a ring of %u samples in %.2f s\n", total, (UINT32_T) (total*NCHANS*sizeof(float) >> 20), CAPACITY, now() - t0);
+	failed |= check(!rfailed, "wrong samples while writing");
+
+	snprintf(path, sizeof(path), "%s/buffer/samples", dir);
+	failed |= check(stat(path, &st) == 0 && st.st_size >= (off_t) (total - CAPACITY) * NCHANS * sizeof(float), "the samples are not on disk");
+
+	/* old samples, and ranges from the disk into the ring */
+	failed |= check(get_data(0, 99, 0), "wrong samples at the start");
+	failed |= check(get_data(total/2, total/2 + 2*CAPACITY, 0), "wrong samples in the middle");
+	failed |= check(get_data(total - CAPACITY - 1000, total - 1, 0), "wrong samples across the end of the ring");
+	failed |= check(get_data(total - 100, total - 1, 0), "wrong samples in the ring");
+
+	/* the same old range, first from the disk (well, the OS cache) and then from the page cache */
+	t0 = now();
+	failed |= check(get_data(total/4, total/4 + 999, 0), "wrong samples from the disk");
+	cold = now() - t0;
+	t0 = now();
+	for (k=0; k<100; k++) failed |= check(get_data(total/4, total/4 + 999, 0), "wrong samples from the cache");
+	warm = (now() - t0) / 100;
+	ft_history_cache_stats(ft_default_stream(), &hits, &misses);
+	printf("reading 1000 old samples: %.3f ms uncached, %.3f ms cached (%lu hits, %lu misses)\n", 1e3*cold, 1e3*warm, (unsigned long) hits, (unsigned long) misses);
+
+	/* after FLUSH_DAT, the history starts from scratch */
+	failed |= check(request(-1, FLUSH_DAT, NULL, 0) == FLUSH_OK, "FLUSH_DAT failed");
+	failed |= check(put_data(1000000, 3*CAPACITY), "PUT_DAT after FLUSH_DAT failed");
+	failed |= check(get_data(0, 99, 1000000) && get_data(3*CAPACITY - 100, 3*CAPACITY - 1, 1000000), "wrong samples after FLUSH_DAT");
+
+	/* FLUSH_HDR removes the history */
+	failed |= check(request(-1, FLUSH_HDR, NULL, 0) == FLUSH_OK, "FLUSH_HDR failed");
+	failed |= check(stat(path, &st) != 0, "FLUSH_HDR did not remove the history");
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
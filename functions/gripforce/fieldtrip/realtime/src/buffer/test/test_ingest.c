@@ -0,0 +1,296 @@
+/*
+ * Measures the throughput of PUT_DAT requests with many channels over a local
+ * TCP connection, with the samples either read into a temporary buffer that
+ * dmarequest copies into the ring (the old way), or received straight into
+ * the ring (see zerocopy.h). The server runs in the same process. Afterwards,
+ * the samples in the ring are checked, and a few malformed requests are sent
+ * to make sure that they are still rejected. Finally, a client that goes away
+ * in the middle of a PUT_DAT must not publish anything, and one that stalls
+ * must not keep the other writers waiting. All of this is done with a
+ * thread per client and with the epoll reactor.
+ *
+ * Use as
+ *    ./test_ingest [port] [seconds]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "zerocopy.h"
+
+#define NCHANS    1024
+#define CAPACITY  10007   /* not a multiple of any block size, so blocks wrap around */
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+static double cputime(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec + ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec;
+}
+
+static int put_header(int server) {
+	struct {
+		messagedef_t def;
+		headerdef_t hdef;
+		ft_chunkdef_t chunkdef;
+		capacitydef_t cap;
+	} req;
+	messagedef_t respdef;
+
+	memset(&req, 0, sizeof(req));
+	req.def.version    = VERSION;
+	req.def.command    = PUT_HDR;
+	req.def.bufsize    = sizeof(req) - sizeof(messagedef_t);
+	req.hdef.nchans    = NCHANS;
+	req.hdef.fsample   = 2000;
+	req.hdef.data_type = DATATYPE_FLOAT32;
+	req.hdef.bufsize   = sizeof(ft_chunkdef_t) + sizeof(capacitydef_t);
+	req.chunkdef.type  = FT_CHUNK_BUFFER_CAPACITY;
+	req.chunkdef.size  = sizeof(capacitydef_t);
+	req.cap.nsamples   = CAPACITY;
+	if (bufwrite(server, &req, sizeof(req)) != sizeof(req)) return -1;
+	if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef)) return -1;
+	return (respdef.command == PUT_OK) ? 0 : -1;
+}
+
+/* sends a PUT_DAT with the given (possibly inconsistent) sizes, returns the response command */
+static int put_data(int server, char *buf, UINT32_T nchans, UINT32_T nsamples, UINT32_T ddefsize, UINT32_T reqsize) {
+	messagedef_t *def = (messagedef_t *) buf;
+	datadef_t *ddef = (datadef_t *) (def+1);
+	messagedef_t respdef;
+
+	def->version    = VERSION;
+	def->command    = PUT_DAT;
+	def->bufsize    = reqsize;
+	ddef->nchans    = nchans;
+	ddef->nsamples  = nsamples;
+	ddef->data_type = DATATYPE_FLOAT32;
+	ddef->bufsize   = ddefsize;
+	if (bufwrite(server, buf, sizeof(messagedef_t) + reqsize) != sizeof(messagedef_t) + reqsize) return -1;
+	if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef)) return -1;
+	return respdef.command;
+}
+
+/* fills in a PUT_DAT of n samples that start at sample "total", see check_ring */
+static UINT32_T fill_data(char *buf, UINT32_T total, UINT32_T n) {
+	messagedef_t *def = (messagedef_t *) buf;
+	datadef_t *ddef = (datadef_t *) (def+1);
+	float *samples = (float *) (ddef+1);
+	UINT32_T j;
+
+	def->version    = VERSION;
+	def->command    = PUT_DAT;
+	def->bufsize    = sizeof(datadef_t) + n*NCHANS*sizeof(float);
+	ddef->nchans    = NCHANS;
+	ddef->nsamples  = n;
+	ddef->data_type = DATATYPE_FLOAT32;
+	ddef->bufsize   = n*NCHANS*sizeof(float);
+	for (j=0; j<n*NCHANS; j++) samples[j] = (float) (total*NCHANS + j);
+	return sizeof(messagedef_t) + def->bufsize;
+}
+
+/* returns the number of samples in the header, or -1 */
+static INT32_T count_samples(int server) {
+	messagedef_t def;
+	headerdef_t hdef;
+	char *rest;
+	int ok;
+
+	def.version = VERSION;
+	def.command = GET_HDR;
+	def.bufsize = 0;
+	if (bufwrite(server, &def, sizeof(def)) != sizeof(def)) return -1;
+	if (bufread(server, &def, sizeof(def)) != sizeof(def) || def.command != GET_OK || def.bufsize < sizeof(headerdef_t)) return -1;
+	rest = (char *) malloc(def.bufsize);
+	ok = (rest != NULL && bufread(server, rest, def.bufsize) == def.bufsize);
+	if (ok) memcpy(&hdef, rest, sizeof(headerdef_t));
+	free(rest);
+	return ok ? (INT32_T) hdef.nsamples : -1;
+}
+
+/* checks that the last "n" samples in the ring are sample*NCHANS + channel */
+static int check_ring(int server, UINT32_T total, UINT32_T n) {
+	struct {
+		messagedef_t def;
+		datasel_t sel;
+	} req;
+	messagedef_t respdef;
+	float *buf = (float *) malloc(sizeof(datadef_t) + n*NCHANS*sizeof(float));
+	const float *samples = (const float *) ((datadef_t *) buf + 1);
+	UINT32_T i;
+	int ok = 1;
+
+	req.def.version = VERSION;
+	req.def.command = GET_DAT;
+	req.def.bufsize = sizeof(datasel_t);
+	req.sel.begsample = total - n;
+	req.sel.endsample = total - 1;
+	if (bufwrite(server, &req, sizeof(req)) != sizeof(req)) ok = 0;
+	else if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef) || respdef.command != GET_OK) ok = 0;
+	else if (bufread(server, buf, respdef.bufsize) != respdef.bufsize) ok = 0;
+	for (i=0; ok && i<n*NCHANS; i++) {
+		if (samples[i] != (float) ((total - n)*NCHANS + i)) ok = 0;
+	}
+	free(buf);
+	return ok;
+}
+
+/* runs all tests against a server with the given number of reactor workers, 0 for a thread per client */
+static int run(int port, double seconds, int workers) {
+	UINT32_T blocks[] = {4, 20, 100, 500};
+	UINT32_T chansize = NCHANS*sizeof(float), total = 0;
+	ft_buffer_server_t *server;
+	char *buf;
+	int client, i, mode, failed = 0;
+
+	ft_set_server_workers(workers);
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	ft_set_server_workers(FT_SERVER_WORKERS);
+	if (server == NULL) {
+		fprintf(stderr, "test_ingest: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	if (client < 0 || put_header(client) != 0) {
+		fprintf(stderr, "test_ingest: could not connect or write the header\n");
+		return 1;
+	}
+	buf = (char *) malloc(sizeof(messagedef_t) + sizeof(datadef_t) + CAPACITY*chansize);
+
+	printf("%u channels, float32, %s\n", NCHANS, workers ? "epoll reactor" : "thread per client");
+	printf("%-7s %8s %12s %12s %12s %14s\n", "mode", "samples", "KB/request", "MB/s", "cpu us/MB", "samples/s");
+	for (i=0; i<sizeof(blocks)/sizeof(blocks[0]); i++) {
+		UINT32_T n = blocks[i], size = n*chansize;
+
+		for (mode=0; mode<2; mode++) {
+			double t0, c0, elapsed, cpu;
+			UINT32_T count = 0;
+			ft_set_ingest_threshold(mode ? FT_INGEST_THRESHOLD : 0);
+
+			t0 = now();
+			c0 = cputime();
+			do {
+				float *samples = (float *) (buf + sizeof(messagedef_t) + sizeof(datadef_t));
+				UINT32_T j;
+				/* only write the first and last value of each sample, to keep the client cheap */
+				for (j=0; j<n; j++) {
+					samples[j*NCHANS] = (float) ((total + j)*NCHANS);
+					samples[j*NCHANS + NCHANS-1] = (float) ((total + j)*NCHANS + NCHANS-1);
+				}
+				if (put_data(client, buf, NCHANS, n, size, sizeof(datadef_t) + size) != PUT_OK) {
+					fprintf(stderr, "test_ingest: PUT_DAT failed\n");
+					return 1;
+				}
+				total += n;
+				count++;
+			} while (now() - t0 < seconds);
+			elapsed = now() - t0;
+			cpu = cputime() - c0;
+			printf("%-7s %8u %12u %12.0f %12.1f %14.0f\n", mode ? "direct" : "copy", n, size/1024,
+				(double) count*size/(1024*1024)/elapsed, 1e6*cpu/((double) count*size/(1024*1024)), count*n/elapsed);
+		}
+	}
+
+	/* fill the whole ring with known values, with blocks that wrap around, and read it back */
+	for (i=0; i<2; i++) {
+		UINT32_T n = 333, j, k;
+		ft_set_ingest_threshold(i ? FT_INGEST_THRESHOLD : 0);
+		for (k=0; k<CAPACITY/n + 2; k++) {
+			float *samples = (float *) (buf + sizeof(messagedef_t) + sizeof(datadef_t));
+			for (j=0; j<n*NCHANS; j++) samples[j] = (float) (total*NCHANS + j);
+			if (put_data(client, buf, NCHANS, n, n*chansize, sizeof(datadef_t) + n*chansize) != PUT_OK) failed = 1;
+			total += n;
+		}
+		if (!check_ring(client, total, CAPACITY)) {
+			fprintf(stderr, "test_ingest: wrong samples in the ring (%s)\n", i ? "direct" : "copy");
+			failed = 1;
+		}
+	}
+
+	/* a client that goes away halfway through a PUT_DAT does not publish anything ... */
+	{
+		UINT32_T n = 100, size = fill_data(buf, total, n);
+		char *other = (char *) malloc(size);
+		messagedef_t respdef;
+		double t0;
+		int sock;
+
+		sock = open_connection("localhost", port);
+		if (sock < 0 || bufwrite(sock, buf, size/2) != size/2) failed = 1;
+		close_connection(sock);
+		usleep(100000);
+		if (count_samples(client) != (INT32_T) total) {
+			fprintf(stderr, "test_ingest: an incomplete PUT_DAT was published\n");
+			failed = 1;
+		}
+
+		/* ... and one that stalls does not keep the others from writing; its
+		   samples come after theirs, once they have all arrived */
+		fill_data(other, total + n, n);
+		sock = open_connection("localhost", port);
+		if (sock < 0 || bufwrite(sock, other, size/2) != size/2) failed = 1;
+		usleep(10000);
+		t0 = now();
+		if (bufwrite(client, buf, size) != size || bufread(client, &respdef, sizeof(respdef)) != sizeof(respdef) || respdef.command != PUT_OK) failed = 1;
+		if (now() - t0 > 10*FT_INGEST_TIMEOUT/1000.0) {
+			fprintf(stderr, "test_ingest: a stalled PUT_DAT kept another one waiting for %.3f s\n", now() - t0);
+			failed = 1;
+		}
+		if (bufwrite(sock, other + size/2, size - size/2) != size - size/2 || bufread(sock, &respdef, sizeof(respdef)) != sizeof(respdef) || respdef.command != PUT_OK) {
+			fprintf(stderr, "test_ingest: the stalled PUT_DAT failed\n");
+			failed = 1;
+		}
+		close_connection(sock);
+		total += 2*n;
+		if (count_samples(client) != (INT32_T) total || !check_ring(client, total, 2*n)) {
+			fprintf(stderr, "test_ingest: wrong samples after a stalled PUT_DAT\n");
+			failed = 1;
+		}
+		free(other);
+	}
+
+	/* requests that are not exactly what the header says go the usual way */
+	if (put_data(client, buf, NCHANS+1, 10, 10*(NCHANS+1)*sizeof(float), sizeof(datadef_t) + 10*(NCHANS+1)*sizeof(float)) != PUT_ERR) {
+		fprintf(stderr, "test_ingest: a PUT_DAT with the wrong number of channels should fail\n");
+		failed = 1;
+	}
+	if (put_data(client, buf, NCHANS, CAPACITY+1, 1, sizeof(datadef_t) + 16*1024) != PUT_ERR) {
+		fprintf(stderr, "test_ingest: a PUT_DAT with inconsistent sizes should fail\n");
+		failed = 1;
+	}
+	if (put_data(client, buf, NCHANS, 5, 5*chansize, sizeof(datadef_t) + 5*chansize + 64) != PUT_OK) {
+		fprintf(stderr, "test_ingest: a PUT_DAT with trailing bytes should still work\n");
+		failed = 1;
+	}
+
+	close_connection(client);
+	ft_stop_buffer_server(server);
+	free(buf);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	double seconds = (argc>2) ? atof(argv[2]) : 1.0;
+	int failed;
+
+	failed  = run(port, seconds, 0);
+	failed |= run(port+1, seconds, FT_SERVER_WORKERS);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,202 @@
+/*
+ * Holds the locks of a stream from one thread while another one waits for
+ * them, and checks that the lock statistics (see lockstat.h) have the wait
+ * under the command that waited and the command that held the lock, and the
+ * hold time under the latter, and that ft_stream_trylock gives up on a busy
+ * lock and is counted like ft_stream_lock otherwise. Then sends requests to
+ * a local server and checks that they show up in the report. Measures what
+ * taking a free lock costs with and without the statistics.
+ *
+ * Use as
+ *    ./test_lockstat [port]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_lockstat"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "stream.h"
+#include "lockstat.h"
+#include "testutil.h"
+
+#define HOLD_MS   50
+#define NLOCKS    100000
+
+typedef struct {
+	ft_stream_t *stream;
+	int kind;
+	UINT16_T command;
+	volatile int taken;
+} holder_t;
+
+static void *hold_lock(void *arg) {
+	holder_t *H = (holder_t *) arg;
+	UINT64_T held = ft_stream_lock(H->stream, H->kind, H->command);
+	H->taken = 1;
+	usleep(HOLD_MS*1000);
+	ft_stream_unlock(H->stream, H->kind, H->command, held);
+	return NULL;
+}
+
+/* "command" waits for lock "kind" while "holder" has it, as lock "held" */
+static int wait_for(ft_stream_t *S, int kind, UINT16_T command, int held, UINT16_T holder) {
+	holder_t H;
+	pthread_t thread;
+	ft_lockstat_t L;
+	UINT32_T count;
+	UINT64_T ns, t;
+	int failed = 0;
+
+	H.stream  = S;
+	H.kind    = held;
+	H.command = holder;
+	H.taken   = 0;
+	ft_lockstat_reset();
+	pthread_create(&thread, NULL, hold_lock, &H);
+	while (!H.taken) usleep(1000);
+	t = ft_stream_lock(S, kind, command);
+	ft_stream_unlock(S, kind, command, t);
+	pthread_join(thread, NULL);
+
+	ft_lockstat_get(kind, command, &L);
+	failed |= check(L.acquired == 1 && L.contended == 1, "the wait was not counted");
+	failed |= check(L.wait_ns > (HOLD_MS/2)*1000000u && L.max_wait_ns == L.wait_ns, "the wait has the wrong length");
+	ns = ft_lockstat_blocked(kind, command, holder, &count);
+	failed |= check(count == 1 && ns == L.wait_ns, "the wait was not put on the holder");
+	ft_lockstat_get(held, holder, &L);
+	failed |= check(L.acquired == 1 && L.contended == 0, "the holder was counted wrongly");
+	failed |= check(L.hold_ns >= HOLD_MS*1000000u && L.max_hold_ns == L.hold_ns, "the hold has the wrong length");
+	return failed;
+}
+
+/* ft_stream_trylock while another thread has mutexdata, and after that */
+static int try_data(ft_stream_t *S) {
+	holder_t H;
+	pthread_t thread;
+	ft_lockstat_t L;
+	UINT64_T t;
+	int failed = 0;
+
+	H.stream  = S;
+	H.kind    = FT_LOCK_DATA;
+	H.command = PUT_DAT;
+	H.taken   = 0;
+	ft_lockstat_reset();
+	pthread_create(&thread, NULL, hold_lock, &H);
+	while (!H.taken) usleep(1000);
+	failed |= check(ft_stream_trylock(S, FT_LOCK_DATA, GET_DAT_DECIMATED, &t) != 0, "trylock took a busy lock");
+	pthread_join(thread, NULL);
+
+	failed |= check(ft_stream_trylock(S, FT_LOCK_DATA, GET_DAT_DECIMATED, &t) == 0, "trylock did not take a free lock");
+	/* the third lock of the stream is mutexdata, see stream.h */
+	failed |= check(S->lockholder[2] == GET_DAT_DECIMATED, "trylock did not record the holder");
+	usleep(HOLD_MS*1000);
+	ft_stream_unlock(S, FT_LOCK_DATA, GET_DAT_DECIMATED, t);
+	ft_lockstat_get(FT_LOCK_DATA, GET_DAT_DECIMATED, &L);
+	failed |= check(L.acquired == 1 && L.contended == 0, "trylock was counted wrongly");
+	failed |= check(L.hold_ns >= HOLD_MS*1000000u && L.max_hold_ns == L.hold_ns, "the hold after trylock has the wrong length");
+	return failed;
+}
+
+static int serve(int port) {
+	ft_buffer_server_t *server;
+	ft_lockstat_t L;
+	FILE *f;
+	char text[8192];
+	size_t n;
+	int client, k, failed = 0;
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_lockstat: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	if ((client = open_connection("localhost", port)) < 0) {
+		fprintf(stderr, "test_lockstat: could not connect\n");
+		return 1;
+	}
+
+	ft_lockstat_reset();
+	failed |= check(put_header(client, 8, DATATYPE_FLOAT32, 0, 0), "PUT_HDR failed");
+	/* ten blocks of 16 samples */
+	failed |= check(put_samples(client, 8, DATATYPE_FLOAT32, 0, 10*16, 16, NULL), "PUT_DAT failed");
+	for (k=0; k<10; k++) request(client, GET_DAT, NULL, 0);
+
+	ft_lockstat_get(FT_LOCK_RING_WRITE, PUT_HDR, &L);
+	failed |= check(L.acquired == 1, "PUT_HDR did not take the ring");
+	ft_lockstat_get(FT_LOCK_DATA, PUT_DAT, &L);
+	failed |= check(L.acquired == 10, "PUT_DAT did not take mutexdata");
+	/* once more if it could have been sent from the ring, but was not */
+	ft_lockstat_get(FT_LOCK_RING_READ, GET_DAT, &L);
+	failed |= check(L.acquired >= 10, "GET_DAT did not take the ring");
+
+	f = tmpfile();
+	ft_lockstat_report(f);
+	rewind(f);
+	n = fread(text, 1, sizeof(text)-1, f);
+	text[n] = 0;
+	fclose(f);
+	failed |= check(strstr(text, "ring (write)  PUT_HDR ") != NULL && strstr(text, "data          PUT_DAT ") != NULL, "the report is incomplete");
+	failed |= check(strstr(text, "busy lock") != NULL, "the report has no waits");
+
+	close_connection(client);
+	ft_stop_buffer_server(server);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	ft_stream_t *S = ft_find_stream("locks", 5, 1);
+	ft_lockstat_t L;
+	UINT64_T t;
+	double t0, on, off;
+	int failed = 0, k;
+
+	failed |= check(ft_lockstat_enable(0) == 0, "could not enable the statistics");
+
+	/* a reader that waits for a writer, and the other way around */
+	failed |= wait_for(S, FT_LOCK_HEADER, GET_HDR, FT_LOCK_HEADER, PUT_HDR);
+	failed |= wait_for(S, FT_LOCK_RING_WRITE, FLUSH_DAT, FT_LOCK_RING_READ, GET_DAT);
+	failed |= wait_for(S, FT_LOCK_RING_READ, GET_DAT, FT_LOCK_RING_WRITE, PUT_HDR);
+	failed |= wait_for(S, FT_LOCK_EVENT, PUT_EVT, FT_LOCK_EVENT, GET_EVT);
+	failed |= try_data(S);
+
+	/* a free lock */
+	ft_lockstat_reset();
+	t0 = now();
+	for (k=0; k<NLOCKS; k++) {
+		t = ft_stream_lock(S, FT_LOCK_DATA, PUT_DAT);
+		ft_stream_unlock(S, FT_LOCK_DATA, PUT_DAT, t);
+	}
+	on = (now() - t0) / NLOCKS;
+	ft_lockstat_get(FT_LOCK_DATA, PUT_DAT, &L);
+	failed |= check(L.acquired == NLOCKS && L.contended == 0, "a free lock was counted wrongly");
+
+	failed |= serve(port);
+
+	/* nothing is counted any more */
+	ft_lockstat_disable();
+	ft_lockstat_reset();
+	t0 = now();
+	for (k=0; k<NLOCKS; k++) {
+		t = ft_stream_lock(S, FT_LOCK_DATA, PUT_DAT);
+		ft_stream_unlock(S, FT_LOCK_DATA, PUT_DAT, t);
+	}
+	off = (now() - t0) / NLOCKS;
+	ft_lockstat_get(FT_LOCK_DATA, PUT_DAT, &L);
+	failed |= check(L.acquired == 0, "the statistics could not be disabled");
+	printf("taking a free lock: %.1f ns with statistics, %.1f ns without\n", 1e9*on, 1e9*off);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
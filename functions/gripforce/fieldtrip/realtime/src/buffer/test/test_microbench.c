@@ -0,0 +1,435 @@
+/*
+ * Micro-benchmarks of the functions that every sample passes through: PUT_DAT
+ * and GET_DAT through dmarequest, with blocks that fit before the end of the
+ * ring and blocks that wrap around it, append, check_event_array, the byte
+ * swaps and the conversion of samples to float for RDA clients. Each runs for
+ * the sizes of the experiments that use the buffer, and is timed as the best
+ * of a few rounds, each long enough to be read from the clock.
+ *
+ * Every result is a line with the name of the benchmark, the number of bytes
+ * that one call handles, the time of a call in nanoseconds and the resulting
+ * rate in MB/s, so that the output can be kept as a baseline:
+ *
+ *    ./test_microbench > baseline.txt
+ *
+ * and later runs compared with it, which adds the time in the baseline and the
+ * change in percent, and fails if anything is slower than the tolerance:
+ *
+ *    ./test_microbench -compare baseline.txt
+ *
+ * The results of another program in the same format, such as odmBench in
+ * ../cpp, are compared by giving them as a file instead of running these.
+ *
+ * Use as
+ *    ./test_microbench [-filter TEXT] [-time MS] [-compare BASELINE [RESULTS]] [-tolerance PERCENT]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "rdaserver.h"
+#include "stats.h"
+
+#define ROUNDS    5
+#define MAXROWS   512
+#define MAXNAME   64
+
+typedef struct {
+	char name[MAXNAME];
+	UINT32_T bytes;
+	double ns;
+} row_t;
+
+static const char *typeNames[] = {"char", "uint8", "uint16", "uint32", "uint64", "int8", "int16", "int32", "int64", "float32", "float64"};
+
+static const char *filter = NULL;
+static double roundTime = 0.04;      /* seconds, each of ROUNDS */
+static double tolerance = 20;        /* percent */
+static row_t baseline[MAXROWS];
+static int nbaseline = -1;           /* no comparison */
+static int slower = 0;
+
+typedef void (*bench_func_t)(void *arg);
+
+/* the time of one call in nanoseconds, the best of ROUNDS rounds */
+static double measure(bench_func_t func, void *arg) {
+	UINT64_T start, elapsed;
+	UINT32_T n = 1, i;
+	double best = 0;
+	int r;
+
+	/* as many calls as fit into one round */
+	for (;;) {
+		start = ft_stats_now();
+		for (i=0; i<n; i++) func(arg);
+		elapsed = ft_stats_now() - start;
+		if (elapsed >= 1e9*roundTime/4 || n >= 0x40000000u) break;
+		n *= 2;
+	}
+	if (elapsed > 0) n = (UINT32_T) (n * (1e9*roundTime / elapsed)) + 1;
+
+	for (r=0; r<ROUNDS; r++) {
+		start = ft_stats_now();
+		for (i=0; i<n; i++) func(arg);
+		elapsed = ft_stats_now() - start;
+		if (r == 0 || elapsed < best) best = (double) elapsed;
+	}
+	return best / n;
+}
+
+static double baseline_of(const char *name) {
+	int i;
+	for (i=0; i<nbaseline; i++) {
+		if (!strcmp(baseline[i].name, name)) return baseline[i].ns;
+	}
+	return 0;
+}
+
+static void report(const char *name, UINT32_T bytes, double ns) {
+	printf("%-40s %10u %12.1f %10.1f", name, bytes, ns, (ns > 0) ? 1e3 * bytes / ns : 0);
+	if (nbaseline >= 0) {
+		double old = baseline_of(name);
+		if (old > 0) {
+			double change = 100.0 * (ns - old) / old;
+			printf(" %12.1f %+8.1f%s", old, change, (change > tolerance) ? "  SLOWER" : "");
+			if (change > tolerance) slower++;
+		}
+		else {
+			printf(" %12s %8s", "-", "new");
+		}
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void run(const char *name, UINT32_T bytes, bench_func_t func, void *arg) {
+	if (filter != NULL && strstr(name, filter) == NULL) return;
+	report(name, bytes, measure(func, arg));
+}
+
+/* reads the lines of a results file, returns their number or -1 */
+static int read_results(const char *filename, row_t *rows) {
+	FILE *f = fopen(filename, "r");
+	char line[256];
+	int n = 0;
+
+	if (f == NULL) {
+		fprintf(stderr, "test_microbench: cannot read %s\n", filename);
+		return -1;
+	}
+	while (n < MAXROWS && fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%63s %u %lf", rows[n].name, &rows[n].bytes, &rows[n].ns) == 3) n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/******************************************************************************
+ * PUT_DAT and GET_DAT through dmarequest
+ ******************************************************************************/
+
+typedef struct {
+	UINT32_T nchans, nsamples, data_type;
+	message_t request;
+	messagedef_t def;
+	void *buf;
+	datasel_t sel;
+} dma_t;
+
+static void dma_request(dma_t *D) {
+	message_t *response = NULL;
+	if (clientrequest(0, &D->request, &response) != 0 || response == NULL || response->def == NULL
+			|| (response->def->command != PUT_OK && response->def->command != GET_OK && response->def->command != FLUSH_OK)) {
+		fprintf(stderr, "test_microbench: request %u failed\n", D->def.command);
+		exit(1);
+	}
+	cleanup_message((void **) &response);
+}
+
+static void put_dat(void *arg) {
+	dma_t *D = (dma_t *) arg;
+	D->def.command = PUT_DAT;
+	D->def.bufsize = sizeof(datadef_t) + D->nchans * D->nsamples * wordsize_from_type(D->data_type);
+	D->request.buf = D->buf;
+	dma_request(D);
+}
+
+static void get_dat(void *arg) {
+	dma_t *D = (dma_t *) arg;
+	D->def.command = GET_DAT;
+	D->def.bufsize = sizeof(datasel_t);
+	D->request.buf = &D->sel;
+	dma_request(D);
+}
+
+/* a fresh ring of "capacity" samples */
+static void put_header(dma_t *D, UINT32_T capacity) {
+	struct {
+		headerdef_t def;
+		ft_chunkdef_t chunkdef;
+		capacitydef_t cap;
+	} hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.def.nchans    = D->nchans;
+	hdr.def.fsample   = 1000;
+	hdr.def.data_type = D->data_type;
+	hdr.def.bufsize   = sizeof(ft_chunkdef_t) + sizeof(capacitydef_t);
+	hdr.chunkdef.type = FT_CHUNK_BUFFER_CAPACITY;
+	hdr.chunkdef.size = sizeof(capacitydef_t);
+	hdr.cap.nsamples  = capacity;
+	D->def.command = PUT_HDR;
+	D->def.bufsize = sizeof(hdr);
+	D->request.buf = &hdr;
+	dma_request(D);
+}
+
+/* A ring of 64 blocks never has a block across its end. In a ring of one
+   block and one sample, each block starts one sample before the previous one,
+   so all but two of every block+1 of them wrap around. The second block that
+   is put there wraps, and is the one that GET_DAT reads. */
+static void bench_dma(UINT32_T nchans, UINT32_T nsamples, UINT32_T data_type) {
+	UINT32_T rawsize = nchans * nsamples * wordsize_from_type(data_type), i;
+	datadef_t *ddef;
+	dma_t D;
+	char name[MAXNAME];
+	int wrap;
+
+	memset(&D, 0, sizeof(D));
+	D.nchans    = nchans;
+	D.nsamples  = nsamples;
+	D.data_type = data_type;
+	D.def.version = VERSION;
+	D.request.def = &D.def;
+	D.buf = malloc(sizeof(datadef_t) + rawsize);
+	if (D.buf == NULL) {
+		fprintf(stderr, "test_microbench: out of memory\n");
+		exit(1);
+	}
+	ddef = (datadef_t *) D.buf;
+	ddef->nchans    = nchans;
+	ddef->nsamples  = nsamples;
+	ddef->data_type = data_type;
+	ddef->bufsize   = rawsize;
+	for (i=0; i<rawsize; i++) ((char *) (ddef+1))[i] = (char) (i*7);
+
+	for (wrap=0; wrap<2; wrap++) {
+		/* a single sample cannot be split */
+		if (wrap && nsamples == 1) continue;
+
+		sprintf(name, "put_dat%s/%ux%u/%s", wrap ? "_wrap" : "", nchans, nsamples, typeNames[data_type]);
+		put_header(&D, wrap ? nsamples+1 : 64*nsamples);
+		run(name, rawsize, put_dat, &D);
+
+		sprintf(name, "get_dat%s/%ux%u/%s", wrap ? "_wrap" : "", nchans, nsamples, typeNames[data_type]);
+		put_header(&D, wrap ? nsamples+1 : 64*nsamples);
+		put_dat(&D);
+		put_dat(&D);
+		D.sel.begsample = nsamples;
+		D.sel.endsample = 2*nsamples - 1;
+		run(name, rawsize, get_dat, &D);
+	}
+	D.def.command = FLUSH_DAT;
+	D.def.bufsize = 0;
+	D.request.buf = NULL;
+	dma_request(&D);
+	free(D.buf);
+}
+
+/******************************************************************************
+ * append and check_event_array
+ ******************************************************************************/
+
+#define APPENDS 64
+
+typedef struct {
+	void *piece;
+	UINT32_T size;
+} append_t;
+
+/* a message built from APPENDS pieces, per piece */
+static void append_pieces(void *arg) {
+	append_t *A = (append_t *) arg;
+	void *buf = NULL;
+	UINT32_T size = 0;
+	int i;
+	for (i=0; i<APPENDS; i++) size = append(&buf, size, A->piece, A->size);
+	free(buf);
+}
+
+typedef struct {
+	void *buf;
+	UINT32_T size;
+	int nevents;
+} events_t;
+
+static void check_events(void *arg) {
+	events_t *E = (events_t *) arg;
+	if (check_event_array(E->size, E->buf) != E->nevents) {
+		fprintf(stderr, "test_microbench: the events are invalid\n");
+		exit(1);
+	}
+}
+
+/* events as put by a stimulus program, with a type of 7 characters and one INT32 value */
+static void make_events(events_t *E, int nevents) {
+	UINT32_T evsize = sizeof(eventdef_t) + 7 + sizeof(INT32_T);
+	int i;
+
+	E->nevents = nevents;
+	E->size = nevents * evsize;
+	E->buf = calloc(nevents, evsize);
+	for (i=0; i<nevents; i++) {
+		eventdef_t *def = (eventdef_t *) ((char *) E->buf + i*evsize);
+		INT32_T value = i;
+		def->type_type   = DATATYPE_CHAR;
+		def->type_numel  = 7;
+		def->value_type  = DATATYPE_INT32;
+		def->value_numel = 1;
+		def->sample      = i;
+		def->bufsize     = 7 + sizeof(INT32_T);
+		memcpy(def+1, "trigger", 7);
+		memcpy((char *) (def+1) + 7, &value, sizeof(value));
+	}
+}
+
+/******************************************************************************
+ * byte swaps and RDA conversion
+ ******************************************************************************/
+
+typedef struct {
+	void *src, *dest;
+	UINT32_T numel, wordsize, data_type;
+} convert_t;
+
+static void swap16(void *arg) { convert_t *C = (convert_t *) arg; ft_swap16(C->numel, C->dest); }
+static void swap32(void *arg) { convert_t *C = (convert_t *) arg; ft_swap32(C->numel, C->dest); }
+static void swap64(void *arg) { convert_t *C = (convert_t *) arg; ft_swap64(C->numel, C->dest); }
+static void swap_copy(void *arg) { convert_t *C = (convert_t *) arg; ft_swap_copy(C->numel, C->wordsize, C->src, C->dest); }
+static void to_float(void *arg) { convert_t *C = (convert_t *) arg; rda_aux_convert_to_float(C->numel, C->dest, C->data_type, C->src); }
+
+static void bench_swap(UINT32_T bytes) {
+	static const bench_func_t swap[] = {swap16, swap32, swap64};
+	convert_t C;
+	char name[MAXNAME];
+	int k;
+
+	C.src  = calloc(1, bytes);
+	C.dest = calloc(1, bytes);
+	for (k=0; k<3; k++) {
+		C.wordsize = 2 << k;
+		C.numel    = bytes / C.wordsize;
+		sprintf(name, "ft_swap%u/%u", 8*C.wordsize, bytes);
+		run(name, bytes, swap[k], &C);
+		sprintf(name, "ft_swap_copy%u/%u", 8*C.wordsize, bytes);
+		run(name, bytes, swap_copy, &C);
+	}
+	free(C.src);
+	free(C.dest);
+}
+
+static void bench_convert(UINT32_T numel, UINT32_T data_type) {
+	convert_t C;
+	char name[MAXNAME];
+	UINT32_T i, ws = wordsize_from_type(data_type);
+
+	C.numel     = numel;
+	C.data_type = data_type;
+	C.src  = malloc((size_t) numel * ws);
+	C.dest = malloc((size_t) numel * sizeof(float));
+	/* small integers, which are exact in every type */
+	for (i=0; i<numel*ws; i++) ((UINT8_T *) C.src)[i] = (i % ws == 0) ? (UINT8_T) i : 0;
+	if (data_type == DATATYPE_FLOAT32) for (i=0; i<numel; i++) ((float *) C.src)[i] = (float) (i & 255);
+	if (data_type == DATATYPE_FLOAT64) for (i=0; i<numel; i++) ((double *) C.src)[i] = (double) (i & 255);
+	sprintf(name, "rda_aux_convert_to_float/%u/%s", numel, typeNames[data_type]);
+	run(name, numel*ws, to_float, &C);
+	free(C.src);
+	free(C.dest);
+}
+
+int main(int argc, char *argv[]) {
+	static const UINT32_T pieces[] = {16, 1024, 65536};
+	static const int nevents[] = {1, 100, 10000};
+	static const UINT32_T swapBytes[] = {4096, 262144, 16777216};
+	static const UINT32_T convertSizes[] = {64, 8960, 262144};
+	static const UINT32_T convertTypes[] = {DATATYPE_INT16, DATATYPE_INT32, DATATYPE_FLOAT32, DATATYPE_FLOAT64};
+	const char *results = NULL;
+	char name[MAXNAME];
+	unsigned int k, j;
+	int arg;
+
+	check_datatypes();
+	for (arg=1; arg<argc; arg++) {
+		if (!strcmp(argv[arg], "-filter") && arg+1 < argc) {
+			filter = argv[++arg];
+		}
+		else if (!strcmp(argv[arg], "-time") && arg+1 < argc) {
+			roundTime = atof(argv[++arg]) / 1000 / ROUNDS;
+		}
+		else if (!strcmp(argv[arg], "-tolerance") && arg+1 < argc) {
+			tolerance = atof(argv[++arg]);
+		}
+		else if (!strcmp(argv[arg], "-compare") && arg+1 < argc) {
+			if ((nbaseline = read_results(argv[++arg], baseline)) < 0) return 1;
+			if (arg+1 < argc && argv[arg+1][0] != '-') results = argv[++arg];
+		}
+		else {
+			fprintf(stderr, "Usage: test_microbench [-filter TEXT] [-time MS] [-compare BASELINE [RESULTS]] [-tolerance PERCENT]\n");
+			return 1;
+		}
+	}
+	if (roundTime <= 0) roundTime = 0.04;
+
+	printf("# %-38s %10s %12s %10s", "benchmark", "bytes", "ns", "MB/s");
+	if (nbaseline >= 0) printf(" %12s %8s", "baseline ns", "change %");
+	printf("\n");
+
+	/* the results of another run */
+	if (results != NULL) {
+		static row_t rows[MAXROWS];
+		int n = read_results(results, rows), i;
+		if (n < 0) return 1;
+		for (i=0; i<n; i++) {
+			if (filter == NULL || strstr(rows[i].name, filter) != NULL) report(rows[i].name, rows[i].bytes, rows[i].ns);
+		}
+		printf("# %d benchmark(s) slower than the baseline by more than %g%%\n", slower, tolerance);
+		return slower > 0;
+	}
+
+	/* gripforce, biosemi, a 64-channel amplifier and an fMRI volume */
+	bench_dma(2, 1, DATATYPE_FLOAT64);
+	bench_dma(280, 32, DATATYPE_FLOAT32);
+	bench_dma(64, 512, DATATYPE_FLOAT32);
+	bench_dma(98304, 1, DATATYPE_INT16);
+
+	for (k=0; k<sizeof(pieces)/sizeof(pieces[0]); k++) {
+		append_t A;
+		A.size  = pieces[k];
+		A.piece = calloc(1, A.size);
+		sprintf(name, "append/%u", A.size);
+		if (filter == NULL || strstr(name, filter) != NULL) report(name, A.size, measure(append_pieces, &A) / APPENDS);
+		free(A.piece);
+	}
+
+	for (k=0; k<sizeof(nevents)/sizeof(nevents[0]); k++) {
+		events_t E;
+		make_events(&E, nevents[k]);
+		sprintf(name, "check_event_array/%d", nevents[k]);
+		run(name, E.size, check_events, &E);
+		free(E.buf);
+	}
+
+	for (k=0; k<sizeof(swapBytes)/sizeof(swapBytes[0]); k++) bench_swap(swapBytes[k]);
+
+	for (j=0; j<sizeof(convertTypes)/sizeof(convertTypes[0]); j++) {
+		for (k=0; k<sizeof(convertSizes)/sizeof(convertSizes[0]); k++) bench_convert(convertSizes[k], convertTypes[j]);
+	}
+
+	if (nbaseline >= 0) printf("# %d benchmark(s) slower than the baseline by more than %g%%\n", slower, tolerance);
+	return slower > 0;
+}
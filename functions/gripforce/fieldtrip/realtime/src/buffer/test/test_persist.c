@@ -0,0 +1,195 @@
+/*
+ * Fills a crash-persistent buffer (see persist.h) in a child process, which
+ * then dies in the middle of writing a block of samples and of appending an
+ * event, and measures how long it takes to restore the session. Afterwards,
+ * the header, samples and events are checked, and the test makes sure that
+ * new samples and events continue with the right numbers.
+ *
+ * Use as
+ *    ./test_persist [directory] [MB]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define TEST_NAME "test_persist"
+
+#include "buffer.h"
+#include "stream.h"
+#include "persist.h"
+#include "testutil.h"
+
+#define NCHANS    64
+#define BLOCKSIZE 1000
+#define NEVENTS   5000
+#define MB        (1024*1024)
+
+static int put_event(INT32_T k) {
+	char buf[sizeof(eventdef_t) + 7 + sizeof(INT32_T)];
+	eventdef_t def;
+	memset(&def, 0, sizeof(def));
+	def.type_type   = DATATYPE_CHAR;
+	def.type_numel  = 7;
+	def.value_type  = DATATYPE_INT32;
+	def.value_numel = 1;
+	def.sample      = k;
+	def.bufsize     = 7 + sizeof(INT32_T);
+	memcpy(buf, &def, sizeof(eventdef_t));
+	memcpy(buf + sizeof(eventdef_t), "trigger", 7);
+	memcpy(buf + sizeof(eventdef_t) + 7, &k, sizeof(INT32_T));
+	return request(-1, PUT_EVT, buf, sizeof(buf)) == PUT_OK;
+}
+
+/* checks that sample n has value v on all channels */
+static int check_sample(UINT32_T n, float v) {
+	datasel_t sel;
+	message_t *resp;
+	int i, ok;
+	sel.begsample = n;
+	sel.endsample = n;
+	resp = send_request(-1, GET_DAT, &sel, sizeof(sel));
+	ok = (resp != NULL && resp->def->command == GET_OK);
+	for (i=0; ok && i<NCHANS; i++) ok = (((float *) ((datadef_t *) resp->buf + 1))[i] == v);
+	release(&resp);
+	return ok;
+}
+
+/* checks that event k is the one that put_event(value) wrote */
+static int check_event(UINT32_T k, INT32_T value) {
+	eventsel_t sel;
+	message_t *resp;
+	INT32_T v;
+	int ok;
+	sel.begevent = k;
+	sel.endevent = k;
+	resp = send_request(-1, GET_EVT, &sel, sizeof(sel));
+	ok = (resp != NULL && resp->def->command == GET_OK && resp->def->bufsize == sizeof(eventdef_t) + 7 + sizeof(INT32_T));
+	if (ok) {
+		memcpy(&v, (char *) resp->buf + sizeof(eventdef_t) + 7, sizeof(INT32_T));
+		ok = (v == value && ((eventdef_t *) resp->buf)->sample == value);
+	}
+	release(&resp);
+	return ok;
+}
+
+/* asks the (rebuilt) event index for the events at the given sample */
+static UINT32_T query_sample(INT32_T sample) {
+	struct {
+		eventquerydef_t def;
+		INT32_T sample;
+	} query;
+	message_t *resp;
+	UINT32_T n = 0;
+	query.def.what    = EVENTSEL_SAMPLE;
+	query.def.bufsize = sizeof(INT32_T);
+	query.sample      = sample;
+	resp = send_request(-1, GET_EVT_QUERY, &query, sizeof(query));
+	if (resp != NULL && resp->def->command == GET_OK) n = resp->def->bufsize / (sizeof(eventdef_t) + 7 + sizeof(INT32_T));
+	release(&resp);
+	return n;
+}
+
+static void remove_sessions(const char *dir) {
+	char path[1024];
+	struct dirent *entry;
+	DIR *D = opendir(dir);
+	if (D == NULL) return;
+	while ((entry = readdir(D)) != NULL) {
+		if (strstr(entry->d_name, FT_PERSIST_SUFFIX) == NULL) continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		unlink(path);
+	}
+	closedir(D);
+}
+
+/* fills the buffer, and dies halfway through the next block and event */
+static int run_server(const char *dir, UINT32_T capacity, UINT32_T nsamples) {
+	ft_stream_t *S = ft_default_stream();
+	ft_ring_segment_t seg[2];
+	INT32_T k;
+	double t0;
+
+	if (ft_persist_enable(dir) != 0) return 1;
+	t0 = now();
+	if (!put_header(-1, NCHANS, DATATYPE_FLOAT32, capacity, NEVENTS) || !put_samples(-1, NCHANS, DATATYPE_FLOAT32, 0, nsamples, BLOCKSIZE, NULL)) return 1;
+	for (k=0; k<NEVENTS+100; k++) {
+		if (!put_event(k)) return 1;
+	}
+	printf("filled %u MB in %.2f s\n", capacity*NCHANS*(UINT32_T) sizeof(float)/MB, now() - t0);
+
+	/* the samples of this block never get committed */
+	ft_ring_reserve(S->data, BLOCKSIZE, seg);
+	memset(seg[0].ptr, 0xff, (size_t) seg[0].nsamples * S->data->chansize / 2);
+	/* and neither does this event, which only got as far as the tail */
+	S->event->tail += sizeof(eventdef_t) + 11;
+
+	fflush(stdout);
+	raise(SIGKILL);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	const char *dir = (argc>1) ? argv[1] : "/tmp/test_persist";
+	UINT32_T megabytes = (argc>2) ? atoi(argv[2]) : 512;
+	UINT32_T capacity = megabytes*(MB/(NCHANS*sizeof(float)));
+	UINT32_T nsamples = capacity + capacity/4 + 7;
+	UINT32_T nevents = NEVENTS+100;
+	message_t *resp;
+	headerdef_t hdef;
+	double t0, elapsed;
+	int failed = 0, status, n;
+	pid_t child;
+
+	remove_sessions(dir);
+
+	child = fork();
+	if (child == 0) return run_server(dir, capacity, nsamples);
+	waitpid(child, &status, 0);
+	if (!WIFSIGNALED(status)) {
+		fprintf(stderr, "test_persist: the server did not get as far as it should\n");
+		return 1;
+	}
+
+	t0 = now();
+	n = ft_persist_enable(dir);
+	elapsed = now() - t0;
+	printf("restored %i session(s) with a ring of %u MB in %.3f ms\n", n, megabytes, 1e3*elapsed);
+	if (check(n == 1, "the session was not restored")) return 1;
+
+	/* the block that was being written is there, but zeroed */
+	resp = send_request(-1, GET_HDR, NULL, 0);
+	failed |= check(resp != NULL && resp->def->command == GET_OK, "GET_HDR failed");
+	if (resp != NULL && resp->def->command == GET_OK) {
+		memcpy(&hdef, resp->buf, sizeof(headerdef_t));
+		failed |= check(hdef.nchans == NCHANS && hdef.data_type == DATATYPE_FLOAT32, "wrong header");
+		failed |= check(hdef.nsamples == nsamples + BLOCKSIZE, "wrong number of samples");
+		failed |= check(hdef.nevents == nevents, "wrong number of events");
+	}
+	release(&resp);
+
+	failed |= check(check_sample(nsamples - capacity + BLOCKSIZE, (float) (nsamples - capacity + BLOCKSIZE)), "wrong oldest sample");
+	failed |= check(check_sample(nsamples - 1, (float) (nsamples - 1)), "wrong last sample");
+	failed |= check(check_sample(nsamples, 0) && check_sample(nsamples + BLOCKSIZE - 1, 0), "the unfinished block was not zeroed");
+	failed |= check(check_event(nevents - NEVENTS, nevents - NEVENTS) && check_event(nevents - 1, nevents - 1), "wrong events");
+	failed |= check(query_sample(nevents - 10) == 1, "the event index was not rebuilt");
+
+	/* new samples and events continue where the old ones stopped */
+	failed |= check(put_samples(-1, NCHANS, DATATYPE_FLOAT32, nsamples + BLOCKSIZE, 10, BLOCKSIZE, NULL) && check_sample(nsamples + BLOCKSIZE + 9, (float) (nsamples + BLOCKSIZE + 9)), "cannot continue writing samples");
+	failed |= check(put_event(nevents) && check_event(nevents, nevents), "cannot continue writing events");
+
+	/* after FLUSH_HDR, there is nothing left to restore */
+	failed |= check(request(-1, FLUSH_HDR, NULL, 0) == FLUSH_OK, "FLUSH_HDR failed");
+	ft_free_streams();
+	failed |= check(ft_persist_enable(dir) == 0, "FLUSH_HDR did not remove the session file");
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
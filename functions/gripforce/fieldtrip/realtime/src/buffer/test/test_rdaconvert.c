@@ -0,0 +1,267 @@
+/*
+ * Checks the conversion of samples to float for RDA clients (see rdaserver.h):
+ * all sample types, with and without scaling, and with and without AVX2.
+ * Measures how much of a core it takes to convert one second of a 512-channel
+ * stream at 5 kHz, and streams scaled samples from a local RDA server.
+ *
+ * Use as
+ *    ./test_rdaconvert [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_rdaconvert"
+
+#include "buffer.h"
+#include "rdaserver.h"
+#include "testutil.h"
+
+#define NCHANS    512
+#define FSAMPLE   5000
+
+static UINT32_T seed = 12345;
+
+static UINT32_T random32(void) {
+	seed = seed * 1664525u + 1013904223u;
+	return seed;
+}
+
+/* random values that every type can hold, and some that are not exact in a float */
+static void fill(UINT32_T data_type, UINT32_T n, void *dest) {
+	UINT32_T i;
+	for (i=0;i<n;i++) {
+		UINT32_T r = random32();
+		switch (data_type) {
+			case DATATYPE_CHAR:
+			case DATATYPE_UINT8:   ((UINT8_T *) dest)[i] = (UINT8_T) r; break;
+			case DATATYPE_INT8:    ((INT8_T *) dest)[i] = (INT8_T) r; break;
+			case DATATYPE_UINT16:  ((UINT16_T *) dest)[i] = (UINT16_T) r; break;
+			case DATATYPE_INT16:   ((INT16_T *) dest)[i] = (INT16_T) r; break;
+			case DATATYPE_UINT32:  ((UINT32_T *) dest)[i] = r; break;
+			case DATATYPE_INT32:   ((INT32_T *) dest)[i] = (INT32_T) r; break;
+			case DATATYPE_UINT64:  ((UINT64_T *) dest)[i] = ((UINT64_T) r << 20) + i; break;
+			case DATATYPE_INT64:   ((INT64_T *) dest)[i] = ((INT64_T) (INT32_T) r << 20) + i; break;
+			case DATATYPE_FLOAT32: ((FLOAT32_T *) dest)[i] = (FLOAT32_T) (INT32_T) r / 65536.0f; break;
+			case DATATYPE_FLOAT64: ((FLOAT64_T *) dest)[i] = (FLOAT64_T) (INT32_T) r / 3.0; break;
+		}
+	}
+}
+
+static float reference(UINT32_T data_type, const void *src, UINT32_T i) {
+	switch (data_type) {
+		case DATATYPE_CHAR:
+		case DATATYPE_UINT8:   return (float) ((const UINT8_T *) src)[i];
+		case DATATYPE_INT8:    return (float) ((const INT8_T *) src)[i];
+		case DATATYPE_UINT16:  return (float) ((const UINT16_T *) src)[i];
+		case DATATYPE_INT16:   return (float) ((const INT16_T *) src)[i];
+		case DATATYPE_UINT32:  return (float) ((const UINT32_T *) src)[i];
+		case DATATYPE_INT32:   return (float) ((const INT32_T *) src)[i];
+		case DATATYPE_UINT64:  return (float) ((const UINT64_T *) src)[i];
+		case DATATYPE_INT64:   return (float) ((const INT64_T *) src)[i];
+		case DATATYPE_FLOAT32: return ((const FLOAT32_T *) src)[i];
+		case DATATYPE_FLOAT64: return (float) ((const FLOAT64_T *) src)[i];
+	}
+	return 0;
+}
+
+static int check_types(void) {
+	UINT32_T types[] = {DATATYPE_CHAR, DATATYPE_UINT8, DATATYPE_UINT16, DATATYPE_UINT32, DATATYPE_UINT64,
+			DATATYPE_INT8, DATATYPE_INT16, DATATYPE_INT32, DATATYPE_INT64, DATATYPE_FLOAT32, DATATYPE_FLOAT64};
+	UINT32_T shapes[][2] = {{1,1}, {7,3}, {8,1}, {9,100}, {64,17}, {512,0}, {3,200000}};
+	void *src = malloc(3*200000*8);
+	float *dest = (float *) malloc(3*200000*sizeof(float) + sizeof(float));
+	float scale[512];
+	UINT32_T t, k, i, c;
+	int failed = 0, scaled;
+	char what[120];
+
+	for (c=0;c<512;c++) scale[c] = 0.1f * (c+1);
+	for (t=0;t<sizeof(types)/sizeof(types[0]);t++) {
+		for (k=0;k<sizeof(shapes)/sizeof(shapes[0]);k++) {
+			UINT32_T nchans = shapes[k][0], nsamples = shapes[k][1], n = nchans*nsamples;
+			fill(types[t], n, src);
+			for (scaled=0;scaled<2;scaled++) {
+				dest[n] = -1.0f;
+				rda_aux_convert_scaled(nchans, nsamples, dest, types[t], src, scaled ? scale : NULL);
+				for (i=0;i<n;i++) {
+					float want = reference(types[t], src, i);
+					if (scaled) want = want * scale[i % nchans];
+					if (dest[i] != want) break;
+				}
+				sprintf(what, "type %u, %u x %u%s: value %u is wrong", types[t], nchans, nsamples,
+						scaled ? ", scaled" : "", i);
+				failed |= check(i == n && dest[n] == -1.0f, what);
+			}
+			if (!scaled) {
+				rda_aux_convert_to_float(n, dest, types[t], src);
+				failed |= check(n == 0 || dest[n-1] == reference(types[t], src, n-1), "rda_aux_convert_to_float differs");
+			}
+		}
+	}
+	free(src);
+	free(dest);
+	return failed;
+}
+
+/* the best time to convert one second of NCHANS x FSAMPLE samples, in ms */
+static double seconds_of_data(UINT32_T data_type, const void *src, float *dest, const float *scale, int reps) {
+	double best = 1e9;
+	int r;
+	for (r=0;r<reps;r++) {
+		double t0 = now();
+		rda_aux_convert_scaled(NCHANS, FSAMPLE, dest, data_type, src, scale);
+		t0 = now() - t0;
+		if (t0 < best) best = t0;
+	}
+	return 1000*best;
+}
+
+static void measure(int reps) {
+	UINT32_T types[] = {DATATYPE_INT16, DATATYPE_INT32, DATATYPE_FLOAT32, DATATYPE_FLOAT64};
+	const char *names[] = {"int16", "int32", "float32", "float64"};
+	void *src = malloc(NCHANS*FSAMPLE*8);
+	float *dest = (float *) malloc(NCHANS*FSAMPLE*sizeof(float));
+	float scale[NCHANS];
+	UINT32_T t, c;
+
+	for (c=0;c<NCHANS;c++) scale[c] = 0.1f;
+	printf("one second of %u channels at %u Hz, ms (= 0.1%% of a core)\n", NCHANS, FSAMPLE);
+	printf("type       scalar    scaled      avx2    scaled\n");
+	for (t=0;t<4;t++) {
+		fill(types[t], NCHANS*FSAMPLE, src);
+		printf("%-8s", names[t]);
+		rda_aux_use_simd(FT_SIMD_NONE);
+		printf("%9.2f %9.2f", seconds_of_data(types[t], src, dest, NULL, reps), seconds_of_data(types[t], src, dest, scale, reps));
+		rda_aux_use_simd(FT_SIMD_AVX2);
+		printf(" %9.2f %9.2f\n", seconds_of_data(types[t], src, dest, NULL, reps), seconds_of_data(types[t], src, dest, scale, reps));
+	}
+	free(src);
+	free(dest);
+}
+
+/* reads one RDA message into a new buffer */
+static char *read_rda(int sock, rda_msg_hdr_t *hdr) {
+	char *msg;
+	if (bufread(sock, hdr, sizeof(rda_msg_hdr_t)) != sizeof(rda_msg_hdr_t) || hdr->nSize < sizeof(rda_msg_hdr_t)) return NULL;
+	msg = (char *) malloc(hdr->nSize);
+	if (msg == NULL) return NULL;
+	memcpy(msg, hdr, sizeof(rda_msg_hdr_t));
+	if (bufread(sock, msg + sizeof(rda_msg_hdr_t), hdr->nSize - sizeof(rda_msg_hdr_t)) != (int) (hdr->nSize - sizeof(rda_msg_hdr_t))) {
+		free(msg);
+		return NULL;
+	}
+	return msg;
+}
+
+/* a header with resolutions, and samples that arrive multiplied with them */
+static int check_server(int port) {
+	enum {nchans = 16, nsamples = 100};
+	char hbuf[sizeof(headerdef_t) + sizeof(ft_chunkdef_t) + nchans*sizeof(double)];
+	char dbuf[sizeof(datadef_t) + nchans*nsamples*sizeof(INT32_T)];
+	headerdef_t *hdef = (headerdef_t *) hbuf;
+	ft_chunkdef_t *cdef = (ft_chunkdef_t *) (hdef+1);
+	datadef_t *ddef = (datadef_t *) dbuf;
+	INT32_T *samples = (INT32_T *) (ddef+1);
+	double res[nchans];
+	messagedef_t def;
+	message_t request, *response = NULL;
+	rda_server_ctrl_t *rda;
+	rda_msg_hdr_t mhdr;
+	char *msg;
+	int sock, failed = 0, errval = 0, received = 0;
+	UINT32_T c, i;
+
+	rda = rda_start_server(0, 0, port, 0, &errval);
+	if (rda == NULL) {
+		fprintf(stderr, "test_rdaconvert: could not start the RDA server on port %i\n", port);
+		return 1;
+	}
+	rda->verbosity = 0;
+	rda->scale = 1;
+
+	memset(hdef, 0, sizeof(headerdef_t));
+	hdef->nchans    = nchans;
+	hdef->fsample   = FSAMPLE;
+	hdef->data_type = DATATYPE_INT32;
+	hdef->bufsize   = sizeof(ft_chunkdef_t) + nchans*sizeof(double);
+	cdef->type = FT_CHUNK_RESOLUTIONS;
+	cdef->size = nchans*sizeof(double);
+	for (c=0;c<nchans;c++) res[c] = 0.5 + c;
+	memcpy(cdef+1, res, sizeof(res));
+	def.version = VERSION;
+	def.command = PUT_HDR;
+	def.bufsize = sizeof(hbuf);
+	request.def = &def;
+	request.buf = hbuf;
+	failed |= check(dmarequest(&request, &response) == 0 && response->def->command == PUT_OK, "PUT_HDR failed");
+	cleanup_message((void **) &response);
+
+	sock = open_connection("localhost", port);
+	if (sock < 0) {
+		fprintf(stderr, "test_rdaconvert: could not connect to the RDA server\n");
+		rda_stop_server(rda);
+		return 1;
+	}
+
+	msg = read_rda(sock, &mhdr);
+	failed |= check(msg != NULL && mhdr.nType == RDA_START_MSG && ((rda_msg_start_t *) msg)->nChannels == nchans, "no start message");
+	if (msg != NULL) {
+		double one[nchans];
+		for (c=0;c<nchans;c++) one[c] = 1.0;
+		failed |= check(memcmp(msg + sizeof(rda_msg_start_t), one, sizeof(one)) == 0, "the start message does not have resolutions of 1.0");
+		free(msg);
+	}
+
+	ddef->nchans    = nchans;
+	ddef->nsamples  = nsamples;
+	ddef->data_type = DATATYPE_INT32;
+	ddef->bufsize   = nchans*nsamples*sizeof(INT32_T);
+	fill(DATATYPE_INT32, nchans*nsamples, samples);
+	for (i=0;i<nchans*nsamples;i++) samples[i] >>= 8;
+	def.command = PUT_DAT;
+	def.bufsize = sizeof(dbuf);
+	request.buf = dbuf;
+	failed |= check(dmarequest(&request, &response) == 0 && response->def->command == PUT_OK, "PUT_DAT failed");
+	cleanup_message((void **) &response);
+
+	/* the samples may come in more than one block */
+	while (received < nsamples && (msg = read_rda(sock, &mhdr)) != NULL) {
+		rda_msg_data_t *R = (rda_msg_data_t *) msg;
+		float *values = (float *) (R+1);
+		failed |= check(mhdr.nType == RDA_FLOAT_MSG, "not a float message");
+		for (i=0;i<R->nPoints*nchans;i++) {
+			UINT32_T k = received*nchans + i;
+			if (values[i] != (float) samples[k] * (float) res[k % nchans]) break;
+		}
+		failed |= check(i == R->nPoints*nchans, "the samples are not scaled with the resolutions");
+		received += R->nPoints;
+		free(msg);
+	}
+	failed |= check(received == nsamples, "not all samples arrived");
+
+	close_connection(sock);
+	rda_stop_server(rda);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	int reps = (argc>2) ? atoi(argv[2]) : 10;
+	int failed = 0, level;
+
+	for (level=FT_SIMD_NONE;level<=FT_SIMD_AVX2;level++) {
+		if (rda_aux_use_simd(level) != level) continue;
+		failed |= check_types();
+	}
+	measure(reps);
+
+	failed |= check_server(port);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
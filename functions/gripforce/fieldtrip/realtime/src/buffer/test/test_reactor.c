@@ -0,0 +1,299 @@
+/*
+ * Compares a server that serves its clients from the epoll reactor (see
+ * reactor.h) with one that starts a thread per client. With 100 idle clients
+ * connected, the reactor should not use any CPU, while the threads wake up
+ * every 10 ms; both should accept a new client right away. The reactor then
+ * has to serve 1000 clients that all send a request at once, wake up more
+ * WAIT_DAT clients than it has workers while yet another client puts the
+ * samples they wait for, time out a WAIT_DAT, answer those whose threshold
+ * is exceeded already, and send a GET_DAT response of several MB to a client
+ * that only starts reading after a while, also when the writer goes round
+ * the whole ring in the meantime. A client that is more than
+ * FT_ZEROCOPY_EVICT_MAX behind by then loses its connection instead.
+ *
+ * Use as
+ *    ./test_reactor [port] [clients]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#define TEST_NAME "test_reactor"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "zerocopy.h"
+#include "testutil.h"
+
+#define NCHANS    16
+#define NSAMPLES  65536   /* 4 MB of FLOAT32 samples for the large GET_DAT */
+#define IDLE      100     /* idle clients for the CPU comparison */
+#define CONNECTS  200     /* connections for the accept latency */
+#define NWAITING  (2*FT_SERVER_WORKERS + 1)
+
+/* seconds of CPU time used by this process so far */
+static double cpu(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + 1e-6*(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* only sends a request, for clients that are answered later, in one piece so Nagle's algorithm does not hold it back */
+static int post(int server, UINT16_T command, const void *buf, UINT32_T bufsize) {
+	char msg[sizeof(messagedef_t) + 64];
+	messagedef_t *def = (messagedef_t *) msg;
+	if (bufsize > 64) return 0;
+	def->version = VERSION;
+	def->command = command;
+	def->bufsize = bufsize;
+	if (bufsize > 0) memcpy(def+1, buf, bufsize);
+	return bufwrite(server, msg, sizeof(messagedef_t) + bufsize) == sizeof(messagedef_t) + bufsize;
+}
+
+/* reads a response of at most "size" bytes into buf, returns its command or 0 */
+static UINT16_T receive(int server, void *buf, UINT32_T size) {
+	messagedef_t def;
+	if (bufread(server, &def, sizeof(def)) != sizeof(def) || def.bufsize > size) return 0;
+	if (def.bufsize > 0 && bufread(server, buf, def.bufsize) != def.bufsize) return 0;
+	return def.command;
+}
+
+/* every value in the ring is different */
+static double ramp(UINT32_T s, UINT32_T c) {
+	return (double) s*NCHANS + c;
+}
+
+static int put_ramp(int server, UINT32_T first, UINT32_T nsamples) {
+	return put_samples(server, NCHANS, DATATYPE_FLOAT32, first, nsamples, nsamples, ramp);
+}
+
+static int count_clients(ft_buffer_server_t *server) {
+	int n;
+	pthread_mutex_lock(&server->lock);
+	n = server->numClients;
+	pthread_mutex_unlock(&server->lock);
+	return n;
+}
+
+/* waits up to a second for the server to see n clients */
+static int has_clients(ft_buffer_server_t *server, int n) {
+	int k;
+	for (k=0; k<100 && count_clients(server) != n; k++) usleep(10000);
+	return count_clients(server) == n;
+}
+
+/* CPU time per second of wall clock time while IDLE clients are connected */
+static double idle_cpu(ft_buffer_server_t *server, int port, int *failed) {
+	int client[IDLE], k;
+	double t0, c0, load;
+
+	for (k=0; k<IDLE; k++) client[k] = open_connection("localhost", port);
+	*failed |= check(has_clients(server, IDLE), "not all idle clients were accepted");
+	t0 = now();
+	c0 = cpu();
+	usleep(1000000);
+	load = (cpu() - c0) / (now() - t0);
+	for (k=0; k<IDLE; k++) close_connection(client[k]);
+	*failed |= check(has_clients(server, 0), "the idle clients were not all closed");
+	return load;
+}
+
+/* median time to connect and get an answer to GET_HDR */
+static double connect_time(int port, int *failed) {
+	double t[CONNECTS], t0;
+	int k;
+
+	for (k=0; k<CONNECTS; k++) {
+		int client;
+		t0 = now();
+		client = open_connection("localhost", port);
+		*failed |= check(client >= 0 && request(client, GET_HDR, NULL, 0) == GET_OK, "no answer after connecting");
+		t[k] = now() - t0;
+		close_connection(client);
+	}
+	qsort(t, CONNECTS, sizeof(double), compare);
+	return t[CONNECTS/2];
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1977;
+	int nclients = (argc>2) ? atoi(argv[2]) : 1000;
+	ft_buffer_server_t *reactor, *threads;
+	struct rlimit rl;
+	headerdef_t hdef;
+	waitdef_t wd;
+	samples_events_t se;
+	datasel_t sel;
+	int *client, writer, reader, other, failed = 0, ok, k;
+	UINT32_T i;
+	double t0, loadReactor, loadThreads, elapsed;
+	char *big;
+	message_t *response;
+
+	/* both ends of every connection are in this process */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if ((double) rl.rlim_cur < 3.0*nclients + 100) {
+		nclients = (int) (rl.rlim_cur - 100) / 3;
+		printf("only %u file descriptors, testing with %i clients\n", (unsigned) rl.rlim_cur, nclients);
+	}
+
+	reactor = ft_start_buffer_server(port, NULL, NULL, NULL);
+	ft_set_server_workers(0);
+	threads = ft_start_buffer_server(port+1, NULL, NULL, NULL);
+	ft_set_server_workers(FT_SERVER_WORKERS);
+	if (reactor == NULL || threads == NULL) {
+		fprintf(stderr, "test_reactor: could not start the servers on ports %i and %i\n", port, port+1);
+		return 1;
+	}
+	reactor->verbosity = threads->verbosity = 0;
+	failed |= check(reactor->reactor != NULL && threads->reactor == NULL, "the servers do not have the right kind");
+
+	failed |= check(put_header(-1, NCHANS, DATATYPE_FLOAT32, 0, 0), "PUT_HDR failed");
+
+	/* idle clients, and new ones */
+	loadThreads = idle_cpu(threads, port+1, &failed);
+	loadReactor = idle_cpu(reactor, port, &failed);
+	printf("CPU load with %i idle clients: %.2f%% with a thread per client, %.2f%% with the reactor\n", IDLE, 100*loadThreads, 100*loadReactor);
+	failed |= check(loadReactor < 0.01 && loadReactor < loadThreads, "the reactor is busy without clients to serve");
+	printf("connecting and GET_HDR: %.3f ms with a thread per client, %.3f ms with the reactor\n",
+	       1e3*connect_time(port+1, &failed), 1e3*connect_time(port, &failed));
+
+	/* many clients that all send a request at the same time */
+	client = (int *) malloc(nclients * sizeof(int));
+	for (k=0; k<nclients; k++) {
+		client[k] = open_connection("localhost", port);
+		if (client[k] < 0) {
+			fprintf(stderr, "test_reactor: could only connect %i clients\n", k);
+			return 1;
+		}
+	}
+	failed |= check(has_clients(reactor, nclients), "not all clients were accepted");
+	t0 = now();
+	for (k=0; k<nclients; k++) post(client[k], GET_HDR, NULL, 0);
+	for (ok=0, k=0; k<nclients; k++) ok += receive(client[k], &hdef, sizeof(hdef)) == GET_OK;
+	elapsed = now() - t0;
+	failed |= check(ok == nclients, "not all clients got an answer");
+	printf("%i clients sent GET_HDR at once, %i answers in %.1f ms\n", nclients, ok, 1e3*elapsed);
+
+	/* more clients wait than there are workers, which does not keep a writer out */
+	wd.threshold.nsamples = 0;
+	wd.threshold.nevents  = 0xFFFFFFFEu;
+	wd.milliseconds = 5000;
+	for (k=0; k<NWAITING; k++) post(client[k], WAIT_DAT, &wd, sizeof(wd));
+	usleep(20000);
+	writer = client[NWAITING];
+	t0 = now();
+	failed |= check(put_ramp(writer, 0, 10), "PUT_DAT failed while clients were waiting");
+	for (ok=0, k=0; k<NWAITING; k++) ok += receive(client[k], &se, sizeof(se)) == WAIT_OK && se.nsamples == 10;
+	elapsed = now() - t0;
+	failed |= check(ok == NWAITING, "not all waiting clients were woken up");
+	failed |= check(elapsed < 1.0, "the waiting clients took too long");
+	printf("%i clients in WAIT_DAT with %i workers woken up by PUT_DAT after %.2f ms\n", ok, FT_SERVER_WORKERS, 1e3*elapsed);
+
+	/* the timeout of WAIT_DAT */
+	wd.threshold.nsamples = 10;
+	wd.milliseconds = 50;
+	t0 = now();
+	ok = post(client[0], WAIT_DAT, &wd, sizeof(wd)) && receive(client[0], &se, sizeof(se)) == WAIT_OK && se.nsamples == 10;
+	elapsed = now() - t0;
+	failed |= check(ok && elapsed >= 0.045 && elapsed < 1.0, "WAIT_DAT did not time out after 50 ms");
+
+	/* a threshold that is exceeded already is answered at once, by all workers together */
+	wd.threshold.nsamples = 5;
+	wd.milliseconds = 5000;
+	t0 = now();
+	for (k=0; k<NWAITING; k++) post(client[k], WAIT_DAT, &wd, sizeof(wd));
+	for (ok=0, k=0; k<NWAITING; k++) ok += receive(client[k], &se, sizeof(se)) == WAIT_OK && se.nsamples == 10;
+	elapsed = now() - t0;
+	failed |= check(ok == NWAITING && elapsed < 1.0, "WAIT_DAT over the threshold was not answered at once");
+
+	for (k=0; k<nclients; k++) close_connection(client[k]);
+	free(client);
+	failed |= check(has_clients(reactor, 0), "not all clients were closed");
+
+	/* a large GET_DAT to a client that reads late */
+	writer = open_connection("localhost", port);
+	for (i=0; i<NSAMPLES; i+=4096) failed |= check(put_ramp(writer, i, 4096), "PUT_DAT of large blocks failed");
+	/* after the 10 samples of the WAIT_DAT test */
+	sel.begsample = 10;
+	sel.endsample = 10 + NSAMPLES-1;
+	big = (char *) malloc(sizeof(datadef_t) + 2*NSAMPLES*NCHANS*sizeof(FLOAT32_T));
+	ok = big != NULL && post(writer, GET_DAT, &sel, sizeof(sel));
+	usleep(200000);
+	ok = ok && receive(writer, big, sizeof(datadef_t) + NSAMPLES*NCHANS*sizeof(FLOAT32_T)) == GET_OK;
+	if (ok) {
+		const FLOAT32_T *samples = (const FLOAT32_T *) (big + sizeof(datadef_t));
+		for (i=0; i<NSAMPLES*NCHANS && ok; i++) ok = samples[i] == (FLOAT32_T) i;
+	}
+	failed |= check(ok, "the large GET_DAT response is not right");
+	/* the ring was not kept locked while the client did not read */
+	failed |= check(put_ramp(writer, NSAMPLES, 10), "PUT_DAT failed after the large GET_DAT");
+
+	/* the same again, but now the writer goes round the whole ring before the
+	   client reads, so it has to evict the pin and the client gets a copy; a
+	   small receive buffer makes sure that the response does not fit in it */
+	reader = open_connection("localhost", port);
+	k = 64*1024;
+	setsockopt(reader, SOL_SOCKET, SO_RCVBUF, &k, sizeof(k));
+	ok = big != NULL && post(reader, GET_DAT, &sel, sizeof(sel));
+	usleep(200000);
+	other = open_connection("localhost", port);
+	t0 = now();
+	for (i=0; i<MAXNUMSAMPLE && ok; i+=4096) ok = put_ramp(other, NSAMPLES+10+i, 4096);
+	elapsed = now() - t0;
+	close_connection(other);
+	failed |= check(ok && elapsed < 10.0, "the writer could not go round the ring while a client did not read");
+	ok = ok && receive(reader, big, sizeof(datadef_t) + NSAMPLES*NCHANS*sizeof(FLOAT32_T)) == GET_OK;
+	if (ok) {
+		const FLOAT32_T *samples = (const FLOAT32_T *) (big + sizeof(datadef_t));
+		for (i=0; i<NSAMPLES*NCHANS && ok; i++) ok = samples[i] == (FLOAT32_T) i;
+	}
+	failed |= check(ok, "the large GET_DAT response was overwritten while the client did not read");
+	close_connection(reader);
+
+	/* twice as much is more than the writer copies, so that client is dropped */
+	response = send_request(-1, GET_HDR, NULL, 0);
+	failed |= check(response != NULL, "GET_HDR failed");
+	if (response != NULL) {
+		sel.endsample = ((headerdef_t *) response->buf)->nsamples - 1;
+		sel.begsample = sel.endsample + 1 - 2*NSAMPLES;
+		release(&response);
+	}
+	failed |= check(2*NSAMPLES*NCHANS*sizeof(FLOAT32_T) > FT_ZEROCOPY_EVICT_MAX + 1024*1024, "the response is too small to test the limit of the copy");
+	reader = open_connection("localhost", port);
+	k = 64*1024;
+	setsockopt(reader, SOL_SOCKET, SO_RCVBUF, &k, sizeof(k));
+	ok = big != NULL && post(reader, GET_DAT, &sel, sizeof(sel));
+	usleep(200000);
+	other = open_connection("localhost", port);
+	t0 = now();
+	for (k=0; k<MAXNUMSAMPLE && ok; k+=4096) ok = put_ramp(other, sel.endsample+1+k, 4096);
+	elapsed = now() - t0;
+	close_connection(other);
+	failed |= check(ok && elapsed < 10.0, "the writer could not go round the ring while a client that is far behind did not read");
+	failed |= check(receive(reader, big, sizeof(datadef_t) + 2*NSAMPLES*NCHANS*sizeof(FLOAT32_T)) == 0, "a client that is too far behind still got its response");
+	close_connection(reader);
+	close_connection(writer);
+	free(big);
+
+	ft_stop_buffer_server(reactor);
+	ft_stop_buffer_server(threads);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
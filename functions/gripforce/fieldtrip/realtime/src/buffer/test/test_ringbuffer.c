@@ -0,0 +1,160 @@
+/*
+ * Benchmark of the lock-free sample ring against the previous locking scheme,
+ * with one writer and an increasing number of concurrent readers. In "mutex"
+ * mode every write and read is done while holding a single mutex, which is
+ * what dmarequest used to do with mutexheader + mutexdata.
+ *
+ * Use as
+ *    ./test_ringbuffer [nchans] [blocksize] [readsize] [seconds]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+#include "ringbuffer.h"
+
+#define MAXREADERS 64
+
+typedef struct {
+	ft_ring_t ring;
+	pthread_mutex_t lock;
+	int useLock;
+	volatile int keepRunning;
+	UINT32_T blocksize;
+	UINT32_T readsize;
+	/* writer statistics */
+	double writeMax;
+	double writeSum;
+	unsigned long numWrites;
+} bench_t;
+
+typedef struct {
+	bench_t *B;
+	unsigned long numReads;
+	unsigned long numOverwritten;
+} reader_t;
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+void *writer_func(void *arg) {
+	bench_t *B = (bench_t *) arg;
+	char *block = (char *) malloc((size_t) B->blocksize * B->ring.chansize);
+	memset(block, 1, (size_t) B->blocksize * B->ring.chansize);
+
+	while (B->keepRunning) {
+		double t0 = now(), dt;
+		if (B->useLock) pthread_mutex_lock(&B->lock);
+		ft_ring_write(&B->ring, block, B->blocksize);
+		if (B->useLock) pthread_mutex_unlock(&B->lock);
+		dt = now() - t0;
+		if (dt > B->writeMax) B->writeMax = dt;
+		B->writeSum += dt;
+		B->numWrites++;
+	}
+	free(block);
+	return NULL;
+}
+
+void *reader_func(void *arg) {
+	reader_t *R = (reader_t *) arg;
+	bench_t *B = R->B;
+	char *dest = (char *) malloc((size_t) B->readsize * B->ring.chansize);
+
+	while (B->keepRunning) {
+		UINT32_T n;
+		int res;
+
+		if (B->useLock) pthread_mutex_lock(&B->lock);
+		n = ft_ring_count(&B->ring);
+		if (n < B->readsize) {
+			if (B->useLock) pthread_mutex_unlock(&B->lock);
+			continue;
+		}
+		/* read the most recent samples, like a realtime client would */
+		res = ft_ring_read(&B->ring, n - B->readsize, B->readsize, dest);
+		if (B->useLock) pthread_mutex_unlock(&B->lock);
+
+		if (res == FT_RING_OK) {
+			R->numReads++;
+		} else {
+			R->numOverwritten++;
+		}
+	}
+	free(dest);
+	return NULL;
+}
+
+void run(int useLock, int numReaders, UINT32_T nchans, UINT32_T blocksize, UINT32_T readsize, double seconds) {
+	bench_t B;
+	reader_t R[MAXREADERS];
+	pthread_t wtid, rtid[MAXREADERS];
+	unsigned long numReads = 0, numOverwritten = 0;
+	double t0, elapsed;
+	int i;
+
+	memset(&B, 0, sizeof(B));
+	if (ft_ring_init(&B.ring, 16*readsize, nchans*sizeof(FLOAT32_T)) != 0) {
+		fprintf(stderr, "test_ringbuffer: out of memory\n");
+		exit(1);
+	}
+	pthread_mutex_init(&B.lock, NULL);
+	B.useLock = useLock;
+	B.keepRunning = 1;
+	B.blocksize = blocksize;
+	B.readsize = readsize;
+
+	t0 = now();
+	pthread_create(&wtid, NULL, writer_func, &B);
+	for (i=0; i<numReaders; i++) {
+		R[i].B = &B;
+		R[i].numReads = R[i].numOverwritten = 0;
+		pthread_create(&rtid[i], NULL, reader_func, &R[i]);
+	}
+
+	usleep((unsigned int) (seconds*1000000));
+	B.keepRunning = 0;
+
+	pthread_join(wtid, NULL);
+	for (i=0; i<numReaders; i++) {
+		pthread_join(rtid[i], NULL);
+		numReads += R[i].numReads;
+		numOverwritten += R[i].numOverwritten;
+	}
+	elapsed = now() - t0;
+
+	printf("%-8s %7d %14.0f %12.2f %12.2f %14.0f %10lu\n", useLock ? "mutex" : "seqlock", numReaders,
+		B.numWrites * (double) blocksize / elapsed,
+		1e6 * B.writeSum / (B.numWrites ? B.numWrites : 1), 1e6 * B.writeMax,
+		numReads / elapsed, numOverwritten);
+
+	ft_ring_free(&B.ring);
+	pthread_mutex_destroy(&B.lock);
+}
+
+int main(int argc, char *argv[]) {
+	UINT32_T nchans    = (argc>1) ? atoi(argv[1]) : 64;
+	UINT32_T blocksize = (argc>2) ? atoi(argv[2]) : 32;
+	UINT32_T readsize  = (argc>3) ? atoi(argv[3]) : 2048;
+	double   seconds   = (argc>4) ? atof(argv[4]) : 1.0;
+	int numReaders, useLock;
+
+	printf("nchans = %u, blocksize = %u, readsize = %u, %.1f seconds per run\n", nchans, blocksize, readsize, seconds);
+	printf("%-8s %7s %14s %12s %12s %14s %10s\n", "mode", "readers", "write smp/s", "write us", "max us", "reads/s", "overwrite");
+
+	for (numReaders = 1; numReaders <= MAXREADERS; numReaders *= 2) {
+		for (useLock = 1; useLock >= 0; useLock--) {
+			run(useLock, numReaders, nchans, blocksize, readsize, seconds);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Runs a buffer server with the shared memory transport (shm://name) in a
+ * child process, and compares the latency of GET_DAT requests that are
+ * answered from the shared ring with those that go over the UNIX domain
+ * socket. It also checks that the client notices when the server flushes
+ * the data or replaces the ring, and that named streams work.
+ *
+ * Use as
+ *    ./test_shm [name] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define TEST_NAME "test_shm"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "shm.h"
+#include "testutil.h"
+
+#define NCHANS    64
+#define BLOCKSIZE 10
+
+static volatile int keepRunning = 1;
+
+static void stop_handler(int sig) {
+	keepRunning = 0;
+}
+
+static int run_server(const char *address) {
+	ft_buffer_server_t *server;
+
+	signal(SIGTERM, stop_handler);
+	server = ft_start_buffer_server(0, address, NULL, NULL);
+	if (server == NULL) return 1;
+	server->verbosity = 0;
+	while (keepRunning) usleep(10000);
+	ft_stop_buffer_server(server);
+	ft_free_streams();
+	return 0;
+}
+
+/* reads samples beg..end and checks them, returns 1 if they are right */
+static int get_data(int server, UINT32_T nchans, UINT32_T beg, UINT32_T end) {
+	datasel_t sel;
+	message_t *resp;
+	int ok;
+
+	sel.begsample = beg;
+	sel.endsample = end;
+	resp = send_request(server, GET_DAT, &sel, sizeof(sel));
+	ok = (resp != NULL && resp->def->command == GET_OK);
+	if (ok) {
+		const datadef_t *ddef = (const datadef_t *) resp->buf;
+		const float *samples = (const float *) (ddef+1);
+		ok = (ddef->nchans == nchans && ddef->nsamples == end-beg+1);
+		ok = ok && samples[0] == (float) beg && samples[(end-beg+1)*nchans-1] == (float) end;
+	}
+	release(&resp);
+	return ok;
+}
+
+static double latency(int server, int reps) {
+	double t0 = now();
+	int k;
+	for (k=0; k<reps; k++) {
+		if (!get_data(server, NCHANS, 100, 100+BLOCKSIZE-1)) {
+			fprintf(stderr, "test_shm: wrong samples\n");
+			exit(1);
+		}
+	}
+	return 1e6 * (now() - t0) / reps;
+}
+
+int main(int argc, char *argv[]) {
+	const char *name = (argc>1) ? argv[1] : "test_shm";
+	int reps = (argc>2) ? atoi(argv[2]) : 20000;
+	char address[64], path[256], control[64];
+	int server, plain, failed = 0;
+	unsigned long local;
+	pid_t child;
+
+	sprintf(address, "shm://%s", name);
+	if (ft_shm_socket_path(name, path, sizeof(path)) != 0) return 1;
+
+	child = fork();
+	if (child == 0) return run_server(address);
+	usleep(200000);
+
+	server = open_connection(address, 0);
+	plain  = open_unix_connection(path);
+	if (server <= 0 || plain <= 0) {
+		fprintf(stderr, "test_shm: could not connect to %s\n", address);
+		kill(child, SIGTERM);
+		return 1;
+	}
+
+	failed |= check(put_header(server, NCHANS, DATATYPE_FLOAT32, 0, 0), "PUT_HDR failed");
+	failed |= check(put_samples(server, NCHANS, DATATYPE_FLOAT32, 0, 100*BLOCKSIZE, BLOCKSIZE, NULL), "PUT_DAT failed");
+
+	printf("GET_DAT of %i samples x %i channels\n", BLOCKSIZE, NCHANS);
+	printf("%-7s %10s\n", "mode", "us/read");
+	printf("%-7s %10.2f\n", "socket", latency(plain, reps));
+	printf("%-7s %10.2f\n", "shm", latency(server, reps));
+	local = ft_shm_local_requests(server);
+	failed |= check(local == (unsigned long) reps, "not all requests were answered from shared memory");
+
+	/* after FLUSH_DAT, the old samples must not be returned anymore */
+	failed |= check(request(server, FLUSH_DAT, NULL, 0) == FLUSH_OK, "FLUSH_DAT failed");
+	failed |= check(request(server, GET_DAT, NULL, 0) == GET_ERR, "GET_DAT after FLUSH_DAT should fail");
+	failed |= check(put_samples(server, NCHANS, DATATYPE_FLOAT32, 0, 5*BLOCKSIZE, BLOCKSIZE, NULL) && get_data(server, NCHANS, 0, 49), "wrong samples after FLUSH_DAT");
+
+	/* a new header means a new ring, which the client has to map */
+	failed |= check(put_header(server, 2*NCHANS, DATATYPE_FLOAT32, 0, 0), "second PUT_HDR failed");
+	failed |= check(put_samples(server, 2*NCHANS, DATATYPE_FLOAT32, 0, 3*BLOCKSIZE, BLOCKSIZE, NULL) && get_data(server, 2*NCHANS, 0, 29), "wrong samples after the second PUT_HDR");
+
+	/* named streams have a ring of their own */
+	failed |= check(request(server, OPEN_STREAM, "other", 5) == OPEN_OK, "OPEN_STREAM failed");
+	failed |= check(put_header(server, 3, DATATYPE_FLOAT32, 0, 0) && put_samples(server, 3, DATATYPE_FLOAT32, 0, 2*BLOCKSIZE, BLOCKSIZE, NULL) && get_data(server, 3, 0, 19), "wrong samples in a named stream");
+	failed |= check(ft_shm_local_requests(server) == local + 3, "GET_DAT did not use shared memory");
+
+	close_connection(server);
+	close_connection(plain);
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+
+	/* the server should have removed its shared memory */
+	sprintf(control, "/ft_%s", name);
+	failed |= check(shm_open(control, O_RDONLY, 0) < 0, "the shared memory was not removed");
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,240 @@
+/*
+ * Checks the service time histograms of stats.h: that every time falls into
+ * the bucket whose bounds hold it, that percentiles come out within a bucket,
+ * and that a server counts the requests of a local TCP connection, with their
+ * sizes and the GET_DAT of samples that were overwritten, in GET_STATS of
+ * either byte order. Measures what counting a request costs.
+ *
+ * Use as
+ *    ./test_stats [port]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_stats"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "stats.h"
+#include "testutil.h"
+
+#define NCHANS    16
+#define CAPACITY  2048
+#define BLOCKSIZE 256
+#define NBLOCKS   20
+#define NREADS    50
+
+static UINT32_T seed = 12345;
+
+static UINT32_T random32(void) {
+	seed = seed * 1664525u + 1013904223u;
+	return seed;
+}
+
+static int check_buckets(void) {
+	UINT32_T bucket[FT_STATS_BUCKETS];
+	UINT64_T v;
+	UINT32_T i, k;
+	double p;
+	int failed = 0;
+
+	for (i=0; i<8; i++) failed |= check(ft_stats_bucket(i) == i && ft_stats_bucket_low(i) == i, "short times are not counted exactly");
+	for (i=0; i+1<FT_STATS_BUCKETS; i++) {
+		failed |= check(ft_stats_bucket_low(i) < ft_stats_bucket_low(i+1), "the buckets do not go up");
+		failed |= check(ft_stats_bucket(ft_stats_bucket_low(i)) == i, "the lower bound of a bucket is not in it");
+		failed |= check(ft_stats_bucket(ft_stats_bucket_low(i+1)-1) == i, "the upper bound of a bucket is not in it");
+		if (failed) return failed;
+	}
+	for (k=0; k<100000; k++) {
+		v = ((UINT64_T) random32() << 8) >> (random32() % 40);
+		i = ft_stats_bucket(v);
+		/* at most 1/8 of the time too low */
+		failed |= check(i == FT_STATS_BUCKETS-1 || (ft_stats_bucket_low(i) <= v && v < ft_stats_bucket_low(i+1)), "a time is not in its bucket");
+		failed |= check(i < 8 || (v - ft_stats_bucket_low(i)) * 8 <= v, "a bucket is wider than 12.5%");
+		if (failed) return failed;
+	}
+	failed |= check(ft_stats_bucket((UINT64_T) 1 << 50) == FT_STATS_BUCKETS-1, "a very long time is not in the last bucket");
+
+	/* 1..1000000 ns, once each */
+	memset(bucket, 0, sizeof(bucket));
+	for (v=1; v<=1000000; v++) bucket[ft_stats_bucket(v)]++;
+	p = ft_stats_percentile(bucket, FT_STATS_BUCKETS, 0.5);
+	failed |= check(p > 500000*0.875 && p < 500000*1.125, "the median is off");
+	p = ft_stats_percentile(bucket, FT_STATS_BUCKETS, 0.99);
+	failed |= check(p > 990000*0.875 && p < 990000*1.125, "the 99th percentile is off");
+	p = ft_stats_percentile(bucket, FT_STATS_BUCKETS, 0.0);
+	failed |= check(p >= 1 && p < 2, "the minimum is off");
+	memset(bucket, 0, sizeof(bucket));
+	failed |= check(ft_stats_percentile(bucket, FT_STATS_BUCKETS, 0.5) == 0, "percentile of nothing");
+	return failed;
+}
+
+static void measure_overhead(void) {
+	int k, n = 1000000;
+	double t0, t1, t2;
+
+	t0 = now();
+	for (k=0; k<n; k++) ft_stats_now();
+	t1 = now();
+	for (k=0; k<n; k++) ft_stats_record(0x7777, ft_stats_now(), 100, 100);
+	t2 = now();
+	printf("counting a request: %.1f ns, of which %.1f ns for each of the two clock readings\n", 1e9*(t2-t1)/n, 1e9*(t1-t0)/n);
+	ft_stats_reset();
+}
+
+/* the statscmd_t of a command in a GET_STATS response, or NULL */
+static statscmd_t *find_command(void *buf, UINT32_T command) {
+	statsdef_t *sdef = (statsdef_t *) buf;
+	char *cmd = (char *) (sdef + 1);
+	UINT32_T n;
+	for (n=0; n<sdef->ncommands; n++) {
+		if (((statscmd_t *) cmd)->command == command) return (statscmd_t *) cmd;
+		cmd += sizeof(statscmd_t) + sdef->nbuckets*sizeof(UINT32_T);
+	}
+	return NULL;
+}
+
+/* GET_STATS in the other byte order, swapped back here */
+static int swapped_stats(int server, char **dest, UINT32_T *size) {
+	messagedef_t def;
+	statsdef_t *sdef;
+	UINT32_T n;
+	char *cmd;
+
+	def.version = VERSION;
+	def.command = GET_STATS;
+	def.bufsize = 0;
+	ft_swap16(2, &def);
+	if (bufwrite(server, &def, sizeof(def)) != sizeof(def)) return 0;
+	if (bufread(server, &def, sizeof(def)) != sizeof(def)) return 0;
+	ft_swap16(2, &def);
+	ft_swap32(1, &def.bufsize);
+	if (def.command != STATS_OK || def.bufsize < sizeof(statsdef_t)) return 0;
+	*dest = (char *) malloc(def.bufsize);
+	if (bufread(server, *dest, def.bufsize) != def.bufsize) return 0;
+	*size = def.bufsize;
+
+	sdef = (statsdef_t *) *dest;
+	ft_swap32(8, sdef);
+	cmd = (char *) (sdef + 1);
+	for (n=0; n<sdef->ncommands; n++) {
+		ft_swap32(2, cmd);
+		ft_swap64(3, cmd + 8);
+		ft_swap32(sdef->nbuckets, cmd + sizeof(statscmd_t));
+		cmd += sizeof(statscmd_t) + sdef->nbuckets*sizeof(UINT32_T);
+	}
+	return 1;
+}
+
+static int check_server(int port) {
+	UINT32_T rawsize = NCHANS*BLOCKSIZE*sizeof(INT32_T), i, k, size = 0;
+	UINT64_T putsize = sizeof(messagedef_t) + sizeof(datadef_t) + rawsize;
+	char *swapped = NULL;
+	message_t *response = NULL;
+	datasel_t sel;
+	statsdef_t *sdef;
+	statscmd_t *put, *get;
+	UINT64_T getsize;
+	int client, raw, failed = 0;
+
+	client = open_connection("localhost", port);
+	raw = open_connection("localhost", port);
+	if (client < 0 || raw < 0) {
+		fprintf(stderr, "test_stats: could not connect\n");
+		return 1;
+	}
+
+	failed |= check(put_header(client, NCHANS, DATATYPE_INT32, 0, 0), "PUT_HDR failed");
+	failed |= check(put_samples(client, NCHANS, DATATYPE_INT32, 0, NBLOCKS*BLOCKSIZE, BLOCKSIZE, NULL), "PUT_DAT failed");
+
+	/* small ones that are copied, a large one from the ring, and one that has been overwritten */
+	for (k=0; k<NREADS; k++) {
+		sel.begsample = NBLOCKS*BLOCKSIZE - 16;
+		sel.endsample = NBLOCKS*BLOCKSIZE - 1;
+		failed |= check(request(client, GET_DAT, &sel, sizeof(sel)) == GET_OK, "GET_DAT failed");
+	}
+	sel.begsample = NBLOCKS*BLOCKSIZE - CAPACITY;
+	failed |= check(request(client, GET_DAT, &sel, sizeof(sel)) == GET_OK, "GET_DAT of the whole ring failed");
+	sel.begsample = 0;
+	failed |= check(request(client, GET_DAT, &sel, sizeof(sel)) == GET_ERR, "GET_DAT of overwritten samples did not fail");
+	getsize = (UINT64_T) NREADS * (sizeof(messagedef_t) + sizeof(datadef_t) + 16*NCHANS*sizeof(INT32_T))
+		+ sizeof(messagedef_t) + sizeof(datadef_t) + CAPACITY*NCHANS*sizeof(INT32_T) + sizeof(messagedef_t);
+
+	response = send_request(client, GET_STATS, NULL, 0);
+	failed |= check(response != NULL && response->def->command == STATS_OK, "GET_STATS failed");
+	if (failed) return failed;
+	sdef = (statsdef_t *) response->buf;
+	failed |= check(response->def->bufsize == sizeof(statsdef_t) + sdef->bufsize
+			&& sdef->bufsize == sdef->ncommands * (sizeof(statscmd_t) + sdef->nbuckets*sizeof(UINT32_T))
+			&& sdef->nbuckets == FT_STATS_BUCKETS, "the size of the response is wrong");
+	failed |= check(sdef->capacity == CAPACITY && sdef->nsamples == NBLOCKS*BLOCKSIZE && sdef->first == NBLOCKS*BLOCKSIZE - CAPACITY, "the ring is not described");
+	failed |= check(sdef->overruns == 1, "the overwritten samples were not counted");
+	put = find_command(response->buf, PUT_DAT);
+	get = find_command(response->buf, GET_DAT);
+	failed |= check(find_command(response->buf, GET_STATS) == NULL, "GET_STATS is counted before it has been answered");
+	failed |= check(put != NULL && put->count == NBLOCKS && put->bytes_in == NBLOCKS*putsize && put->bytes_out == NBLOCKS*sizeof(messagedef_t), "PUT_DAT was not counted");
+	failed |= check(get != NULL && get->count == NREADS+2 && get->bytes_in == (NREADS+2)*(sizeof(messagedef_t) + sizeof(datasel_t)) && get->bytes_out == getsize, "GET_DAT was not counted");
+	if (failed) return failed;
+	{
+		UINT32_T *bucket = (UINT32_T *) (get + 1), total = 0;
+		double p50 = ft_stats_percentile(bucket, sdef->nbuckets, 0.5);
+		double p99 = ft_stats_percentile(bucket, sdef->nbuckets, 0.99);
+		double p999 = ft_stats_percentile(bucket, sdef->nbuckets, 0.999);
+		for (i=0; i<sdef->nbuckets; i++) total += bucket[i];
+		failed |= check(total == get->count, "the buckets do not add up");
+		failed |= check(get->total_ns > 0 && p50 > 0 && p50 <= p99 && p99 <= p999, "the percentiles are not in order");
+		failed |= check(get->total_ns / get->count < (UINT64_T) 1e9, "GET_DAT took too long");
+		printf("GET_DAT: %u requests, mean %.1f us, p50 %.1f us, p99 %.1f us\n", get->count, 1e-3*get->total_ns/get->count, 1e-3*p50, 1e-3*p99);
+	}
+
+	/* the same in the other byte order, and with reset */
+	failed |= check(swapped_stats(raw, &swapped, &size), "GET_STATS in the other byte order failed");
+	if (failed) return failed;
+	sdef = (statsdef_t *) swapped;
+	failed |= check(sdef->capacity == CAPACITY && sdef->nbuckets == FT_STATS_BUCKETS && sdef->overruns == 1, "the statsdef_t was not swapped");
+	get = find_command(swapped, GET_DAT);
+	failed |= check(get != NULL && get->count == NREADS+2 && get->bytes_out == getsize, "the statscmd_t were not swapped");
+	free(swapped);
+
+	i = FT_STATS_RESET;
+	failed |= check(request(client, GET_STATS, &i, sizeof(i)) == STATS_OK, "GET_STATS with reset failed");
+	release(&response);
+	response = send_request(client, GET_STATS, NULL, 0);
+	failed |= check(response != NULL && response->def->command == STATS_OK, "GET_STATS after reset failed");
+	if (failed) return failed;
+	sdef = (statsdef_t *) response->buf;
+	failed |= check(sdef->ncommands == 1 && find_command(response->buf, GET_STATS) != NULL && sdef->overruns == 0, "the counters were not reset");
+
+	release(&response);
+	close_connection(client);
+	close_connection(raw);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	capacitydef_t capacity = {0, 0, CAPACITY, 0};
+	ft_buffer_server_t *server;
+	int failed = 0;
+
+	failed |= check_buckets();
+	measure_overhead();
+
+	ft_set_default_capacity(&capacity);
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_stats: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	failed |= check_server(port);
+	ft_stop_buffer_server(server);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,206 @@
+/*
+ * Runs a number of (in-process) clients in parallel, each of which opens its
+ * own named stream with OPEN_STREAM and writes a header with a different
+ * number of channels, data and events to it. Afterwards every client checks
+ * that it only sees its own header, samples and events, and that the default
+ * stream has not been touched.
+ *
+ * Use as
+ *    ./test_streams [numstreams] [numblocks]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+#include "stream.h"
+
+#define BLOCKSIZE 32
+
+typedef struct {
+	int id;
+	int numblocks;
+	int failed;
+} client_t;
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+static UINT16_T request(UINT16_T command, void *buf, UINT32_T bufsize, message_t **resp) {
+	messagedef_t def;
+	message_t msg;
+	UINT16_T result;
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	msg.def = &def;
+	msg.buf = buf;
+	*resp = NULL;
+	if (dmarequest(&msg, resp) != 0 || *resp == NULL) {
+		fprintf(stderr, "test_streams: dmarequest failed\n");
+		exit(1);
+	}
+	result = (*resp)->def->command;
+	return result;
+}
+
+static void free_response(message_t *resp) {
+	if (resp == NULL) return;
+	FREE(resp->buf);
+	FREE(resp->def);
+	FREE(resp);
+}
+
+static int check(client_t *C, int ok, const char *what) {
+	if (!ok) {
+		fprintf(stderr, "test_streams: stream %i: %s\n", C->id, what);
+		C->failed = 1;
+	}
+	return ok;
+}
+
+void *client_func(void *arg) {
+	client_t *C = (client_t *) arg;
+	message_t *resp;
+	char name[32];
+	UINT32_T nchans = C->id + 1;
+	char *buf;
+	headerdef_t hdef;
+	datadef_t *ddef;
+	int i, j;
+
+	sprintf(name, "stream%i", C->id);
+	check(C, request(OPEN_STREAM, name, strlen(name), &resp) == OPEN_OK, "OPEN_STREAM failed");
+	free_response(resp);
+
+	memset(&hdef, 0, sizeof(hdef));
+	hdef.nchans    = nchans;
+	hdef.fsample   = 1000;
+	hdef.data_type = DATATYPE_INT32;
+	check(C, request(PUT_HDR, &hdef, sizeof(hdef), &resp) == PUT_OK, "PUT_HDR failed");
+	free_response(resp);
+
+	/* the samples in each stream contain the stream id, so we can check where they ended up */
+	buf = (char *) malloc(sizeof(datadef_t) + BLOCKSIZE*nchans*sizeof(INT32_T));
+	ddef = (datadef_t *) buf;
+	ddef->nchans    = nchans;
+	ddef->nsamples  = BLOCKSIZE;
+	ddef->data_type = DATATYPE_INT32;
+	ddef->bufsize   = BLOCKSIZE*nchans*sizeof(INT32_T);
+	for (j=0; j<BLOCKSIZE*nchans; j++) ((INT32_T *) (ddef+1))[j] = C->id;
+
+	for (i=0; i<C->numblocks; i++) {
+		check(C, request(PUT_DAT, buf, sizeof(datadef_t) + ddef->bufsize, &resp) == PUT_OK, "PUT_DAT failed");
+		free_response(resp);
+		if (i % 10 == 0) {
+			struct {
+				eventdef_t def;
+				char type[8];
+				INT32_T value;
+			} evt;
+			memset(&evt, 0, sizeof(evt));
+			evt.def.type_type   = DATATYPE_CHAR;
+			evt.def.type_numel  = 8;
+			evt.def.value_type  = DATATYPE_INT32;
+			evt.def.value_numel = 1;
+			evt.def.sample      = i*BLOCKSIZE;
+			evt.def.bufsize     = 8 + sizeof(INT32_T);
+			memcpy(evt.type, "stream  ", 8);
+			evt.value = C->id;
+			check(C, request(PUT_EVT, &evt, sizeof(evt), &resp) == PUT_OK, "PUT_EVT failed");
+			free_response(resp);
+		}
+	}
+	free(buf);
+
+	/* now check that this stream only contains what we wrote */
+	if (check(C, request(GET_HDR, NULL, 0, &resp) == GET_OK, "GET_HDR failed")) {
+		const headerdef_t *h = (const headerdef_t *) resp->buf;
+		check(C, h->nchans == nchans, "wrong number of channels");
+		check(C, h->nsamples == (UINT32_T) C->numblocks*BLOCKSIZE, "wrong number of samples");
+		check(C, h->nevents == (UINT32_T) (C->numblocks+9)/10, "wrong number of events");
+	}
+	free_response(resp);
+
+	if (check(C, request(GET_DAT, NULL, 0, &resp) == GET_OK, "GET_DAT failed")) {
+		const datadef_t *d = (const datadef_t *) resp->buf;
+		const INT32_T *s = (const INT32_T *) (d+1);
+		for (j=0; j<d->nsamples*d->nchans; j++) {
+			if (!check(C, s[j] == C->id, "found samples of another stream")) break;
+		}
+	}
+	free_response(resp);
+
+	if (check(C, request(GET_EVT, NULL, 0, &resp) == GET_OK, "GET_EVT failed")) {
+		UINT32_T offset = 0;
+		while (offset < resp->def->bufsize) {
+			const eventdef_t *e = (const eventdef_t *) ((char *) resp->buf + offset);
+			const INT32_T *value = (const INT32_T *) ((char *) (e+1) + e->type_numel);
+			if (!check(C, *value == C->id, "found events of another stream")) break;
+			offset += sizeof(eventdef_t) + e->bufsize;
+		}
+	}
+	free_response(resp);
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	int numstreams = (argc>1) ? atoi(argv[1]) : 8;
+	int numblocks  = (argc>2) ? atoi(argv[2]) : 10000;
+	client_t *C = (client_t *) calloc(numstreams, sizeof(client_t));
+	pthread_t *tid = (pthread_t *) malloc(numstreams * sizeof(pthread_t));
+	message_t *resp;
+	char longname[FT_STREAM_NAME_LENGTH+2];
+	double t0, elapsed;
+	int i, failed = 0;
+
+	t0 = now();
+	for (i=0; i<numstreams; i++) {
+		C[i].id = i;
+		C[i].numblocks = numblocks;
+		pthread_create(&tid[i], NULL, client_func, &C[i]);
+	}
+	for (i=0; i<numstreams; i++) {
+		pthread_join(tid[i], NULL);
+		failed |= C[i].failed;
+	}
+	elapsed = now() - t0;
+
+	/* this thread never opened a stream, so it should see an empty default stream */
+	if (request(GET_HDR, NULL, 0, &resp) != GET_ERR) {
+		fprintf(stderr, "test_streams: the default stream should not have a header\n");
+		failed = 1;
+	}
+	free_response(resp);
+
+	/* names that are too long or contain spaces are rejected */
+	memset(longname, 'x', sizeof(longname));
+	if (request(OPEN_STREAM, longname, FT_STREAM_NAME_LENGTH+1, &resp) != OPEN_ERR) {
+		fprintf(stderr, "test_streams: a name that is too long should be rejected\n");
+		failed = 1;
+	}
+	free_response(resp);
+	if (request(OPEN_STREAM, "a b", 3, &resp) != OPEN_ERR) {
+		fprintf(stderr, "test_streams: a name with a space should be rejected\n");
+		failed = 1;
+	}
+	free_response(resp);
+
+	printf("%i streams, %i blocks of %i samples each, %.1f ms, %.0f PUT_DAT per second\n",
+		numstreams, numblocks, BLOCKSIZE, 1e3*elapsed, numstreams*numblocks/elapsed);
+
+	ft_free_streams();
+	free(C);
+	free(tid);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
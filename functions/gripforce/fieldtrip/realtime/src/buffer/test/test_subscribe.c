@@ -0,0 +1,309 @@
+/*
+ * Subscribes to the samples and events of a stream (see subscribe.h) over a
+ * local TCP connection, while a second connection puts blocks of samples
+ * that contain their own number, with an event each. The pushed samples and
+ * events should arrive in order and without gaps, nothing should be pushed
+ * without credit or after UNSUBSCRIBE, a client that subscribes from a
+ * sample that has been overwritten should get the oldest one that is left,
+ * and after FLUSH_DAT the pushes should start at sample 0 again. The time
+ * from PUT_DAT to the push of a single sample is compared with polling
+ * GET_HDR every millisecond.
+ *
+ * Use as
+ *    ./test_subscribe [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/select.h>
+
+#define TEST_NAME "test_subscribe"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "subscribe.h"
+#include "testutil.h"
+
+#define NCHANS    4
+#define BLOCKSIZE 10
+#define CAPACITY  2000
+#define NBLOCKS   1000
+#define AHEAD     50    /* blocks the writer may be ahead of the reader */
+
+static int compare(const void *a, const void *b) {
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* returns 1 if the server sends something within the given number of milliseconds */
+static int readable(int server, int milliseconds) {
+	fd_set set;
+	struct timeval tv;
+	FD_ZERO(&set);
+	FD_SET(server, &set);
+	tv.tv_sec  = 0;
+	tv.tv_usec = milliseconds * 1000;
+	return select(server+1, &set, NULL, NULL, &tv) > 0;
+}
+
+/* puts nsamples samples that contain their own number, starting with sample "first" */
+static int put_numbered(int server, UINT32_T first, UINT32_T nsamples) {
+	return put_samples(server, NCHANS, DATATYPE_INT32, first, nsamples, nsamples, NULL);
+}
+
+static int put_event(int server, INT32_T sample) {
+	char event[sizeof(eventdef_t) + 3 + sizeof(INT32_T)];
+	eventdef_t *edef = (eventdef_t *) event;
+
+	memset(edef, 0, sizeof(eventdef_t));
+	edef->type_type   = DATATYPE_CHAR;
+	edef->type_numel  = 3;
+	edef->value_type  = DATATYPE_INT32;
+	edef->value_numel = 1;
+	edef->sample      = sample;
+	edef->bufsize     = 3 + sizeof(INT32_T);
+	memcpy(edef+1, "blk", 3);
+	memcpy((char *) (edef+1) + 3, &sample, sizeof(INT32_T));
+	return request(server, PUT_EVT, event, sizeof(event)) == PUT_OK;
+}
+
+/* the writer, and how far the reader has come */
+typedef struct {
+	int server;
+	int failed;
+	volatile UINT32_T received;
+	pthread_mutex_t lock;
+} writer_t;
+
+static void *writer(void *arg) {
+	writer_t *W = (writer_t *) arg;
+	UINT32_T block;
+
+	for (block=0; block<NBLOCKS; block++) {
+		/* the reader should not fall so far behind that the ring overtakes it */
+		for (;;) {
+			UINT32_T received;
+			pthread_mutex_lock(&W->lock);
+			received = W->received;
+			pthread_mutex_unlock(&W->lock);
+			if (block*BLOCKSIZE < received + AHEAD*BLOCKSIZE) break;
+			usleep(100);
+		}
+		if (!put_numbered(W->server, block*BLOCKSIZE, BLOCKSIZE) || !put_event(W->server, (INT32_T) (block*BLOCKSIZE))) W->failed = 1;
+	}
+	return NULL;
+}
+
+/* checks a PUSH_DAT, returns the number of samples, or -1 if they are not the expected ones */
+static int check_push(const message_t *push, UINT32_T expected) {
+	const datasel_t *sel = (const datasel_t *) push->buf;
+	const datadef_t *ddef = (const datadef_t *) (sel+1);
+	const INT32_T *samples = (const INT32_T *) (ddef+1);
+	UINT32_T i, n;
+
+	if (push->def->bufsize < sizeof(datasel_t) + sizeof(datadef_t)) return -1;
+	n = ddef->nsamples;
+	if ((UINT32_T) sel->begsample != expected || (UINT32_T) sel->endsample != expected + n - 1) return -1;
+	if (ddef->nchans != NCHANS || ddef->data_type != DATATYPE_INT32) return -1;
+	for (i=0; i<n*NCHANS; i++) {
+		if (samples[i] != (INT32_T) (expected + i/NCHANS)) return -1;
+	}
+	return (int) n;
+}
+
+/* the first push that comes in, which should be a PUSH_DAT; returns its first sample, or -1 */
+static INT32_T first_push(int server) {
+	message_t *push = NULL;
+	INT32_T first = -1;
+
+	while (readable(server, 500) && ft_receive(server, &push) == 0) {
+		int done = (push->def->command == PUSH_DAT);
+		if (done) first = ((const datasel_t *) push->buf)->begsample;
+		release(&push);
+		if (done) break;
+	}
+	return first;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1975;
+	int reps = (argc>2) ? atoi(argv[2]) : 100;
+	ft_buffer_server_t *server;
+	subscribedef_t sub;
+	message_t *push = NULL;
+	writer_t W;
+	pthread_t thread;
+	UINT32_T nextsample = 0, nextevent = 0, nsamples;
+	int client, other, k, pushes = 0, failed = 0;
+	double *pushed, *polled, t0;
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_subscribe: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	other = open_connection("localhost", port);
+	if (client < 0 || other < 0) {
+		fprintf(stderr, "test_subscribe: could not connect\n");
+		return 1;
+	}
+
+	failed |= check(put_header(other, NCHANS, DATATYPE_INT32, CAPACITY, 0), "PUT_HDR failed");
+
+	sub.begsample    = 0;
+	sub.begevent     = 0;
+	sub.blocksize    = 3*BLOCKSIZE;
+	sub.milliseconds = 5;
+	sub.credit       = 4;
+	failed |= check(ft_subscribe(client, &sub, 0, NULL) == 0, "SUBSCRIBE_DAT failed");
+
+	/* every sample and every event once, in order, one credit back per push */
+	W.server   = other;
+	W.failed   = 0;
+	W.received = 0;
+	pthread_mutex_init(&W.lock, NULL);
+	pthread_create(&thread, NULL, writer, &W);
+	while (nextsample < NBLOCKS*BLOCKSIZE || nextevent < NBLOCKS) {
+		if (!readable(client, 2000) || ft_receive(client, &push) != 0) {
+			failed |= check(0, "the pushes stopped");
+			break;
+		}
+		pushes++;
+		if (push->def->command == PUSH_DAT) {
+			int n = check_push(push, nextsample);
+			if (n <= 0 || n > 3*BLOCKSIZE) {
+				failed |= check(0, "the pushed samples are not the next ones");
+				break;
+			}
+			nextsample += n;
+			pthread_mutex_lock(&W.lock);
+			W.received = nextsample;
+			pthread_mutex_unlock(&W.lock);
+		}
+		else if (push->def->command == PUSH_EVT) {
+			const eventsel_t *sel = (const eventsel_t *) push->buf;
+			if ((UINT32_T) sel->begevent != nextevent || sel->endevent < sel->begevent) {
+				failed |= check(0, "the pushed events are not the next ones");
+				break;
+			}
+			nextevent = sel->endevent + 1;
+		}
+		else {
+			failed |= check(0, "unexpected message instead of a push");
+			break;
+		}
+		release(&push);
+		failed |= check(ft_grant_credit(client, 1) == 0, "SUBSCRIBE_CREDIT failed");
+	}
+	release(&push);
+	pthread_join(thread, NULL);
+	failed |= check(W.failed == 0, "the writer failed");
+	printf("%u samples and %u events in %i pushes\n", nextsample, nextevent, pushes);
+
+	/* the client has 4 credits left, after which nothing comes until it grants more */
+	for (k=0; k<4; k++) {
+		failed |= check(put_numbered(other, nextsample + k*sub.blocksize, sub.blocksize), "PUT_DAT failed");
+	}
+	for (k=0; k<4; k++) {
+		failed |= check(readable(client, 500) && ft_receive(client, &push) == 0 && check_push(push, nextsample) == (int) sub.blocksize, "a push with credit did not come");
+		release(&push);
+		nextsample += sub.blocksize;
+	}
+	failed |= check(put_numbered(other, nextsample, sub.blocksize), "PUT_DAT failed");
+	failed |= check(!readable(client, 50), "a push came without credit");
+	failed |= check(ft_grant_credit(client, 1) == 0, "SUBSCRIBE_CREDIT failed");
+	failed |= check(readable(client, 500) && ft_receive(client, &push) == 0 && check_push(push, nextsample) == (int) sub.blocksize, "the push did not come after SUBSCRIBE_CREDIT");
+	release(&push);
+	nextsample += sub.blocksize;
+
+	/* after UNSUBSCRIBE, nothing is pushed and requests are answered as usual */
+	failed |= check(ft_grant_credit(client, 10) == 0, "SUBSCRIBE_CREDIT failed");
+	failed |= check(ft_unsubscribe(client) == 0, "UNSUBSCRIBE failed");
+	failed |= check(put_numbered(other, nextsample, 1), "PUT_DAT failed");
+	nextsample++;
+	failed |= check(!readable(client, 50), "a push came after UNSUBSCRIBE");
+	failed |= check(request(client, GET_HDR, NULL, 0) == GET_OK, "GET_HDR after UNSUBSCRIBE failed");
+
+	/* a client that starts from a sample that has been overwritten gets the oldest one left */
+	sub.begevent = -1;
+	sub.credit   = 1;
+	failed |= check(ft_subscribe(client, &sub, 0, NULL) == 0, "SUBSCRIBE_DAT failed");
+	failed |= check(first_push(client) == (INT32_T) (nextsample - CAPACITY), "the push does not start with the oldest sample in the ring");
+	failed |= check(ft_unsubscribe(client) == 0, "UNSUBSCRIBE failed");
+
+	/* after FLUSH_DAT, the subscription starts at 0 again */
+	sub.begsample = -1;
+	sub.credit    = 10;
+	failed |= check(ft_subscribe(client, &sub, 0, NULL) == 0, "SUBSCRIBE_DAT failed");
+	failed |= check(request(other, FLUSH_DAT, NULL, 0) == FLUSH_OK, "FLUSH_DAT failed");
+	usleep(30000);
+	failed |= check(put_numbered(other, 0, BLOCKSIZE), "PUT_DAT failed");
+	failed |= check(first_push(client) == 0, "the push after FLUSH_DAT does not start at 0");
+	failed |= check(ft_unsubscribe(client) == 0, "UNSUBSCRIBE failed");
+
+	/* invalid subscriptions are refused */
+	sub.blocksize = 0;
+	failed |= check(ft_subscribe(client, &sub, 0, NULL) != 0, "a subscription without a block size was accepted");
+
+	/* the latency of a single sample, pushed or polled */
+	pushed = (double *) malloc(reps * sizeof(double));
+	polled = (double *) malloc(reps * sizeof(double));
+	sub.blocksize = 1;
+	sub.credit    = 1;
+	failed |= check(ft_subscribe(client, &sub, 0, NULL) == 0, "SUBSCRIBE_DAT failed");
+	nsamples = BLOCKSIZE;
+	for (k=0; k<reps; k++) {
+		t0 = now();
+		failed |= check(put_numbered(other, nsamples, 1), "PUT_DAT failed");
+		if (!readable(client, 500) || ft_receive(client, &push) != 0 || check_push(push, nsamples) != 1) {
+			failed |= check(0, "the single sample was not pushed");
+			break;
+		}
+		pushed[k] = now() - t0;
+		release(&push);
+		failed |= check(ft_grant_credit(client, 1) == 0, "SUBSCRIBE_CREDIT failed");
+		nsamples++;
+	}
+	failed |= check(ft_unsubscribe(client) == 0, "UNSUBSCRIBE failed");
+	for (k=0; k<reps; k++) {
+		message_t msg, *response = NULL;
+		messagedef_t def;
+
+		def.version = VERSION;
+		def.command = GET_HDR;
+		def.bufsize = 0;
+		msg.def = &def;
+		msg.buf = NULL;
+		t0 = now();
+		failed |= check(put_numbered(other, nsamples, 1), "PUT_DAT failed");
+		nsamples++;
+		for (;;) {
+			usleep(1000);
+			if (clientrequest(client, &msg, &response) != 0) break;
+			if (((headerdef_t *) response->buf)->nsamples == nsamples) break;
+		}
+		polled[k] = now() - t0;
+		release(&response);
+	}
+	qsort(pushed, reps, sizeof(double), compare);
+	qsort(polled, reps, sizeof(double), compare);
+	printf("PUT_DAT to arrival of one sample, median: %.3f ms pushed, %.3f ms polling GET_HDR every ms\n", 1e3*pushed[reps/2], 1e3*polled[reps/2]);
+	failed |= check(pushed[reps/2] < polled[reps/2], "pushing is slower than polling");
+	free(pushed);
+	free(polled);
+
+	close_connection(client);
+	close_connection(other);
+	ft_stop_buffer_server(server);
+	pthread_mutex_destroy(&W.lock);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
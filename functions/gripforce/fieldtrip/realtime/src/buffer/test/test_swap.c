@@ -0,0 +1,282 @@
+/*
+ * Checks the endian-swap kernels (see endianutil.h) with every instruction set
+ * the CPU supports against a reference, for all word sizes, odd lengths and
+ * unaligned data, in place and while copying. Measures their throughput for
+ * blocks from 64 bytes to 64 MB next to the old byte-by-byte loop, and reads
+ * samples over a local TCP connection as a client of the other byte order.
+ *
+ * Use as
+ *    ./test_swap [port] [maxbytes]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_swap"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "testutil.h"
+
+#define NCHANS    64
+#define NSAMPLES  2048
+
+static const char *levelName[] = {"scalar", "ssse3", "avx2"};
+
+static UINT32_T seed = 12345;
+
+static UINT32_T random32(void) {
+	seed = seed * 1664525u + 1013904223u;
+	return seed;
+}
+
+/* what ft_swap32 used to be: one byte at a time */
+static void bytewise32(unsigned int numel, void *data) {
+	unsigned int n;
+	char *d = (char *) data;
+	for (n=0;n<numel;n++) {
+		char t0 = d[0];
+		char t1 = d[1];
+		d[0] = d[3];
+		d[1] = d[2];
+		d[2] = t1;
+		d[3] = t0;
+		d+=4;
+	}
+}
+
+static void reference(size_t numel, unsigned int wordsize, const char *src, char *dest) {
+	size_t n;
+	unsigned int i;
+	for (n=0;n<numel;n++)
+		for (i=0;i<wordsize;i++) dest[n*wordsize + i] = src[n*wordsize + wordsize-1 - i];
+}
+
+static void swap_in_place(unsigned int numel, unsigned int wordsize, void *data) {
+	switch (wordsize) {
+		case 2: ft_swap16(numel, data); break;
+		case 4: ft_swap32(numel, data); break;
+		case 8: ft_swap64(numel, data); break;
+	}
+}
+
+/* every length up to a few blocks of the widest kernel, at every misalignment */
+static int check_kernels(int level) {
+	unsigned int wordsizes[] = {2, 4, 8};
+	char *src  = (char *) malloc(4096 + 64);
+	char *want = (char *) malloc(4096 + 64);
+	char *got  = (char *) malloc(4096 + 64);
+	unsigned int w, numel, offset, i;
+	int failed = 0;
+	char what[100];
+
+	for (i=0;i<4096+64;i++) src[i] = (char) random32();
+	for (w=0;w<3;w++) {
+		unsigned int ws = wordsizes[w];
+		for (numel=0;numel<=4096/ws;numel += (numel < 300) ? 1 : 97) {
+			for (offset=0;offset<8;offset++) {
+				size_t nbytes = (size_t) numel * ws;
+				reference(numel, ws, src + offset, want);
+
+				memcpy(got + offset, src + offset, nbytes);
+				swap_in_place(numel, ws, got + offset);
+				sprintf(what, "%s: in-place swap of %u x %u bytes at offset %u", levelName[level], numel, ws, offset);
+				failed |= check(memcmp(got + offset, want, nbytes) == 0, what);
+
+				/* nothing may be written past the end */
+				memset(got, 0x5A, 4096 + 64);
+				ft_swap_copy(numel, ws, src + offset, got + offset);
+				sprintf(what, "%s: swap while copying %u x %u bytes at offset %u", levelName[level], numel, ws, offset);
+				failed |= check(memcmp(got + offset, want, nbytes) == 0 && got[offset + nbytes] == 0x5A && (offset == 0 || got[offset-1] == 0x5A), what);
+				if (failed) break;
+			}
+		}
+	}
+	ft_swap_copy(3, 1, src, got);
+	failed |= check(memcmp(got, src, 3) == 0, "single bytes are not copied as they are");
+
+	free(src);
+	free(want);
+	free(got);
+	return failed;
+}
+
+/* the best of enough repetitions to move about 256 MB, in GB/s */
+static double throughput(int level, unsigned int wordsize, size_t nbytes, char *src, char *dest, int copy) {
+	size_t reps = (256u << 20) / nbytes, r;
+	double best = 1e9;
+	int round;
+
+	if (reps < 2) reps = 2;
+	for (round=0;round<3;round++) {
+		double t0 = now(), t;
+		for (r=0;r<reps;r++) {
+			if (level < 0 && copy) {
+				memcpy(dest, src, nbytes);
+				bytewise32(nbytes / 4, dest);
+			}
+			else if (level < 0)
+				bytewise32(nbytes / 4, src);
+			else if (copy)
+				ft_swap_copy(nbytes / wordsize, wordsize, src, dest);
+			else
+				swap_in_place(nbytes / wordsize, wordsize, src);
+		}
+		t = (now() - t0) / reps;
+		if (t < best) best = t;
+	}
+	return nbytes / best / 1e9;
+}
+
+static void measure(int maxlevel, size_t maxbytes) {
+	char *src  = (char *) malloc(maxbytes);
+	char *dest = (char *) malloc(maxbytes);
+	size_t nbytes;
+	int level;
+
+	memset(src, 1, maxbytes);
+	memset(dest, 2, maxbytes);
+
+	printf("block size     bytewise32");
+	for (level=0;level<=maxlevel;level++) printf("  %8s16 %8s32 %8s64", levelName[level], levelName[level], levelName[level]);
+	printf("   GB/s in place\n");
+	for (nbytes=64;nbytes<=maxbytes;nbytes*=4) {
+		printf("%10lu B %12.2f", (unsigned long) nbytes, throughput(-1, 4, nbytes, src, dest, 0));
+		for (level=0;level<=maxlevel;level++) {
+			ft_swap_use_simd(level);
+			printf("  %10.2f %10.2f %10.2f", throughput(level, 2, nbytes, src, dest, 0),
+					throughput(level, 4, nbytes, src, dest, 0), throughput(level, 8, nbytes, src, dest, 0));
+		}
+		printf("\n");
+	}
+
+	/* what a GET_DAT of the other byte order did before (copy, then swap) and does now */
+	ft_swap_use_simd(FT_SIMD_AVX2);
+	printf("block size   memcpy+bytewise32   ft_swap_copy 32   GB/s copied\n");
+	for (nbytes=64;nbytes<=maxbytes;nbytes*=16) {
+		printf("%10lu B %19.2f %17.2f\n", (unsigned long) nbytes, throughput(-1, 4, nbytes, src, dest, 1),
+				throughput(maxlevel, 4, nbytes, src, dest, 1));
+	}
+	free(src);
+	free(dest);
+}
+
+/* a request in the other byte order, read back as it comes */
+static UINT16_T swapped_request(int server, UINT16_T command, datasel_t *sel, char *dest, UINT32_T *respsize) {
+	messagedef_t def, respdef;
+	datasel_t s = *sel;
+
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = sizeof(s);
+	ft_swap16(2, &def);
+	ft_swap32(1, &def.bufsize);
+	ft_swap32(2, &s);
+	if (bufwrite(server, &def, sizeof(def)) != sizeof(def)) return 0;
+	if (bufwrite(server, &s, sizeof(s)) != sizeof(s)) return 0;
+	if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef)) return 0;
+	ft_swap16(2, &respdef);
+	ft_swap32(1, &respdef.bufsize);
+	if (respdef.version != VERSION) return 0;
+	if (bufread(server, dest, respdef.bufsize) != respdef.bufsize) return 0;
+	*respsize = respdef.bufsize;
+	return respdef.command;
+}
+
+static int check_connection(int port) {
+	UINT32_T rawsize = NCHANS*NSAMPLES*sizeof(INT32_T), respsize = 0, nsamples[] = {NSAMPLES, 10};
+	char *samples = (char *) malloc(sizeof(datadef_t) + rawsize);
+	char *dest = (char *) malloc(sizeof(datadef_t) + rawsize);
+	char *want = (char *) malloc(rawsize);
+	datadef_t *ddef = (datadef_t *) samples, *got = (datadef_t *) dest;
+	headerdef_t hdef;
+	datasel_t sel;
+	messagedef_t def;
+	message_t request, *response = NULL;
+	int client, raw, failed = 0, k;
+	UINT32_T i;
+
+	client = open_connection("localhost", port);
+	raw = open_connection("localhost", port);
+	if (client < 0 || raw < 0) {
+		fprintf(stderr, "test_swap: could not connect\n");
+		return 1;
+	}
+
+	memset(&hdef, 0, sizeof(hdef));
+	hdef.nchans    = NCHANS;
+	hdef.fsample   = 2048;
+	hdef.data_type = DATATYPE_INT32;
+	def.version = VERSION;
+	def.command = PUT_HDR;
+	def.bufsize = sizeof(hdef);
+	request.def = &def;
+	request.buf = &hdef;
+	failed |= check(clientrequest(client, &request, &response) == 0 && response->def->command == PUT_OK, "PUT_HDR failed");
+	cleanup_message((void **) &response);
+
+	ddef->nchans    = NCHANS;
+	ddef->nsamples  = NSAMPLES;
+	ddef->data_type = DATATYPE_INT32;
+	ddef->bufsize   = rawsize;
+	for (i=0;i<NCHANS*NSAMPLES;i++) ((UINT32_T *) (ddef+1))[i] = random32();
+	def.command = PUT_DAT;
+	def.bufsize = sizeof(datadef_t) + rawsize;
+	request.buf = samples;
+	failed |= check(clientrequest(client, &request, &response) == 0 && response->def->command == PUT_OK, "PUT_DAT failed");
+	cleanup_message((void **) &response);
+
+	/* large enough to be swapped while copied from the ring, and small enough for dmarequest */
+	for (k=0;k<2;k++) {
+		UINT32_T size = NCHANS*nsamples[k]*sizeof(INT32_T);
+		double t0 = now();
+		sel.begsample = 0;
+		sel.endsample = nsamples[k] - 1;
+		failed |= check(swapped_request(raw, GET_DAT, &sel, dest, &respsize) == GET_OK && respsize == sizeof(datadef_t) + size, "GET_DAT in the other byte order failed");
+		t0 = now() - t0;
+		ft_swap32(4, got);
+		failed |= check(got->nchans == NCHANS && got->nsamples == nsamples[k] && got->data_type == DATATYPE_INT32 && got->bufsize == size, "the datadef_t was not swapped");
+		reference(size / 4, 4, (char *) (ddef+1), want);
+		failed |= check(memcmp(got+1, want, size) == 0, "the samples were not swapped");
+		if (k == 0) printf("GET_DAT of %u x %u int32 in the other byte order: %.3f ms\n", NCHANS, nsamples[k], 1000*t0);
+	}
+
+	close_connection(client);
+	close_connection(raw);
+	free(samples);
+	free(dest);
+	free(want);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	size_t maxbytes = (argc>2) ? (size_t) atol(argv[2]) : (64u << 20);
+	ft_buffer_server_t *server;
+	int failed = 0, maxlevel, level;
+
+	/* the best the CPU supports, and everything below */
+	maxlevel = ft_swap_use_simd(FT_SIMD_AVX2);
+	for (level=FT_SIMD_NONE;level<=maxlevel;level++) {
+		failed |= check(ft_swap_use_simd(level) == level, "an instruction set that is supported could not be selected");
+		failed |= check_kernels(level);
+	}
+	measure(maxlevel, maxbytes);
+	ft_swap_use_simd(maxlevel);
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_swap: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	failed |= check_connection(port);
+	ft_stop_buffer_server(server);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
@@ -0,0 +1,177 @@
+/*
+ * Traces the requests of local TCP connections (see trace.h), to the epoll
+ * reactor and to a thread per client, and checks that the file that is
+ * written out on SIGUSR1 and by ft_trace_dump has the spans of every phase
+ * of every kind of request, that no thread keeps more spans than its ring
+ * holds, and that a reader that waits for a writer shows up as a lock wait.
+ * Measures the round trip of GET_HDR with and without tracing.
+ *
+ * Use as
+ *    ./test_trace [port] [file]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define TEST_NAME "test_trace"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "trace.h"
+#include "testutil.h"
+
+#define NCHANS    32
+#define BLOCKSIZE 1024
+#define NSPANS    512
+#define NROUNDS   200
+
+/* the whole file, or NULL */
+static char *read_file(const char *name) {
+	FILE *f = fopen(name, "r");
+	char *text;
+	long size;
+	if (f == NULL) return NULL;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	text = (char *) malloc(size + 1);
+	if (fread(text, 1, size, f) != (size_t) size) size = 0;
+	text[size] = 0;
+	fclose(f);
+	return text;
+}
+
+static int count(const char *text, const char *what) {
+	int n = 0;
+	const char *p = text;
+	while ((p = strstr(p, what)) != NULL) {
+		n++;
+		p += strlen(what);
+	}
+	return n;
+}
+
+/* the most spans in one row of the timeline */
+static int busiest_row(const char *text) {
+	int spans[256], row, most = 0;
+	const char *p = text;
+	memset(spans, 0, sizeof(spans));
+	while ((p = strstr(p, "\"ph\":\"X\",\"pid\":1,\"tid\":")) != NULL) {
+		p += strlen("\"ph\":\"X\",\"pid\":1,\"tid\":");
+		row = atoi(p);
+		if (row > 0 && row < 256 && ++spans[row] > most) most = spans[row];
+	}
+	return most;
+}
+
+static void *hold_header(void *arg) {
+	int server = *(int *) arg;
+	/* replacing the header takes the ring for writing */
+	put_header(server, NCHANS, DATATYPE_FLOAT32, 0, 0);
+	return NULL;
+}
+
+static int exercise(int port, int workers, const char *file) {
+	UINT32_T k;
+	ft_buffer_server_t *server;
+	datasel_t sel;
+	pthread_t thread;
+	double t0, traced, untraced;
+	char *text;
+	int client, other, failed = 0, k2;
+
+	ft_set_server_workers(workers);
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_trace: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	other = open_connection("localhost", port);
+	if (client < 0 || other < 0) {
+		fprintf(stderr, "test_trace: could not connect\n");
+		return 1;
+	}
+
+	ft_trace_enable(file, NSPANS, 0);
+	failed |= check(put_header(client, NCHANS, DATATYPE_FLOAT32, 0, 0), "PUT_HDR failed");
+	failed |= check(put_samples(client, NCHANS, DATATYPE_FLOAT32, 0, 4*BLOCKSIZE, BLOCKSIZE, NULL), "PUT_DAT failed");
+	/* small, and large enough to be sent from the ring */
+	sel.begsample = 0;
+	sel.endsample = 9;
+	failed |= check(request(client, GET_DAT, &sel, sizeof(sel)) == GET_OK, "GET_DAT failed");
+	sel.endsample = 2*BLOCKSIZE - 1;
+	failed |= check(request(client, GET_DAT, &sel, sizeof(sel)) == GET_OK, "GET_DAT from the ring failed");
+
+	/* many GET_HDR while the other connection replaces the header, some of them have to wait */
+	for (k2=0; k2<5; k2++) {
+		pthread_create(&thread, NULL, hold_header, &other);
+		for (k=0; k<10; k++) request(client, GET_HDR, NULL, 0);
+		pthread_join(thread, NULL);
+	}
+
+	failed |= check(ft_trace_dump() == 0, "the trace could not be written");
+	text = read_file(file);
+	failed |= check(text != NULL && strncmp(text, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", 39) == 0 && strstr(text, "\n]}\n") != NULL, "the trace is not in the Trace Event Format");
+	if (failed) return failed;
+	failed |= check(count(text, "\"name\":\"read header\",\"cat\":\"PUT_HDR\"") >= 1, "no header was read for PUT_HDR");
+	failed |= check(count(text, "\"name\":\"read body\",\"cat\":\"PUT_DAT\"") == 4, "no body was read for PUT_DAT");
+	failed |= check(count(text, "\"name\":\"execute\",\"cat\":\"PUT_DAT\"") == 4, "PUT_DAT was not executed");
+	failed |= check(count(text, "\"name\":\"write\",\"cat\":\"GET_DAT\"") == 2, "GET_DAT was not written");
+	failed |= check(count(text, "\"name\":\"lock wait\",\"cat\":\"GET_HDR\"") >= 1, "GET_HDR never waited for a lock");
+	failed |= check(count(text, "\"name\":\"thread_name\"") >= 1, "the rows have no names");
+	free(text);
+
+	/* a full ring shows all but the oldest span, which may be written to while it is copied */
+	for (k=0; k<NSPANS; k++) request(client, GET_HDR, NULL, 0);
+	t0 = now();
+	for (k=0; k<NROUNDS; k++) request(client, GET_HDR, NULL, 0);
+	traced = (now() - t0) / NROUNDS;
+
+	/* a signal has the same effect as ft_trace_dump */
+	unlink(file);
+	kill(getpid(), SIGUSR1);
+	for (k=0; k<100 && (text = read_file(file)) == NULL; k++) usleep(10000);
+	failed |= check(text != NULL, "SIGUSR1 did not write the trace");
+	if (text != NULL) {
+		failed |= check(busiest_row(text) == NSPANS-1, "a ring does not keep the right number of spans");
+		failed |= check(count(text, "\"cat\":\"GET_HDR\"") >= NSPANS-1, "the last GET_HDR are missing");
+		free(text);
+	}
+
+	ft_trace_disable();
+	t0 = now();
+	for (k=0; k<NROUNDS; k++) request(client, GET_HDR, NULL, 0);
+	untraced = (now() - t0) / NROUNDS;
+	printf("%s: GET_HDR round trip %.1f us traced, %.1f us not traced\n", workers ? "reactor" : "threads", 1e6*traced, 1e6*untraced);
+
+	close_connection(client);
+	close_connection(other);
+	ft_stop_buffer_server(server);
+	return failed;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1974;
+	const char *file = (argc>2) ? argv[2] : "test_trace.json";
+	int failed = 0;
+
+	/* before any server threads are started, see trace.h */
+	failed |= check(ft_trace_enable(file, NSPANS, 0) == 0, "tracing could not be enabled");
+	ft_trace_disable();
+
+	failed |= exercise(port, FT_SERVER_WORKERS, file);
+	failed |= exercise(port+1, 0, file);
+	unlink(file);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
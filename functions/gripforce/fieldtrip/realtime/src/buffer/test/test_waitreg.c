@@ -0,0 +1,214 @@
+/*
+ * Benchmark of the WAIT_DAT waiter registry against the previous scheme, in
+ * which every waiter sleeps on one condition variable that is broadcast on
+ * every PUT_DAT. A writer thread adds a block of samples every millisecond,
+ * while a large number of reader threads each wait for a different number
+ * of new samples, like clients that process the data in different block
+ * sizes. Reported are the number of times a waiter woke up (and how many of
+ * those were for nothing), the delay between the PUT_DAT and the wakeup,
+ * and the CPU time used by the whole process.
+ *
+ * Use as
+ *    ./test_waitreg [maxreaders] [seconds]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "buffer.h"
+#include "waitreg.h"
+
+#define BLOCKSIZE 10
+#define PERIOD_US 1000
+
+typedef struct {
+	int useRegistry;
+	volatile int keepRunning;
+	/* broadcast scheme */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	UINT32_T nsamples;
+	/* registry scheme */
+	ft_waitreg_t registry;
+	/* time at which the current number of samples was reached, by either scheme */
+	volatile double tUpdate;
+} bench_t;
+
+typedef struct {
+	bench_t *B;
+	UINT32_T step;
+	unsigned long numWakeups;
+	unsigned long numUseless;
+	double latSum;
+	double latMax;
+} reader_t;
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+static double cputime(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec + ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec;
+}
+
+static void deadline(struct timespec *ts, int ms) {
+	struct timeval tp;
+	gettimeofday(&tp, NULL);
+	ts->tv_sec  = tp.tv_sec;
+	ts->tv_nsec = 1000 * (tp.tv_usec + ms*1000);
+	while (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+void *writer_func(void *arg) {
+	bench_t *B = (bench_t *) arg;
+	UINT32_T n = 0;
+
+	while (B->keepRunning) {
+		usleep(PERIOD_US);
+		n += BLOCKSIZE;
+		if (B->useRegistry) {
+			B->tUpdate = now();
+			ft_waitreg_update(&B->registry, FT_WAIT_SAMPLES, n);
+		} else {
+			pthread_mutex_lock(&B->lock);
+			B->nsamples = n;
+			B->tUpdate = now();
+			pthread_cond_broadcast(&B->cond);
+			pthread_mutex_unlock(&B->lock);
+		}
+	}
+	/* release everybody */
+	if (B->useRegistry) {
+		ft_waitreg_update(&B->registry, FT_WAIT_SAMPLES, 0xFFFFFFFF);
+	} else {
+		pthread_mutex_lock(&B->lock);
+		B->nsamples = 0xFFFFFFFF;
+		pthread_cond_broadcast(&B->cond);
+		pthread_mutex_unlock(&B->lock);
+	}
+	return NULL;
+}
+
+static void record(reader_t *R, int useful) {
+	double lat = now() - R->B->tUpdate;
+	R->numWakeups++;
+	if (!useful) {
+		R->numUseless++;
+		return;
+	}
+	R->latSum += lat;
+	if (lat > R->latMax) R->latMax = lat;
+}
+
+void *reader_func(void *arg) {
+	reader_t *R = (reader_t *) arg;
+	bench_t *B = R->B;
+	UINT32_T seen = 0;
+	struct timespec ts;
+
+	while (B->keepRunning) {
+		samples_events_t threshold, current;
+		threshold.nsamples = seen + R->step;
+		threshold.nevents  = 0xFFFFFFFF;
+		deadline(&ts, 500);
+
+		if (B->useRegistry) {
+			if (ft_waitreg_wait(&B->registry, &threshold, &ts, &current) == 1) {
+				record(R, 1);
+				R->numWakeups--;   /* counted by the registry */
+			}
+			seen = current.nsamples;
+		} else {
+			/* this is what WAIT_DAT used to do */
+			pthread_mutex_lock(&B->lock);
+			while (B->nsamples <= threshold.nsamples) {
+				if (pthread_cond_timedwait(&B->cond, &B->lock, &ts) != 0) break;
+				record(R, B->nsamples > threshold.nsamples);
+			}
+			seen = B->nsamples;
+			pthread_mutex_unlock(&B->lock);
+		}
+	}
+	return NULL;
+}
+
+void run(int useRegistry, int numReaders, double seconds) {
+	bench_t B;
+	reader_t *R = (reader_t *) calloc(numReaders, sizeof(reader_t));
+	pthread_t wtid, *rtid = (pthread_t *) malloc(numReaders * sizeof(pthread_t));
+	unsigned long numWakeups = 0, numUseless = 0, numUseful;
+	double latSum = 0, latMax = 0, t0, c0, elapsed, cpu;
+	int i;
+
+	memset(&B, 0, sizeof(B));
+	pthread_mutex_init(&B.lock, NULL);
+	pthread_cond_init(&B.cond, NULL);
+	ft_waitreg_init(&B.registry);
+	B.useRegistry = useRegistry;
+	B.keepRunning = 1;
+
+	t0 = now();
+	c0 = cputime();
+	for (i=0; i<numReaders; i++) {
+		R[i].B = &B;
+		/* every reader waits for a different number of blocks */
+		R[i].step = BLOCKSIZE * (1 + i % 100) - 1;
+		pthread_create(&rtid[i], NULL, reader_func, &R[i]);
+	}
+	pthread_create(&wtid, NULL, writer_func, &B);
+
+	usleep((unsigned int) (seconds*1000000));
+	B.keepRunning = 0;
+
+	pthread_join(wtid, NULL);
+	for (i=0; i<numReaders; i++) {
+		pthread_join(rtid[i], NULL);
+		numWakeups += R[i].numWakeups;
+		numUseless += R[i].numUseless;
+		latSum += R[i].latSum;
+		if (R[i].latMax > latMax) latMax = R[i].latMax;
+	}
+	elapsed = now() - t0;
+	cpu = cputime() - c0;
+	if (useRegistry) numWakeups = B.registry.wakeups;
+	numUseful = numWakeups - numUseless;
+
+	printf("%-9s %7d %12.0f %12.0f %10.1f %10.1f %9.1f%%\n", useRegistry ? "registry" : "broadcast", numReaders,
+		numWakeups / elapsed, numUseless / elapsed,
+		1e6 * latSum / (numUseful ? numUseful : 1), 1e6 * latMax, 100.0 * cpu / elapsed);
+
+	ft_waitreg_destroy(&B.registry);
+	pthread_cond_destroy(&B.cond);
+	pthread_mutex_destroy(&B.lock);
+	free(R);
+	free(rtid);
+}
+
+int main(int argc, char *argv[]) {
+	int maxReaders = (argc>1) ? atoi(argv[1]) : 400;
+	double seconds = (argc>2) ? atof(argv[2]) : 2.0;
+	int numReaders, useRegistry;
+
+	printf("one block of %i samples every %i us, %.1f seconds per run\n", BLOCKSIZE, PERIOD_US, seconds);
+	printf("%-9s %7s %12s %12s %10s %10s %10s\n", "mode", "readers", "wakeups/s", "useless/s", "mean us", "max us", "cpu");
+
+	for (numReaders = 25; numReaders <= maxReaders; numReaders *= 2) {
+		for (useRegistry = 0; useRegistry <= 1; useRegistry++) {
+			run(useRegistry, numReaders, seconds);
+		}
+	}
+	return 0;
+}
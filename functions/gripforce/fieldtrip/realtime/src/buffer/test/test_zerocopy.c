@@ -0,0 +1,243 @@
+/*
+ * Measures the throughput of large GET_DAT requests (10 - 100 MB) over a
+ * local TCP connection, with the response either copied into a freshly
+ * allocated buffer (the old way) or written straight from the ring with
+ * writev (see zerocopy.h). The server runs in the same process; the client
+ * reads every response into the same buffer, so that the client side costs
+ * the same in both cases.
+ *
+ * Afterwards, a client asks for 8 MB from a small ring and then stops reading.
+ * The writer has to be able to go round the ring nonetheless, with the
+ * reactor, with a thread per client (ft_set_server_workers(0)), and with
+ * tcpserver. It also has to when a socket layer pinned the samples and then
+ * hangs without parking the pin, in which case it revokes the pin after
+ * FT_RING_PIN_TIMEOUT.
+ *
+ * Use as
+ *    ./test_zerocopy [port] [repetitions]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pthread.h>
+
+#define TEST_NAME "test_zerocopy"
+
+#include "buffer.h"
+#include "socketserver.h"
+#include "zerocopy.h"
+#include "testutil.h"
+
+#define NCHANS   256
+#define MB       (1024*1024)
+#define SMALL    65536    /* samples in the ring for the stalled client */
+#define STALLED  8192     /* samples that it asks for */
+
+static double cputime(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + 1e-6*ru.ru_utime.tv_usec + ru.ru_stime.tv_sec + 1e-6*ru.ru_stime.tv_usec;
+}
+
+/* every value in the ring is different */
+static double ramp(UINT32_T s, UINT32_T c) {
+	return (double) s*NCHANS + c;
+}
+
+/* adds samples first ... first+nsamples-1 of NCHANS float channels to the default stream */
+static void put_ramp(UINT32_T first, UINT32_T nsamples) {
+	if (!put_samples(-1, NCHANS, DATATYPE_FLOAT32, first, nsamples, 1000, ramp)) {
+		fprintf(stderr, "test_zerocopy: PUT_DAT failed\n");
+		exit(1);
+	}
+}
+
+/* fills the ring of the default stream with nsamples samples of NCHANS float channels */
+static void fill_buffer(UINT32_T capacity, UINT32_T nsamples) {
+	if (!put_header(-1, NCHANS, DATATYPE_FLOAT32, capacity, 0)) {
+		fprintf(stderr, "test_zerocopy: PUT_HDR failed\n");
+		exit(1);
+	}
+	put_ramp(0, nsamples);
+}
+
+/* reads samples begsample..endsample into dest, returns the number of bytes or -1 */
+static int get_data(int server, UINT32_T begsample, UINT32_T endsample, char *dest) {
+	struct {
+		messagedef_t def;
+		datasel_t sel;
+	} req;
+	messagedef_t respdef;
+
+	req.def.version = VERSION;
+	req.def.command = GET_DAT;
+	req.def.bufsize = sizeof(datasel_t);
+	req.sel.begsample = begsample;
+	req.sel.endsample = endsample;
+	if (bufwrite(server, &req, sizeof(req)) != sizeof(req)) return -1;
+	if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef)) return -1;
+	if (respdef.command != GET_OK) return -1;
+	if (bufread(server, dest, respdef.bufsize) != respdef.bufsize) return -1;
+	return respdef.bufsize;
+}
+
+/* Lets a client with a small receive buffer ask for the last STALLED samples
+   of a ring of SMALL samples, and not read them. Returns the seconds it then
+   takes the writer to go round the ring, or -1 if the client could not connect. */
+static double stalled_client(int port) {
+	struct {
+		messagedef_t def;
+		datasel_t sel;
+	} req;
+	int client, size = 4096;
+	double t0, elapsed;
+
+	fill_buffer(SMALL, SMALL);
+	client = open_connection("localhost", port);
+	if (client < 0) return -1;
+	setsockopt(client, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	req.def.version = VERSION;
+	req.def.command = GET_DAT;
+	req.def.bufsize = sizeof(datasel_t);
+	req.sel.begsample = SMALL - STALLED;
+	req.sel.endsample = SMALL - 1;
+	if (bufwrite(client, &req, sizeof(req)) != sizeof(req)) return -1;
+	/* until the server is stuck in the middle of the response */
+	usleep(200000);
+
+	t0 = now();
+	put_ramp(SMALL, SMALL + 1000);
+	elapsed = now() - t0;
+	close_connection(client);
+	return elapsed;
+}
+
+/* Pins the last STALLED samples of a ring of SMALL samples, as a socket layer
+   that hangs before it can park the pin. Returns the seconds it then takes the
+   writer to go round the ring, or -1 if the pin was not revoked. */
+static double stalled_reader(void) {
+	messagedef_t def;
+	datasel_t sel;
+	message_t msg;
+	ft_pinned_data_t P;
+	double t0, elapsed;
+
+	fill_buffer(SMALL, SMALL);
+	def.version = VERSION;
+	def.command = GET_DAT;
+	def.bufsize = sizeof(datasel_t);
+	sel.begsample = SMALL - STALLED;
+	sel.endsample = SMALL - 1;
+	msg.def = &def;
+	msg.buf = &sel;
+	if (!ft_getdat_pinned(&msg, &P)) return -1;
+
+	t0 = now();
+	put_ramp(SMALL, SMALL + 1000);
+	elapsed = now() - t0;
+	return (ft_getdat_release(&P) == FT_RING_OVERWRITTEN) ? elapsed : -1;
+}
+
+int main(int argc, char *argv[]) {
+	int port = (argc>1) ? atoi(argv[1]) : 1973;
+	int reps = (argc>2) ? atoi(argv[2]) : 5;
+	int sizes[] = {10, 25, 50, 100};
+	UINT32_T chansize = NCHANS*sizeof(float);
+	UINT32_T capacity = 200*MB/chansize, nsamples = 3*capacity/2;
+	ft_buffer_server_t *server, *threads;
+	host_t host;
+	pthread_t tcpthread;
+	double elapsed;
+	char *dest;
+	int client, i, k, mode, failed = 0;
+
+	printf("filling a ring of %u MB with %u channels ...\n", capacity*chansize/MB, NCHANS);
+	fill_buffer(capacity, nsamples);
+
+	server = ft_start_buffer_server(port, NULL, NULL, NULL);
+	if (server == NULL) {
+		fprintf(stderr, "test_zerocopy: could not start server on port %i\n", port);
+		return 1;
+	}
+	server->verbosity = 0;
+	client = open_connection("localhost", port);
+	if (client < 0) {
+		fprintf(stderr, "test_zerocopy: could not connect\n");
+		return 1;
+	}
+	dest = (char *) malloc(sizeof(datadef_t) + 100*MB + chansize);
+
+	printf("%-9s %8s %12s %12s %12s\n", "mode", "MB", "ms/read", "MB/s", "cpu ms/read");
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		UINT32_T n = sizes[i]*MB/chansize;
+		/* read the most recent samples */
+		UINT32_T endsample = nsamples - 1, begsample = nsamples - n;
+
+		for (mode=0; mode<2; mode++) {
+			double t0, c0, elapsed, cpu;
+			ft_set_zerocopy_threshold(mode ? FT_ZEROCOPY_THRESHOLD : 0);
+
+			t0 = now();
+			c0 = cputime();
+			for (k=0; k<reps; k++) {
+				const float *samples = (const float *) (dest + sizeof(datadef_t));
+				if (get_data(client, begsample, endsample, dest) != sizeof(datadef_t) + n*chansize) {
+					fprintf(stderr, "test_zerocopy: GET_DAT failed\n");
+					return 1;
+				}
+				/* check the first and the last value */
+				if (samples[0] != (float) (begsample*NCHANS) || samples[n*NCHANS-1] != (float) (endsample*NCHANS + NCHANS-1)) {
+					fprintf(stderr, "test_zerocopy: wrong samples in the response\n");
+					failed = 1;
+				}
+			}
+			elapsed = (now() - t0) / reps;
+			cpu = (cputime() - c0) / reps;
+			printf("%-9s %8i %12.2f %12.0f %12.2f\n", mode ? "zerocopy" : "copy", sizes[i], 1e3*elapsed, sizes[i]/elapsed, 1e3*cpu);
+		}
+	}
+
+	close_connection(client);
+	free(dest);
+
+	/* a stalled client of each kind of server */
+	ft_set_zerocopy_threshold(FT_ZEROCOPY_THRESHOLD);
+	ft_set_server_workers(0);
+	threads = ft_start_buffer_server(port+1, NULL, NULL, NULL);
+	ft_set_server_workers(FT_SERVER_WORKERS);
+	strcpy(host.name, "localhost");
+	host.port = port+2;
+	if (threads == NULL || pthread_create(&tcpthread, NULL, tcpserver, &host) != 0) {
+		fprintf(stderr, "test_zerocopy: could not start the other servers\n");
+		return 1;
+	}
+	threads->verbosity = 0;
+	usleep(100000);
+	for (k=0; k<3; k++) {
+		static const char *kind[] = {"the reactor", "a thread per client", "tcpserver"};
+		elapsed = stalled_client(port+k);
+		printf("writer going round the ring while a client of %s does not read: %.1f ms\n", kind[k], 1e3*elapsed);
+		if (elapsed < 0 || elapsed > 2.0) {
+			fprintf(stderr, "test_zerocopy: a client of %s that does not read holds up the writer\n", kind[k]);
+			failed = 1;
+		}
+	}
+	elapsed = stalled_reader();
+	printf("writer going round the ring while a pin is not parked: %.1f ms\n", 1e3*elapsed);
+	if (elapsed < 0 || elapsed > 2.0) {
+		fprintf(stderr, "test_zerocopy: a pin that is not parked holds up the writer, or is not revoked\n");
+		failed = 1;
+	}
+	pthread_cancel(tcpthread);
+	pthread_join(tcpthread, NULL);
+	ft_stop_buffer_server(threads);
+	ft_stop_buffer_server(server);
+
+	printf("%s\n", failed ? "FAILED" : "ok");
+	return failed;
+}
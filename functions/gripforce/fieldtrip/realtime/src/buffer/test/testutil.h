@@ -0,0 +1,155 @@
+/*
+ * Helpers that are shared by the tests: checks that report under the name of
+ * the test, requests to a server or to the buffer in the same process, the
+ * PUT_HDR and PUT_DAT that fill a buffer, and requests that are timed over a
+ * socket without going through clientrequest, so that the response is read
+ * into memory of the test instead of a newly allocated message.
+ *
+ * Define TEST_NAME as the name of the test before including this file.
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#ifndef TESTUTIL_H
+#define TESTUTIL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "buffer.h"
+
+#ifndef TEST_NAME
+#define TEST_NAME "test"
+#endif
+
+#define TEST_MAX_REQUEST  8192   /* largest payload of a request sent with get_request */
+
+/* the value of channel c of sample s that put_samples writes */
+typedef double (*test_value_t)(UINT32_T s, UINT32_T c);
+
+static double now(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6*tv.tv_usec;
+}
+
+/* prints what went wrong unless ok, returns 1 if it did */
+static int check(int ok, const char *what) {
+	if (!ok) fprintf(stderr, TEST_NAME ": %s\n", what);
+	return !ok;
+}
+
+/* cleanup_message does not reset the pointer */
+static void release(message_t **msg) {
+	cleanup_message((void **) msg);
+	*msg = NULL;
+}
+
+/* sends a request to the server, or to the buffer in this process if server<0,
+ * returns the response or NULL */
+static message_t *send_request(int server, UINT16_T command, const void *buf, UINT32_T bufsize) {
+	messagedef_t def;
+	message_t msg, *response = NULL;
+	int res;
+
+	def.version = VERSION;
+	def.command = command;
+	def.bufsize = bufsize;
+	msg.def = &def;
+	msg.buf = (void *) buf;
+	res = (server < 0) ? dmarequest(&msg, &response) : clientrequest(server, &msg, &response);
+	if (res != 0) release(&response);
+	return response;
+}
+
+/* like send_request, but returns the command of the response, or 0 without one */
+static UINT16_T request(int server, UINT16_T command, const void *buf, UINT32_T bufsize) {
+	message_t *response = send_request(server, command, buf, bufsize);
+	UINT16_T result = (response != NULL) ? response->def->command : 0;
+	release(&response);
+	return result;
+}
+
+/* puts a header of nchans channels at 1000 Hz, with room for "capacity" samples and
+ * "nevents" events unless both are 0, returns 1 if it was answered with PUT_OK */
+static int put_header(int server, UINT32_T nchans, UINT32_T data_type, UINT32_T capacity, UINT32_T nevents) {
+	struct {
+		headerdef_t def;
+		ft_chunkdef_t chunkdef;
+		capacitydef_t cap;
+	} hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.def.nchans    = nchans;
+	hdr.def.fsample   = 1000;
+	hdr.def.data_type = data_type;
+	if (capacity > 0 || nevents > 0) {
+		hdr.def.bufsize   = sizeof(ft_chunkdef_t) + sizeof(capacitydef_t);
+		hdr.chunkdef.type = FT_CHUNK_BUFFER_CAPACITY;
+		hdr.chunkdef.size = sizeof(capacitydef_t);
+		hdr.cap.nsamples  = capacity;
+		hdr.cap.nevents   = nevents;
+	}
+	return request(server, PUT_HDR, &hdr, sizeof(headerdef_t) + hdr.def.bufsize) == PUT_OK;
+}
+
+/* puts samples first ... first+nsamples-1 of nchans channels of INT16, INT32, FLOAT32 or
+ * FLOAT64 in blocks of at most "blocksize" samples. The values are value(s,c), or the
+ * sample number if value is NULL. Returns 1 if every block was answered with PUT_OK. */
+static int put_samples(int server, UINT32_T nchans, UINT32_T data_type, UINT32_T first, UINT32_T nsamples, UINT32_T blocksize, test_value_t value) {
+	UINT32_T wordsize = wordsize_from_type(data_type), i, j, n;
+	char *buf = (char *) malloc(sizeof(datadef_t) + blocksize*nchans*wordsize);
+	datadef_t *ddef = (datadef_t *) buf;
+	void *samples = (void *) (ddef+1);
+	int ok = (buf != NULL);
+
+	for (i=0; i<nsamples && ok; i+=n) {
+		n = (nsamples - i < blocksize) ? nsamples - i : blocksize;
+		for (j=0; j<n*nchans; j++) {
+			UINT32_T s = first + i + j/nchans;
+			double v = (value != NULL) ? value(s, j%nchans) : (double) s;
+			switch (data_type) {
+				case DATATYPE_INT16:   ((INT16_T *) samples)[j] = (INT16_T) v; break;
+				case DATATYPE_INT32:   ((INT32_T *) samples)[j] = (INT32_T) v; break;
+				case DATATYPE_FLOAT32: ((FLOAT32_T *) samples)[j] = (FLOAT32_T) v; break;
+				case DATATYPE_FLOAT64: ((FLOAT64_T *) samples)[j] = (FLOAT64_T) v; break;
+				default: ok = 0;
+			}
+		}
+		ddef->nchans    = nchans;
+		ddef->nsamples  = n;
+		ddef->data_type = data_type;
+		ddef->bufsize   = n*nchans*wordsize;
+		ok = ok && request(server, PUT_DAT, buf, sizeof(datadef_t) + ddef->bufsize) == PUT_OK;
+	}
+	free(buf);
+	return ok;
+}
+
+/* sends a request with the given payload in one write, and reads the response
+ * into dest, returns the size of the response or -1 if it is not a GET_OK */
+static int get_request(int server, UINT16_T command, const void *buf, UINT32_T bufsize, char *dest) {
+	char req[sizeof(messagedef_t) + TEST_MAX_REQUEST];
+	messagedef_t *def = (messagedef_t *) req;
+	messagedef_t respdef;
+
+	if (bufsize > TEST_MAX_REQUEST) return -1;
+	def->version = VERSION;
+	def->command = command;
+	def->bufsize = bufsize;
+	memcpy(def+1, buf, bufsize);
+	if (bufwrite(server, req, sizeof(messagedef_t) + bufsize) != sizeof(messagedef_t) + bufsize) return -1;
+	if (bufread(server, &respdef, sizeof(respdef)) != sizeof(respdef)) return -1;
+	if (bufread(server, dest, respdef.bufsize) != respdef.bufsize) return -1;
+	return (respdef.command == GET_OK) ? (int) respdef.bufsize : -1;
+}
+
+/* the number of repetitions of a timing from the command line, at least 1 */
+static int repetitions(int argc, char *argv[], int index, int dflt) {
+	int reps = (argc > index) ? atoi(argv[index]) : dflt;
+	return (reps < 1) ? 1 : reps;
+}
+
+#endif /* TESTUTIL_H */
@@ -7,24 +7,86 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include "buffer.h"
+#include "persist.h"
+#include "history.h"
+#include "trace.h"
+#include "lockstat.h"
 
 int main(int argc, char *argv[]) {
 	host_t host;
+	capacitydef_t capacity = {0, 0, 0, 0};
+	const char *persist = NULL, *history = NULL, *trace = NULL;
+	int i, arg = 1, locks = 0;
 
     /* verify that all datatypes have the expected syze in bytes */
     check_datatypes();
 
 	sprintf(host.name, DEFAULT_HOSTNAME);
-	if (argc>1) {
+	if (argc>1 && argv[1][0] != '-') {
 		host.port = atoi(argv[1]);
+		arg = 2;
 	}
 	else {
-	    printf("Using default port, recommended usage 'buffer [port]'. \n");
+	    printf("Using default port, recommended usage 'buffer [port] [-samples N | -seconds S | -bytes N[k|M|G]] [-events N] [-persist DIR] [-history DIR] [-trace FILE] [-locks SECONDS]'. \n");
 		host.port = DEFAULT_PORT;
 	}
 
+	/* the remaining arguments specify the capacity of the data and event ring, and where to keep them */
+	for (i=arg; i<argc; i+=2) {
+		if (!strcmp(argv[i], "-persist") && i+1<argc) {
+			persist = argv[i+1];
+			continue;
+		}
+		if (!strcmp(argv[i], "-history") && i+1<argc) {
+			history = argv[i+1];
+			continue;
+		}
+		if (!strcmp(argv[i], "-trace") && i+1<argc) {
+			trace = argv[i+1];
+			continue;
+		}
+		if (!strcmp(argv[i], "-locks") && i+1<argc && atoi(argv[i+1]) > 0) {
+			locks = atoi(argv[i+1]);
+			continue;
+		}
+		if (parse_capacity_option(argv[i], (i+1<argc) ? argv[i+1] : NULL, &capacity) != 1) {
+			fprintf(stderr, "Invalid option '%s', usage 'buffer [port] [-samples N | -seconds S | -bytes N[k|M|G]] [-events N] [-persist DIR] [-history DIR] [-trace FILE] [-locks SECONDS]'\n", argv[i]);
+			return 1;
+		}
+	}
+	ft_set_default_capacity(&capacity);
+
+	/* keep the header, data and events in files that survive a crash, and pick up where a previous run left off */
+	if (persist) {
+		int n = ft_persist_enable(persist);
+		if (n < 0) {
+			fprintf(stderr, "Cannot keep the buffer in '%s'\n", persist);
+			return 1;
+		}
+		printf("Keeping the buffer in %s, restored %d stream(s)\n", persist, n);
+	}
+
+	/* write samples to disk before they leave the ring, so that GET_DAT can still get them */
+	if (history) {
+		if (ft_history_enable(history, 0) != 0) return 1;
+		printf("Keeping the history of the samples in %s\n", history);
+	}
+
+	/* a timeline of the requests, written on SIGUSR1 and when the buffer is stopped */
+	if (trace) {
+		if (ft_trace_enable(trace, 0, FT_TRACE_DUMP_ON_EXIT) != 0) return 1;
+		printf("Tracing requests to %s, send SIGUSR1 to write it out\n", trace);
+	}
+
+	/* who waits for whom on the locks of the streams, printed every so many seconds */
+	if (locks) {
+		if (ft_lockstat_enable(locks) != 0) return 1;
+		printf("Printing lock statistics every %d s\n", locks);
+	}
+
 	/* start the buffer */
 	printf("Starting FieldTrip buffer on port %d... \n", host.port);
 	tcpserver((void *)(&host));
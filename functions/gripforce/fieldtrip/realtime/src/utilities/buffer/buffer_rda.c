@@ -27,7 +27,7 @@ int main(int argc, char *argv[]) {
 #ifndef PLATFORM_WINDOWS
 	sigset_t sigInt;
 #endif
-	int errval, blocksize;
+	int errval, blocksize, scale;
 
     /* verify that all datatypes have the expected syze in bytes */
     check_datatypes();
@@ -46,8 +46,15 @@ int main(int argc, char *argv[]) {
 		blocksize = 0;
 	}
 
+	if (argc>3) {
+		scale = atoi(argv[3]);
+	} else {
+		scale = 0;
+	}
+
 	if (host.port <= 0 || blocksize < 0) {
-		fprintf(stderr, "Usage: buffer_rda [port [blocksize]]\nPort number must be positive, block size must be >= 0.\n");
+		fprintf(stderr, "Usage: buffer_rda [port [blocksize [scale]]]\nPort number must be positive, block size must be >= 0.\n");
+		fprintf(stderr, "With scale=1, the samples are multiplied with the channel resolutions before they are sent.\n");
 		return 1;
 	}
 
@@ -70,6 +77,7 @@ int main(int argc, char *argv[]) {
 		return errval;
 	}
 	rdac->verbosity = 6;
+	rdac->scale = scale;
 
 #ifndef PLATFORM_WINDOWS
 	/* We want CTRL-C in this thread */
@@ -0,0 +1,104 @@
+/*
+ * Prints how long a buffer server takes to answer each kind of request, how
+ * much it reads and writes for them, and how full its ring is (see stats.h).
+ * With an interval, it does so every so many seconds for the requests since
+ * the last time.
+ *
+ * Use as
+ *    buffer_stats [host [port [seconds]]]
+ *
+ * Copyright (C) 2017, Donders Institute for Brain, Cognition and Behaviour; Radboud University; NL
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "stats.h"
+
+/* a time in nanoseconds, in a unit that keeps it short */
+static void print_time(double ns) {
+	if (ns < 1e4)
+		printf(" %8.0fns", ns);
+	else if (ns < 1e7)
+		printf(" %8.1fus", ns/1e3);
+	else
+		printf(" %8.1fms", ns/1e6);
+}
+
+static int print_stats(int server, UINT32_T flags) {
+	messagedef_t def;
+	message_t request, *response = NULL;
+	statsdef_t *sdef;
+	char *cmd;
+	UINT32_T n;
+
+	def.version = VERSION;
+	def.command = GET_STATS;
+	def.bufsize = sizeof(flags);
+	request.def = &def;
+	request.buf = &flags;
+	if (clientrequest(server, &request, &response) != 0 || response == NULL) {
+		fprintf(stderr, "buffer_stats: GET_STATS failed\n");
+		return -1;
+	}
+	if (response->def->command != STATS_OK || response->def->bufsize < sizeof(statsdef_t)) {
+		fprintf(stderr, "buffer_stats: the server does not keep statistics\n");
+		cleanup_message((void **) &response);
+		return -1;
+	}
+	sdef = (statsdef_t *) response->buf;
+
+	printf("%-17s %9s %10s %10s %10s %10s %10s %12s %12s\n", "command", "count", "mean", "p50", "p90", "p99", "p99.9", "bytes in", "bytes out");
+	cmd = (char *) (sdef + 1);
+	for (n=0; n<sdef->ncommands; n++) {
+		statscmd_t *C = (statscmd_t *) cmd;
+		UINT32_T *bucket = (UINT32_T *) (C + 1);
+		printf("%-17s %9u", command_name(C->command), C->count);
+		print_time(C->count ? (double) C->total_ns / C->count : 0);
+		print_time(ft_stats_percentile(bucket, sdef->nbuckets, 0.5));
+		print_time(ft_stats_percentile(bucket, sdef->nbuckets, 0.9));
+		print_time(ft_stats_percentile(bucket, sdef->nbuckets, 0.99));
+		print_time(ft_stats_percentile(bucket, sdef->nbuckets, 0.999));
+		printf(" %12.0f %12.0f\n", (double) C->bytes_in, (double) C->bytes_out);
+		cmd += sizeof(statscmd_t) + sdef->nbuckets*sizeof(UINT32_T);
+	}
+
+	if (sdef->capacity > 0) {
+		UINT32_T held = sdef->nsamples - sdef->first;
+		printf("ring: %u of %u samples (%.1f%%), %u written, %u overwritten, %u waits for readers\n",
+				held, sdef->capacity, 100.0*held/sdef->capacity, sdef->nsamples, sdef->first, sdef->pinwaits);
+	}
+	else {
+		printf("ring: no header\n");
+	}
+	printf("GET_DAT of overwritten samples: %u\n\n", sdef->overruns);
+	fflush(stdout);
+
+	cleanup_message((void **) &response);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	char hostname[256] = DEFAULT_HOSTNAME;
+	int port = DEFAULT_PORT, seconds = 0, server, i;
+
+	if (argc>1) strncpy(hostname, argv[1], sizeof(hostname)-1);
+	if (argc>2) port = atoi(argv[2]);
+	if (argc>3) seconds = atoi(argv[3]);
+
+	server = open_connection(hostname, port);
+	if (server < 0) {
+		fprintf(stderr, "buffer_stats: cannot connect to %s:%i, usage 'buffer_stats [host [port [seconds]]]'\n", hostname, port);
+		return 1;
+	}
+
+	/* after the first time, only what happened in the last interval */
+	if (print_stats(server, seconds > 0 ? FT_STATS_RESET : 0) != 0) return 1;
+	while (seconds > 0) {
+		for (i=0; i<10*seconds; i++) usleep(100000);
+		if (print_stats(server, FT_STATS_RESET) != 0) return 1;
+	}
+	close_connection(server);
+	return 0;
+}
@@ -65,6 +65,9 @@ int my_request_handler(const message_t *request, message_t **response, void *use
 				printf("Get all events ... ");
 			}
 			break;
+		case GET_EVT_QUERY:
+			printf("Query events, bufsize = %i ... ", request->def->bufsize);
+			break;
 		case FLUSH_EVT:
 			printf("Flush events ... ");
 			break;
@@ -76,6 +79,9 @@ int my_request_handler(const message_t *request, message_t **response, void *use
 				printf("Wait data, malformed! ... \n");
 			}
 			break;
+		case OPEN_STREAM:
+			printf("Open stream '%.*s' ... ", (int) request->def->bufsize, (const char *) request->buf);
+			break;
 	}
 	
 	res = dmarequest(request, response);
@@ -114,26 +120,36 @@ void abortHandler(int sig) {
 }
 
 int main(int argc, char *argv[]) {
-	int port;
+	int port, i, arg = 1;
 	char *name = NULL;
+	capacitydef_t capacity = {0, 0, 0, 0};
 	
     /* verify that all datatypes have the expected syze in bytes */
     check_datatypes();
 
-	if (argc>1) {
+	if (argc>1 && argv[1][0] != '-') {
 		port = atoi(argv[1]);
 		if (port == 0) {
 			name = argv[1];
 		}	
+		arg = 2;
 	} else {
 		port = 1972;
 	}
+
+	/* the remaining arguments specify the capacity of the data and event ring */
+	for (i=arg; i<argc; i+=2) {
+		if (parse_capacity_option(argv[i], (i+1<argc) ? argv[i+1] : NULL, &capacity) != 1) {
+			fprintf(stderr, "Invalid option '%s', usage 'buffer_unix [port|name|shm://name] [-samples N | -seconds S | -bytes N[k|M|G]] [-events N]'\n", argv[i]);
+			return 1;
+		}
+	}
 	
 	/* with enabled debug output */
-	S = ft_start_buffer_server(port, name, my_request_handler, NULL);
+	S = ft_start_buffer_server_capacity(port, name, my_request_handler, NULL, &capacity);
 	/* plain server without extra output */
 	/*
-	S = ft_start_buffer_server(port, name, NULL, NULL);
+	S = ft_start_buffer_server_capacity(port, name, NULL, NULL, &capacity);
 	*/
 	if (S==NULL) return 1;
 	signal(SIGINT, abortHandler);
@@ -142,6 +158,8 @@ int main(int argc, char *argv[]) {
 	}
 	printf("Ctrl-C pressed -- stopping buffer server...\n");
 	ft_stop_buffer_server(S);
+	/* this also removes the shared memory of a shm:// server */
+	ft_free_streams();
 	printf("Done.\n");
 	return 0;
 }
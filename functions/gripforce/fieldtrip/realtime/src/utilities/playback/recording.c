@@ -120,6 +120,9 @@ int my_request_handler(const message_t *request, message_t **response, void *use
 				printf("Get all events ... ");
 			}
 			break;
+		case GET_EVT_QUERY:
+			printf("Query events, bufsize = %i ... ", request->def->bufsize);
+			break;
 		case FLUSH_EVT:
 			printf("Flush events ... ");
 			break;
@@ -131,6 +134,9 @@ int my_request_handler(const message_t *request, message_t **response, void *use
 				printf("Wait data, malformed! ... \n");
 			}
 			break;
+		case OPEN_STREAM:
+			printf("Open stream '%.*s' ... ", (int) request->def->bufsize, (const char *) request->buf);
+			break;
 	}
 
 	res = dmarequest(request, response);